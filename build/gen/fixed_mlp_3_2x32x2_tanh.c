@@ -0,0 +1,136 @@
+// Generated by gen_fixed_mlp for 3 layers, 2 -> 32 -> 2, tanh. Don't edit, set FIXED_* in the Makefile
+#include "fixed_mlp.h"
+#include "fastmath.h"
+
+#include <math.h>
+
+const FixedMlpSpec fixed_mlp_spec = { 3, 2, 32, 2, "tanh", 1218 };
+
+// y = x @ W + b for x [2] and W [2, 32]. The sums build in a local that GCC keeps in vector registers, a fully
+// unrolled loop over y gets vectorised across the inputs instead, with a shuffle per load
+static inline void dense_2x32(const float* restrict w, const float* restrict b, const float* restrict x, float* restrict y) {
+    float acc[32] = { 0 };
+    for(int i = 0; i < 2; i++) {
+        const float a = x[i];
+        for(int j = 0; j < 32; j++) acc[j] += a * w[i * 32 + j];
+    }
+    for(int j = 0; j < 32; j++) y[j] = acc[j] + b[j];
+}
+
+// gx = W @ gy with the W from before the step, then W -= lr * x^T gy and b -= lr * gy in the same pass
+static inline void dense_sgd_2x32(float* restrict w, float* restrict b, const float* restrict x, const float* restrict gy, float* restrict gx, float lr) {
+    for(int i = 0; i < 2; i++) {
+        float sum = 0.0f;
+#pragma GCC unroll 32
+        for(int j = 0; j < 32; j++) {
+            sum += w[i * 32 + j] * gy[j];
+            w[i * 32 + j] -= lr * (x[i] * gy[j]);
+        }
+        gx[i] = sum;
+    }
+    for(int j = 0; j < 32; j++) b[j] -= lr * gy[j];
+}
+
+// y = x @ W + b for x [32] and W [32, 32]. The sums build in a local that GCC keeps in vector registers, a fully
+// unrolled loop over y gets vectorised across the inputs instead, with a shuffle per load
+static inline void dense_32x32(const float* restrict w, const float* restrict b, const float* restrict x, float* restrict y) {
+    float acc[32] = { 0 };
+    for(int i = 0; i < 32; i++) {
+        const float a = x[i];
+        for(int j = 0; j < 32; j++) acc[j] += a * w[i * 32 + j];
+    }
+    for(int j = 0; j < 32; j++) y[j] = acc[j] + b[j];
+}
+
+// gx = W @ gy with the W from before the step, then W -= lr * x^T gy and b -= lr * gy in the same pass
+static inline void dense_sgd_32x32(float* restrict w, float* restrict b, const float* restrict x, const float* restrict gy, float* restrict gx, float lr) {
+    for(int i = 0; i < 32; i++) {
+        float sum = 0.0f;
+#pragma GCC unroll 32
+        for(int j = 0; j < 32; j++) {
+            sum += w[i * 32 + j] * gy[j];
+            w[i * 32 + j] -= lr * (x[i] * gy[j]);
+        }
+        gx[i] = sum;
+    }
+    for(int j = 0; j < 32; j++) b[j] -= lr * gy[j];
+}
+
+// y = x @ W + b for x [32] and W [32, 2]. The sums build in a local that GCC keeps in vector registers, a fully
+// unrolled loop over y gets vectorised across the inputs instead, with a shuffle per load
+static inline void dense_32x2(const float* restrict w, const float* restrict b, const float* restrict x, float* restrict y) {
+    float acc[2] = { 0 };
+    for(int i = 0; i < 32; i++) {
+        const float a = x[i];
+        for(int j = 0; j < 2; j++) acc[j] += a * w[i * 2 + j];
+    }
+    for(int j = 0; j < 2; j++) y[j] = acc[j] + b[j];
+}
+
+// gx = W @ gy with the W from before the step, then W -= lr * x^T gy and b -= lr * gy in the same pass
+static inline void dense_sgd_32x2(float* restrict w, float* restrict b, const float* restrict x, const float* restrict gy, float* restrict gx, float lr) {
+    for(int i = 0; i < 32; i++) {
+        float sum = 0.0f;
+#pragma GCC unroll 32
+        for(int j = 0; j < 2; j++) {
+            sum += w[i * 2 + j] * gy[j];
+            w[i * 2 + j] -= lr * (x[i] * gy[j]);
+        }
+        gx[i] = sum;
+    }
+    for(int j = 0; j < 2; j++) b[j] -= lr * gy[j];
+}
+
+static inline void act_forward(float* y) {
+    for(int j = 0; j < 32; j += V8_WIDTH) {
+        f32x8 v = v8_load(y + j);
+        v8_tanh(&v);
+        v8_store(y + j, v);
+    }
+}
+
+// g through the activation, from its output y
+static inline void act_backward(const float* y, float* g) {
+    for(int j = 0; j < 32; j += V8_WIDTH) {
+        const f32x8 v = v8_load(y + j);
+        v8_store(g + j, v8_load(g + j) * (1.0f - v * v));
+    }
+}
+
+void fixed_mlp_forward(const float* params, const float* x, float* logits) {
+    float h[2][32];
+    dense_2x32(params + 0, params + 64, x, h[0]);
+    act_forward(h[0]);
+    dense_32x32(params + 96, params + 1120, h[0], h[1]);
+    act_forward(h[1]);
+    dense_32x2(params + 1152, params + 1216, h[1], logits);
+}
+
+float fixed_mlp_train_step(float* params, const float* x, int label, float lr) {
+    float h[2][32];
+    float z[2], g[2];
+    float gh[2][32];
+    dense_2x32(params + 0, params + 64, x, h[0]);
+    act_forward(h[0]);
+    dense_32x32(params + 96, params + 1120, h[0], h[1]);
+    act_forward(h[1]);
+    dense_32x2(params + 1152, params + 1216, h[1], z);
+
+    float max_ = z[0];
+    for(int j = 1; j < 2; j++) max_ = z[j] > max_? z[j] : max_;
+    float sum = 0.0f;
+    for(int j = 0; j < 2; j++) {
+        g[j] = fast_expf(z[j] - max_);
+        sum += g[j];
+    }
+    for(int j = 0; j < 2; j++) g[j] = g[j] / sum - (j == label);
+    const float loss = logf(sum) + max_ - z[label];
+
+    dense_sgd_32x2(params + 1152, params + 1216, h[1], g, gh[1], lr);
+    act_backward(h[1], gh[1]);
+    dense_sgd_32x32(params + 96, params + 1120, h[0], gh[1], gh[0], lr);
+    act_backward(h[0], gh[0]);
+    dense_sgd_2x32(params + 0, params + 64, x, gh[0], gh[1], lr);
+
+    return loss;
+}
@@ -0,0 +1,105 @@
+#ifndef ASYNC_SAVE_H
+#define ASYNC_SAVE_H
+
+#include "nn.h"
+#include "arena.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Checkpoints that don't hold up training. async_save_snapshot copies the used part of the param arena (weights,
+   grads, norm stats, optimiser moments, whatever was put there) into one of two buffers with one memcpy and returns,
+   a writer thread turns the copy into a model file (the bytes save_model writes), writes path.tmp, fsyncs it, renames
+   it over path and fsyncs the directory. While one buffer is being written the next snapshot goes into the other, so
+   a snapshot never waits on the disk, if that one was still waiting its turn it gets replaced (counted as
+   superseded), only the newest state is worth writing.
+   The MLP's structure (shapes, tensor pointers) is read by the writer as is, only the values come from the copy, so
+   nothing but values may change between init and free. With ASYNC_SAVE_DIRECT the file is written with O_DIRECT from
+   a page aligned buffer and cut to size after, file systems that refuse it (tmpfs) get buffered writes instead */
+enum {
+    ASYNC_SAVE_DIRECT = 1 << 0,
+};
+
+typedef enum { SAVE_SLOT_FREE, SAVE_SLOT_FILLING, SAVE_SLOT_READY, SAVE_SLOT_WRITING } SaveSlotState;
+
+typedef struct {
+    uint8_t* image;
+    size_t bytes;
+    uint64_t step;
+    SaveSlotState state;
+} SaveSlot;
+
+typedef struct AsyncSaver {
+    const MLP* nn;
+    const Arena* arena;
+    char* path;
+    char* tmp_path;
+    // Where path is, fsynced after the rename so the rename itself is durable
+    char* dir_path;
+    int flags;
+
+    SaveSlot slots[2];
+    // The serialised file, page aligned and padded to a whole page for O_DIRECT
+    uint8_t* file;
+    size_t file_bytes;
+    size_t file_capacity;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    pthread_t writer;
+    int stop;
+
+    // Everything below is under lock
+    uint64_t written_step;
+    int last_ok;
+    size_t snapshots;
+    size_t written;
+    size_t superseded;
+    size_t failed;
+    size_t direct_fallbacks;
+    double snapshot_ms;
+    double max_snapshot_ms;
+    double write_ms;
+    double max_write_ms;
+    char error[128];
+} AsyncSaver;
+
+typedef struct {
+    size_t snapshots;
+    size_t written;
+    size_t superseded;
+    size_t failed;
+    // Files written buffered because O_DIRECT was refused
+    size_t direct_fallbacks;
+    // Step of the newest snapshot on disk
+    uint64_t written_step;
+    // Time the caller spent in async_save_snapshot, the whole cost to the training loop
+    double snapshot_ms;
+    double max_snapshot_ms;
+    // Time the writer thread spent per file, serialise to rename
+    double write_ms;
+    double max_write_ms;
+    // Why the last failed write failed, empty if none did
+    char error[128];
+} AsyncSaveStats;
+
+// nn's tensors all have to live in arena. flags is 0 or ASYNC_SAVE_DIRECT
+void async_save_init(AsyncSaver* saver, const MLP* nn, const Arena* arena, const char* path, int flags);
+// Waits for the newest snapshot to be written, then stops the writer
+void async_save_free(AsyncSaver* saver);
+// At a step boundary, nothing may be writing the params while it copies. step is only carried into the stats
+void async_save_snapshot(AsyncSaver* saver, uint64_t step);
+// Blocks until every snapshot so far is written or superseded, 1 if the last write went through
+int async_save_flush(AsyncSaver* saver);
+void async_save_stats(AsyncSaver* saver, AsyncSaveStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Picks op variants by timing them instead of by rank. The first node seen for an (op, input shapes and dtypes, cpu,
+   thread count) key runs every supported variant of its kernel forward and backward on scratch copies of its inputs,
+   and the fastest is remembered and appended to the cache file. Later nodes with the same key, in this process or any
+   later one on the same cpu model, get the cached variant without any timing. Ops with one variant or none, and
+   nodes with sparse inputs, keep the kernel's static choice */
+typedef struct {
+    // Nodes answered from the cache
+    size_t hits;
+    // Keys that were timed in this process
+    size_t tuned;
+    // Keys known, loaded plus tuned
+    size_t entries;
+} AutotuneStats;
+
+// Installs the tuner into op_choose_variant and loads the cache, NULL path keeps the results in memory only. A missing
+// file is an empty cache, lines for other cpus are kept but never match
+void autotune_enable(const char* cache_path);
+// Drops the tuner and the in memory cache, the file stays
+void autotune_disable(void);
+void autotune_stats(AutotuneStats* stats);
+// Cpu model part of the key, from /proc/cpuinfo with the spaces replaced
+const char* autotune_cpu_id(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
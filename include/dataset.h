@@ -4,15 +4,18 @@
 #include "utils.h"
 #include "probhelper.h"
 #include "arena.h"
+#include "tensor.h"
 #include <stdlib.h>
 #include <stdalign.h>
 
 typedef enum { DATA_XOR, DATA_TMOONS, DATA_SPIRAL, DATA_FPETALS } DatasetShape;
 
-// class_dpoints allocated linearly by arena as well
+// class_dpoints allocated linearly by arena as well, laid out row major as [num_classes, num_data_points, data_dims]
 // should introduce shapes as well (no problem so far since dims 2 is hardcoded for spiral)
 typedef struct {
     float* class_dpoints;
+    // [num_classes * num_data_points, data_dims] tensor header over class_dpoints, batches are views of it
+    Tensor* points;
     int num_classes;
     int num_data_points;
     int data_dims;
@@ -21,5 +24,7 @@ typedef struct {
 void generate_dataset(Dataset* dataset, Arena* arena, int dims, int num_data_points, int num_classes, DatasetShape shape, uint32_t* state);
 void free_dataset(Dataset* dataset);
 void shuffle_indexes(int* shuffle_arr, int arr_size, uint32_t* rng);
+// Zero copy [count, data_dims] view over points [start, start + count) of one class, only the header is allocated
+Tensor* dataset_batch_view(Arena* arena, const Dataset* dataset, int class_idx, int start, int count);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,132 @@
+#ifndef DTYPE_H
+#define DTYPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// use C linkage for any of the libraries that are in cpp
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Storage type of a tensor, F32 is 0 so memset tensors default to fp32
+// Compute always happens in fp32, the 16 bit types are storage only (halving the bytes moved per element).
+// I32 is for integer inputs such as class labels
+typedef enum { DTYPE_F32 = 0, DTYPE_BF16, DTYPE_F16, DTYPE_I32 } DType;
+
+static inline size_t dtype_size(DType dtype) {
+    return (dtype == DTYPE_BF16 || dtype == DTYPE_F16)? sizeof(uint16_t) : sizeof(float);
+}
+
+// bf16 is just the top half of a fp32, round to nearest even on the dropped half
+static inline uint16_t f32_to_bf16(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    // Keep NaNs quiet instead of letting the rounding carry turn them into inf
+    if((bits & 0x7FFFFFFFu) > 0x7F800000u) {
+        return (uint16_t) ((bits >> 16) | 0x40u);
+    }
+
+    bits += 0x7FFFu + ((bits >> 16) & 1u);
+    return (uint16_t) (bits >> 16);
+}
+
+static inline float bf16_to_f32(uint16_t value) {
+    uint32_t bits = (uint32_t) value << 16;
+    float out;
+    memcpy(&out, &bits, sizeof(out));
+    return out;
+}
+
+// IEEE half, round to nearest even, overflow goes to inf and tiny values go through the subnormals
+static inline uint16_t f32_to_f16(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint32_t sign = (bits >> 16) & 0x8000u;
+    uint32_t exp = (bits >> 23) & 0xFFu;
+    uint32_t mant = bits & 0x7FFFFFu;
+
+    if(exp == 0xFFu) {
+        return (uint16_t) (sign | 0x7C00u | (mant? 0x200u : 0u));
+    }
+
+    int32_t e = (int32_t) exp - 127 + 15;
+
+    if(e >= 31) {
+        return (uint16_t) (sign | 0x7C00u);
+    }
+    if(e <= 0) {
+        if(e < -10) {
+            return (uint16_t) sign;
+        }
+
+        // Subnormal half, shift the mantissa (with the implicit bit) down to a 2^-24 unit
+        mant |= 0x800000u;
+        uint32_t shift = (uint32_t) (14 - e);
+        uint32_t half = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1u);
+        uint32_t halfway = 1u << (shift - 1u);
+
+        if(rem > halfway || (rem == halfway && (half & 1u))) {
+            half++;
+        }
+        return (uint16_t) (sign | half);
+    }
+
+    uint32_t half = ((uint32_t) e << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1FFFu;
+
+    // A carry out of the mantissa bumps the exponent, which is the correct rounding (up to inf)
+    if(rem > 0x1000u || (rem == 0x1000u && (half & 1u))) {
+        half++;
+    }
+    return (uint16_t) (sign | half);
+}
+
+static inline float f16_to_f32(uint16_t value) {
+    uint32_t sign = ((uint32_t) value & 0x8000u) << 16;
+    uint32_t exp = ((uint32_t) value >> 10) & 0x1Fu;
+    uint32_t mant = (uint32_t) value & 0x3FFu;
+    uint32_t bits;
+
+    if(exp == 0) {
+        if(mant == 0) {
+            bits = sign;
+        }
+        else {
+            // Renormalise the subnormal
+            exp = 1;
+            while(!(mant & 0x400u)) {
+                mant <<= 1;
+                exp--;
+            }
+            mant &= 0x3FFu;
+            bits = sign | ((exp + 112u) << 23) | (mant << 13);
+        }
+    }
+    else if(exp == 31) {
+        bits = sign | 0x7F800000u | (mant << 13);
+    }
+    else {
+        bits = sign | ((exp + 112u) << 23) | (mant << 13);
+    }
+
+    float out;
+    memcpy(&out, &bits, sizeof(out));
+    return out;
+}
+
+// Bulk conversions, these use F16C / AVX-512 BF16 when the cpu has them and the scalar routines above otherwise
+void convert_f32_to_bf16(const float* src, uint16_t* dst, size_t n);
+void convert_bf16_to_f32(const uint16_t* src, float* dst, size_t n);
+void convert_f32_to_f16(const float* src, uint16_t* dst, size_t n);
+void convert_f16_to_f32(const uint16_t* src, float* dst, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,269 @@
+#ifndef FASTMATH_H
+#define FASTMATH_H
+
+#include <stdint.h>
+#include <string.h>
+
+// use C linkage for any of the libraries that are in cpp
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Portable SIMD through the GCC/Clang vector extensions, 8 fp32 lanes. Without -mavx the compiler lowers these to
+   pairs of SSE ops, with it a single ymm op, so kernels get SIMD without intrinsics or per target code.
+   The scalar fast_* versions mirror the vector math step for step so loop tails produce the same values.
+   No function here takes or returns an f32x8 by value: without -mavx that changes the calling convention, and GCC
+   says so at every such definition and call (-Wpsabi), which no pragma fully silences. The small helpers are macros
+   over expressions, the transcendentals work in place through a pointer */
+typedef float f32x8 __attribute__((vector_size(32)));
+typedef int32_t i32x8 __attribute__((vector_size(32)));
+// For loads and stores at any float address, aliasing the floats it's read from
+typedef float f32x8_u __attribute__((vector_size(32), aligned(4), may_alias));
+
+#define V8_WIDTH 8
+
+#define v8_set(value) ((f32x8) { 0 } + (float) (value))
+#define v8_load(src) (*(const f32x8_u*) (src))
+#define v8_store(dst, v) ((void) (*(f32x8_u*) (dst) = (v)))
+
+// Lane select through the comparison mask, vector ?: is C++ only. mask is used twice, keep it free of side effects
+#define v8_select(mask, a, b) ((f32x8) (((i32x8) (a) & (mask)) | ((i32x8) (b) & ~(mask))))
+// Both arguments are used twice, pass plain variables
+#define v8_max(a, b) v8_select((a) > (b), (a), (b))
+#define v8_min(a, b) v8_select((a) < (b), (a), (b))
+
+static inline float v8_hmax(const f32x8* v) {
+    float m = (*v)[0];
+    for(int i = 1; i < V8_WIDTH; i++) m = (*v)[i] > m? (*v)[i] : m;
+    return m;
+}
+
+static inline float v8_hsum(const f32x8* v) {
+    return (((*v)[0] + (*v)[4]) + ((*v)[1] + (*v)[5])) + (((*v)[2] + (*v)[6]) + ((*v)[3] + (*v)[7]));
+}
+
+/* exp: x = n ln2 + r with |r| <= ln2 / 2, e^r from the Cephes degree 5 minimax polynomial, 2^n built in the exponent
+   bits. n is rounded with the 1.5 * 2^23 trick, ln2 is split in two (Cody-Waite) to keep r exact. Max error 1 ULP.
+   Inputs are clamped to [-87.34, 88], so the result never overflows and bottoms out at FLT_MIN instead of 0 */
+#define FM_EXP_HI 88.0f
+#define FM_EXP_LO -87.33654475f
+#define FM_LOG2E 1.44269504088896341f
+#define FM_ROUND_MAGIC 12582912.0f
+#define FM_LN2_HI 0.693359375f
+#define FM_LN2_LO -2.12194440e-4f
+#define FM_EXP_P0 1.9875691500e-4f
+#define FM_EXP_P1 1.3981999507e-3f
+#define FM_EXP_P2 8.3334519073e-3f
+#define FM_EXP_P3 4.1665795894e-2f
+#define FM_EXP_P4 1.6666665459e-1f
+#define FM_EXP_P5 5.0000001201e-1f
+
+// *v = e^*v
+static inline void v8_exp(f32x8* v) {
+    const f32x8 lo = v8_set(FM_EXP_LO), hi = v8_set(FM_EXP_HI);
+    f32x8 x = v8_max(*v, lo);
+    x = v8_min(x, hi);
+
+    f32x8 t = x * FM_LOG2E + FM_ROUND_MAGIC;
+    f32x8 n = t - FM_ROUND_MAGIC;
+    i32x8 ni = (i32x8) t - (i32x8) v8_set(FM_ROUND_MAGIC);
+
+    f32x8 r = x - n * FM_LN2_HI;
+    r = r - n * FM_LN2_LO;
+
+    f32x8 p = v8_set(FM_EXP_P0);
+    p = p * r + FM_EXP_P1;
+    p = p * r + FM_EXP_P2;
+    p = p * r + FM_EXP_P3;
+    p = p * r + FM_EXP_P4;
+    p = p * r + FM_EXP_P5;
+    p = p * r * r + r + 1.0f;
+
+    *v = p * (f32x8) ((ni + 127) << 23);
+}
+
+static inline float fast_expf(float x) {
+    x = x > FM_EXP_LO? x : FM_EXP_LO;
+    x = x < FM_EXP_HI? x : FM_EXP_HI;
+
+    float t = x * FM_LOG2E + FM_ROUND_MAGIC;
+    float n = t - FM_ROUND_MAGIC;
+    int32_t t_bits, magic_bits;
+    float magic = FM_ROUND_MAGIC;
+    memcpy(&t_bits, &t, sizeof(t_bits));
+    memcpy(&magic_bits, &magic, sizeof(magic_bits));
+
+    float r = x - n * FM_LN2_HI;
+    r = r - n * FM_LN2_LO;
+
+    float p = FM_EXP_P0;
+    p = p * r + FM_EXP_P1;
+    p = p * r + FM_EXP_P2;
+    p = p * r + FM_EXP_P3;
+    p = p * r + FM_EXP_P4;
+    p = p * r + FM_EXP_P5;
+    p = p * r * r + r + 1.0f;
+
+    int32_t scale_bits = (t_bits - magic_bits + 127) << 23;
+    float scale;
+    memcpy(&scale, &scale_bits, sizeof(scale));
+
+    return p * scale;
+}
+
+// Per lane sqrtss, which GCC turns into one sqrtps when it may drop errno (-fno-math-errno)
+static inline void v8_sqrt(f32x8* v) {
+    for(int i = 0; i < V8_WIDTH; i++) (*v)[i] = __builtin_sqrtf((*v)[i]);
+}
+
+/* log: x = m 2^e with m in [sqrt(0.5), sqrt(2)), log(m) from the Cephes logf degree 8 polynomial in m - 1, e ln2 added
+   back in the same two parts as exp. Positive normal inputs only, no zero, inf, NaN or subnormal handling. Max error
+   1 ULP */
+#define FM_SQRTHF 0.707106781186547524f
+#define FM_LOG_P0 7.0376836292e-2f
+#define FM_LOG_P1 -1.1514610310e-1f
+#define FM_LOG_P2 1.1676998740e-1f
+#define FM_LOG_P3 -1.2420140846e-1f
+#define FM_LOG_P4 1.4249322787e-1f
+#define FM_LOG_P5 -1.6668057665e-1f
+#define FM_LOG_P6 2.0000714765e-1f
+#define FM_LOG_P7 -2.4999993993e-1f
+#define FM_LOG_P8 3.3333331174e-1f
+
+// *v = log(*v)
+static inline void v8_log(f32x8* v) {
+    i32x8 bits = (i32x8) *v;
+    i32x8 e = ((bits >> 23) & 0xff) - 126;
+    f32x8 m = (f32x8) ((bits & 0x007fffff) | 0x3f000000);
+
+    // m in [0.5, 1), the lower part is doubled and takes one off the exponent (the mask is -1)
+    i32x8 low = m < FM_SQRTHF;
+    e += low;
+    f32x8 x = v8_select(low, m + m, m) - 1.0f;
+    f32x8 fe = __builtin_convertvector(e, f32x8);
+
+    f32x8 z = x * x;
+    f32x8 y = v8_set(FM_LOG_P0);
+    y = y * x + FM_LOG_P1;
+    y = y * x + FM_LOG_P2;
+    y = y * x + FM_LOG_P3;
+    y = y * x + FM_LOG_P4;
+    y = y * x + FM_LOG_P5;
+    y = y * x + FM_LOG_P6;
+    y = y * x + FM_LOG_P7;
+    y = y * x + FM_LOG_P8;
+    y = y * x * z;
+
+    y += fe * FM_LN2_LO;
+    y -= 0.5f * z;
+    *v = x + y + fe * FM_LN2_HI;
+}
+
+/* sin and cos of 2 pi t. The reduction is done in turns and is exact: q is the nearest quarter turn, t - q / 4 is in
+   [-1/8, 1/8] with no rounding (|t| < 2^20), so x = 2 pi (t - q / 4) is in [-pi/4, pi/4] without a Cody-Waite split.
+   Cephes sinf and cosf polynomials on x, q mod 4 swaps them and sets the signs. Max error 2 ULP */
+#define FM_2PI 6.28318530717958647692f
+#define FM_SIN_P0 -1.9515295891e-4f
+#define FM_SIN_P1 8.3321608736e-3f
+#define FM_SIN_P2 -1.6666654611e-1f
+#define FM_COS_P0 2.443315711809948e-5f
+#define FM_COS_P1 -1.388731625493765e-3f
+#define FM_COS_P2 4.166664568298827e-2f
+
+static inline void v8_sincos_turn(const f32x8* t, f32x8* sin_out, f32x8* cos_out) {
+    f32x8 q4 = *t * 4.0f + FM_ROUND_MAGIC;
+    i32x8 quadrant = ((i32x8) q4 - (i32x8) v8_set(FM_ROUND_MAGIC)) & 3;
+    f32x8 x = (*t - (q4 - FM_ROUND_MAGIC) * 0.25f) * FM_2PI;
+
+    f32x8 z = x * x;
+    f32x8 sp = v8_set(FM_SIN_P0);
+    sp = sp * z + FM_SIN_P1;
+    sp = sp * z + FM_SIN_P2;
+    sp = sp * z * x + x;
+
+    f32x8 cp = v8_set(FM_COS_P0);
+    cp = cp * z + FM_COS_P1;
+    cp = cp * z + FM_COS_P2;
+    cp = cp * z * z - 0.5f * z + 1.0f;
+
+    // Quadrants 1 and 3 swap, sin is negative in 2 and 3, cos in 1 and 2
+    i32x8 swap = (quadrant & 1) != 0;
+    i32x8 sin_sign = ((quadrant & 2) != 0) & INT32_MIN;
+    i32x8 cos_sign = (((quadrant + 1) & 2) != 0) & INT32_MIN;
+    *sin_out = (f32x8) ((i32x8) v8_select(swap, cp, sp) ^ sin_sign);
+    *cos_out = (f32x8) ((i32x8) v8_select(swap, sp, cp) ^ cos_sign);
+}
+
+/* sigmoid(x) = 1 / (1 + e^-x), with e = exp(-|x|) so the exp never overflows: 1 / (1 + e) for x >= 0 and e / (1 + e) for
+   x < 0, which keeps full relative precision on the small side. Max error 2 ULP over [-87, 88] (sweep in the sigmoid
+   selftest). Below -87.3 the exp clamp bottoms out and the result stays around FLT_MIN instead of going subnormal */
+static inline void v8_sigmoid(f32x8* v) {
+    const f32x8 x = *v;
+    f32x8 e = v8_select(x < 0.0f, x, -x);
+    v8_exp(&e);
+    f32x8 s = 1.0f / (1.0f + e);
+
+    *v = v8_select(x < 0.0f, e * s, s);
+}
+
+static inline float fast_sigmoidf(float x) {
+    float e = fast_expf(x < 0.0f? x : -x);
+    float s = 1.0f / (1.0f + e);
+
+    return x < 0.0f? e * s : s;
+}
+
+/* tanh: Cephes tanhf split. |x| < 0.625 uses the odd minimax polynomial x + x^3 P(x^2), everything above goes through
+   1 - 2 / (e^2|x| + 1) where the cancellation is mild, sign restored at the end. Both halves are computed for every lane
+   and blended, no branches. Max error 1 ULP over [-10, 10] (sweep in the tanh selftest), past |x| = 9 the result is
+   exactly +-1 */
+#define FM_TANH_SPLIT 0.625f
+#define FM_TANH_P0 -5.70498872745e-3f
+#define FM_TANH_P1 2.06390887954e-2f
+#define FM_TANH_P2 -5.37397155531e-2f
+#define FM_TANH_P3 1.33314422036e-1f
+#define FM_TANH_P4 -3.33332819422e-1f
+
+static inline void v8_tanh(f32x8* v) {
+    const f32x8 x = *v;
+    f32x8 ax = v8_select(x < 0.0f, -x, x);
+
+    f32x8 z = x * x;
+    f32x8 p = v8_set(FM_TANH_P0);
+    p = p * z + FM_TANH_P1;
+    p = p * z + FM_TANH_P2;
+    p = p * z + FM_TANH_P3;
+    p = p * z + FM_TANH_P4;
+    f32x8 small = p * z * x + x;
+
+    f32x8 e = ax + ax;
+    v8_exp(&e);
+    f32x8 large = 1.0f - 2.0f / (e + 1.0f);
+    large = v8_select(x < 0.0f, -large, large);
+
+    *v = v8_select(ax < FM_TANH_SPLIT, small, large);
+}
+
+static inline float fast_tanhf(float x) {
+    float ax = x < 0.0f? -x : x;
+
+    if(ax < FM_TANH_SPLIT) {
+        float z = x * x;
+        float p = FM_TANH_P0;
+        p = p * z + FM_TANH_P1;
+        p = p * z + FM_TANH_P2;
+        p = p * z + FM_TANH_P3;
+        p = p * z + FM_TANH_P4;
+
+        return p * z * x + x;
+    }
+
+    float large = 1.0f - 2.0f / (fast_expf(ax + ax) + 1.0f);
+    return x < 0.0f? -large : large;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
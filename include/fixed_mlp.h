@@ -0,0 +1,35 @@
+#ifndef FIXED_MLP_H
+#define FIXED_MLP_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Interface of the kernels src/codegen/gen_fixed_mlp.c writes for one MLP shape known at build time (see FIXED_* in
+   the Makefile). Every bound is a literal in the generated code, so the compiler unrolls and keeps the small layers in
+   registers. Params are one flat buffer, per layer the weight [in, out] row major and then the bias [out], the same
+   order and layout as MLP::layers */
+typedef struct {
+    int num_layers;
+    int input_dim;
+    int width;
+    int output_dim;
+    // "relu", "tanh" or "sigmoid", after every hidden layer
+    const char* activation;
+    size_t num_params;
+} FixedMlpSpec;
+
+extern const FixedMlpSpec fixed_mlp_spec;
+
+// logits [output_dim] of one sample x [input_dim]
+void fixed_mlp_forward(const float* params, const float* x, float* logits);
+// Forward, softmax cross entropy against label, backward and the SGD update fused per layer, returns the loss
+float fixed_mlp_train_step(float* params, const float* x, int label, float lr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
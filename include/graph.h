@@ -46,6 +46,15 @@ typedef struct Node {
     int topo_index;
     // Children for the curr node
     NodeUse* users;
+    // Per op state the forward saves for the backward (eg the fused cross entropy's logits grad), NULL for most ops
+    Tensor* aux;
+    // out holds the current value (leaves always do), cleared by the dirty marking and lazy resets
+    int evaluated;
+    // Per op settings that aren't graph tensors (eg NormAttrs), owned by the caller, NULL for most. Always passed to
+    // add_node_attrs, so they are in place for the shape inference and the variant chooser
+    const void* attrs;
+    // Implementation picked for this node by the kernel's chooser at add_node, NULL runs the kernel's forward/backward
+    const OpVariant* variant;
 } Node;
 
 typedef struct {
@@ -53,19 +62,166 @@ typedef struct {
     Node** nodes;
     size_t size;
     size_t capacity;
+
+    // Gradient checkpointing, 0 = off. When on, op outputs are added without storage and only every
+    // checkpoint_every-th op output is kept, the rest is recomputed per segment during the backward pass
+    int checkpoint_every;
+    struct CheckpointPlan* ckpt;
+
+    // Lazy mode, add_node only records and graph_value computes what is asked for. The DFS stack is kept between
+    // calls and only regrown with the graph
+    int lazy;
+    Node** lazy_stack;
+    size_t lazy_stack_capacity;
 } Graph;
 
+// Recompute overhead and activation memory of the last checkpointed forward/backward
+typedef struct {
+    size_t forward_nodes;
+    size_t recomputed_nodes;
+    double forward_ms;
+    double recompute_ms;
+    // Checkpointed outputs kept for the whole step
+    size_t stored_activation_bytes;
+    // stored + the per segment activation and grad buffers, vs what keeping every op output would need
+    size_t peak_activation_bytes;
+    size_t full_activation_bytes;
+} CheckpointStats;
+
 void graph_init(Graph* graph, Arena* arena);
 void graph_free(Graph* g);
 // Leaf or input node, to wrap an existing tensor as the input node
 Node* graph_add_input(Graph* g, Tensor* t);
+// What the passes run for a node, its chosen variant if it has one, else the kernel's own forward/backward
+static inline OpForward node_forward_fn(const Node* node, const OpKernel* kernel) {
+    return (node->variant && node->variant->forward)? node->variant->forward : kernel->forward;
+}
+
+static inline OpBackward node_backward_fn(const Node* node, const OpKernel* kernel) {
+    return (node->variant && node->variant->backward)? node->variant->backward : kernel->backward;
+}
+
 Node* add_node(Graph* graph, Op op, int n_in, Node **inputs);
+// add_node with node->attrs already set when the shape inference runs
+Node* add_node_attrs(Graph* graph, Op op, int n_in, Node** inputs, const void* attrs);
 void graph_ensure_grad(Graph* graph, Tensor* tensor);
 void topological_sort(Graph* graph, Node*** output_order, size_t* total_outputs);
 void graph_forward_pass(Node* const* order, size_t order_size);
 void graph_backward_pass(Graph* graph, Node* const* order, size_t order_size, Tensor* loss);
+
+/* Has to be called before any node is added. Op outputs then get their storage on first use, and graph_value(node)
+   runs only the not yet evaluated ancestors of node, so branches nobody asks for cost neither time nor memory.
+   Values stay cached until graph_lazy_reset. graph_backward_pass skips nodes that were never evaluated, so ask for
+   the loss value first */
+void graph_enable_lazy(Graph* graph);
+Tensor* graph_value(Graph* graph, Node* node);
+// Marks every op output stale after leaves were written to, the storage is kept
+void graph_lazy_reset(Graph* graph);
+
+/* Incremental re-execution: after a tensor changed, mark it dirty and only its downstream nodes are stale, found
+   through the users lists. graph_value (lazy) or graph_forward_pass_incremental (eager) then recompute just those and
+   keep every clean activation. Marking stops at nodes that are already stale, their users are stale too */
+void graph_mark_dirty(Graph* graph, Node* node);
+// Every leaf showing the tensor, including views over it (eg the expanded bias of a layer)
+void graph_mark_tensor_dirty(Graph* graph, const Tensor* tensor);
+// Runs only the stale nodes of order and returns how many that was, the first call runs everything
+size_t graph_forward_pass_incremental(Graph* graph, Node* const* order, size_t order_size);
+
+// Has to be called before any node is added, every <= 0 picks sqrt of the op count at the first forward
+void graph_enable_checkpointing(Graph* graph, int every);
+// Checkpointed graphs have to run forward through this, graph_backward_pass picks the checkpointed path on its own
+void graph_forward_pass_checkpointed(Graph* graph, Node* const* order, size_t order_size);
+void graph_backward_pass_checkpointed(Graph* graph, Node* const* order, size_t order_size, Tensor* loss);
+void graph_checkpoint_stats(const Graph* graph, CheckpointStats* stats);
 // Node* graph_optimiser_pass(Graph* graph, Node** order, size_t order_size);
 
+/* Execution plan: the op nodes of a sorted order lowered into one contiguous array of PlanSteps with the kernel
+   function pointers and operand data pointers resolved, forward and backward are then straight loops over it with no
+   registry lookups. Element wise ops with contiguous (or bias broadcast) operands run their flat variants on raw
+   pointers, everything else calls the node kernel through the cached pointer */
+typedef struct {
+    PlanStep* steps;
+    size_t num_steps;
+    size_t num_flat;
+    // Every op output and differentiable input had a grad at build time
+    int has_grads;
+    // Forward as machine code (see jit.h), NULL runs the steps
+    struct JitProgram* jit;
+} ExecPlan;
+
+// Grads that exist at build time are wired in, so a training plan has to be built after they are allocated
+void exec_plan_build(ExecPlan* plan, Arena* arena, Node* const* order, size_t order_size);
+// Re-resolve the pointers in place after a tensor was swapped (eg graph_template_bind), allocates nothing
+void exec_plan_refresh(ExecPlan* plan);
+void exec_plan_forward(const ExecPlan* plan);
+// Compiles the forward, 1 if it took, 0 leaves the interpreter (not x86-64, TINYENGINE_JIT=0, no exec pages). Refresh
+// recompiles, disable frees the code
+int exec_plan_enable_jit(ExecPlan* plan);
+void exec_plan_disable_jit(ExecPlan* plan);
+// Seeds loss->grad with 1, the grads are accumulated into so they have to be cleared first
+void exec_plan_backward(const ExecPlan* plan, Tensor* loss);
+
+/* Graph template: a graph built once the normal way is recorded into a persistent arena as one flat, topologically
+   ordered block, the nodes in one array, all input edges in one array and all user edges in another, with the op
+   outputs and their grads preallocated. Every later step only rebinds leaves (or writes into template owned ones) and
+   runs, nothing is allocated or linked per step. Kernels still take a Node*, so the node records stay but are laid
+   out back to back in execution order */
+typedef struct GraphTemplate {
+    Arena* arena;
+    size_t num_nodes;
+    size_t num_edges;
+    Node* nodes;
+    // &nodes[i], so the usual order based passes can walk the template
+    Node** order;
+    Node** edges;
+    NodeUse* uses;
+
+    // Recorded graph index -> template position, only meaningful while the recorded graph is still alive
+    int32_t* position;
+    size_t recorded_size;
+
+    // Grads of the op outputs and the template owned leaves, cleared with one memset per backward
+    float* grad_block;
+    size_t grad_block_elems;
+
+    // What forward/backward actually run
+    ExecPlan plan;
+} GraphTemplate;
+
+/* order has to come from topological_sort on graph. Leaves whose header was allocated in the graph arena (views, batch
+   inputs) are copied into the template arena, their data too if it also lived there; leaves from other arenas
+   (parameters) are referenced as is */
+void graph_template_record(GraphTemplate* tmpl, Arena* arena, const Graph* graph, Node* const* order, size_t order_size);
+// Maps a node of the recorded graph onto the template, call it before the recorded graph's arena is reset
+Node* graph_template_node(const GraphTemplate* tmpl, const Node* recorded);
+// Swap a leaf's tensor for another of the same shape and dtype
+void graph_template_bind(GraphTemplate* tmpl, Node* leaf, Tensor* tensor);
+void graph_template_forward(const GraphTemplate* tmpl);
+int graph_template_enable_jit(GraphTemplate* tmpl);
+void graph_template_backward(GraphTemplate* tmpl, const Node* loss);
+
+/* Forward mode: every differentiable tensor gets a tangent of its own layout, a view's tangent is the same view of its
+   base's tangent. Directions are set on the leaves by hand (tensor->tangent), leaves without one get zeroes. Tensors
+   outside the graph arena have to bring their own, same rule as for the grads */
+void graph_ensure_tangent(Graph* graph, Tensor* tensor);
+// Runs forward and jvp node by node, so afterwards every node->out->tangent is J dir in a single sweep
+void graph_forward_jvp_pass(Graph* graph, Node* const* order, size_t order_size);
+/* Forward over reverse, after graph_forward_jvp_pass: the usual backward plus the tangent of every grad, so a parameter
+   ends with its gradient in p->grad and the Hessian vector product H dir in p->grad->tangent, for about the cost of
+   two backward passes. Like the grads, the grad tangents are accumulated into and have to be cleared first */
+void graph_hvp_backward_pass(Graph* graph, Node* const* order, size_t order_size, Tensor* loss);
+
+/* Per sample grads (DP clipping, influence), run after the usual batch backward on the same order. Parameters have to
+   enter as a matmul weight or a broadcast bias over [N, k] rows. They are each sample's share of the batch grad, so
+   with a mean loss they carry its 1/N */
+// out is [N, param shape], out[n] the grad sample n alone contributes, summing over n gives param->grad
+void graph_per_sample_grads(Node* const* order, size_t order_size, const Tensor* param, Tensor* out);
+// sq_norms[n] = ||grad of sample n||^2 over all params, straight from the input and output grad rows, nothing [N, in, out] sized
+void graph_per_sample_sq_norms(Node* const* order, size_t order_size, Tensor* const* params, size_t num_params, int64_t batch, float* sq_norms);
+/* DP-SGD style: every sample's grad (over all params) is clipped to clip_norm and the clipped grads replace the batch
+   grads, scaled on the fly so the per sample tensor never exists. scale is [N] scratch and ends with the clip factors */
+void graph_per_sample_clip_accumulate(Node* const* order, size_t order_size, Tensor* const* params, size_t num_params, int64_t batch, float clip_norm, float* scale);
+
 
 
 #ifdef __cplusplus
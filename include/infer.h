@@ -0,0 +1,68 @@
+#ifndef INFER_H
+#define INFER_H
+
+#include "nn.h"
+#include "arena.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Concurrent inference on one MLP. The model's tensors are only ever read, every call builds its forward graph in a
+   scratch arena of its own and runs it there, so any number of threads can call mlp_infer on one pool with no lock
+   and no copy of the weights. The arenas sit on a lock-free stack (the head carries a tag against ABA), a call pops
+   one and pushes it back when done. When they are all out, or the batch is bigger than the pool was sized for, the
+   call maps a one-off arena instead of waiting. Building the graph reads the thread count lock-free, and a threaded
+   matmul finding the worker pool busy (another call's, or a training step's parallel_for) runs inline rather than
+   queueing for it. The one lock left on the way is autotune's cache lock when autotune is enabled, taken briefly per
+   lookup and held through the tuning of a shape it hasn't seen yet.
+   Nothing may train the model while calls are running. For fixed results use mlp_set_training(nn, 0) first, then
+   batch norm uses its running stats and dropout is a copy */
+typedef struct InferSlot {
+    Arena arena;
+    // Index + 1 of the slot below on the stack, 0 at the bottom
+    atomic_uint next;
+} InferSlot;
+
+typedef struct InferPool {
+    // What mlp_infer runs, mlp_infer_on takes any model with the same layer shapes
+    const MLP* nn;
+    int num_layers;
+    // [num_layers + 1], input_dim then every layer's out_features
+    int64_t* dims;
+    int64_t input_dim;
+    int64_t output_dim;
+    int64_t max_rows;
+    size_t arena_bytes;
+    InferSlot* slots;
+    int num_slots;
+    // Top slot index + 1 in the low 32 bits (0 empty), bumped on every push and pop in the high 32
+    _Atomic uint64_t head;
+    atomic_size_t calls;
+    atomic_size_t overflows;
+} InferPool;
+
+typedef struct {
+    size_t calls;
+    // Calls that found no free slot or had more than max_rows rows
+    size_t overflows;
+} InferStats;
+
+// num_slots arenas, each big enough for a max_rows batch, num_slots <= 0 is one per parallel_num_threads()
+void infer_pool_init(InferPool* pool, const MLP* nn, int64_t input_dim, int64_t max_rows, int num_slots);
+// No call may still be running
+void infer_pool_free(InferPool* pool);
+// Thread safe. x is [rows, input_dim] row major, logits [rows, output_dim]
+void mlp_infer(InferPool* pool, const float* x, int64_t rows, float* logits);
+// Same on nn instead of pool->nn, eg one version of a ModelHandle. fatal if its shapes differ from the pool's
+void mlp_infer_on(InferPool* pool, const MLP* nn, const float* x, int64_t rows, float* logits);
+void infer_pool_stats(InferPool* pool, InferStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
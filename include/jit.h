@@ -0,0 +1,41 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "graph.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* x86-64 code for an execution plan's forward, built by a small in tree assembler straight into an mmap'd page that is
+   flipped to read+exec once written. Runs of plan steps become one function each with every pointer, shape and loop
+   bound baked in: a row major f32 matmul gets its GEMM inlined for the exact [n, m] x [m, k] with the accumulators
+   held in xmm registers, and the element wise ops after it (bias add, sub, mul, relu) are applied to those registers
+   before anything goes back to memory. Element wise runs without a matmul are fused the same way. Every op output is
+   still stored, so the interpreted backward finds what it expects. Math is SSE without FMA in the kernels' own
+   summation order, so the results are bit for bit the interpreter's. Everything else stays on the plan's step loop.
+   Off on other architectures, or with TINYENGINE_JIT=0, where compiling just gives NULL */
+typedef struct JitProgram JitProgram;
+
+typedef struct {
+    // Functions emitted and the plan steps they cover
+    size_t fused_groups;
+    size_t fused_steps;
+    // Steps left to the interpreter
+    size_t interpreted_steps;
+    size_t code_bytes;
+} JitStats;
+
+// Pointers are taken as they are now, a plan refreshed after a bind has to be compiled again (exec_plan_refresh does)
+JitProgram* jit_compile_forward(const ExecPlan* plan);
+void jit_run_forward(const JitProgram* prog);
+void jit_stats(const JitProgram* prog, JitStats* stats);
+void jit_free(JitProgram* prog);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -13,17 +13,20 @@ void run_inference(const MLP* nn);
 // see how
 // void run_eval(const MLP* nn, const Dataset* dataset);
 
-static void save_model(const char* file_path, const MLP* nn) {
-    FILE* f = fopen(file_path, "wb");
-    if(!f) {
-        fatal("save_model: failed to open %s", file_path);
-    }
+// The bytes of nn's model file into out, or only their count when out is NULL. With image set the values are read
+// from it instead of the tensors, image being a copy of the memory from base on that holds them (see async_save.h)
+static inline size_t model_serialize(const MLP* nn, const void* base, const void* image, uint8_t* out) {
+    size_t at = 0;
+
+#define MODEL_PUT(src, bytes) do { if(out) memcpy(out + at, (src), (bytes)); at += (bytes); } while(0)
+#define MODEL_DATA(tensor) (image? (const uint8_t*) image + ((const uint8_t*) (tensor)->data - (const uint8_t*) base) \
+    : (const uint8_t*) (tensor)->data)
 
     const char header[8] = "TMLP000";
-    fwrite(header, 1, 8, f);
+    MODEL_PUT(header, 8);
 
     // Perhaps should include other metadata of the MLP, (to add in nn.h)
-    fwrite(&nn->num_layers, sizeof(int), 1, f);
+    MODEL_PUT(&nn->num_layers, sizeof(int));
 
     for(int l = 0; l < nn->num_layers; l++) {
         Linear* layer = &nn->layers[l];
@@ -33,45 +36,148 @@ static void save_model(const char* file_path, const MLP* nn) {
         int64_t w0 = W->shape[0], w1 = W->shape[1];
         int64_t b0 = b->shape[0], b1 = b->shape[1];
 
-        fwrite(&w0, sizeof(int64_t), 1, f);
-        fwrite(&w1, sizeof(int64_t), 1, f);
-        fwrite(W->data, sizeof(float), (size_t)(w0*w1), f);
+        MODEL_PUT(&w0, sizeof(int64_t));
+        MODEL_PUT(&w1, sizeof(int64_t));
+        MODEL_PUT(MODEL_DATA(W), sizeof(float) * (size_t)(w0*w1));
 
-        fwrite(&b0, sizeof(int64_t), 1, f);
-        fwrite(&b1, sizeof(int64_t), 1, f);
-        fwrite(b->data, sizeof(float), (size_t)(b0*b1), f);
+        MODEL_PUT(&b0, sizeof(int64_t));
+        MODEL_PUT(&b1, sizeof(int64_t));
+        MODEL_PUT(MODEL_DATA(b), sizeof(float) * (size_t)(b0*b1));
     }
 
-    fclose(f);
+    // Norm params trail the layers, the widths come from the layers so only the values are stored
+    if(nn->norms) {
+        int norm = (int) nn->norm;
+        MODEL_PUT(&norm, sizeof(int));
+
+        for(int l = 0; l < nn->num_layers - 1; l++) {
+            const NormLayer* layer = &nn->norms[l];
+            size_t width = total_elems(layer->gamma);
+
+            MODEL_PUT(MODEL_DATA(layer->gamma), sizeof(float) * width);
+            MODEL_PUT(MODEL_DATA(layer->beta), sizeof(float) * width);
+            if(nn->norm == NORM_BATCH) {
+                MODEL_PUT(MODEL_DATA(layer->attrs.running_mean), sizeof(float) * width);
+                MODEL_PUT(MODEL_DATA(layer->attrs.running_var), sizeof(float) * width);
+            }
+        }
+    }
+
+#undef MODEL_DATA
+#undef MODEL_PUT
+
+    return at;
+}
+
+// Written to file_path.tmp and renamed over file_path, so a reader (eg a ModelHandle watching the path) sees either
+// the old file or the whole new one
+static inline void save_model(const char* file_path, const MLP* nn) {
+    size_t path_len = strlen(file_path);
+    size_t bytes = model_serialize(nn, NULL, NULL, NULL);
+    char* tmp_path = (char*) malloc(path_len + 5);
+    uint8_t* file = (uint8_t*) malloc(bytes);
+    if(!tmp_path || !file) {
+        fatal("save_model: malloc failed");
+    }
+    memcpy(tmp_path, file_path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+    model_serialize(nn, NULL, NULL, file);
+
+    FILE* f = fopen(tmp_path, "wb");
+    if(!f) {
+        fatal("save_model: failed to open %s", tmp_path);
+    }
+
+    fwrite(file, 1, bytes, f);
+    int failed = ferror(f);
+    failed |= fclose(f) != 0;
+    if(failed) {
+        fatal("save_model: writing %s failed", tmp_path);
+    }
+    if(rename(tmp_path, file_path) != 0) {
+        fatal("save_model: renaming %s to %s failed", tmp_path, file_path);
+    }
+    free(file);
+    free(tmp_path);
 }
 
-static void load_model(const char* file_path, MLP* nn) {
+// Same as load_model but a bad file is reported instead of fatal: 0 and why in err, nn partly overwritten
+static inline int read_model(const char* file_path, MLP* nn, char* err, size_t err_size) {
     FILE* f = fopen(file_path, "rb");
     if(!f) {
-        fatal("save_model: failed to open %s", file_path);
+        snprintf(err, err_size, "failed to open %s", file_path);
+        return 0;
     }
 
-    // UPDATE THE METADATA READ/LOADED IF NOT UPDATED (better for aligment to the model)
-    fread(&nn->num_layers, sizeof(int), 1, f);
+#define READ_MODEL_FAIL(...) do { snprintf(err, err_size, __VA_ARGS__); fclose(f); return 0; } while(0)
+
+    char header[8];
+    int num_layers = 0;
+    if(fread(header, 1, 8, f) != 8 || memcmp(header, "TMLP000", 8) != 0) {
+        READ_MODEL_FAIL("%s is not a TMLP000 model file", file_path);
+    }
+    if(fread(&num_layers, sizeof(int), 1, f) != 1 || num_layers != nn->num_layers) {
+        READ_MODEL_FAIL("%s has %d layers, model has %d", file_path, num_layers, nn->num_layers);
+    }
 
     for(int l = 0; l < nn->num_layers; l++) {
         Linear* layer = &nn->layers[l];
         Tensor* W = layer->weight;
         Tensor* b = layer->bias;
 
-        int64_t w0 = W->shape[0], w1 = W->shape[1];
-        int64_t b0 = b->shape[0], b1 = b->shape[1];
+        int64_t w0 = 0, w1 = 0;
+        int64_t b0 = 0, b1 = 0;
+
+        if(fread(&w0, sizeof(int64_t), 1, f) != 1 || fread(&w1, sizeof(int64_t), 1, f) != 1
+            || w0 != W->shape[0] || w1 != W->shape[1]) {
+            READ_MODEL_FAIL("layer %d weight shape mismatch", l);
+        }
+        if(fread(W->data, sizeof(float), (size_t)(w0*w1), f) != (size_t)(w0*w1)) {
+            READ_MODEL_FAIL("%s is truncated", file_path);
+        }
+
+        if(fread(&b0, sizeof(int64_t), 1, f) != 1 || fread(&b1, sizeof(int64_t), 1, f) != 1
+            || b0 != b->shape[0] || b1 != b->shape[1]) {
+            READ_MODEL_FAIL("layer %d bias shape mismatch", l);
+        }
+        if(fread(b->data, sizeof(float), (size_t)(b0*b1), f) != (size_t)(b0*b1)) {
+            READ_MODEL_FAIL("%s is truncated", file_path);
+        }
+    }
 
-        fread(&w0, sizeof(int64_t), 1, f);
-        fread(&w1, sizeof(int64_t), 1, f);
-        fread(W->data, sizeof(float), (size_t)(w0*w1), f);
+    int norm = NORM_NONE;
+    if(nn->norms && (fread(&norm, sizeof(int), 1, f) != 1 || norm != (int) nn->norm)) {
+        READ_MODEL_FAIL("%s has norm type %d, model has %d", file_path, norm, (int) nn->norm);
+    }
+    if(!nn->norms && fgetc(f) != EOF) {
+        READ_MODEL_FAIL("%s has norm layers, model has none", file_path);
+    }
+
+    for(int l = 0; nn->norms && l < nn->num_layers - 1; l++) {
+        NormLayer* layer = &nn->norms[l];
+        size_t width = total_elems(layer->gamma);
+        Tensor* params[4] = { layer->gamma, layer->beta, layer->attrs.running_mean, layer->attrs.running_var };
 
-        fread(&b0, sizeof(int64_t), 1, f);
-        fread(&b1, sizeof(int64_t), 1, f);
-        fread(b->data, sizeof(float), (size_t)(b0*b1), f);
+        for(int p = 0; p < (nn->norm == NORM_BATCH? 4 : 2); p++) {
+            if(fread(params[p]->data, sizeof(float), width, f) != width) {
+                READ_MODEL_FAIL("%s is truncated", file_path);
+            }
+        }
     }
 
+#undef READ_MODEL_FAIL
+
     fclose(f);
+    return 1;
+}
+
+// nn has to be built by init_mlp with the same architecture first, the file only carries the parameters
+static inline void load_model(const char* file_path, MLP* nn) {
+    char err[256];
+
+    if(!read_model(file_path, nn, err, sizeof(err))) {
+        fatal("load_model: %s", err);
+    }
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,106 @@
+#ifndef MODEL_HANDLE_H
+#define MODEL_HANDLE_H
+
+#include "nn.h"
+#include "infer.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The architecture every version is built with, a file has to match it to be swapped in
+typedef struct {
+    int num_layers;
+    int input_dim;
+    int width;
+    int output_dim;
+    Activation activation;
+    NormType norm;
+} ModelArch;
+
+// One loaded set of params, in an arena of its own so it can be dropped in one go
+typedef struct ModelVersion {
+    MLP nn;
+    Arena arena;
+    // 1 for the first, +1 per swap
+    uint64_t id;
+} ModelVersion;
+
+/* RCU style handle for serving while the model file gets replaced. Readers pin the current version with two atomic
+   increments and a load, never a lock, and run on it until they let go, however many swaps happen meanwhile. A reload
+   builds the new version off to the side (read_model checks every shape, then every param has to be finite), swaps
+   the pointer, then waits out a grace period before freeing the old one: the reader counts are split by an epoch
+   parity, the epoch is flipped twice and each old side has to drain, which covers every reader that could still have
+   seen the old pointer. Reloads are serialised among themselves, only they ever wait.
+   model_handle_watch polls the file's inode, size and mtime from a thread and reloads on any change. save_model
+   renames into place, a file written in place may be caught half done, it is rejected then and picked up once it
+   changes again */
+typedef struct ModelHandle {
+    ModelArch arch;
+    _Atomic(ModelVersion*) current;
+    atomic_uint epoch;
+    atomic_size_t readers[2];
+    pthread_mutex_t reload_lock;
+
+    InferPool pool;
+
+    atomic_size_t reloads;
+    atomic_size_t rejected;
+    atomic_size_t freed;
+    // Longest grace period so far, in microseconds
+    atomic_size_t max_grace_us;
+
+    // The file version 1 came from, the one the watcher follows
+    char* path;
+    int poll_ms;
+    pthread_t watcher;
+    int watching;
+    atomic_int stop;
+    // Identity of the file last tried, so a broken one isn't retried until it changes
+    dev_t seen_dev;
+    ino_t seen_ino;
+    off_t seen_size;
+    int64_t seen_mtime_ns;
+} ModelHandle;
+
+// What a reader holds between begin and end
+typedef struct {
+    const ModelVersion* version;
+    unsigned side;
+} ModelRead;
+
+typedef struct {
+    uint64_t version;
+    size_t reloads;
+    size_t rejected;
+    size_t freed;
+    double max_grace_ms;
+} ModelHandleStats;
+
+// Loads path as version 1, fatal if it doesn't load. The inference pool gets max_rows and num_slots (see infer.h)
+void model_handle_init(ModelHandle* handle, const ModelArch* arch, const char* path, int64_t max_rows, int num_slots);
+// Stops the watcher and frees the current version, no reader may be left
+void model_handle_free(ModelHandle* handle);
+
+// Lock free, pairs with model_read_end on the same thread or another
+ModelRead model_read_begin(ModelHandle* handle);
+void model_read_end(ModelHandle* handle, ModelRead read);
+// begin, mlp_infer_on the pinned version, end. Returns the version id that answered
+uint64_t model_handle_infer(ModelHandle* handle, const float* x, int64_t rows, float* logits);
+
+// Loads, validates and swaps, 1 if the file went in, 0 (and why in err when given) if it was rejected
+int model_handle_reload(ModelHandle* handle, const char* path, char* err, size_t err_size);
+// Background reloads of the init path every time it changes, checked every poll_ms
+void model_handle_watch(ModelHandle* handle, int poll_ms);
+void model_handle_stats(ModelHandle* handle, ModelHandleStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -29,19 +29,50 @@ typedef enum {
     ACT_SOFTMAX,
 } Activation;
 
+typedef enum {
+    NORM_NONE = 0,
+    NORM_LAYER,
+    NORM_BATCH,
+} NormType;
+
 // Abstracting layers for the AD and not the actual nn
 typedef struct Linear {
     size_t in_features;
     size_t out_features;
     Tensor* weight;
     Tensor* bias;
+    // Optional bf16/fp16 working copy of weight used by the forward/backward, weight stays the fp32 master copy
+    // and weight_half->grad aliases weight->grad so the optimiser only ever sees fp32
+    Tensor* weight_half;
 } Linear;
 
+// Conv1D/Conv2D layer over NC(H)W inputs, weight [out, in, (kh,) kw] and bias [out]
+typedef struct ConvLayer {
+    int spatial;
+    size_t in_channels;
+    size_t out_channels;
+    Tensor* weight;
+    Tensor* bias;
+    ConvAttrs attrs;
+} ConvLayer;
+
+// gamma and beta [1, width] after a hidden layer's bias add, attrs is handed to the norm node as its Node::attrs
+typedef struct NormLayer {
+    Tensor* gamma;
+    Tensor* beta;
+    NormAttrs attrs;
+} NormLayer;
+
 // Perhaps should add more metadata, to update in model.h
 typedef struct MLP {
     int num_layers;
     Linear* layers;
     Activation hidden_activation;
+    // num_layers - 1 of them (one per hidden layer) when norm isn't NORM_NONE
+    NormType norm;
+    NormLayer* norms;
+    // After each hidden activation when set, num_layers - 1 of them, one seed each
+    DropoutAttrs* dropouts;
 } MLP;
 
 // Fully connected always
@@ -55,10 +86,26 @@ void init_mlp(MLP* nn,
             InitScheme hidden_init, 
             InitScheme output_init, 
             uint32_t* rng_state);
+Node* layer_forward(Graph* graph, Node* input, const Linear* layer);
+// kernel, stride and padding have spatial entries (height first), NULL stride is 1 and NULL padding 0
+void conv_layer_init(ConvLayer* layer, Arena* param_arena, int spatial, size_t in_channels, size_t out_channels,
+    const int* kernel, const int* stride, const int* padding, InitScheme init_scheme, uint32_t* rng);
+Node* conv_layer_forward(Graph* graph, Node* input, const ConvLayer* layer);
 Node* mlp_forward(Graph* graph, Node* input, const MLP* nn);
 Node* apply_activation(Graph* graph, Activation activation, Node* input);
 void mlp_zero_grads(MLP* nn);
 void mlp_sgd_step(MLP* nn, float lr);
+// Mixed precision: 16 bit weight copies in param_arena next to the fp32 masters, resync after every optimiser step
+void mlp_enable_mixed_precision(MLP* nn, Arena* param_arena, DType dtype);
+void mlp_sync_half_weights(MLP* nn);
+// Norm between every hidden layer and its activation, params and the batch norm running stats go into param_arena
+void mlp_enable_norm(MLP* nn, Arena* param_arena, NormType norm);
+// Dropout with probability p after every hidden activation, mlp_sgd_step moves its step so each step gets new masks
+void mlp_enable_dropout(MLP* nn, float p, uint64_t seed);
+// Batch norm switches between the batch and the running stats when training is 0, takes effect on the next forward
+// (templates included). Dropout is left out of the graphs mlp_forward builds while training is 0, a template recorded
+// then stays without it, record again after switching back
+void mlp_set_training(MLP* nn, int training);
 void mlp_free(MLP* nn);
 
 
@@ -11,20 +11,147 @@ typedef struct Node Node;
 // Format: typedef {return_type} (*{function_name})({parameter_list});
 typedef void (*OpForward)(Node*);
 typedef void (*OpBackward)(Node*);
-typedef enum { OP_INPUT, OP_ADD, OP_SUB, OP_MUL, OP_MATMUL, OP_RELU, OP_SOFTMAX, OP_SIGMOID, OP_TANH } Op;
+// The built in ops keep their fixed ids, register_opkernel hands ops with optype OP_DYNAMIC the next id from
+// OP_BUILTIN_COUNT up
+typedef enum { OP_DYNAMIC = -1, OP_INPUT, OP_ADD, OP_SUB, OP_MUL, OP_MATMUL, OP_RELU, OP_SOFTMAX, OP_SIGMOID, OP_TANH, OP_SOFTMAX_CROSS_ENTROPY, OP_EMBEDDING, OP_LAYERNORM, OP_BATCHNORM, OP_DROPOUT, OP_CONV1D, OP_CONV2D, OP_BUILTIN_COUNT } Op;
 
+// Settings of the norm ops through Node::attrs, NULL attrs is eps NORM_DEFAULT_EPS and batch statistics
+#define NORM_DEFAULT_EPS 1e-5f
+typedef struct NormAttrs {
+    float eps;
+    // BatchNorm only: the running stats are [1, D] tensors in the persistent arena, moved by momentum on every training
+    // backward (so forward only runs and checkpoint recomputes leave them alone) and used instead of the batch ones
+    // when training is 0
+    float momentum;
+    int training;
+    Tensor* running_mean;
+    Tensor* running_var;
+} NormAttrs;
+
+// Settings of OP_DROPOUT through Node::attrs, NULL attrs (or training 0, or p 0) makes it a copy. The keep mask is a
+// Philox draw keyed by seed, step and the element index, so a recompute gives the same mask as long as step hasn't
+// moved, the caller bumps step once per training step
+typedef struct DropoutAttrs {
+    float p;
+    uint64_t seed;
+    uint64_t step;
+    int training;
+} DropoutAttrs;
+
+// Settings of OP_CONV1D/OP_CONV2D, given to add_node_attrs since the output shape depends on them. Index 0 is the
+// height and 1 the width, conv1d only reads index 0. NULL attrs is stride 1 and no padding
+typedef struct ConvAttrs {
+    int stride[2];
+    int padding[2];
+} ConvAttrs;
+
+// One lowered op of an execution plan (see exec_plan_build in graph.h), everything the flat kernels need is resolved
+// up front so running a step touches no Node or Tensor header
+typedef struct PlanStep PlanStep;
+typedef void (*PlanFn)(const PlanStep*);
+
+struct PlanStep {
+    // Always set, the node path is taken when the op has no flat variant or the operands don't fit it
+    Node* node;
+    OpForward forward;
+    OpBackward backward;
+    // NULL means run forward/backward(node)
+    PlanFn flat_forward;
+    PlanFn flat_backward;
+
+    // Contiguous fp32 operands, grads NULL for forward only plans
+    float* out;
+    float* gout;
+    float* in[2];
+    float* gin[2];
+    size_t n;
+    // Input j is a [1, cols] row repeated down the rows through a 0 stride (an expanded bias), data and grad
+    int bcast[2];
+    int64_t cols;
+};
+
+// Rough cost of one forward of a node, what the schedulers (variant chooser, checkpoint stats) rank by
+typedef struct {
+    double flops;
+    double bytes;
+} OpCost;
+
+// Output shape of a node whose inputs (and attrs) are set, fatal on inputs it can't take, returns the ndim
+typedef int (*OpInfer)(const Node* node, int64_t out_shape[6]);
+// Scratch the kernel keeps on node->aux between forward and backward, returns its ndim, 0 for none
+typedef int (*OpAuxShape)(const Node* node, int64_t aux_shape[6], DType* dtype);
+typedef void (*OpCostFn)(const Node* node, OpCost* cost);
+
+typedef enum { OP_IMPL_SCALAR = 0, OP_IMPL_SIMD, OP_IMPL_THREADED } OpImpl;
+
+// One implementation of an op, supports NULL means it takes any node the infer accepted
 typedef struct {
+    OpImpl impl;
+    const char* name;
+    OpForward forward;
+    OpBackward backward;
+    int (*supports)(const Node* node);
+} OpVariant;
+
+#define OP_MAX_VARIANTS 4
+// Threaded variants only pay off above this many flops per node
+#define OP_THREADED_MIN_FLOPS 1e5
+
+typedef struct OpKernel OpKernel;
+// Index into kernel->variants for the node, called once per node by add_node
+typedef int (*OpChooser)(const Node* node, const OpKernel* kernel);
+
+struct OpKernel {
     Op optype;
     const char* name;
     OpForward forward;
     OpBackward backward;
-} OpKernel;
+    // Number of inputs add_node checks before infer, 0 leaves it to infer (optional inputs)
+    int arity;
+    OpInfer infer;
+    OpAuxShape aux_shape;
+    // NULL is one flop per output element and every input and output read or written once
+    OpCostFn cost;
+    // Optional, forward/backward above are what runs when there are none. choose NULL is op_default_chooser
+    OpVariant variants[OP_MAX_VARIANTS];
+    int num_variants;
+    OpChooser choose;
+    // Optional flat variants for contiguous fp32 operands of the output's size, flat_row_broadcast if they also take
+    // the bcast inputs
+    PlanFn flat_forward;
+    PlanFn flat_backward;
+    int flat_row_broadcast;
+    // Forward mode, out->tangent from the primal values and the input tangents. Run after forward
+    OpForward jvp;
+    // Tangent of the backward: accumulates in->grad->tangent from out->grad, out->grad->tangent and the tangents of
+    // the primals. Running it next to backward is forward over reverse, ie Hessian vector products
+    OpBackward backward_jvp;
+};
 
-// Called by the op init fns
-void register_opkernel(const OpKernel* kernel);
+// Called by the op init fns, or at runtime for ops living outside the tree. Returns the op id, a fresh one for
+// OP_DYNAMIC. Not locked, register before other threads build graphs
+Op register_opkernel(const OpKernel* kernel);
 
-// Get opkernel by its enum
+// Get opkernel by its enum or a registered dynamic id, NULL if there is none
 const OpKernel* get_opkernel(Op optype);
+// OP_DYNAMIC if no op has that name
+Op find_op(const char* name);
+
+OpCost op_cost(const Node* node);
+// NULL when the kernel has no variants. Asks the tuner first when one is set and the kernel has a choice to make
+const OpVariant* op_choose_variant(const Node* node);
+// Measured choice over the static one (see autotune.h), returning -1 falls back to kernel->choose or the default. NULL
+// removes it
+void op_set_tuner(OpChooser tuner);
+// The fastest supported impl, threaded only with more than 1 thread and OP_THREADED_MIN_FLOPS of work
+int op_default_chooser(const Node* node, const OpKernel* kernel);
+
+// Shape rules shared by the infer callbacks. Inputs are dense fp32 unless their bit is in allow_mask
+void op_require_dense_f32(const Node* node, unsigned allow_mask);
+// Output shaped like input 0
+int op_infer_unary(const Node* node, int64_t out_shape[6]);
+// Two inputs of the same shape
+int op_infer_elementwise(const Node* node, int64_t out_shape[6]);
 // Simple testing function for each op, all 3 nodes are n_dim = 2
 // fill_(a,b,c) is the shape of input a,b and output c respectively
 // fill_a 0th idx is the float to fill the first input's entire 2x3 tensor, 1st is backprop grad val
@@ -9,8 +9,27 @@ extern "C" {
 
 typedef enum { OPTIM_SGD, OPTIM_ADAM, OPTIM_ADAM_W } Optimiser;
 
+// Adam moments, fp32 and shaped like the tensor. weight_decay > 0 is AdamW (decoupled, applied to the weights)
+typedef struct {
+    Tensor* m;
+    Tensor* v;
+    float beta1;
+    float beta2;
+    float eps;
+    float weight_decay;
+    int64_t step;
+} AdamState;
+
 void tensor_zero_grad(Tensor* tensor);
 void sgd_step(Tensor* tensor, float lr);
+void adam_init(AdamState* state, Arena* arena, const Tensor* like, float beta1, float beta2, float eps, float weight_decay);
+void adam_step(Tensor* tensor, AdamState* state, float lr);
+
+// Lazy updates for tables with a row sparse grad: only the rows touched since the last step are read or written and
+// the grad is cleared after, so a step costs the touched rows whatever the vocab. Lazy Adam leaves the moments of
+// untouched rows where they were instead of decaying them
+void sparse_sgd_step(Tensor* table, float lr);
+void sparse_adam_step(Tensor* table, AdamState* state, float lr);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,27 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// fn(ctx, begin, end) over a sub range of [0, n), ranges never overlap so a kernel that writes only the outputs of its
+// own range needs no locking and gives the same bits for any thread count
+typedef void (*ParallelFn)(void* ctx, size_t begin, size_t end);
+
+// Splits [0, n) into chunks of grain items run by a lazily started worker pool plus the calling thread. Runs inline
+// when there is 1 thread, a single chunk, or the pool is already busy (nested calls, other threads)
+void parallel_for(size_t n, size_t grain, ParallelFn fn, void* ctx);
+
+// 0 picks TINYENGINE_THREADS from the environment or else the online cpu count, the pool is restarted on a change
+void parallel_set_threads(int num_threads);
+// Lock-free, safe to call from anywhere including while a job runs
+int parallel_num_threads(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
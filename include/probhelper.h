@@ -1,6 +1,7 @@
 #ifndef PROBHELPER_H
 #define PROBHELPER_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <math.h>
 #ifndef PI
@@ -12,4 +13,30 @@ float rand_uniform01(uint32_t* state);
 float rand_uniform(uint32_t* state, float low, float high);
 float rand_normal(uint32_t* state, float mean, float std);
 
+/* Philox4x32-10 counter based generator (Salmon et al. 2011, the Random123 one). Every block of 4 outputs is a pure
+   function of (key, counter), there is no state to carry from one value to the next, so any element can be generated
+   on its own. Output i of a stream is word i % 4 of block i / 4, whoever computes it and in whatever order.
+   The key is the seed, the stream id sits in the upper half of the counter */
+typedef struct {
+    uint32_t key[2];
+    uint64_t stream;
+    // Next unused output index, the sequential fill_* calls consume from here
+    uint64_t offset;
+} Philox;
+
+void philox_init(Philox* rng, uint64_t seed, uint64_t stream);
+void philox_block(const Philox* rng, uint64_t block, uint32_t out[4]);
+
+// Sequential use: fill the next n values of the stream and advance it. Big fills are cut into fixed chunks of *_at calls
+// run through parallel_for, so the values are the same on any number of threads
+void fill_uniform(Philox* rng, float* dst, size_t n, float low, float high);
+void fill_normal(Philox* rng, float* dst, size_t n, float mean, float std);
+
+/* Split use: dst gets outputs [first, first + n) of the stream and rng is left untouched. Threads handing out disjoint
+   ranges of one array get exactly what a single fill_* over the whole array gives, whatever the thread count.
+   Normals come in Box-Muller pairs (2k, 2k + 1) from one pair of uniforms, cos and sin halves both used, 8 pairs at a
+   time through the fastmath.h log and sincos (within 1e-6 std of libm in double) */
+void fill_uniform_at(const Philox* rng, float* dst, uint64_t first, size_t n, float low, float high);
+void fill_normal_at(const Philox* rng, float* dst, uint64_t first, size_t n, float mean, float std);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,49 @@
+#ifndef QUANT_H
+#define QUANT_H
+
+#include "nn.h"
+#include "arena.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Post training int8 quantisation of a trained MLP, inference only
+// Weights are symmetric per output channel, activations are symmetric per tensor with the scale taken from a calibration pass
+typedef struct QuantLinear {
+    int64_t in_features;
+    int64_t out_features;
+    // [out, in], transposed from the fp32 [in, out] layout so each output channel is one contiguous dot product
+    int8_t* weight;
+    // [out] dequant scale per channel
+    float* w_scale;
+    // [out] per channel sum of the int8 weights, corrects the +128 offset the u8 x s8 VNNI path needs
+    int32_t* w_sum;
+    // [out] kept in fp32, added in the epilogue
+    float* bias;
+    // Scale of the int8 input activations of this layer
+    float in_scale;
+} QuantLinear;
+
+typedef struct QuantMLP {
+    int num_layers;
+    QuantLinear* layers;
+    Activation hidden_activation;
+} QuantMLP;
+
+// calib is [n_calib, input_dim] row major (eg a sample of Dataset::class_dpoints), scratch is reset as needed.
+// Everything the quantised model keeps is allocated from q_arena
+void quantize_mlp(QuantMLP* q, const MLP* nn, Arena* q_arena, Arena* scratch, const float* calib, int64_t n_calib);
+// x is [n, input_dim], out is [n, output_dim] raw logits (fp32), temporaries come from scratch
+void qmlp_forward(const QuantMLP* q, const float* x, int64_t n, float* out, Arena* scratch);
+// Accuracy check against the fp32 path: max abs logit error and the fraction of rows with the same argmax
+void qmlp_compare(const QuantMLP* q, const MLP* nn, const float* x, int64_t n, Arena* scratch, float* max_abs_err, float* argmax_agreement);
+size_t qmlp_weight_bytes(const QuantMLP* q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
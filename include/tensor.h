@@ -2,6 +2,7 @@
 #define TENSOR_H
 
 #include "arena.h"
+#include "dtype.h"
 
 typedef struct Arena Arena;
 
@@ -18,25 +19,114 @@ typedef struct Arena Arena;
 extern "C" {
 #endif  
 
+// Index arrays of a CSR sparse [rows, cols] tensor, row i's nonzeros are values[row_ptr[i] .. row_ptr[i + 1]) with
+// their columns in col_idx. The values are the tensor's data
+typedef struct CsrIndex {
+    int64_t nnz;
+    int32_t* row_ptr;
+    int32_t* col_idx;
+} CsrIndex;
+
+// Row sparse grad of a [vocab, dim] table (eg an embedding), only the rows touched since the last clear exist. Their
+// grads are packed in values [num_rows, dim] in first touch order, slot maps a table row onto its packed row (-1 if
+// untouched) so repeated rows accumulate in place. Clearing resets just the touched slots
+typedef struct RowSparseGrad {
+    int64_t vocab;
+    int64_t dim;
+    int64_t num_rows;
+    int64_t capacity;
+    int32_t* rows;
+    int32_t* slot;
+    float* values;
+} RowSparseGrad;
+
 // tensor struct, grad for easier (lazier) backpropagation, another tensor with the same shape
 // data is all stored within our arena
+// Views share data with their base tensor, data already points at the first element of the view so the
+// offset is baked into the pointer and kernels never need a separate offset
 typedef struct Tensor {
-    float* data;
+    // data16 aliases the same storage for the bf16/fp16 dtypes, data is only valid to index for DTYPE_F32
+    union {
+        float* data;
+        uint16_t* data16;
+        int32_t* data_i32;
+    };
+    DType dtype;
     int64_t shape[6];
     int64_t stride[6];
     int ndim;
     struct Tensor* grad;
+    // Forward mode direction (see graph_forward_jvp_pass), on a grad it is the tangent of the grad for the HVP pass
+    struct Tensor* tangent;
+    // NULL for tensors that own their data, otherwise the tensor whose data this view aliases
+    const struct Tensor* base;
+    // 1 if the strides are exactly row major, so kernels can take the flat data[i] fast path
+    int is_contiguous;
+    // Non NULL for a CSR sparse tensor, only matmul takes those (as A) and they never get a grad
+    const CsrIndex* csr;
+    // Takes the place of grad for tables whose backward only touches a few rows, see tensor_attach_sparse_grad
+    RowSparseGrad* sparse_grad;
 } Tensor;
 
 // NTS: const so we compiler would yell at us if we accidentally change the input tensor
 size_t total_elems(const Tensor* tensor);
 // Some other convenience functions
 Tensor* tensor_new(Arena* arena, int ndim, const int64_t* shape);
+Tensor* tensor_new_dtype(Arena* arena, int ndim, const int64_t* shape, DType dtype);
+// Shape/strides only with data left NULL, for tensors whose storage is bound later (eg checkpointed activations)
+Tensor* tensor_new_header(Arena* arena, int ndim, const int64_t* shape, DType dtype);
 Tensor* tensor_zeroes_like(Arena* arena, const Tensor* like);
+// CSR sparse fp32 [rows, cols] with room for nnz values, row_ptr/col_idx/data are left for the caller to fill
+Tensor* tensor_new_csr(Arena* arena, int64_t rows, int64_t cols, int64_t nnz);
+Tensor* tensor_csr_copy(Arena* arena, const Tensor* src);
+// Gives a 2D fp32 table a row sparse grad instead of a dense one, capacity is the most distinct rows per step
+void tensor_attach_sparse_grad(Arena* arena, Tensor* table, int64_t capacity);
+// Packed grad row for a table row, zeroed on first touch since the last clear
+float* row_sparse_grad_row(RowSparseGrad* grad, int32_t row);
+void row_sparse_grad_clear(RowSparseGrad* grad);
 void tensor_fill(Tensor* tensor, float value);
 void print_tensor_recursive(const Tensor* t, int dim, int64_t offset);
 void print_tensor(const Tensor* t);
 
+// Zero copy views, the view header is allocated from the arena but data is shared with src.
+// If src carries a grad, the view gets the matching view of the grad so backward accumulates into src->grad
+Tensor* tensor_transpose(Arena* arena, const Tensor* src, int dim0, int dim1);
+Tensor* tensor_permute(Arena* arena, const Tensor* src, const int* perm);
+// Only for contiguous src, anything else has to be copied first
+Tensor* tensor_reshape(Arena* arena, const Tensor* src, int ndim, const int64_t* shape);
+Tensor* tensor_narrow(Arena* arena, const Tensor* src, int dim, int64_t start, int64_t length);
+// Broadcast size 1 dims (and new leading dims) to shape with a 0 stride
+Tensor* tensor_expand(Arena* arena, const Tensor* src, int ndim, const int64_t* shape);
+// Same as tensor_transpose but the header lives in caller storage (eg the stack inside a kernel), grad is not carried
+void tensor_transpose_into(Tensor* view, const Tensor* src, int dim0, int dim1);
+
+int tensor_is_contiguous(const Tensor* tensor);
+void tensor_update_contiguity(Tensor* tensor);
+// Maps a row major linear index onto the element offset through the strides, used by the non contiguous kernel paths
+size_t tensor_elem_offset(const Tensor* tensor, size_t linear_idx);
+
+// Element read at an element offset widened to fp32 whatever the storage dtype, for the slow/generic paths
+static inline float tensor_load(const Tensor* tensor, size_t offset) {
+    if(tensor->dtype == DTYPE_BF16) return bf16_to_f32(tensor->data16[offset]);
+    if(tensor->dtype == DTYPE_F16) return f16_to_f32(tensor->data16[offset]);
+    if(tensor->dtype == DTYPE_I32) return (float) tensor->data_i32[offset];
+    return tensor->data[offset];
+}
+
+// Labels and sparse inputs are data, everything else gets a grad
+static inline int tensor_is_differentiable(const Tensor* tensor) {
+    return tensor->dtype != DTYPE_I32 && !tensor->csr;
+}
+
+// fp32 element at a row major linear index, the strided lookup is skipped for contiguous tensors
+static inline float* tensor_at(const Tensor* tensor, size_t linear_idx) {
+    return tensor->data + (tensor->is_contiguous? linear_idx : tensor_elem_offset(tensor, linear_idx));
+}
+
+// Allocates a copy of src in dtype, tensor_copy_cast converts between two tensors of the same shape
+Tensor* tensor_cast(Arena* arena, const Tensor* src, DType dtype);
+void tensor_copy_cast(Tensor* dst, const Tensor* src);
+
 #ifdef __cplusplus
 }
 #endif
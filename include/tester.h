@@ -10,6 +10,8 @@
 #include <math.h>
 
 int areAlmostEqual(float a, float b);
+// Distance in units in the last place, for checking the approximated kernels against a double reference
+int64_t ulp_distance(float a, float b);
 void testOp(Op op, const int64_t* sh_a, const int64_t* sh_b, const int64_t* sh_c, 
     float* fill_a, float* fill_b, float fill_c, float* unary_out);
 
@@ -15,6 +15,10 @@ extern "C" {
 void fatalf(const char* file, int line, const char* fmt, ...);
 #define fatal(...) fatalf(__FILE__, __LINE__, __VA_ARGS__)
 
+// Milliseconds on the monotonic clock, for timing only: it never jumps with NTP or date changes, which would skew a
+// measurement (and an autotune pick persisted from it). Only differences mean anything
+double now_ms(void);
+
 // Round pointer so that subsequent allocations are aligned (eg cache line)
 // and avoid misaligned access. The alignment `a` would be taken from
 // `alignof()` (power-of-two expected).
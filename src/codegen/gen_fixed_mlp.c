@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fastmath.h"
+
+// Build time generator for include/fixed_mlp.h: gen_fixed_mlp <layers> <input> <width> <output> <relu|tanh|sigmoid> <out.c>
+// writes the forward and the fused train step of that one MLP shape with every loop bound and param offset a literal.
+// The layer loops keep the matmul kernel's summation order (zero, x @ W in order of the inputs, then + b), so the
+// logits come out the same as the graph's
+
+typedef struct {
+    int in;
+    int out;
+    size_t w;
+    size_t b;
+} LayerShape;
+
+static void emit_dense(FILE* f, int in, int out) {
+    fprintf(f,
+        "// y = x @ W + b for x [%d] and W [%d, %d]. The sums build in a local that GCC keeps in vector registers, a fully\n"
+        "// unrolled loop over y gets vectorised across the inputs instead, with a shuffle per load\n"
+        "static inline void dense_%dx%d(const float* restrict w, const float* restrict b, const float* restrict x, float* restrict y) {\n"
+        "    float acc[%d] = { 0 };\n"
+        "    for(int i = 0; i < %d; i++) {\n"
+        "        const float a = x[i];\n"
+        "        for(int j = 0; j < %d; j++) acc[j] += a * w[i * %d + j];\n"
+        "    }\n"
+        "    for(int j = 0; j < %d; j++) y[j] = acc[j] + b[j];\n"
+        "}\n\n",
+        in, in, out, in, out, out, in, out, out, out);
+
+    fprintf(f,
+        "// gx = W @ gy with the W from before the step, then W -= lr * x^T gy and b -= lr * gy in the same pass\n"
+        "static inline void dense_sgd_%dx%d(float* restrict w, float* restrict b, const float* restrict x, const float* restrict gy, float* restrict gx, float lr) {\n"
+        "    for(int i = 0; i < %d; i++) {\n"
+        "        float sum = 0.0f;\n"
+        "#pragma GCC unroll 32\n"
+        "        for(int j = 0; j < %d; j++) {\n"
+        "            sum += w[i * %d + j] * gy[j];\n"
+        "            w[i * %d + j] -= lr * (x[i] * gy[j]);\n"
+        "        }\n"
+        "        gx[i] = sum;\n"
+        "    }\n"
+        "    for(int j = 0; j < %d; j++) b[j] -= lr * gy[j];\n"
+        "}\n\n",
+        in, out, in, out, out, out, out);
+}
+
+// tanh and sigmoid go through the activation ops' fastmath kernels, 8 lane chunks and a scalar tail, instead of libm.
+// relu stays a plain loop, GCC vectorises that one by itself
+static void emit_activation(FILE* f, const char* act, int width) {
+    const char* vec_forward = NULL;
+    const char* forward = "y[j] > 0.0f? y[j] : 0.0f";
+    const char* vec_deriv = NULL;
+    const char* deriv = "y[j] > 0.0f? g[j] : 0.0f";
+
+    if(strcmp(act, "tanh") == 0) {
+        vec_forward = "v8_tanh(&v);";
+        forward = "fast_tanhf(y[j])";
+        vec_deriv = "v8_load(g + j) * (1.0f - v * v)";
+        deriv = "g[j] * (1.0f - y[j] * y[j])";
+    }
+    else if(strcmp(act, "sigmoid") == 0) {
+        vec_forward = "v8_sigmoid(&v);";
+        forward = "fast_sigmoidf(y[j])";
+        vec_deriv = "v8_load(g + j) * v * (1.0f - v)";
+        deriv = "g[j] * y[j] * (1.0f - y[j])";
+    }
+
+    const int body = vec_forward? width - width % V8_WIDTH : 0;
+    fprintf(f, "static inline void act_forward(float* y) {\n");
+    if(body) {
+        fprintf(f,
+            "    for(int j = 0; j < %d; j += V8_WIDTH) {\n"
+            "        f32x8 v = v8_load(y + j);\n"
+            "        %s\n"
+            "        v8_store(y + j, v);\n"
+            "    }\n",
+            body, vec_forward);
+    }
+    if(body < width) fprintf(f, "    for(int j = %d; j < %d; j++) y[j] = %s;\n", body, width, forward);
+    fprintf(f, "}\n\n");
+
+    fprintf(f,
+        "// g through the activation, from its output y\n"
+        "static inline void act_backward(const float* y, float* g) {\n");
+    if(body) {
+        fprintf(f,
+            "    for(int j = 0; j < %d; j += V8_WIDTH) {\n"
+            "        const f32x8 v = v8_load(y + j);\n"
+            "        v8_store(g + j, %s);\n"
+            "    }\n",
+            body, vec_deriv);
+    }
+    if(body < width) fprintf(f, "    for(int j = %d; j < %d; j++) g[j] = %s;\n", body, width, deriv);
+    fprintf(f, "}\n\n");
+}
+
+// name, or name[index] when index >= 0
+static const char* buffer(char* buf, size_t size, const char* name, int index) {
+    if(index < 0) snprintf(buf, size, "%s", name);
+    else snprintf(buf, size, "%s[%d]", name, index);
+
+    return buf;
+}
+
+int main(int argc, char** argv) {
+    if(argc != 7) {
+        fprintf(stderr, "usage: %s <layers> <input> <width> <output> <relu|tanh|sigmoid> <out.c>\n", argv[0]);
+        return 2;
+    }
+
+    int layers = atoi(argv[1]), input = atoi(argv[2]), width = atoi(argv[3]), output = atoi(argv[4]);
+    const char* act = argv[5];
+
+    if(layers < 1 || input < 1 || width < 1 || output < 1) {
+        fprintf(stderr, "gen_fixed_mlp: layers and dims must be >= 1\n");
+        return 2;
+    }
+    if(strcmp(act, "relu") != 0 && strcmp(act, "tanh") != 0 && strcmp(act, "sigmoid") != 0) {
+        fprintf(stderr, "gen_fixed_mlp: activation must be relu, tanh or sigmoid, got %s\n", act);
+        return 2;
+    }
+
+    LayerShape* shapes = (LayerShape*) malloc((size_t) layers * sizeof(LayerShape));
+    if(!shapes) {
+        fprintf(stderr, "gen_fixed_mlp: malloc failed\n");
+        return 1;
+    }
+
+    // Same shapes as init_mlp
+    size_t offset = 0;
+    for(int l = 0; l < layers; l++) {
+        shapes[l].in = (l == 0)? input : width;
+        shapes[l].out = (l == layers - 1)? output : width;
+        shapes[l].w = offset;
+        shapes[l].b = offset + (size_t) shapes[l].in * (size_t) shapes[l].out;
+        offset = shapes[l].b + (size_t) shapes[l].out;
+    }
+
+    FILE* f = fopen(argv[6], "w");
+    if(!f) {
+        fprintf(stderr, "gen_fixed_mlp: can't write %s\n", argv[6]);
+        return 1;
+    }
+
+    fprintf(f, "// Generated by gen_fixed_mlp for %d layers, %d -> %d -> %d, %s. Don't edit, set FIXED_* in the Makefile\n",
+        layers, input, width, output, act);
+    fprintf(f, "#include \"fixed_mlp.h\"\n#include \"fastmath.h\"\n\n#include <math.h>\n\n");
+    fprintf(f, "const FixedMlpSpec fixed_mlp_spec = { %d, %d, %d, %d, \"%s\", %zu };\n\n", layers, input, width, output, act, offset);
+
+    // One dense pair per distinct (in, out), at most input x width, width x width and width x output
+    for(int l = 0; l < layers; l++) {
+        int seen = 0;
+        for(int k = 0; k < l; k++) seen |= shapes[k].in == shapes[l].in && shapes[k].out == shapes[l].out;
+        if(!seen) emit_dense(f, shapes[l].in, shapes[l].out);
+    }
+    if(layers > 1) {
+        emit_activation(f, act, width);
+    }
+
+    fprintf(f, "void fixed_mlp_forward(const float* params, const float* x, float* logits) {\n");
+    if(layers > 1) fprintf(f, "    float h[2][%d];\n", width);
+    for(int l = 0; l < layers; l++) {
+        const LayerShape* s = &shapes[l];
+        char in_buf[32], out_buf[32];
+        const char* in = buffer(in_buf, sizeof(in_buf), l == 0? "x" : "h", l == 0? -1 : (l - 1) & 1);
+        const char* out = buffer(out_buf, sizeof(out_buf), l == layers - 1? "logits" : "h", l == layers - 1? -1 : l & 1);
+
+        fprintf(f, "    dense_%dx%d(params + %zu, params + %zu, %s, %s);\n", s->in, s->out, s->w, s->b, in, out);
+        if(l != layers - 1) fprintf(f, "    act_forward(%s);\n", out);
+    }
+    fprintf(f, "}\n\n");
+
+    // The hidden activations are all kept for the backward, the grad ping pongs between two buffers
+    fprintf(f, "float fixed_mlp_train_step(float* params, const float* x, int label, float lr) {\n");
+    if(layers > 1) fprintf(f, "    float h[%d][%d];\n", layers - 1, width);
+    fprintf(f, "    float z[%d], g[%d];\n", output, output);
+    fprintf(f, "    float gh[2][%d];\n", width > input? width : input);
+    for(int l = 0; l < layers; l++) {
+        const LayerShape* s = &shapes[l];
+        char in_buf[32], out_buf[32];
+        const char* in = buffer(in_buf, sizeof(in_buf), l == 0? "x" : "h", l - 1);
+        const char* out = buffer(out_buf, sizeof(out_buf), l == layers - 1? "z" : "h", l == layers - 1? -1 : l);
+
+        fprintf(f, "    dense_%dx%d(params + %zu, params + %zu, %s, %s);\n", s->in, s->out, s->w, s->b, in, out);
+        if(l != layers - 1) fprintf(f, "    act_forward(%s);\n", out);
+    }
+
+    fprintf(f,
+        "\n    float max_ = z[0];\n"
+        "    for(int j = 1; j < %d; j++) max_ = z[j] > max_? z[j] : max_;\n"
+        "    float sum = 0.0f;\n"
+        "    for(int j = 0; j < %d; j++) {\n"
+        "        g[j] = fast_expf(z[j] - max_);\n"
+        "        sum += g[j];\n"
+        "    }\n"
+        "    for(int j = 0; j < %d; j++) g[j] = g[j] / sum - (j == label);\n"
+        "    const float loss = logf(sum) + max_ - z[label];\n\n",
+        output, output, output);
+
+    for(int l = layers - 1; l >= 0; l--) {
+        const LayerShape* s = &shapes[l];
+        char in_buf[32], gy_buf[32], gx_buf[32];
+        const char* in = buffer(in_buf, sizeof(in_buf), l == 0? "x" : "h", l - 1);
+        const char* gy = buffer(gy_buf, sizeof(gy_buf), l == layers - 1? "g" : "gh", l == layers - 1? -1 : l & 1);
+        const char* gx = buffer(gx_buf, sizeof(gx_buf), "gh", (l + 1) & 1);
+
+        fprintf(f, "    dense_sgd_%dx%d(params + %zu, params + %zu, %s, %s, %s, lr);\n", s->in, s->out, s->w, s->b, in, gy, gx);
+        if(l != 0) fprintf(f, "    act_backward(h[%d], %s);\n", l - 1, gx);
+    }
+    fprintf(f, "\n    return loss;\n}\n");
+
+    fclose(f);
+    free(shapes);
+    return 0;
+}
@@ -0,0 +1,415 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "autotune.h"
+#include "graph.h"
+#include "parallel.h"
+
+#include <pthread.h>
+
+// Timed runs per variant after a warmup, the fastest one counts
+#define AUTOTUNE_REPS 5
+#define AUTOTUNE_KEY_MAX 512
+
+typedef struct {
+    char* key;
+    char variant[32];
+} TuneEntry;
+
+static struct {
+    pthread_mutex_t lock;
+    char* path;
+    TuneEntry* entries;
+    size_t size;
+    size_t capacity;
+    AutotuneStats stats;
+    char cpu[128];
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// The scratch graph add_node builds while timing asks for a variant too, that one just takes the static choice
+static _Thread_local int tuning = 0;
+
+const char* autotune_cpu_id(void) {
+    if(cache.cpu[0]) {
+        return cache.cpu;
+    }
+
+    snprintf(cache.cpu, sizeof(cache.cpu), "unknown");
+    FILE* f = fopen("/proc/cpuinfo", "r");
+    if(f) {
+        char line[256];
+        while(fgets(line, sizeof(line), f)) {
+            char* colon = strchr(line, ':');
+            if(strncmp(line, "model name", 10) != 0 || !colon) continue;
+
+            snprintf(cache.cpu, sizeof(cache.cpu), "%s", colon + 1 + (colon[1] == ' '));
+            break;
+        }
+        fclose(f);
+    }
+
+    // One token, so it can't break the tab separated cache lines
+    for(char* c = cache.cpu; *c; c++) {
+        if(*c == '\n') *c = '\0';
+        else if(*c == ' ' || *c == '\t') *c = '_';
+    }
+
+    return cache.cpu;
+}
+
+static const char* dtype_tag(DType dtype) {
+    switch(dtype) {
+        case DTYPE_F32: return "f32";
+        case DTYPE_BF16: return "bf16";
+        case DTYPE_F16: return "f16";
+        case DTYPE_I32: return "i32";
+    }
+    return "?";
+}
+
+static size_t append_shape(char* buf, size_t len, const Tensor* tensor) {
+    for(int d = 0; d < tensor->ndim && len < AUTOTUNE_KEY_MAX; d++) {
+        len += (size_t) snprintf(buf + len, AUTOTUNE_KEY_MAX - len, "%s%lld", d? "x" : "[", (long long) tensor->shape[d]);
+    }
+    if(len < AUTOTUNE_KEY_MAX) {
+        len += (size_t) snprintf(buf + len, AUTOTUNE_KEY_MAX - len, "]");
+    }
+
+    return len;
+}
+
+// eg mat_mul|Intel(R)_Xeon(R)...|t8|f32[32x2],f32[2x32]->[32x32], the output shape carries strides and padding
+static void node_key(const Node* node, const OpKernel* kernel, char key[AUTOTUNE_KEY_MAX]) {
+    size_t len = (size_t) snprintf(key, AUTOTUNE_KEY_MAX, "%s|%s|t%d|", kernel->name, autotune_cpu_id(), parallel_num_threads());
+
+    for(int i = 0; i < node->n_input && len < AUTOTUNE_KEY_MAX; i++) {
+        const Tensor* in = node->inputs[i]->out;
+        len += (size_t) snprintf(key + len, AUTOTUNE_KEY_MAX - len, "%s%s", i? "," : "", dtype_tag(in->dtype));
+        len = append_shape(key, len, in);
+    }
+    if(len < AUTOTUNE_KEY_MAX) {
+        len += (size_t) snprintf(key + len, AUTOTUNE_KEY_MAX - len, "->");
+        append_shape(key, len, node->out);
+    }
+}
+
+static TuneEntry* find_entry(const char* key) {
+    for(size_t i = 0; i < cache.size; i++) {
+        if(strcmp(cache.entries[i].key, key) == 0) return &cache.entries[i];
+    }
+
+    return NULL;
+}
+
+static void add_entry(const char* key, const char* variant) {
+    TuneEntry* entry = find_entry(key);
+
+    if(!entry) {
+        if(cache.size == cache.capacity) {
+            cache.capacity = cache.capacity? 2 * cache.capacity : 32;
+            cache.entries = (TuneEntry*) realloc(cache.entries, cache.capacity * sizeof(TuneEntry));
+            if(!cache.entries) {
+                fatal("autotune: growing the cache to %zu entries failed", cache.capacity);
+            }
+        }
+
+        entry = &cache.entries[cache.size++];
+        entry->key = strdup(key);
+        if(!entry->key) {
+            fatal("autotune: strdup of a cache key failed");
+        }
+    }
+
+    snprintf(entry->variant, sizeof(entry->variant), "%s", variant);
+}
+
+// key \t variant \t best ms, a later line for the same key wins
+static void load_cache(const char* path) {
+    FILE* f = fopen(path, "r");
+    if(!f) {
+        return;
+    }
+
+    char line[AUTOTUNE_KEY_MAX + 64];
+    while(fgets(line, sizeof(line), f)) {
+        char* tab = strchr(line, '\t');
+        if(!tab) continue;
+
+        *tab = '\0';
+        char* variant = tab + 1;
+        variant[strcspn(variant, "\t\n")] = '\0';
+        if(*variant) add_entry(line, variant);
+    }
+
+    fclose(f);
+}
+
+static void save_entry(const char* key, const char* variant, double ms) {
+    if(!cache.path) {
+        return;
+    }
+
+    FILE* f = fopen(cache.path, "a");
+    if(!f) {
+        fprintf(stderr, "autotune: can't append to %s, %s stays in memory only\n", cache.path, key);
+        return;
+    }
+    fprintf(f, "%s\t%s\t%.6f\n", key, variant, ms);
+    fclose(f);
+}
+
+static int find_variant(const OpKernel* kernel, const Node* node, const char* name) {
+    for(int i = 0; i < kernel->num_variants; i++) {
+        const OpVariant* v = &kernel->variants[i];
+        if(strcmp(v->name, name) == 0 && (!v->supports || v->supports(node))) return i;
+    }
+
+    return -1;
+}
+
+static size_t tensor_bytes(const Tensor* tensor) {
+    return total_elems(tensor) * sizeof(float);
+}
+
+// Best of AUTOTUNE_REPS forward (+ backward when every input takes a grad) runs of one variant on the scratch node
+static double time_variant(Node* node, const OpKernel* kernel, const OpVariant* variant, int with_backward) {
+    OpForward forward = variant->forward? variant->forward : kernel->forward;
+    OpBackward backward = variant->backward? variant->backward : kernel->backward;
+    double best = 0.0;
+
+    for(int rep = 0; rep <= AUTOTUNE_REPS; rep++) {
+        double start = now_ms();
+        forward(node);
+        if(with_backward) backward(node);
+        double elapsed = now_ms() - start;
+
+        // rep 0 is the warmup
+        if(rep == 1 || (rep > 1 && elapsed < best)) best = elapsed;
+    }
+
+    return best;
+}
+
+// Rebuilds the node on fresh inputs of the same shapes and dtypes (attrs shared) so the real tensors are never
+// touched, they may not even have storage yet in lazy or checkpointed graphs
+static int tune_node(const Node* node, const OpKernel* kernel, double* best_ms) {
+    size_t bytes = 1 << 16;
+    int with_backward = kernel->backward != NULL;
+
+    for(int i = 0; i < node->n_input; i++) {
+        const Tensor* in = node->inputs[i]->out;
+        if(in->csr) return -1;
+
+        bytes += 2 * tensor_bytes(in) + 256;
+        with_backward &= in->dtype == DTYPE_F32;
+    }
+    bytes += 2 * tensor_bytes(node->out) + (node->aux? tensor_bytes(node->aux) : 0) + 1024;
+
+    Arena scratch;
+    arena_init(&scratch, 2 * bytes);
+    Graph graph;
+    graph_init(&graph, &scratch);
+
+    Node* inputs[8];
+    if(node->n_input > 8) {
+        fatal("autotune: %s has %d inputs, at most 8 are tuned", kernel->name, node->n_input);
+    }
+    for(int i = 0; i < node->n_input; i++) {
+        const Tensor* in = node->inputs[i]->out;
+        Tensor* copy = tensor_new_dtype(&scratch, in->ndim, in->shape, in->dtype);
+
+        // Zeroed int inputs are valid labels and indices, the floats get something that isn't all zeros
+        memset(copy->data, 0, total_elems(copy) * dtype_size(copy->dtype));
+        if(copy->dtype == DTYPE_F32) {
+            for(size_t j = 0; j < total_elems(copy); j++) copy->data[j] = 0.01f * (float) (j % 97) - 0.5f;
+        }
+
+        inputs[i] = graph_add_input(&graph, copy);
+        if(with_backward) graph_ensure_grad(&graph, copy);
+    }
+
+    Node* probe = add_node_attrs(&graph, node->operation, node->n_input, inputs, node->attrs);
+    if(with_backward) {
+        graph_ensure_grad(&graph, probe->out);
+        tensor_fill(probe->out->grad, 1.0f);
+    }
+
+    int best = -1;
+    for(int i = 0; i < kernel->num_variants; i++) {
+        const OpVariant* v = &kernel->variants[i];
+        if(v->supports && !v->supports(node)) continue;
+
+        double ms = time_variant(probe, kernel, v, with_backward);
+        if(best < 0 || ms < *best_ms) {
+            best = i;
+            *best_ms = ms;
+        }
+    }
+
+    arena_free(&scratch);
+    return best;
+}
+
+static int autotune_choose(const Node* node, const OpKernel* kernel) {
+    if(tuning) {
+        return -1;
+    }
+
+    char key[AUTOTUNE_KEY_MAX];
+    node_key(node, kernel, key);
+
+    pthread_mutex_lock(&cache.lock);
+    const TuneEntry* entry = find_entry(key);
+    int pick = entry? find_variant(kernel, node, entry->variant) : -1;
+
+    if(pick >= 0) {
+        cache.stats.hits++;
+        pthread_mutex_unlock(&cache.lock);
+        return pick;
+    }
+
+    // Unknown key, or the cached variant is gone from the kernel since the file was written
+    double ms = 0.0;
+    tuning = 1;
+    pick = tune_node(node, kernel, &ms);
+    tuning = 0;
+
+    if(pick >= 0) {
+        add_entry(key, kernel->variants[pick].name);
+        save_entry(key, kernel->variants[pick].name, ms);
+        cache.stats.tuned++;
+        cache.stats.entries = cache.size;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    return pick;
+}
+
+void autotune_enable(const char* cache_path) {
+    autotune_disable();
+
+    pthread_mutex_lock(&cache.lock);
+    if(cache_path) {
+        cache.path = strdup(cache_path);
+        if(!cache.path) {
+            fatal("autotune_enable: strdup of the cache path failed");
+        }
+        load_cache(cache_path);
+    }
+    cache.stats.entries = cache.size;
+    pthread_mutex_unlock(&cache.lock);
+
+    op_set_tuner(autotune_choose);
+}
+
+void autotune_disable(void) {
+    op_set_tuner(NULL);
+
+    pthread_mutex_lock(&cache.lock);
+    for(size_t i = 0; i < cache.size; i++) {
+        free(cache.entries[i].key);
+    }
+    free(cache.entries);
+    free(cache.path);
+    cache.entries = NULL;
+    cache.path = NULL;
+    cache.size = cache.capacity = 0;
+    memset(&cache.stats, 0, sizeof(cache.stats));
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void autotune_stats(AutotuneStats* stats) {
+    pthread_mutex_lock(&cache.lock);
+    *stats = cache.stats;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+#ifdef AUTOTUNE_SELFTEST_MAIN
+#include <assert.h>
+#include <unistd.h>
+
+static int fast_runs = 0;
+static int slow_runs = 0;
+
+static void scale_fwd(Node* node) {
+    const Tensor* A = node->inputs[0]->out;
+    for(size_t i = 0; i < total_elems(node->out); i++) node->out->data[i] = 2.0f * A->data[i];
+}
+
+static void scale_bwd(Node* node) {
+    Tensor* gA = node->inputs[0]->out->grad;
+    for(size_t i = 0; i < total_elems(node->out); i++) gA->data[i] += 2.0f * node->out->grad->data[i];
+}
+
+static void scale_fwd_fast(Node* node) { fast_runs++; scale_fwd(node); }
+
+// Ranks above the fast one, so the static chooser takes it, but does the work 50 times
+static void scale_fwd_slow(Node* node) {
+    slow_runs++;
+    for(int rep = 0; rep < 50; rep++) scale_fwd(node);
+}
+
+static const OpKernel scale_kernel = {
+    .optype = OP_DYNAMIC,
+    .name = "scale2",
+    .forward = scale_fwd,
+    .backward = scale_bwd,
+    .arity = 1,
+    .infer = op_infer_unary,
+    .variants = {
+        { OP_IMPL_SCALAR, "fast", scale_fwd_fast, NULL, NULL },
+        { OP_IMPL_SIMD, "slow", scale_fwd_slow, NULL, NULL },
+    },
+    .num_variants = 2,
+};
+
+static const OpVariant* choice_for(Op op, int64_t rows) {
+    Arena arena;
+    arena_init(&arena, 1 << 20);
+    Graph graph;
+    graph_init(&graph, &arena);
+
+    const int64_t shape[2] = { rows, 256 };
+    Node* in[1] = { graph_add_input(&graph, tensor_new(&arena, 2, shape)) };
+    const OpVariant* variant = add_node(&graph, op, 1, in)->variant;
+
+    arena_free(&arena);
+    return variant;
+}
+
+int main(void) {
+    Op scale = register_opkernel(&scale_kernel);
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/autotune_selftest_%d.txt", (int) getpid());
+    remove(path);
+
+    // Static choice ranks slow first
+    assert(strcmp(choice_for(scale, 64)->name, "slow") == 0);
+
+    // First sight of a key times both, the same key again is a lookup, a new shape is timed again
+    AutotuneStats stats;
+    autotune_enable(path);
+    assert(strcmp(choice_for(scale, 64)->name, "fast") == 0);
+    int timed_runs = fast_runs + slow_runs;
+    assert(fast_runs == AUTOTUNE_REPS + 1 && slow_runs == AUTOTUNE_REPS + 1);
+    assert(strcmp(choice_for(scale, 64)->name, "fast") == 0);
+    assert(fast_runs + slow_runs == timed_runs);
+    assert(strcmp(choice_for(scale, 32)->name, "fast") == 0);
+    autotune_stats(&stats);
+    assert(stats.tuned == 2 && stats.hits == 1 && stats.entries == 2);
+
+    // A fresh start reads the file back and never times
+    autotune_disable();
+    autotune_enable(path);
+    timed_runs = fast_runs + slow_runs;
+    assert(strcmp(choice_for(scale, 64)->name, "fast") == 0 && strcmp(choice_for(scale, 32)->name, "fast") == 0);
+    autotune_stats(&stats);
+    assert(fast_runs + slow_runs == timed_runs && stats.tuned == 0 && stats.hits == 2 && stats.entries == 2);
+
+    autotune_disable();
+    assert(strcmp(choice_for(scale, 64)->name, "slow") == 0);
+    remove(path);
+
+    printf("autotune picked the fast variant on %s, cache reload skipped timing, selftest passed\n", autotune_cpu_id());
+    return 0;
+}
+#endif
@@ -0,0 +1,397 @@
+#include "graph.h"
+
+#include <math.h>
+
+/* Gradient checkpointing: the op nodes of the sorted order are cut into segments of checkpoint_every ops.
+   Only the last output of each segment (plus anything a later segment reads) is kept, every other output of
+   a segment lives in one shared segment buffer that is recycled by the next segment. The backward pass walks the
+   segments back to front, recomputing each segment from the checkpoints before it, so the activations kept
+   grow with L / k + k, which is O(sqrt(L)) for k = sqrt(L). Grads of the interior outputs get the same treatment. */
+
+typedef struct CheckpointPlan {
+    size_t order_size;
+    int num_segments;
+    // [num_segments + 1] positions into the order, segment s runs over [seg_begin[s], seg_begin[s + 1])
+    size_t* seg_begin;
+    // Bytes of the segment buffers that segment s uses
+    size_t* seg_bytes;
+    // Indexed by topo_index
+    uint8_t* is_ckpt;
+    size_t* buf_offset;
+
+    uint8_t* act_buf;
+    uint8_t* grad_buf;
+    size_t buf_bytes;
+    // Segment whose interior activations currently sit in act_buf
+    int resident_segment;
+
+    CheckpointStats stats;
+} CheckpointPlan;
+
+static size_t out_bytes(const Tensor* tensor) {
+    return total_elems(tensor) * sizeof(float);
+}
+
+void graph_enable_checkpointing(Graph* graph, int every) {
+    if(!graph) {
+        fatal("graph_enable_checkpointing cannot run: graph is NULL");
+    }
+    if(graph->size != 0) {
+        fatal("graph_enable_checkpointing cannot run: nodes were already added with storage");
+    }
+
+    // -1 marks auto (sqrt of the op count), any non zero value turns the deferred allocation on
+    graph->checkpoint_every = (every > 0)? every : -1;
+    graph->ckpt = NULL;
+}
+
+static CheckpointPlan* build_plan(Graph* graph, Node* const* order, size_t order_size) {
+    Arena* arena = graph->arena;
+    size_t total_nodes = graph->size;
+
+    size_t num_ops = 0;
+    for(size_t i = 0; i < order_size; i++) {
+        if(order[i]->operation != OP_INPUT) num_ops++;
+    }
+    if(num_ops == 0) {
+        fatal("graph checkpointing cannot run: graph has no op nodes");
+    }
+
+    int every = graph->checkpoint_every;
+    if(every < 0) {
+        every = (int) ceil(sqrt((double) num_ops));
+    }
+
+    CheckpointPlan* plan = arena_alloc(arena, sizeof(CheckpointPlan), alignof(CheckpointPlan));
+    memset(plan, 0, sizeof(CheckpointPlan));
+
+    plan->order_size = order_size;
+    plan->num_segments = (int) ((num_ops + (size_t) every - 1) / (size_t) every);
+    plan->seg_begin = arena_alloc(arena, (size_t) (plan->num_segments + 1) * sizeof(size_t), alignof(size_t));
+    plan->seg_bytes = arena_alloc(arena, (size_t) plan->num_segments * sizeof(size_t), alignof(size_t));
+    plan->is_ckpt = arena_alloc(arena, total_nodes, alignof(uint8_t));
+    plan->buf_offset = arena_alloc(arena, total_nodes * sizeof(size_t), alignof(size_t));
+    int* seg_of = arena_alloc(arena, total_nodes * sizeof(int), alignof(int));
+
+    memset(plan->seg_bytes, 0, (size_t) plan->num_segments * sizeof(size_t));
+    memset(plan->is_ckpt, 0, total_nodes);
+
+    // Segment boundaries, the last op of each segment is a checkpoint
+    size_t op_idx = 0;
+    plan->seg_begin[0] = 0;
+
+    for(size_t i = 0; i < order_size; i++) {
+        Node* node = order[i];
+        seg_of[node->topo_index] = -1;
+
+        if(node->operation == OP_INPUT) {
+            continue;
+        }
+
+        int seg = (int) (op_idx / (size_t) every);
+        seg_of[node->topo_index] = seg;
+
+        if(op_idx % (size_t) every == (size_t) every - 1 || op_idx == num_ops - 1) {
+            plan->is_ckpt[node->topo_index] = 1;
+            plan->seg_begin[seg + 1] = i + 1;
+        }
+
+        op_idx++;
+    }
+    plan->seg_begin[plan->num_segments] = order_size;
+
+    // An interior output read from another segment would be gone by the time that segment runs, keep it too
+    for(size_t i = 0; i < order_size; i++) {
+        Node* node = order[i];
+
+        for(int j = 0; j < node->n_input; j++) {
+            Node* in = node->inputs[j];
+
+            if(in->operation != OP_INPUT && seg_of[in->topo_index] != seg_of[node->topo_index]) {
+                plan->is_ckpt[in->topo_index] = 1;
+            }
+        }
+    }
+
+    // Checkpoints get their own storage, interior outputs are packed into the segment buffer
+    for(size_t i = 0; i < order_size; i++) {
+        Node* node = order[i];
+
+        if(node->operation == OP_INPUT) {
+            continue;
+        }
+
+        size_t bytes = out_bytes(node->out);
+        plan->stats.full_activation_bytes += 2 * bytes;
+
+        if(plan->is_ckpt[node->topo_index]) {
+            node->out->data = arena_alloc(arena, bytes, 64);
+            plan->stats.stored_activation_bytes += 2 * bytes;
+            continue;
+        }
+
+        int seg = seg_of[node->topo_index];
+        plan->buf_offset[node->topo_index] = plan->seg_bytes[seg];
+        plan->seg_bytes[seg] = (size_t) ALIGN_UP(plan->seg_bytes[seg] + bytes, 64);
+
+        // Grad header only, its data is bound into the grad buffer when the segment runs backward
+        node->out->grad = tensor_new_header(arena, node->out->ndim, node->out->shape, DTYPE_F32);
+    }
+
+    for(int s = 0; s < plan->num_segments; s++) {
+        plan->buf_bytes = plan->seg_bytes[s] > plan->buf_bytes? plan->seg_bytes[s] : plan->buf_bytes;
+    }
+
+    plan->act_buf = arena_alloc(arena, plan->buf_bytes + 64, 64);
+    plan->grad_buf = arena_alloc(arena, plan->buf_bytes + 64, 64);
+    plan->stats.peak_activation_bytes = plan->stats.stored_activation_bytes + 2 * plan->buf_bytes;
+    plan->resident_segment = -1;
+
+    return plan;
+}
+
+static void bind_segment(CheckpointPlan* plan, Node* const* order, int seg, int bind_grads) {
+    for(size_t i = plan->seg_begin[seg]; i < plan->seg_begin[seg + 1]; i++) {
+        Node* node = order[i];
+
+        if(node->operation == OP_INPUT || plan->is_ckpt[node->topo_index]) {
+            continue;
+        }
+
+        size_t offset = plan->buf_offset[node->topo_index];
+
+        if(bind_grads) {
+            node->out->grad->data = (float*) (plan->grad_buf + offset);
+        }
+        else {
+            node->out->data = (float*) (plan->act_buf + offset);
+        }
+    }
+
+    if(bind_grads) {
+        memset(plan->grad_buf, 0, plan->seg_bytes[seg]);
+    }
+}
+
+// When recomputing, the checkpoints in the segment still hold their values and are skipped
+static size_t run_segment(CheckpointPlan* plan, Node* const* order, int seg, int recompute) {
+    size_t ran = 0;
+
+    for(size_t i = plan->seg_begin[seg]; i < plan->seg_begin[seg + 1]; i++) {
+        Node* node = order[i];
+
+        if(node->operation == OP_INPUT || (recompute && plan->is_ckpt[node->topo_index])) {
+            continue;
+        }
+
+        const OpKernel* k = get_opkernel(node->operation);
+        if(!k || !k->forward) {
+            fatal("graph_forward_pass_checkpointed cannot run: missing forward kernel for op %d", (int) node->operation);
+        }
+
+        node_forward_fn(node, k)(node);
+        ran++;
+    }
+
+    plan->resident_segment = seg;
+    return ran;
+}
+
+void graph_forward_pass_checkpointed(Graph* graph, Node* const* order, size_t order_size) {
+    if(!graph || (!order && order_size != 0)) {
+        fatal("graph_forward_pass_checkpointed cannot run: input is NULL");
+    }
+    if(graph->checkpoint_every == 0) {
+        fatal("graph_forward_pass_checkpointed cannot run: checkpointing is not enabled on this graph");
+    }
+
+    if(!graph->ckpt || graph->ckpt->order_size != order_size) {
+        graph->ckpt = build_plan(graph, order, order_size);
+    }
+
+    CheckpointPlan* plan = graph->ckpt;
+    double start = now_ms();
+    size_t ran = 0;
+
+    for(int s = 0; s < plan->num_segments; s++) {
+        bind_segment(plan, order, s, 0);
+        ran += run_segment(plan, order, s, 0);
+    }
+
+    plan->stats.forward_nodes = ran;
+    plan->stats.forward_ms = now_ms() - start;
+    plan->stats.recomputed_nodes = 0;
+    plan->stats.recompute_ms = 0.0;
+}
+
+void graph_backward_pass_checkpointed(Graph* graph, Node* const* order, size_t order_size, Tensor* loss) {
+    if(!graph || !order || !loss) {
+        fatal("graph_backward_pass_checkpointed cannot run: input is NULL");
+    }
+
+    CheckpointPlan* plan = graph->ckpt;
+    if(!plan || plan->order_size != order_size) {
+        fatal("graph_backward_pass_checkpointed cannot run: run graph_forward_pass_checkpointed on this order first");
+    }
+
+    graph_ensure_grad(graph, loss);
+    if(total_elems(loss) != 1) {
+        fatal("graph_backward_pass_checkpointed cannot run: loss must be a scalar / 1 dimension, loss has %zu elements", total_elems(loss));
+    }
+    loss->grad->data[0] = 1.0f;
+
+    for(int s = plan->num_segments - 1; s >= 0; s--) {
+        // The last segment is still resident from the forward pass, every earlier one is recomputed from its checkpoints
+        if(plan->resident_segment != s) {
+            double start = now_ms();
+            bind_segment(plan, order, s, 0);
+            plan->stats.recomputed_nodes += run_segment(plan, order, s, 1);
+            plan->stats.recompute_ms += now_ms() - start;
+        }
+
+        bind_segment(plan, order, s, 1);
+
+        for(size_t i = plan->seg_begin[s + 1]; i-- > plan->seg_begin[s]; ) {
+            Node* node = order[i];
+
+            if(node->operation == OP_INPUT) {
+                continue;
+            }
+
+            graph_ensure_grad(graph, node->out);
+            for(int j = 0; j < node->n_input; j++) {
+                if(tensor_is_differentiable(node->inputs[j]->out)) graph_ensure_grad(graph, node->inputs[j]->out);
+            }
+
+            const OpKernel* k = get_opkernel(node->operation);
+            if(!k || !k->backward) {
+                fatal("graph_backward_pass_checkpointed cannot run: op backpropagation is missing, op index: %d", (int) node->operation);
+            }
+
+            node_backward_fn(node, k)(node);
+        }
+    }
+}
+
+void graph_checkpoint_stats(const Graph* graph, CheckpointStats* stats) {
+    if(!graph || !stats) {
+        return;
+    }
+
+    if(!graph->ckpt) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    *stats = graph->ckpt->stats;
+}
+
+#ifdef CHECKPOINT_SELFTEST_MAIN
+#include <assert.h>
+
+#define CKPT_LAYERS 24
+#define CKPT_WIDTH 16
+
+// Deep relu chain ending in a [1, 1] output, built the same way into either a plain or a checkpointed graph
+static Tensor* build_chain(Graph* graph, Tensor* x, Tensor** weights, Tensor** biases, Tensor* w_out) {
+    Node* head = graph_add_input(graph, x);
+
+    for(int l = 0; l < CKPT_LAYERS; l++) {
+        Node* mm_in[2] = { head, graph_add_input(graph, weights[l]) };
+        Node* mm = add_node(graph, OP_MATMUL, 2, mm_in);
+        Node* add_in[2] = { mm, graph_add_input(graph, biases[l]) };
+        Node* add = add_node(graph, OP_ADD, 2, add_in);
+        Node* act_in[1] = { add };
+        head = add_node(graph, OP_RELU, 1, act_in);
+    }
+
+    Node* out_in[2] = { head, graph_add_input(graph, w_out) };
+    return add_node(graph, OP_MATMUL, 2, out_in)->out;
+}
+
+static void run_step(Graph* graph, Tensor** weights, Tensor** biases, Tensor* w_out, int checkpointed) {
+    // Input lives in the scratch arena like in the training loop, so the backward pass can give it a grad
+    const int64_t x_shape[2] = { 1, CKPT_WIDTH };
+    Tensor* x = tensor_new(graph->arena, 2, x_shape);
+    for(size_t i = 0; i < total_elems(x); i++) x->data[i] = (float) i / CKPT_WIDTH;
+
+    Tensor* loss = build_chain(graph, x, weights, biases, w_out);
+    Node** order = NULL;
+    size_t order_n = 0;
+    topological_sort(graph, &order, &order_n);
+
+    if(checkpointed) graph_forward_pass_checkpointed(graph, order, order_n);
+    else graph_forward_pass(order, order_n);
+
+    graph_backward_pass(graph, order, order_n, loss);
+}
+
+int main(void) {
+    Arena params, scratch;
+    arena_init(&params, 1 << 20);
+    arena_init(&scratch, 1 << 22);
+
+    uint32_t seed = 1;
+    const int64_t w_shape[2] = { CKPT_WIDTH, CKPT_WIDTH };
+    const int64_t b_shape[2] = { 1, CKPT_WIDTH };
+    const int64_t o_shape[2] = { CKPT_WIDTH, 1 };
+    Tensor* weights[CKPT_LAYERS];
+    Tensor* biases[CKPT_LAYERS];
+
+    for(int l = 0; l < CKPT_LAYERS; l++) {
+        weights[l] = tensor_new(&params, 2, w_shape);
+        biases[l] = tensor_new(&params, 2, b_shape);
+        for(size_t i = 0; i < total_elems(weights[l]); i++) {
+            seed = seed * 1664525u + 1013904223u;
+            weights[l]->data[i] = ((float) (seed >> 8) / 16777216.0f - 0.5f) * 0.9f;
+        }
+        tensor_fill(biases[l], 0.05f);
+        weights[l]->grad = tensor_zeroes_like(&params, weights[l]);
+        biases[l]->grad = tensor_zeroes_like(&params, biases[l]);
+    }
+    Tensor* w_out = tensor_new(&params, 2, o_shape);
+    tensor_fill(w_out, 0.25f);
+    w_out->grad = tensor_zeroes_like(&params, w_out);
+
+    Graph plain;
+    graph_init(&plain, &scratch);
+    run_step(&plain, weights, biases, w_out, 0);
+
+    float ref_first[CKPT_WIDTH * CKPT_WIDTH];
+    float ref_last_bias[CKPT_WIDTH];
+    memcpy(ref_first, weights[0]->grad->data, sizeof(ref_first));
+    memcpy(ref_last_bias, biases[CKPT_LAYERS - 1]->grad->data, sizeof(ref_last_bias));
+
+    for(int l = 0; l < CKPT_LAYERS; l++) {
+        tensor_fill(weights[l]->grad, 0.0f);
+        tensor_fill(biases[l]->grad, 0.0f);
+    }
+    arena_reset(&scratch);
+
+    Graph ckpt;
+    graph_init(&ckpt, &scratch);
+    graph_enable_checkpointing(&ckpt, 0);
+    run_step(&ckpt, weights, biases, w_out, 1);
+
+    for(int i = 0; i < CKPT_WIDTH * CKPT_WIDTH; i++) {
+        assert(fabsf(ref_first[i] - weights[0]->grad->data[i]) <= 1e-5f * (1.0f + fabsf(ref_first[i])));
+    }
+    for(int i = 0; i < CKPT_WIDTH; i++) {
+        assert(fabsf(ref_last_bias[i] - biases[CKPT_LAYERS - 1]->grad->data[i]) <= 1e-5f * (1.0f + fabsf(ref_last_bias[i])));
+    }
+
+    CheckpointStats stats;
+    graph_checkpoint_stats(&ckpt, &stats);
+    printf("checkpointing: %zu forward nodes, %zu recomputed (%.1f%% overhead, %.3f ms vs %.3f ms)\n",
+        stats.forward_nodes, stats.recomputed_nodes, 100.0 * (double) stats.recomputed_nodes / (double) stats.forward_nodes,
+        stats.recompute_ms, stats.forward_ms);
+    printf("activation+grad bytes: peak %zu (stored %zu) vs %zu without checkpointing\n",
+        stats.peak_activation_bytes, stats.stored_activation_bytes, stats.full_activation_bytes);
+    assert(stats.peak_activation_bytes < stats.full_activation_bytes);
+
+    arena_free(&params);
+    arena_free(&scratch);
+    printf("checkpoint selftest passed\n");
+    return 0;
+}
+#endif
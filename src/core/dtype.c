@@ -0,0 +1,252 @@
+#include "dtype.h"
+#include "tensor.h"
+#include "utils.h"
+
+#include <immintrin.h>
+#include <stdalign.h>
+
+// The SIMD bodies are compiled for their own target so the rest of the build stays baseline x86-64,
+// and are only called after the cpu has been checked at runtime
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define DTYPE_X86_SIMD 1
+#endif
+
+#ifdef DTYPE_X86_SIMD
+static int cpu_has_f16c(void) {
+    static int cached = -1;
+    if(cached < 0) {
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+    }
+    return cached;
+}
+
+static int cpu_has_avx2(void) {
+    static int cached = -1;
+    if(cached < 0) {
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("avx2");
+    }
+    return cached;
+}
+
+static int cpu_has_avx512bf16(void) {
+    static int cached = -1;
+    if(cached < 0) {
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bf16");
+    }
+    return cached;
+}
+
+__attribute__((target("avx,f16c")))
+static size_t f32_to_f16_f16c(const float* src, uint16_t* dst, size_t n) {
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps(src + i);
+        _mm_storeu_si128((__m128i*) (dst + i), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+    }
+    return i;
+}
+
+__attribute__((target("avx,f16c")))
+static size_t f16_to_f32_f16c(const uint16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+        __m128i h = _mm_loadu_si128((const __m128i*) (src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+    }
+    return i;
+}
+
+__attribute__((target("avx512f,avx512bf16")))
+static size_t f32_to_bf16_avx512(const float* src, uint16_t* dst, size_t n) {
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m512 v = _mm512_loadu_ps(src + i);
+        // vcvtneps2bf16 rounds to nearest even and keeps NaNs, same as the scalar routine
+        __m256bh h = _mm512_cvtneps_pbh(v);
+        _mm256_storeu_si256((__m256i*) (dst + i), (__m256i) h);
+    }
+    return i;
+}
+
+// Widening bf16 is a zero extend and a shift, plain AVX2 is enough
+__attribute__((target("avx2")))
+static size_t bf16_to_f32_avx2(const uint16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+        __m128i h = _mm_loadu_si128((const __m128i*) (src + i));
+        __m256i w = _mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16);
+        _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(w));
+    }
+    return i;
+}
+#endif
+
+void convert_f32_to_bf16(const float* src, uint16_t* dst, size_t n) {
+    size_t i = 0;
+#ifdef DTYPE_X86_SIMD
+    if(cpu_has_avx512bf16()) {
+        i = f32_to_bf16_avx512(src, dst, n);
+    }
+#endif
+    for(; i < n; i++) {
+        dst[i] = f32_to_bf16(src[i]);
+    }
+}
+
+void convert_bf16_to_f32(const uint16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+#ifdef DTYPE_X86_SIMD
+    if(cpu_has_avx2()) {
+        i = bf16_to_f32_avx2(src, dst, n);
+    }
+#endif
+    for(; i < n; i++) {
+        dst[i] = bf16_to_f32(src[i]);
+    }
+}
+
+void convert_f32_to_f16(const float* src, uint16_t* dst, size_t n) {
+    size_t i = 0;
+#ifdef DTYPE_X86_SIMD
+    if(cpu_has_f16c()) {
+        i = f32_to_f16_f16c(src, dst, n);
+    }
+#endif
+    for(; i < n; i++) {
+        dst[i] = f32_to_f16(src[i]);
+    }
+}
+
+void convert_f16_to_f32(const uint16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+#ifdef DTYPE_X86_SIMD
+    if(cpu_has_f16c()) {
+        i = f16_to_f32_f16c(src, dst, n);
+    }
+#endif
+    for(; i < n; i++) {
+        dst[i] = f16_to_f32(src[i]);
+    }
+}
+
+static void tensor_store(Tensor* tensor, size_t offset, float value) {
+    if(tensor->dtype == DTYPE_BF16) tensor->data16[offset] = f32_to_bf16(value);
+    else if(tensor->dtype == DTYPE_F16) tensor->data16[offset] = f32_to_f16(value);
+    else if(tensor->dtype == DTYPE_I32) tensor->data_i32[offset] = (int32_t) value;
+    else tensor->data[offset] = value;
+}
+
+void tensor_copy_cast(Tensor* dst, const Tensor* src) {
+    if(!dst || !src) {
+        fatal("tensor_copy_cast cannot run: dst or src is NULL");
+    }
+
+    size_t n = total_elems(src);
+    if(total_elems(dst) != n) {
+        fatal("tensor_copy_cast cannot run: %zu elems vs %zu elems", total_elems(dst), n);
+    }
+
+    if(!dst->is_contiguous || !src->is_contiguous) {
+        for(size_t i = 0; i < n; i++) {
+            tensor_store(dst, tensor_elem_offset(dst, i), tensor_load(src, tensor_elem_offset(src, i)));
+        }
+
+        return;
+    }
+
+    if(src->dtype == dst->dtype) {
+        memcpy(dst->data, src->data, n * dtype_size(src->dtype));
+    }
+    else if(src->dtype == DTYPE_F32 && dst->dtype == DTYPE_BF16) {
+        convert_f32_to_bf16(src->data, dst->data16, n);
+    }
+    else if(src->dtype == DTYPE_F32 && dst->dtype == DTYPE_F16) {
+        convert_f32_to_f16(src->data, dst->data16, n);
+    }
+    else if(src->dtype == DTYPE_BF16 && dst->dtype == DTYPE_F32) {
+        convert_bf16_to_f32(src->data16, dst->data, n);
+    }
+    else if(src->dtype == DTYPE_F16 && dst->dtype == DTYPE_F32) {
+        convert_f16_to_f32(src->data16, dst->data, n);
+    }
+    else {
+        // bf16 <-> f16 and the int32 conversions, rare enough to go through fp32 one element at a time
+        for(size_t i = 0; i < n; i++) {
+            tensor_store(dst, i, tensor_load(src, i));
+        }
+    }
+}
+
+Tensor* tensor_cast(Arena* arena, const Tensor* src, DType dtype) {
+    if(!arena || !src) {
+        fatal("tensor_cast cannot run: arena or src is NULL");
+    }
+
+    Tensor* out = tensor_new_dtype(arena, src->ndim, src->shape, dtype);
+    tensor_copy_cast(out, src);
+
+    return out;
+}
+
+#ifdef DTYPE_SELFTEST_MAIN
+#include <assert.h>
+#include <math.h>
+
+int main(void) {
+    float src[37];
+    uint16_t h[37];
+    float back[37];
+
+    for(int i = 0; i < 37; i++) {
+        src[i] = (float) (i - 18) * 0.37f + 1e-3f * (float) i;
+    }
+
+    // Bulk (SIMD body + scalar tail) must match the scalar routine bit for bit
+    convert_f32_to_bf16(src, h, 37);
+    for(int i = 0; i < 37; i++) {
+        assert(h[i] == f32_to_bf16(src[i]));
+    }
+    convert_bf16_to_f32(h, back, 37);
+    for(int i = 0; i < 37; i++) {
+        assert(fabsf(back[i] - src[i]) <= fabsf(src[i]) * (1.0f / 256.0f));
+    }
+
+    convert_f32_to_f16(src, h, 37);
+    for(int i = 0; i < 37; i++) {
+        assert(h[i] == f32_to_f16(src[i]));
+    }
+    convert_f16_to_f32(h, back, 37);
+    for(int i = 0; i < 37; i++) {
+        assert(fabsf(back[i] - src[i]) <= fabsf(src[i]) * (1.0f / 2048.0f));
+    }
+
+    // Edge cases: rounding to even, overflow, subnormals, NaN
+    assert(f32_to_f16(65504.0f) == 0x7BFF);
+    assert(f32_to_f16(1e6f) == 0x7C00);
+    assert(f16_to_f32(0x0001) == ldexpf(1.0f, -24));
+    assert(f32_to_f16(ldexpf(1.0f, -24)) == 0x0001);
+    assert(f32_to_bf16(1.0f + ldexpf(1.0f, -8)) == 0x3F80);
+    assert(isnan(bf16_to_f32(f32_to_bf16(NAN))));
+
+    Arena arena;
+    arena_init(&arena, 4096);
+    const int64_t shape[2] = {3, 5};
+    Tensor* t = tensor_new(&arena, 2, shape);
+    for(size_t i = 0; i < total_elems(t); i++) {
+        t->data[i] = (float) i * 0.5f;
+    }
+
+    Tensor* tb = tensor_cast(&arena, t, DTYPE_BF16);
+    Tensor* tt = tensor_transpose(&arena, tb, 0, 1);
+    Tensor* back_t = tensor_cast(&arena, tt, DTYPE_F32);
+    assert(back_t->data[1] == 2.5f);
+    print_tensor(tb);
+
+    arena_free(&arena);
+    printf("dtype selftest passed\n");
+    return 0;
+}
+#endif
@@ -12,6 +12,11 @@ void graph_init(Graph* graph, Arena* arena) {
     graph->arena = arena;
     graph->size = 0;
     graph->capacity = 16;
+    graph->checkpoint_every = 0;
+    graph->ckpt = NULL;
+    graph->lazy = 0;
+    graph->lazy_stack = NULL;
+    graph->lazy_stack_capacity = 0;
     graph->nodes = arena_alloc(arena, graph->capacity * sizeof(Node*), alignof(Node*));
 }
 
@@ -68,6 +73,7 @@ Node* graph_add_input(Graph* graph, Tensor* tensor) {
     node->inputs = NULL;
     node->n_input = 0;
     node->topo_index = (int) graph->size;
+    node->evaluated = 1;
 
     graph->nodes[graph->size++] = node;
     node->users = NULL;
@@ -75,19 +81,17 @@ Node* graph_add_input(Graph* graph, Tensor* tensor) {
     return node;
 }
 
-static void ensure_same_shape(const Tensor* a, const Tensor* b) {
-    if(a->ndim != b->ndim) {
-        fatal("shape mismatch: %d ndim of left arg tensor vs %d ndim of right arg tensor", a->ndim, b->ndim);
+// Checkpointed graphs only get the header here, storage is bound by the checkpoint plan. Lazy ones allocate on first use
+static Tensor* alloc_output(Graph* graph, int ndim, const int64_t* shape) {
+    if(graph->checkpoint_every != 0 || graph->lazy) {
+        return tensor_new_header(graph->arena, ndim, shape, DTYPE_F32);
     }
 
-    for(int i = 0; i < a->ndim; i++) {
-        if(a->shape[i] != b->shape[i]) {
-            fatal("shape mismatch at dim %d: %d ndim of left arg tensor vs %d ndim of right arg tensor", i, a->ndim, b->ndim);
-        }
-    }
+    return tensor_new(graph->arena, ndim, shape);
 }
 
-static Tensor* infer_and_alloc_output(Graph* graph, Op op, int n_inputs, Node** inputs) {
+// The per op rules live with the kernels, this only checks the arity and allocates what infer and aux_shape ask for
+static void infer_and_alloc_output(Graph* graph, Node* node) {
     if(!graph) {
         fatal("infer_and_alloc_output cannot run: graph is NULL");
     }
@@ -95,50 +99,35 @@ static Tensor* infer_and_alloc_output(Graph* graph, Op op, int n_inputs, Node**
         fatal("infer_and_alloc_output cannot run: arena is NULL");
     }
 
-    Tensor* A = inputs[0]->out;
-    Tensor* B;
-    if(n_inputs == 2) B = inputs[1]->out;
-
-    if(op == OP_ADD || op == OP_MUL || op == OP_SUB) {
-        if(n_inputs != 2) {
-            fatal("infer_and_alloc_output: 2 Inputs is expected, but %d inputs received", n_inputs);
-        }
-        ensure_same_shape(A, B);
-
-        return tensor_new(graph->arena, A->ndim, A->shape);
+    const OpKernel* k = get_opkernel(node->operation);
+    if(!k || !k->infer) {
+        fatal("infer_and_alloc_output cannot run: OP type index (%d) is not supported", (int) node->operation);
+    }
+    if(k->arity != 0 && node->n_input != k->arity) {
+        fatal("infer_and_alloc_output: %s expects %d inputs, but %d inputs received", k->name, k->arity, node->n_input);
     }
-    else if(op == OP_MATMUL) {
-        if(n_inputs != 2) {
-            fatal("infer_and_alloc_output: 2 Inputs is expected, but %d inputs received", n_inputs);
-        }
-        if(A->ndim != 2 || B->ndim !=2) {
-            fatal("infer_and_alloc_output cannot run: matmul must involve 2 dimensional tensors");
-        }
 
-        int64_t ad1 = A->shape[0], ad2 = A->shape[1];
-        int64_t bd1 = B->shape[0], bd2 = B->shape[1];
+    int64_t shape[6];
+    int ndim = k->infer(node, shape);
+    node->out = alloc_output(graph, ndim, shape);
 
-        if(ad2 != bd1) {
-            fatal("infer_and_alloc_output cannot run: matmul shape mismatch, %d vs %d", ad2, bd1);
-        }
+    // Always real storage, the checkpoint plan only manages the op outputs
+    if(k->aux_shape) {
+        int64_t aux_shape[6];
+        DType aux_dtype = DTYPE_F32;
+        int aux_ndim = k->aux_shape(node, aux_shape, &aux_dtype);
 
-        int64_t output_shape[2] = {ad1, bd2};
-        
-        return tensor_new(graph->arena, 2, output_shape);
-    }
-    if (op == OP_RELU || op == OP_SOFTMAX || op == OP_SIGMOID || op == OP_TANH) {
-        if (n_inputs != 1) {
-            fatal("infer_and_alloc_output: unary op expects 1 input (got %d)", n_inputs);
+        if(aux_ndim > 0) {
+            node->aux = tensor_new_dtype(graph->arena, aux_ndim, aux_shape, aux_dtype);
         }
-        return tensor_new(graph->arena, A->ndim, A->shape);
     }
-
-    fatal("infer_and_alloc_output cannot run: OP type index (%d) is not supported", (int) op);
-
-    return NULL;
 }
 
 Node* add_node(Graph* graph, Op op, int n_inputs, Node** inputs) {
+    return add_node_attrs(graph, op, n_inputs, inputs, NULL);
+}
+
+Node* add_node_attrs(Graph* graph, Op op, int n_inputs, Node** inputs, const void* attrs) {
     if(!graph || !inputs) {
         printf("add_node: graph/inputs is not initialised.");
         return NULL;
@@ -164,13 +153,160 @@ Node* add_node(Graph* graph, Op op, int n_inputs, Node** inputs) {
         inputs[i]->users = user;
     }
 
-    output_node->out = infer_and_alloc_output(graph, op, n_inputs, inputs);
+    output_node->attrs = attrs;
+    infer_and_alloc_output(graph, output_node);
+    output_node->variant = op_choose_variant(output_node);
     output_node->topo_index = (int) graph->size;
     graph->nodes[graph->size++] = output_node;
 
     return output_node;
 }
 
+void graph_enable_lazy(Graph* graph) {
+    if(!graph) {
+        fatal("graph_enable_lazy cannot run: graph is NULL");
+    }
+    if(graph->size != 0) {
+        fatal("graph_enable_lazy cannot run: graph already has %zu nodes", graph->size);
+    }
+    if(graph->checkpoint_every != 0) {
+        fatal("graph_enable_lazy cannot run: checkpointed graphs run through graph_forward_pass_checkpointed");
+    }
+
+    graph->lazy = 1;
+}
+
+static void compute_stale_node(Graph* graph, Node* node) {
+    Tensor* out = node->out;
+
+    if(!out->data) {
+        out->data = arena_alloc(graph->arena, total_elems(out) * sizeof(float), alignof(float));
+    }
+
+    const OpKernel* k = get_opkernel(node->operation);
+    if(!k || !k->forward) {
+        fatal("graph_value cannot run: missing forward kernel for op %d", (int) node->operation);
+    }
+
+    node_forward_fn(node, k)(node);
+    node->evaluated = 1;
+}
+
+// Shared by the lazy DFS and the dirty marking, both push every node at most once
+static Node** traversal_stack(Graph* graph) {
+    if(graph->lazy_stack_capacity < graph->size) {
+        graph->lazy_stack_capacity = graph->capacity;
+        graph->lazy_stack = arena_alloc(graph->arena, graph->lazy_stack_capacity * sizeof(Node*), alignof(Node*));
+    }
+
+    return graph->lazy_stack;
+}
+
+// Iterative post order DFS over the stale ancestors. Only the top of the stack ever descends and it is finished before
+// anything below resumes, so the stack is a single path and never holds more than graph->size nodes
+Tensor* graph_value(Graph* graph, Node* node) {
+    if(!graph || !node) {
+        fatal("graph_value cannot run: graph or node is NULL");
+    }
+    if(!graph->lazy) {
+        fatal("graph_value cannot run: graph is not lazy, use graph_forward_pass");
+    }
+    if(node->evaluated) {
+        return node->out;
+    }
+
+    Node** stack = traversal_stack(graph);
+    size_t top = 0;
+    stack[top++] = node;
+
+    while(top > 0) {
+        Node* curr = stack[top - 1];
+        Node* pending = NULL;
+
+        for(int j = 0; j < curr->n_input && !pending; j++) {
+            if(!curr->inputs[j]->evaluated) pending = curr->inputs[j];
+        }
+
+        if(pending) {
+            stack[top++] = pending;
+            continue;
+        }
+
+        compute_stale_node(graph, curr);
+        top--;
+    }
+
+    return node->out;
+}
+
+void graph_lazy_reset(Graph* graph) {
+    for(size_t i = 0; i < graph->size; i++) {
+        if(graph->nodes[i]->operation != OP_INPUT) {
+            graph->nodes[i]->evaluated = 0;
+        }
+    }
+}
+
+void graph_mark_dirty(Graph* graph, Node* node) {
+    if(!graph || !node) {
+        fatal("graph_mark_dirty cannot run: graph or node is NULL");
+    }
+
+    Node** stack = traversal_stack(graph);
+    size_t top = 0;
+
+    // A leaf itself is never stale, only what is computed from it
+    if(node->operation != OP_INPUT) {
+        if(!node->evaluated) return;
+        node->evaluated = 0;
+    }
+    stack[top++] = node;
+
+    while(top > 0) {
+        Node* curr = stack[--top];
+
+        for(NodeUse* u = curr->users; u; u = u->next) {
+            if(u->user->evaluated) {
+                u->user->evaluated = 0;
+                stack[top++] = u->user;
+            }
+        }
+    }
+}
+
+void graph_mark_tensor_dirty(Graph* graph, const Tensor* tensor) {
+    for(size_t i = 0; i < graph->size; i++) {
+        Node* node = graph->nodes[i];
+
+        if(node->operation == OP_INPUT && (node->out == tensor || node->out->base == tensor)) {
+            graph_mark_dirty(graph, node);
+        }
+    }
+}
+
+size_t graph_forward_pass_incremental(Graph* graph, Node* const* order, size_t order_size) {
+    if(!graph || (!order && order_size != 0)) {
+        fatal("graph_forward_pass_incremental cannot run: input is NULL");
+    }
+    if(graph->checkpoint_every != 0) {
+        fatal("graph_forward_pass_incremental cannot run: checkpointed graphs don't keep their activations");
+    }
+
+    size_t ran = 0;
+    for(size_t i = 0; i < order_size; i++) {
+        Node* node = order[i];
+
+        if(node->evaluated) {
+            continue;
+        }
+
+        compute_stale_node(graph, node);
+        ran++;
+    }
+
+    return ran;
+}
+
 // can consider to sort the order within the graph and not have another allocated space
 void topological_sort(Graph* graph, Node*** output_order, size_t* total_outputs) {
     if(!graph || !output_order || !total_outputs) {
@@ -183,7 +319,7 @@ void topological_sort(Graph* graph, Node*** output_order, size_t* total_outputs)
     size_t order_idx = 0;
     Node** order = arena_alloc(graph->arena, total_nodes * sizeof(Node*), alignof(Node*));
     
-    int* in_degree = arena_alloc(graph->arena, total_nodes, alignof(int));
+    int* in_degree = arena_alloc(graph->arena, total_nodes * sizeof(int), alignof(int));
     memset(in_degree, 0, total_nodes * sizeof(int));
 
     size_t head = 0, tail = 0;
@@ -244,7 +380,8 @@ void graph_forward_pass(Node* const* order, size_t order_size) {
             fatal("graph_forward_pass cannot run: missing forward kernel for op %d", (int)curr_node->operation);
         }
 
-        k->forward(curr_node);
+        node_forward_fn(curr_node, k)(curr_node);
+        curr_node->evaluated = 1;
     }
 }
 
@@ -261,7 +398,7 @@ void ensure_grad(Arena* arena, Tensor* tensor) {
 
 void graph_ensure_grad(Graph* graph, Tensor* tensor) {
     if (!tensor) return;
-    if (tensor->grad) return;
+    if (tensor->grad || tensor->sparse_grad) return;
 
     if (ptr_in_arena(graph->arena, tensor)) {
         tensor->grad = tensor_zeroes_like(graph->arena, tensor);
@@ -278,13 +415,19 @@ void graph_backward_pass(Graph* graph, Node* const* order, size_t order_size, Te
     if(!graph || !order || !loss) {
         fatal("graph_backward_pass cannot run: input is NULL");
     }
+    if(graph->checkpoint_every != 0) {
+        graph_backward_pass_checkpointed(graph, order, order_size, loss);
+        return;
+    }
 
     graph_ensure_grad(graph, loss);
     size_t loss_elems = total_elems(loss);
 
     if(loss_elems != 1) {
-        fatal("graph_backward_pass cannot run: loss must be a scalar / 1 dimension, loss has %d elements", loss_elems);
+        fatal("graph_backward_pass cannot run: loss must be a scalar / 1 dimension, loss has %zu elements", loss_elems);
     }
+    // d(loss)/d(loss)
+    loss->grad->data[0] = 1.0f;
 
     for(int i = order_size - 1; i >= 0; i--) {
         Node* node = order[i];
@@ -292,11 +435,15 @@ void graph_backward_pass(Graph* graph, Node* const* order, size_t order_size, Te
         if(node->operation == OP_INPUT) {
             break;
         }
+        // Never computed in lazy mode, so not an ancestor of the loss either
+        if(graph->lazy && !node->evaluated) {
+            continue;
+        }
 
         graph_ensure_grad(graph, node->out);
         // Again, this loop considers the possibility that there are more than one inputs per node, but now everything is hard coded to 2 inputs, since fused kernels are not considered
         for(int j = 0; j < node->n_input; j++) {
-            graph_ensure_grad(graph, node->inputs[i]->out);
+            if(tensor_is_differentiable(node->inputs[j]->out)) graph_ensure_grad(graph, node->inputs[j]->out);
         }
 
         const OpKernel* curr_opp = get_opkernel(node->operation);
@@ -307,7 +454,7 @@ void graph_backward_pass(Graph* graph, Node* const* order, size_t order_size, Te
             fatal("graph_backward_pass cannot run: op backpropagation is missing, op index: %d", (int) node->operation);
         }
 
-        curr_opp->backward(node);
+        node_backward_fn(node, curr_opp)(node);
     }
 }
 
@@ -323,12 +470,112 @@ void graph_backward_pass(Graph* graph, Node* const* order, size_t order_size, Te
 //     }
 // }
 
-#ifdef DGRAPH_SELFTEST_MAIN
-#include "op.h"
-
-int main() {
-
-
+#ifdef GRAPH_SELFTEST_MAIN
+#include <assert.h>
+
+// Lazy mode: a loss branch and a metric head off the same hidden node, only what is asked for runs
+int main(void) {
+    Arena arena;
+    arena_init(&arena, 1 << 16);
+    Graph graph;
+    graph_init(&graph, &arena);
+    graph_enable_lazy(&graph);
+
+    const int64_t shape[2] = { 2, 3 }, col_shape[2] = { 3, 1 }, row_shape[2] = { 1, 2 };
+    Tensor* x = tensor_new(&arena, 2, shape);
+    Tensor* w = tensor_new(&arena, 2, shape);
+    Tensor* col = tensor_new(&arena, 2, col_shape);
+    Tensor* row = tensor_new(&arena, 2, row_shape);
+    tensor_fill(x, 2.0f);
+    tensor_fill(w, 3.0f);
+    tensor_fill(col, 1.0f);
+    tensor_fill(row, 1.0f);
+
+    Node* xn = graph_add_input(&graph, x);
+    Node* wn = graph_add_input(&graph, w);
+    Node* hidden_in[2] = { xn, wn };
+    Node* hidden = add_node(&graph, OP_MUL, 2, hidden_in);
+
+    // loss = row @ relu(hidden) @ col, a [1, 1] sum
+    Node* act_in[1] = { hidden };
+    Node* act = add_node(&graph, OP_RELU, 1, act_in);
+    Node* sum_rows_in[2] = { graph_add_input(&graph, row), act };
+    Node* sum_rows = add_node(&graph, OP_MATMUL, 2, sum_rows_in);
+    Node* loss_in[2] = { sum_rows, graph_add_input(&graph, col) };
+    Node* loss = add_node(&graph, OP_MATMUL, 2, loss_in);
+
+    // metric = hidden - x, never needed for training
+    Node* metric_in[2] = { hidden, xn };
+    Node* metric = add_node(&graph, OP_SUB, 2, metric_in);
+
+    assert(loss->out->data == NULL && metric->out->data == NULL);
+
+    Tensor* value = graph_value(&graph, loss);
+    assert(value->data[0] == 36.0f);
+    assert(hidden->evaluated && act->evaluated && loss->evaluated);
+    assert(!metric->evaluated && metric->out->data == NULL);
+
+    Node** order = NULL;
+    size_t order_n = 0;
+    topological_sort(&graph, &order, &order_n);
+    graph_backward_pass(&graph, order, order_n, loss->out);
+    for(size_t i = 0; i < total_elems(x); i++) assert(x->grad->data[i] == 3.0f);
+    assert(metric->out->grad == NULL);
+
+    // Cached: nothing upstream is recomputed, only the metric itself
+    hidden->out->data[0] = -100.0f;
+    assert(graph_value(&graph, metric)->data[0] == -102.0f);
+    assert(graph_value(&graph, metric)->data[1] == 4.0f);
+
+    // After a reset everything is recomputed from the leaves
+    tensor_fill(x, 1.0f);
+    graph_lazy_reset(&graph);
+    assert(graph_value(&graph, loss)->data[0] == 18.0f);
+    assert(!metric->evaluated);
+
+    // Dirty marking on the lazy graph: w feeds hidden, so the loss and the metric head both go stale
+    tensor_fill(w, 1.0f);
+    graph_value(&graph, metric);
+    graph_mark_tensor_dirty(&graph, w);
+    assert(!hidden->evaluated && !loss->evaluated && !metric->evaluated);
+    assert(graph_value(&graph, loss)->data[0] == 6.0f);
+    printf("lazy graph selftest passed\n");
+
+    // Eager incremental forward: a = x * w1 feeds only c, b = x * w2 feeds c and d
+    Graph eager;
+    graph_init(&eager, &arena);
+    Tensor* w1 = tensor_new(&arena, 2, shape);
+    Tensor* w2 = tensor_new(&arena, 2, shape);
+    tensor_fill(w1, 2.0f);
+    tensor_fill(w2, -1.0f);
+
+    Node* ex = graph_add_input(&eager, x);
+    Node* a_in[2] = { ex, graph_add_input(&eager, w1) };
+    Node* a = add_node(&eager, OP_MUL, 2, a_in);
+    Node* b_in[2] = { ex, graph_add_input(&eager, w2) };
+    Node* b = add_node(&eager, OP_MUL, 2, b_in);
+    Node* c_in[2] = { a, b };
+    Node* c = add_node(&eager, OP_SUB, 2, c_in);
+    Node* d_in[1] = { b };
+    Node* d = add_node(&eager, OP_RELU, 1, d_in);
+    topological_sort(&eager, &order, &order_n);
+
+    assert(graph_forward_pass_incremental(&eager, order, order_n) == 4);
+    assert(graph_forward_pass_incremental(&eager, order, order_n) == 0);
+    assert(c->out->data[0] == 3.0f && d->out->data[0] == 0.0f);
+
+    tensor_fill(w1, 5.0f);
+    graph_mark_tensor_dirty(&eager, w1);
+    assert(graph_forward_pass_incremental(&eager, order, order_n) == 2);
+    assert(c->out->data[0] == 6.0f && b->evaluated && d->evaluated);
+
+    tensor_fill(x, -2.0f);
+    graph_mark_dirty(&eager, ex);
+    assert(graph_forward_pass_incremental(&eager, order, order_n) == 4);
+    assert(c->out->data[0] == -12.0f && d->out->data[0] == 2.0f);
+    printf("incremental forward selftest passed\n");
+
+    arena_free(&arena);
     return 0;
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,328 @@
+#include "graph.h"
+
+// Recording only reads the graph, everything the template keeps is allocated from the template arena
+
+static int in_arena(const Arena* arena, const void* p) {
+    const uint8_t* curr = (const uint8_t*) p;
+    return p && curr >= arena->base && curr < arena->curr;
+}
+
+// A leaf needs a template owned grad if it has none or if the one it has would die with the recorded graph's arena
+static int leaf_needs_owned_grad(const Arena* graph_arena, const Tensor* tensor) {
+    if(!tensor_is_differentiable(tensor) || tensor->sparse_grad) {
+        return 0;
+    }
+
+    return !tensor->grad || in_arena(graph_arena, tensor->grad->data);
+}
+
+// Header with its data pointing into the grad block
+static Tensor* grad_from_block(GraphTemplate* tmpl, const Tensor* like, size_t* cursor) {
+    Tensor* grad = tensor_new_header(tmpl->arena, like->ndim, like->shape, DTYPE_F32);
+    grad->data = tmpl->grad_block + *cursor;
+    *cursor += total_elems(like);
+
+    return grad;
+}
+
+static Tensor* copy_header(Arena* arena, const Tensor* src) {
+    Tensor* copy = arena_alloc(arena, sizeof(Tensor), alignof(Tensor));
+    *copy = *src;
+
+    return copy;
+}
+
+static Tensor* record_leaf(GraphTemplate* tmpl, const Arena* graph_arena, Tensor* src, size_t* cursor) {
+    Tensor* leaf = src;
+
+    if(src->csr && in_arena(graph_arena, src->data)) {
+        // Sparse batches bring their index arrays along, they never have a grad
+        return tensor_csr_copy(tmpl->arena, src);
+    }
+    if(in_arena(graph_arena, src->data)) {
+        // Batch inputs built in the step arena, the template takes a copy and owns it from now on
+        if(!src->is_contiguous) {
+            fatal("graph_template_record cannot run: leaf data in the graph arena has to be contiguous");
+        }
+        leaf = tensor_new_dtype(tmpl->arena, src->ndim, src->shape, src->dtype);
+        memcpy(leaf->data, src->data, total_elems(src) * dtype_size(src->dtype));
+    }
+    else if(in_arena(graph_arena, src)) {
+        // View header over persistent data (eg an expanded bias), only the header has to move
+        leaf = copy_header(tmpl->arena, src);
+
+        if(src->grad && !in_arena(graph_arena, src->grad->data) && in_arena(graph_arena, src->grad)) {
+            leaf->grad = copy_header(tmpl->arena, src->grad);
+        }
+    }
+
+    if(leaf_needs_owned_grad(graph_arena, src)) {
+        leaf->grad = grad_from_block(tmpl, leaf, cursor);
+    }
+
+    return leaf;
+}
+
+void graph_template_record(GraphTemplate* tmpl, Arena* arena, const Graph* graph, Node* const* order, size_t order_size) {
+    if(!tmpl || !arena || !graph || !order) {
+        fatal("graph_template_record cannot run: input is NULL");
+    }
+    if(graph->checkpoint_every != 0) {
+        fatal("graph_template_record cannot run: checkpointed graphs bind their own activation storage");
+    }
+    if(order_size != graph->size) {
+        fatal("graph_template_record cannot run: order has %zu nodes, graph has %zu", order_size, graph->size);
+    }
+
+    memset(tmpl, 0, sizeof(*tmpl));
+    tmpl->arena = arena;
+    tmpl->num_nodes = order_size;
+    tmpl->recorded_size = graph->size;
+
+    size_t grad_elems = 0;
+    for(size_t i = 0; i < order_size; i++) {
+        const Node* node = order[i];
+        tmpl->num_edges += (size_t) node->n_input;
+
+        if(node->operation != OP_INPUT || leaf_needs_owned_grad(graph->arena, node->out)) {
+            grad_elems += total_elems(node->out);
+        }
+    }
+
+    tmpl->nodes = arena_alloc(arena, order_size * sizeof(Node), alignof(Node));
+    tmpl->order = arena_alloc(arena, order_size * sizeof(Node*), alignof(Node*));
+    tmpl->edges = arena_alloc(arena, (tmpl->num_edges + 1) * sizeof(Node*), alignof(Node*));
+    tmpl->uses = arena_alloc(arena, (tmpl->num_edges + 1) * sizeof(NodeUse), alignof(NodeUse));
+    tmpl->position = arena_alloc(arena, graph->size * sizeof(int32_t), alignof(int32_t));
+    tmpl->grad_block_elems = grad_elems;
+    tmpl->grad_block = arena_alloc(arena, (grad_elems + 1) * sizeof(float), alignof(float));
+    memset(tmpl->nodes, 0, order_size * sizeof(Node));
+
+    for(size_t i = 0; i < order_size; i++) {
+        if(order[i]->topo_index < 0 || (size_t) order[i]->topo_index >= graph->size) {
+            fatal("graph_template_record cannot run: order is not from topological_sort on this graph");
+        }
+        tmpl->position[order[i]->topo_index] = (int32_t) i;
+        tmpl->order[i] = &tmpl->nodes[i];
+    }
+
+    size_t edge = 0;
+    size_t cursor = 0;
+    for(size_t i = 0; i < order_size; i++) {
+        const Node* src = order[i];
+        Node* node = &tmpl->nodes[i];
+
+        node->operation = src->operation;
+        node->attrs = src->attrs;
+        node->variant = src->variant;
+        node->topo_index = (int) i;
+        node->n_input = src->n_input;
+        node->inputs = tmpl->edges + edge;
+
+        for(int j = 0; j < src->n_input; j++) {
+            Node* input = &tmpl->nodes[tmpl->position[src->inputs[j]->topo_index]];
+            node->inputs[j] = input;
+
+            // Same prepend as add_node, just out of one array
+            NodeUse* use = &tmpl->uses[edge + (size_t) j];
+            use->user = node;
+            use->next = input->users;
+            input->users = use;
+        }
+        edge += (size_t) src->n_input;
+
+        if(src->operation == OP_INPUT) {
+            node->out = record_leaf(tmpl, graph->arena, src->out, &cursor);
+            continue;
+        }
+
+        node->out = tensor_new(arena, src->out->ndim, src->out->shape);
+        node->out->grad = grad_from_block(tmpl, node->out, &cursor);
+
+        if(src->aux) {
+            node->aux = tensor_new_dtype(arena, src->aux->ndim, src->aux->shape, src->aux->dtype);
+        }
+    }
+
+    exec_plan_build(&tmpl->plan, arena, tmpl->order, tmpl->num_nodes);
+}
+
+Node* graph_template_node(const GraphTemplate* tmpl, const Node* recorded) {
+    if(!tmpl || !recorded || recorded->topo_index < 0 || (size_t) recorded->topo_index >= tmpl->recorded_size) {
+        fatal("graph_template_node cannot run: node is not part of the recorded graph");
+    }
+
+    return &tmpl->nodes[tmpl->position[recorded->topo_index]];
+}
+
+void graph_template_bind(GraphTemplate* tmpl, Node* leaf, Tensor* tensor) {
+    if(!tmpl || !leaf || !tensor) {
+        fatal("graph_template_bind cannot run: input is NULL");
+    }
+    if(leaf < tmpl->nodes || leaf >= tmpl->nodes + tmpl->num_nodes || leaf->operation != OP_INPUT) {
+        fatal("graph_template_bind cannot run: node is not a leaf of this template");
+    }
+
+    const Tensor* old = leaf->out;
+    if(tensor->ndim != old->ndim || tensor->dtype != old->dtype) {
+        fatal("graph_template_bind cannot run: tensor has ndim %d dtype %d, leaf has ndim %d dtype %d", tensor->ndim, (int) tensor->dtype, old->ndim, (int) old->dtype);
+    }
+    for(int d = 0; d < old->ndim; d++) {
+        if(tensor->shape[d] != old->shape[d]) {
+            fatal("graph_template_bind cannot run: shape mismatch at dim %d, %lld vs %lld", d, (long long) tensor->shape[d], (long long) old->shape[d]);
+        }
+    }
+
+    // A tensor without a grad sinks into the previous one's, only allocated if the leaf never had one to lend
+    if(!tensor->grad && tensor_is_differentiable(tensor)) {
+        tensor->grad = old->grad? old->grad : tensor_zeroes_like(tmpl->arena, tensor);
+    }
+
+    leaf->out = tensor;
+    exec_plan_refresh(&tmpl->plan);
+}
+
+void graph_template_forward(const GraphTemplate* tmpl) {
+    exec_plan_forward(&tmpl->plan);
+}
+
+int graph_template_enable_jit(GraphTemplate* tmpl) {
+    if(!tmpl) {
+        fatal("graph_template_enable_jit cannot run: input is NULL");
+    }
+
+    return exec_plan_enable_jit(&tmpl->plan);
+}
+
+void graph_template_backward(GraphTemplate* tmpl, const Node* loss) {
+    if(!tmpl || !loss) {
+        fatal("graph_template_backward cannot run: input is NULL");
+    }
+    if(total_elems(loss->out) != 1) {
+        fatal("graph_template_backward cannot run: loss must be a scalar, loss has %zu elements", total_elems(loss->out));
+    }
+
+    memset(tmpl->grad_block, 0, tmpl->grad_block_elems * sizeof(float));
+    exec_plan_backward(&tmpl->plan, loss->out);
+}
+
+#ifdef GRAPH_TEMPLATE_SELFTEST_MAIN
+#include <assert.h>
+#include <math.h>
+
+#define TPL_IN 3
+#define TPL_HIDDEN 8
+#define TPL_BATCH 4
+
+// [B, in] @ W1 + b1 -> relu -> @ W2, summed to a scalar through a [out, 1] ones matmul
+static Node* build(Graph* graph, Tensor* x, Tensor* w1, Tensor* b1, Tensor* w2, Tensor* ones, Node** x_node) {
+    *x_node = graph_add_input(graph, x);
+
+    int64_t b_shape[2] = { TPL_BATCH, TPL_HIDDEN };
+    Node* mm_in[2] = { *x_node, graph_add_input(graph, w1) };
+    Node* mm = add_node(graph, OP_MATMUL, 2, mm_in);
+    Node* add_in[2] = { mm, graph_add_input(graph, tensor_expand(graph->arena, b1, 2, b_shape)) };
+    Node* add = add_node(graph, OP_ADD, 2, add_in);
+    Node* act_in[1] = { add };
+    Node* act = add_node(graph, OP_RELU, 1, act_in);
+    Node* out_in[2] = { act, graph_add_input(graph, w2) };
+    Node* out = add_node(graph, OP_MATMUL, 2, out_in);
+    Node* sum_in[2] = { graph_add_input(graph, ones), out };
+    return add_node(graph, OP_MATMUL, 2, sum_in);
+}
+
+static void fill_x(Tensor* x, int step) {
+    for(size_t i = 0; i < total_elems(x); i++) x->data[i] = sinf((float) (i + 7 * step));
+}
+
+int main(void) {
+    Arena params, scratch, tmpl_arena;
+    arena_init(&params, 1 << 16);
+    arena_init(&scratch, 1 << 18);
+    arena_init(&tmpl_arena, 1 << 18);
+
+    const int64_t w1_shape[2] = { TPL_IN, TPL_HIDDEN }, b1_shape[2] = { 1, TPL_HIDDEN };
+    const int64_t w2_shape[2] = { TPL_HIDDEN, 1 }, ones_shape[2] = { 1, TPL_BATCH }, x_shape[2] = { TPL_BATCH, TPL_IN };
+    Tensor* w1 = tensor_new(&params, 2, w1_shape);
+    Tensor* b1 = tensor_new(&params, 2, b1_shape);
+    Tensor* w2 = tensor_new(&params, 2, w2_shape);
+    Tensor* ones = tensor_new(&params, 2, ones_shape);
+    for(size_t i = 0; i < total_elems(w1); i++) w1->data[i] = cosf((float) i);
+    for(size_t i = 0; i < total_elems(w2); i++) w2->data[i] = 0.5f - 0.1f * (float) i;
+    tensor_fill(b1, 0.1f);
+    tensor_fill(ones, 1.0f);
+    w1->grad = tensor_zeroes_like(&params, w1);
+    b1->grad = tensor_zeroes_like(&params, b1);
+    w2->grad = tensor_zeroes_like(&params, w2);
+
+    // Record from a throwaway build, the recorded graph's arena is reset right after
+    Graph graph;
+    graph_init(&graph, &scratch);
+    Tensor* x0 = tensor_new(&scratch, 2, x_shape);
+    Node* x_rec = NULL;
+    Node* loss_rec = build(&graph, x0, w1, b1, w2, ones, &x_rec);
+    Node** order = NULL;
+    size_t order_n = 0;
+    topological_sort(&graph, &order, &order_n);
+
+    GraphTemplate tmpl;
+    graph_template_record(&tmpl, &tmpl_arena, &graph, order, order_n);
+    Node* x_leaf = graph_template_node(&tmpl, x_rec);
+    Node* loss = graph_template_node(&tmpl, loss_rec);
+    Tensor* owned_x = x_leaf->out;
+    arena_reset(&scratch);
+    size_t tmpl_bytes = (size_t) (tmpl_arena.curr - tmpl_arena.base);
+
+    for(int step = 0; step < 3; step++) {
+        // Reference: the usual per step graph
+        Graph ref;
+        graph_init(&ref, &scratch);
+        Tensor* x = tensor_new(&scratch, 2, x_shape);
+        fill_x(x, step);
+        Node* x_node = NULL;
+        Node* ref_loss = build(&ref, x, w1, b1, w2, ones, &x_node);
+        topological_sort(&ref, &order, &order_n);
+        graph_forward_pass(order, order_n);
+        graph_backward_pass(&ref, order, order_n, ref_loss->out);
+
+        float ref_value = ref_loss->out->data[0];
+        float ref_gw1[TPL_IN * TPL_HIDDEN], ref_gb1[TPL_HIDDEN];
+        memcpy(ref_gw1, w1->grad->data, sizeof(ref_gw1));
+        memcpy(ref_gb1, b1->grad->data, sizeof(ref_gb1));
+        tensor_fill(w1->grad, 0.0f);
+        tensor_fill(b1->grad, 0.0f);
+        tensor_fill(w2->grad, 0.0f);
+
+        // Template: even steps write into the leaf copy the template owns, odd steps bind a fresh tensor
+        if(step % 2 == 0) {
+            graph_template_bind(&tmpl, x_leaf, owned_x);
+            fill_x(owned_x, step);
+        }
+        else {
+            Tensor* bound = tensor_new(&scratch, 2, x_shape);
+            fill_x(bound, step);
+            graph_template_bind(&tmpl, x_leaf, bound);
+        }
+        graph_template_forward(&tmpl);
+        graph_template_backward(&tmpl, loss);
+
+        assert(fabsf(loss->out->data[0] - ref_value) < 1e-5f);
+        for(int i = 0; i < TPL_IN * TPL_HIDDEN; i++) assert(fabsf(w1->grad->data[i] - ref_gw1[i]) < 1e-5f);
+        for(int i = 0; i < TPL_HIDDEN; i++) assert(fabsf(b1->grad->data[i] - ref_gb1[i]) < 1e-5f);
+
+        tensor_fill(w1->grad, 0.0f);
+        tensor_fill(b1->grad, 0.0f);
+        tensor_fill(w2->grad, 0.0f);
+        arena_reset(&scratch);
+    }
+
+    // Steps after recording never touch the template arena, fresh tensors borrow the leaf's grad
+    assert((size_t) (tmpl_arena.curr - tmpl_arena.base) == tmpl_bytes);
+    printf("graph template: %zu nodes, %zu edges, %zu bytes recorded once, selftest passed\n", tmpl.num_nodes, tmpl.num_edges, tmpl_bytes);
+
+    arena_free(&params);
+    arena_free(&scratch);
+    arena_free(&tmpl_arena);
+    return 0;
+}
+#endif
@@ -0,0 +1,313 @@
+#include "graph.h"
+
+// Forward mode and forward over reverse, the per op math lives next to forward/backward in each kernel (jvp and
+// backward_jvp), this only walks the order and makes sure every tangent exists
+
+static int in_arena(const Arena* arena, const void* p) {
+    const uint8_t* curr = (const uint8_t*) p;
+    return p && curr >= arena->base && curr < arena->curr;
+}
+
+void graph_ensure_tangent(Graph* graph, Tensor* tensor) {
+    if(!tensor || tensor->tangent) return;
+
+    if(!in_arena(graph->arena, tensor)) {
+        // Same trap as graph_ensure_grad, a scratch tangent hung off a persistent tensor dangles after arena_reset
+        fatal("graph_ensure_tangent cannot run: a non-graph tensor has no tangent, set one (zeroes for a constant) first");
+    }
+
+    if(!tensor->base) {
+        tensor->tangent = tensor_zeroes_like(graph->arena, tensor);
+        return;
+    }
+
+    // Views keep the grads consistent by aliasing the base's grad, tangents do the same with the base's tangent
+    Tensor* base = (Tensor*) tensor->base;
+    if(!base->tangent) {
+        if(!in_arena(graph->arena, base)) {
+            fatal("graph_ensure_tangent cannot run: the base of a view has no tangent, set one (zeroes for a constant) first");
+        }
+        base->tangent = tensor_zeroes_like(graph->arena, base);
+    }
+
+    size_t elem_size = dtype_size(tensor->dtype);
+    size_t offset = (size_t) ((const char*) tensor->data - (const char*) base->data) / elem_size;
+    Tensor* view = arena_alloc(graph->arena, sizeof(Tensor), alignof(Tensor));
+
+    *view = *tensor;
+    view->dtype = DTYPE_F32;
+    view->data = base->tangent->data + offset;
+    view->base = base->tangent;
+    view->grad = NULL;
+    view->tangent = NULL;
+    tensor->tangent = view;
+}
+
+static const OpKernel* tangent_kernel(const Node* node, const char* caller) {
+    const OpKernel* k = get_opkernel(node->operation);
+
+    if(!k) {
+        fatal("%s cannot run: op is out of bounds/not registered, op index: %d", caller, (int) node->operation);
+    }
+    if(!k->jvp || !k->backward_jvp) {
+        fatal("%s cannot run: op %s has no forward mode rule", caller, k->name);
+    }
+
+    return k;
+}
+
+static void check_graph(const Graph* graph, const char* caller) {
+    // Checkpointed and lazy graphs have op outputs without storage, the tangents would need the same bookkeeping
+    if(graph->checkpoint_every != 0 || graph->lazy) {
+        fatal("%s cannot run: not supported on checkpointed or lazy graphs", caller);
+    }
+}
+
+void graph_forward_jvp_pass(Graph* graph, Node* const* order, size_t order_size) {
+    if(!graph || !order) {
+        fatal("graph_forward_jvp_pass cannot run: input is NULL");
+    }
+    check_graph(graph, "graph_forward_jvp_pass");
+
+    for(size_t i = 0; i < order_size; i++) {
+        Node* node = order[i];
+
+        if(node->operation == OP_INPUT) {
+            if(tensor_is_differentiable(node->out)) graph_ensure_tangent(graph, node->out);
+            continue;
+        }
+
+        const OpKernel* k = tangent_kernel(node, "graph_forward_jvp_pass");
+        node_forward_fn(node, k)(node);
+        graph_ensure_tangent(graph, node->out);
+        k->jvp(node);
+        node->evaluated = 1;
+    }
+}
+
+void graph_hvp_backward_pass(Graph* graph, Node* const* order, size_t order_size, Tensor* loss) {
+    if(!graph || !order || !loss) {
+        fatal("graph_hvp_backward_pass cannot run: input is NULL");
+    }
+    check_graph(graph, "graph_hvp_backward_pass");
+    if(total_elems(loss) != 1) {
+        fatal("graph_hvp_backward_pass cannot run: loss must be a scalar, loss has %zu elements", total_elems(loss));
+    }
+
+    graph_ensure_grad(graph, loss);
+    graph_ensure_tangent(graph, loss->grad);
+    // The seed doesn't move with the direction
+    loss->grad->data[0] = 1.0f;
+    loss->grad->tangent->data[0] = 0.0f;
+
+    for(size_t i = order_size; i-- > 0; ) {
+        Node* node = order[i];
+
+        if(node->operation == OP_INPUT) {
+            break;
+        }
+
+        const OpKernel* k = tangent_kernel(node, "graph_hvp_backward_pass");
+        graph_ensure_grad(graph, node->out);
+        graph_ensure_tangent(graph, node->out->grad);
+        for(int j = 0; j < node->n_input; j++) {
+            Tensor* in = node->inputs[j]->out;
+
+            if(!tensor_is_differentiable(in)) continue;
+            graph_ensure_grad(graph, in);
+            graph_ensure_tangent(graph, in->grad);
+        }
+
+        node_backward_fn(node, k)(node);
+        k->backward_jvp(node);
+    }
+}
+
+#ifdef JVP_SELFTEST_MAIN
+#include <assert.h>
+#include <math.h>
+
+#define JVP_N 4
+#define JVP_IN 3
+#define JVP_HIDDEN 5
+#define JVP_CLASSES 3
+#define JVP_NUM_PARAMS 3
+
+typedef struct {
+    Tensor* p[JVP_NUM_PARAMS];
+    // Direction and the H dir result per parameter, laid out like p
+    Tensor* dir[JVP_NUM_PARAMS];
+    Tensor* hvp[JVP_NUM_PARAMS];
+} Params;
+
+/* Every op with a forward mode rule: z = x W + b, relu(tanh(z) - tanh(z) * sigmoid(z)) @ V, softmax, cross entropy
+   on top of that. W is used through a transposed view of a [HIDDEN, IN] tensor and b through an expanded one, so view
+   tangents are in play too */
+static Node* build(Graph* graph, Params* params, Tensor* x, Tensor* labels) {
+    const int64_t b_shape[2] = { JVP_N, JVP_HIDDEN };
+    Node* mm_in[2] = { graph_add_input(graph, x), graph_add_input(graph, tensor_transpose(graph->arena, params->p[0], 0, 1)) };
+    Node* mm = add_node(graph, OP_MATMUL, 2, mm_in);
+    Node* z_in[2] = { mm, graph_add_input(graph, tensor_expand(graph->arena, params->p[1], 2, b_shape)) };
+    Node* z = add_node(graph, OP_ADD, 2, z_in);
+    Node* un_in[1] = { z };
+    Node* t = add_node(graph, OP_TANH, 1, un_in);
+    Node* s = add_node(graph, OP_SIGMOID, 1, un_in);
+    Node* m_in[2] = { t, s };
+    Node* m = add_node(graph, OP_MUL, 2, m_in);
+    Node* d_in[2] = { t, m };
+    Node* d = add_node(graph, OP_SUB, 2, d_in);
+    Node* r_in[1] = { d };
+    Node* r = add_node(graph, OP_RELU, 1, r_in);
+    Node* o_in[2] = { r, graph_add_input(graph, params->p[2]) };
+    Node* o = add_node(graph, OP_MATMUL, 2, o_in);
+    Node* sm_in[1] = { o };
+    Node* sm = add_node(graph, OP_SOFTMAX, 1, sm_in);
+    Node* ce_in[2] = { sm, graph_add_input(graph, labels) };
+    return add_node(graph, OP_SOFTMAX_CROSS_ENTROPY, 2, ce_in);
+}
+
+// Loss at the current params with the grads in p->grad. With a jvp out the forward mode passes run instead, jvp gets
+// the directional derivative and hvp[k] H dir
+static float run(Params* params, float* jvp) {
+    Arena scratch;
+    arena_init(&scratch, 1 << 18);
+    Graph graph;
+    graph_init(&graph, &scratch);
+
+    const int64_t x_shape[2] = { JVP_N, JVP_IN }, l_shape[1] = { JVP_N };
+    Tensor* x = tensor_new(&scratch, 2, x_shape);
+    Tensor* labels = tensor_new_dtype(&scratch, 1, l_shape, DTYPE_I32);
+    for(size_t i = 0; i < total_elems(x); i++) x->data[i] = 1.5f * sinf(1.7f * (float) i + 0.3f);
+    for(int b = 0; b < JVP_N; b++) labels->data_i32[b] = b % JVP_CLASSES;
+
+    for(int k = 0; k < JVP_NUM_PARAMS; k++) {
+        tensor_fill(params->p[k]->grad, 0.0f);
+        if(jvp) tensor_fill(params->hvp[k], 0.0f);
+        params->p[k]->tangent = jvp? params->dir[k] : NULL;
+        params->p[k]->grad->tangent = jvp? params->hvp[k] : NULL;
+    }
+
+    Node* loss = build(&graph, params, x, labels);
+    Node** order = NULL;
+    size_t order_n = 0;
+    topological_sort(&graph, &order, &order_n);
+
+    if(jvp) {
+        graph_forward_jvp_pass(&graph, order, order_n);
+        graph_hvp_backward_pass(&graph, order, order_n, loss->out);
+        *jvp = loss->out->tangent->data[0];
+    }
+    else {
+        graph_forward_pass(order, order_n);
+        graph_backward_pass(&graph, order, order_n, loss->out);
+    }
+
+    float value = loss->out->data[0];
+    for(int k = 0; k < JVP_NUM_PARAMS; k++) {
+        params->p[k]->tangent = NULL;
+        params->p[k]->grad->tangent = NULL;
+    }
+    arena_free(&scratch);
+    return value;
+}
+
+static void axpy(Params* params, float alpha, Tensor* const* by) {
+    for(int k = 0; k < JVP_NUM_PARAMS; k++) {
+        for(size_t i = 0; i < total_elems(params->p[k]); i++) params->p[k]->data[i] += alpha * by[k]->data[i];
+    }
+}
+
+static double dot(Tensor* const* a, Tensor* const* b) {
+    double sum = 0.0;
+    for(int k = 0; k < JVP_NUM_PARAMS; k++) {
+        for(size_t i = 0; i < total_elems(a[k]); i++) sum += (double) a[k]->data[i] * b[k]->data[i];
+    }
+    return sum;
+}
+
+int main(void) {
+    Arena arena;
+    arena_init(&arena, 1 << 18);
+
+    const int64_t shapes[JVP_NUM_PARAMS][2] = { { JVP_HIDDEN, JVP_IN }, { 1, JVP_HIDDEN }, { JVP_HIDDEN, JVP_CLASSES } };
+    Params params;
+    Tensor* grads[JVP_NUM_PARAMS];
+    Tensor* other_dir[JVP_NUM_PARAMS];
+    Tensor* other_hvp[JVP_NUM_PARAMS];
+    Tensor* fd[JVP_NUM_PARAMS];
+
+    for(int k = 0; k < JVP_NUM_PARAMS; k++) {
+        params.p[k] = tensor_new(&arena, 2, shapes[k]);
+        params.p[k]->grad = tensor_zeroes_like(&arena, params.p[k]);
+        params.dir[k] = tensor_new(&arena, 2, shapes[k]);
+        params.hvp[k] = tensor_new(&arena, 2, shapes[k]);
+        grads[k] = tensor_new(&arena, 2, shapes[k]);
+        other_dir[k] = tensor_new(&arena, 2, shapes[k]);
+        other_hvp[k] = tensor_new(&arena, 2, shapes[k]);
+        fd[k] = tensor_new(&arena, 2, shapes[k]);
+
+        for(size_t i = 0; i < total_elems(params.p[k]); i++) {
+            params.p[k]->data[i] = 0.8f * cosf(2.3f * (float) i + (float) k);
+            params.dir[k]->data[i] = sinf(0.7f * (float) i + 1.1f * (float) k);
+            other_dir[k]->data[i] = cosf(1.9f * (float) i - 0.4f * (float) k);
+        }
+    }
+
+    // The forward mode passes compute the same loss and grads as the plain ones
+    float ref = run(&params, NULL);
+    for(int k = 0; k < JVP_NUM_PARAMS; k++) memcpy(grads[k]->data, params.p[k]->grad->data, total_elems(grads[k]) * sizeof(float));
+    float jvp = 0.0f;
+    float got = run(&params, &jvp);
+    assert(fabsf(ref - got) < 1e-6f);
+    for(int k = 0; k < JVP_NUM_PARAMS; k++) {
+        for(size_t i = 0; i < total_elems(grads[k]); i++) assert(fabsf(grads[k]->data[i] - params.p[k]->grad->data[i]) < 1e-6f);
+    }
+
+    // J dir against the reverse mode grad and against central differences
+    double grad_dot = dot(grads, params.dir);
+    assert(fabs(jvp - grad_dot) < 1e-5 * (1.0 + fabs(grad_dot)));
+
+    const float eps = 1e-2f;
+    axpy(&params, eps, params.dir);
+    float up = run(&params, NULL);
+    for(int k = 0; k < JVP_NUM_PARAMS; k++) memcpy(fd[k]->data, params.p[k]->grad->data, total_elems(fd[k]) * sizeof(float));
+    axpy(&params, -2.0f * eps, params.dir);
+    float down = run(&params, NULL);
+    axpy(&params, eps, params.dir);
+    float fd_jvp = (up - down) / (2.0f * eps);
+    assert(fabsf(jvp - fd_jvp) < 1e-3f * (1.0f + fabsf(jvp)));
+
+    // H dir against the central difference of the grads
+    double max_err = 0.0, max_hv = 0.0;
+    for(int k = 0; k < JVP_NUM_PARAMS; k++) {
+        for(size_t i = 0; i < total_elems(fd[k]); i++) {
+            double fd_hv = (fd[k]->data[i] - params.p[k]->grad->data[i]) / (2.0 * eps);
+            double err = fabs(fd_hv - params.hvp[k]->data[i]);
+            max_err = err > max_err? err : max_err;
+            max_hv = fabs(params.hvp[k]->data[i]) > max_hv? fabs(params.hvp[k]->data[i]) : max_hv;
+        }
+    }
+    assert(max_hv > 1e-3 && max_err < 2e-2 * max_hv);
+
+    // And the Hessian is symmetric, u . H v = v . H u
+    Tensor* saved_dir[JVP_NUM_PARAMS];
+    Tensor* saved_hvp[JVP_NUM_PARAMS];
+    for(int k = 0; k < JVP_NUM_PARAMS; k++) {
+        saved_dir[k] = params.dir[k];
+        saved_hvp[k] = params.hvp[k];
+        params.dir[k] = other_dir[k];
+        params.hvp[k] = other_hvp[k];
+    }
+    float other_jvp = 0.0f;
+    run(&params, &other_jvp);
+    double u_hv = dot(other_dir, saved_hvp);
+    double v_hu = dot(saved_dir, other_hvp);
+    assert(fabs(u_hv - v_hu) < 1e-4 * (1.0 + fabs(u_hv)));
+
+    printf("jvp %.6f (grad dot %.6f, fd %.6f), hvp max err vs fd %.2e, u.Hv %.6f v.Hu %.6f, selftest passed\n",
+        jvp, grad_dot, fd_jvp, max_err, u_hv, v_hu);
+
+    arena_free(&arena);
+    return 0;
+}
+#endif
@@ -1,21 +1,254 @@
 #include "op.h"
+#include "graph.h"
+#include "parallel.h"
 
 #include <string.h>
 #include <math.h>
 
-#define MAX_OPS 20
+// Indexed by op id, the built in ids first and the dynamic ones after, grown on demand
+static const OpKernel** registry = NULL;
+static size_t registry_size = OP_BUILTIN_COUNT;
+static size_t registry_capacity = 0;
+static OpChooser tuner = NULL;
 
-static const OpKernel* registry[MAX_OPS];
+static void registry_reserve(size_t size) {
+    if(size <= registry_capacity) {
+        return;
+    }
+
+    size_t capacity = registry_capacity? 2 * registry_capacity : 2 * OP_BUILTIN_COUNT;
+    while(capacity < size) capacity *= 2;
 
-void register_opkernel(const OpKernel* kernel) {
-    if(kernel->optype < 0 || kernel->optype >= MAX_OPS) {
-        fatal("Registry is full!");
+    const OpKernel** grown = (const OpKernel**) realloc((void*) registry, capacity * sizeof(OpKernel*));
+    if(!grown) {
+        fatal("register_opkernel: growing the registry to %zu ops failed", capacity);
     }
-    registry[kernel->optype] = kernel;
+
+    memset((void*) (grown + registry_capacity), 0, (capacity - registry_capacity) * sizeof(OpKernel*));
+    registry = grown;
+    registry_capacity = capacity;
+}
+
+Op register_opkernel(const OpKernel* kernel) {
+    if(!kernel || !kernel->name) {
+        fatal("register_opkernel cannot run: kernel or its name is NULL");
+    }
+    if(kernel->optype >= OP_BUILTIN_COUNT || kernel->optype == OP_INPUT) {
+        fatal("register_opkernel cannot run: %s has id %d, runtime ops register as OP_DYNAMIC", kernel->name, (int) kernel->optype);
+    }
+    if(kernel->num_variants < 0 || kernel->num_variants > OP_MAX_VARIANTS) {
+        fatal("register_opkernel cannot run: %s has %d variants, at most %d", kernel->name, kernel->num_variants, OP_MAX_VARIANTS);
+    }
+    if(find_op(kernel->name) != OP_DYNAMIC) {
+        fatal("register_opkernel cannot run: an op named %s is already registered", kernel->name);
+    }
+
+    Op id = kernel->optype;
+    if(id == OP_DYNAMIC) {
+        id = (Op) registry_size++;
+    }
+
+    registry_reserve(registry_size);
+    registry[id] = kernel;
+
+    return id;
 }
 
 const OpKernel* get_opkernel(Op optype) {
-    if(optype < 0 || optype >= MAX_OPS) return NULL;
-    
+    if(optype < 0 || (size_t) optype >= registry_size || (size_t) optype >= registry_capacity) return NULL;
+
     return registry[optype];
-}
\ No newline at end of file
+}
+
+Op find_op(const char* name) {
+    for(size_t i = 0; i < registry_size && i < registry_capacity; i++) {
+        if(registry[i] && strcmp(registry[i]->name, name) == 0) {
+            return (Op) i;
+        }
+    }
+
+    return OP_DYNAMIC;
+}
+
+OpCost op_cost(const Node* node) {
+    OpCost cost = { 0.0, 0.0 };
+    const OpKernel* k = get_opkernel(node->operation);
+
+    if(k && k->cost) {
+        k->cost(node, &cost);
+        return cost;
+    }
+
+    cost.flops = (double) total_elems(node->out);
+    cost.bytes = (double) (total_elems(node->out) * sizeof(float));
+    for(int i = 0; i < node->n_input; i++) {
+        cost.bytes += (double) (total_elems(node->inputs[i]->out) * dtype_size(node->inputs[i]->out->dtype));
+    }
+
+    return cost;
+}
+
+int op_default_chooser(const Node* node, const OpKernel* kernel) {
+    int threaded_ok = parallel_num_threads() > 1 && op_cost(node).flops >= OP_THREADED_MIN_FLOPS;
+    int best = -1;
+
+    for(int i = 0; i < kernel->num_variants; i++) {
+        const OpVariant* v = &kernel->variants[i];
+
+        if(v->supports && !v->supports(node)) continue;
+        if(v->impl == OP_IMPL_THREADED && !threaded_ok) continue;
+        if(best < 0 || v->impl > kernel->variants[best].impl) best = i;
+    }
+
+    return best;
+}
+
+const OpVariant* op_choose_variant(const Node* node) {
+    const OpKernel* k = get_opkernel(node->operation);
+
+    if(!k || k->num_variants == 0) {
+        return NULL;
+    }
+
+    int pick = (tuner && k->num_variants > 1)? tuner(node, k) : -1;
+    if(pick < 0) {
+        pick = k->choose? k->choose(node, k) : op_default_chooser(node, k);
+    }
+    if(pick < 0 || pick >= k->num_variants) {
+        fatal("op_choose_variant: %s has no variant for this node (chooser gave %d)", k->name, pick);
+    }
+
+    return &k->variants[pick];
+}
+
+void op_set_tuner(OpChooser chooser) {
+    tuner = chooser;
+}
+
+void op_require_dense_f32(const Node* node, unsigned allow_mask) {
+    for(int i = 0; i < node->n_input; i++) {
+        const Tensor* in = node->inputs[i]->out;
+
+        if(allow_mask & (1u << i)) continue;
+        if(in->csr) {
+            fatal("infer_and_alloc_output cannot run: op %d can't take a sparse input %d, only matmul's A can be CSR", (int) node->operation, i);
+        }
+        // Only matmul widens 16 bit storage on the fly, the other kernels index data as fp32 (labels aside)
+        if(in->dtype != DTYPE_F32) {
+            fatal("infer_and_alloc_output cannot run: op %d expects fp32 inputs, input %d has dtype %d", (int) node->operation, i, (int) in->dtype);
+        }
+    }
+}
+
+int op_infer_unary(const Node* node, int64_t out_shape[6]) {
+    const Tensor* A = node->inputs[0]->out;
+
+    op_require_dense_f32(node, 0);
+    memcpy(out_shape, A->shape, (size_t) A->ndim * sizeof(int64_t));
+
+    return A->ndim;
+}
+
+int op_infer_elementwise(const Node* node, int64_t out_shape[6]) {
+    const Tensor* a = node->inputs[0]->out;
+    const Tensor* b = node->inputs[1]->out;
+
+    op_require_dense_f32(node, 0);
+    if(a->ndim != b->ndim) {
+        fatal("shape mismatch: %d ndim of left arg tensor vs %d ndim of right arg tensor", a->ndim, b->ndim);
+    }
+    for(int i = 0; i < a->ndim; i++) {
+        if(a->shape[i] != b->shape[i]) {
+            fatal("shape mismatch at dim %d: %lld of left arg tensor vs %lld of right arg tensor", i, (long long) a->shape[i], (long long) b->shape[i]);
+        }
+    }
+
+    return op_infer_unary(node, out_shape);
+}
+
+#ifdef OP_SELFTEST_MAIN
+#include <assert.h>
+#include <stdio.h>
+
+static int scalar_runs = 0;
+static int threaded_runs = 0;
+
+// out = a * a, an op that lives outside the tree and only exists once registered at runtime
+static void square_fwd(Node* node) {
+    const Tensor* A = node->inputs[0]->out;
+    for(size_t i = 0; i < total_elems(node->out); i++) node->out->data[i] = A->data[i] * A->data[i];
+}
+
+static void square_bwd(Node* node) {
+    const Tensor* A = node->inputs[0]->out;
+    for(size_t i = 0; i < total_elems(node->out); i++) A->grad->data[i] += 2.0f * A->data[i] * node->out->grad->data[i];
+}
+
+static void square_fwd_scalar(Node* node) { scalar_runs++; square_fwd(node); }
+static void square_fwd_threaded(Node* node) { threaded_runs++; square_fwd(node); }
+
+// The threaded variant only takes 2D inputs
+static int square_threaded_supports(const Node* node) {
+    return node->inputs[0]->out->ndim == 2;
+}
+
+static const OpKernel square_kernel = {
+    .optype = OP_DYNAMIC,
+    .name = "square",
+    .forward = square_fwd,
+    .backward = square_bwd,
+    .arity = 1,
+    .infer = op_infer_unary,
+    .variants = {
+        { OP_IMPL_SCALAR, "scalar", square_fwd_scalar, NULL, NULL },
+        { OP_IMPL_THREADED, "threaded", square_fwd_threaded, NULL, square_threaded_supports },
+    },
+    .num_variants = 2,
+};
+
+int main(void) {
+    Op square = register_opkernel(&square_kernel);
+    assert(square >= OP_BUILTIN_COUNT && get_opkernel(square) == &square_kernel);
+    assert(find_op("square") == square && find_op("no_such_op") == OP_DYNAMIC);
+
+    Arena arena;
+    arena_init(&arena, 1 << 23);
+    Graph graph;
+    graph_init(&graph, &arena);
+
+    // Forward and backward of the runtime op through the ordinary passes
+    const int64_t one[2] = { 1, 1 };
+    Tensor* x = tensor_new(&arena, 2, one);
+    x->data[0] = 3.0f;
+    Node* in[1] = { graph_add_input(&graph, x) };
+    graph_ensure_grad(&graph, x);
+    Node* y = add_node(&graph, square, 1, in);
+
+    Node** order = NULL;
+    size_t order_n = 0;
+    topological_sort(&graph, &order, &order_n);
+    graph_forward_pass(order, order_n);
+    graph_backward_pass(&graph, order, order_n, y->out);
+    assert(y->out->data[0] == 9.0f && x->grad->data[0] == 6.0f);
+    // Too small to thread, and the scalar variant has no backward of its own so the kernel's ran
+    assert(y->variant == &square_kernel.variants[0] && scalar_runs == 1);
+
+    // Big enough with more than one thread goes to the threaded variant, unless it doesn't support the node
+    parallel_set_threads(4);
+    const int64_t big[2] = { 512, 512 }, flat[1] = { 512 * 512 };
+    Node* big_in[1] = { graph_add_input(&graph, tensor_new(&arena, 2, big)) };
+    Node* flat_in[1] = { graph_add_input(&graph, tensor_new(&arena, 1, flat)) };
+    Node* y_big = add_node(&graph, square, 1, big_in);
+    Node* y_flat = add_node(&graph, square, 1, flat_in);
+    assert(op_cost(y_big).flops == 512.0 * 512.0);
+    assert(y_big->variant->impl == OP_IMPL_THREADED && y_flat->variant->impl == OP_IMPL_SCALAR);
+    node_forward_fn(y_big, &square_kernel)(y_big);
+    assert(threaded_runs == 1);
+
+    parallel_set_threads(1);
+
+    printf("runtime op %s got id %d, forward/backward and variant choice selftest passed\n", square_kernel.name, (int) square);
+    arena_free(&arena);
+    return 0;
+}
+#endif
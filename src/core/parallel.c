@@ -0,0 +1,262 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "parallel.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+// One job at a time, the workers and the caller pull chunk indices off next until they run out
+typedef struct {
+    ParallelFn fn;
+    void* ctx;
+    size_t n;
+    size_t grain;
+    size_t chunks;
+    atomic_size_t next;
+    atomic_size_t done;
+} Job;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t finished;
+    // Held by the caller for the whole job, a second caller that can't get it just runs inline
+    pthread_mutex_t job_lock;
+    pthread_t* threads;
+    int num_workers;
+    // Read without any lock (graph building asks for it on every node), 0 until first asked or set
+    atomic_int num_threads;
+    int stop;
+    // Bumped per job so a worker knows a wakeup is new work, active counts the workers still inside the job
+    unsigned long generation;
+    int active;
+    Job job;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+    .job_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static _Thread_local int in_worker = 0;
+
+static void run_chunks(Job* job) {
+    for(;;) {
+        size_t c = atomic_fetch_add(&job->next, 1);
+        if(c >= job->chunks) {
+            return;
+        }
+
+        size_t begin = c * job->grain;
+        size_t end = (begin + job->grain < job->n)? begin + job->grain : job->n;
+        job->fn(job->ctx, begin, end);
+        atomic_fetch_add(&job->done, 1);
+    }
+}
+
+static void* worker_main(void* arg) {
+    (void) arg;
+    in_worker = 1;
+
+    // Jobs from before the worker existed are none of its business, a job started while it was spawning just runs
+    // without it
+    pthread_mutex_lock(&pool.lock);
+    unsigned long seen = pool.generation;
+    for(;;) {
+        while(!pool.stop && pool.generation == seen) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+        if(pool.stop) {
+            break;
+        }
+
+        seen = pool.generation;
+        pool.active++;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_chunks(&pool.job);
+
+        pthread_mutex_lock(&pool.lock);
+        if(--pool.active == 0) {
+            pthread_cond_signal(&pool.finished);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+static int default_threads(void) {
+    const char* env = getenv("TINYENGINE_THREADS");
+    if(env && atoi(env) > 0) {
+        return atoi(env);
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0? (int) cpus : 1;
+}
+
+static void stop_workers(void) {
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    for(int i = 0; i < pool.num_workers; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.num_workers = 0;
+    pool.stop = 0;
+}
+
+// Called with job_lock held
+static void start_workers(void) {
+    int num_threads = parallel_num_threads();
+    if(pool.num_workers == num_threads - 1) {
+        return;
+    }
+
+    stop_workers();
+    if(num_threads == 1) {
+        return;
+    }
+
+    pool.threads = (pthread_t*) malloc((size_t) (num_threads - 1) * sizeof(pthread_t));
+    if(!pool.threads) {
+        fatal("parallel_for: malloc for %d worker threads failed", num_threads - 1);
+    }
+
+    for(int i = 0; i < num_threads - 1; i++) {
+        if(pthread_create(&pool.threads[i], NULL, worker_main, NULL) != 0) {
+            fatal("parallel_for: pthread_create failed for worker %d", i);
+        }
+        pool.num_workers++;
+    }
+}
+
+// A job already running keeps the workers it has, the next one restarts the pool at the new count
+void parallel_set_threads(int num_threads) {
+    atomic_store(&pool.num_threads, num_threads > 0? num_threads : default_threads());
+}
+
+int parallel_num_threads(void) {
+    int n = atomic_load(&pool.num_threads);
+    if(n == 0) {
+        // Racing first calls agree on whichever default got stored first
+        int unset = 0;
+        n = default_threads();
+        if(!atomic_compare_exchange_strong(&pool.num_threads, &unset, n)) {
+            n = unset;
+        }
+    }
+
+    return n;
+}
+
+void parallel_for(size_t n, size_t grain, ParallelFn fn, void* ctx) {
+    if(n == 0) {
+        return;
+    }
+
+    grain = grain? grain : 1;
+    size_t chunks = (n + grain - 1) / grain;
+
+    if(chunks == 1 || in_worker || pthread_mutex_trylock(&pool.job_lock) != 0) {
+        fn(ctx, 0, n);
+        return;
+    }
+
+    start_workers();
+    if(pool.num_workers == 0) {
+        pthread_mutex_unlock(&pool.job_lock);
+        fn(ctx, 0, n);
+        return;
+    }
+
+    // A worker that woke too late for the last job can still be inside it, it has to leave before the fields change
+    pthread_mutex_lock(&pool.lock);
+    while(pool.active > 0) {
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    }
+
+    Job* job = &pool.job;
+    job->fn = fn;
+    job->ctx = ctx;
+    job->n = n;
+    job->grain = grain;
+    job->chunks = chunks;
+    atomic_store(&job->next, 0);
+    atomic_store(&job->done, 0);
+
+    pool.generation++;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    in_worker = 1;
+    run_chunks(job);
+    in_worker = 0;
+
+    // Every chunk is done once next ran out and no worker is left inside the job
+    pthread_mutex_lock(&pool.lock);
+    while(pool.active > 0 || atomic_load(&job->done) < chunks) {
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_mutex_unlock(&pool.job_lock);
+}
+
+#ifdef PARALLEL_SELFTEST_MAIN
+#include <assert.h>
+#include <stdio.h>
+
+#define PAR_N 10007
+
+typedef struct {
+    int* hits;
+} Counts;
+
+static void mark(void* ctx, size_t begin, size_t end) {
+    Counts* counts = ctx;
+
+    for(size_t i = begin; i < end; i++) {
+        counts->hits[i]++;
+    }
+}
+
+// A parallel_for from inside a chunk runs inline instead of deadlocking on the busy pool
+static void nested(void* ctx, size_t begin, size_t end) {
+    Counts* counts = ctx;
+
+    parallel_for(end - begin, 16, mark, &(Counts) { counts->hits + begin });
+}
+
+int main(void) {
+    static int hits[PAR_N];
+    Counts counts = { hits };
+
+    for(int threads = 1; threads <= 4; threads++) {
+        parallel_set_threads(threads);
+        assert(parallel_num_threads() == threads);
+
+        memset(hits, 0, sizeof(hits));
+        for(int rep = 0; rep < 50; rep++) {
+            parallel_for(PAR_N, 64 + (size_t) rep, mark, &counts);
+        }
+        for(int i = 0; i < PAR_N; i++) assert(hits[i] == 50);
+
+        memset(hits, 0, sizeof(hits));
+        parallel_for(PAR_N, 1000, nested, &counts);
+        for(int i = 0; i < PAR_N; i++) assert(hits[i] == 1);
+    }
+
+    parallel_set_threads(1);
+    printf("parallel_for covers every index once for 1 to 4 threads, nested calls included, selftest passed\n");
+    return 0;
+}
+#endif
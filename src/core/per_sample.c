@@ -0,0 +1,343 @@
+#include "graph.h"
+
+#include <math.h>
+
+/* Per sample grads read off what the batch backward already left behind, no extra pass through the graph. The grad
+   of a matmul weight for sample n is the outer product A[n]^T gC[n] of that sample's input row and output grad row, the
+   grad of a broadcast bias is gC[n]. A parameter is found through its grad, so views and the 16 bit weight copies (whose
+   grad is the master's) are matched too */
+
+typedef struct {
+    const Node* node;
+    // Leaf the node reads the parameter through, leaf->grad is the view of param->grad the node accumulates into
+    const Tensor* leaf;
+    int is_bias;
+} ParamUse;
+
+static int grads_alias(const Tensor* leaf_grad, const Tensor* grad) {
+    return leaf_grad && (leaf_grad == grad || leaf_grad->base == grad);
+}
+
+// Next node at or after *cursor that reads param, 0 once there is none left
+static int next_use(Node* const* order, size_t order_size, const Tensor* param, size_t* cursor, int* input, ParamUse* use) {
+    for(; *cursor < order_size; (*cursor)++, *input = 0) {
+        const Node* node = order[*cursor];
+        if(node->operation == OP_INPUT) continue;
+
+        for(; *input < node->n_input; (*input)++) {
+            const Tensor* leaf = node->inputs[*input]->out;
+            if(node->inputs[*input]->operation != OP_INPUT || !grads_alias(leaf->grad, param->grad)) continue;
+
+            use->node = node;
+            use->leaf = leaf;
+            use->is_bias = node->operation == OP_ADD && leaf->ndim == 2 && leaf->grad->stride[0] == 0;
+            if(!use->is_bias && !(node->operation == OP_MATMUL && *input == 1)) {
+                fatal("per sample grads cannot run: parameters have to be a matmul weight or a broadcast bias (op %d, input %d)", (int) node->operation, *input);
+            }
+            (*input)++;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void check_use(const ParamUse* use, int64_t batch) {
+    const Tensor* out = use->node->out;
+
+    if(out->ndim != 2 || out->shape[0] != batch || !out->grad) {
+        fatal("per sample grads cannot run: expected a [%lld, k] op output with a grad, run the batch backward first", (long long) batch);
+    }
+}
+
+// dst, laid out like param->grad, += scale * sample n's grad through this use
+static void accumulate_sample(const ParamUse* use, const Tensor* param, int64_t n, float scale, float* dst) {
+    const Tensor* g = use->leaf->grad;
+    const Tensor* gC = use->node->out->grad;
+    const float* gc = gC->data + n * gC->stride[0];
+    const int64_t cols = gC->shape[1];
+    float* base = dst + (g->data - param->grad->data);
+
+    if(use->is_bias) {
+        for(int64_t j = 0; j < cols; j++) {
+            base[j * g->stride[1]] += scale * gc[j * gC->stride[1]];
+        }
+
+        return;
+    }
+
+    const Tensor* A = use->node->inputs[0]->out;
+    if(A->csr) {
+        // Sparse input row, only its nonzeros' rows of the weight get anything
+        for(int32_t p = A->csr->row_ptr[n]; p < A->csr->row_ptr[n + 1]; p++) {
+            const float a = scale * A->data[p];
+            float* row = base + A->csr->col_idx[p] * g->stride[0];
+
+            for(int64_t j = 0; j < cols; j++) {
+                row[j * g->stride[1]] += a * gc[j * gC->stride[1]];
+            }
+        }
+
+        return;
+    }
+
+    for(int64_t i = 0; i < A->shape[1]; i++) {
+        const float a = scale * tensor_load(A, (size_t) (n * A->stride[0] + i * A->stride[1]));
+        float* row = base + i * g->stride[0];
+
+        // Post relu inputs are mostly zeroes
+        if(a == 0.0f) continue;
+        for(int64_t j = 0; j < cols; j++) {
+            row[j * g->stride[1]] += a * gc[j * gC->stride[1]];
+        }
+    }
+}
+
+// ||A[n]^T gC[n]||^2 = ||A[n]||^2 ||gC[n]||^2 for a rank one outer product, so the norm costs in + out, not in * out
+static float sample_sq_norm(const ParamUse* use, int64_t n) {
+    const Tensor* gC = use->node->out->grad;
+    float g2 = 0.0f;
+
+    for(int64_t j = 0; j < gC->shape[1]; j++) {
+        float g = gC->data[n * gC->stride[0] + j * gC->stride[1]];
+        g2 += g * g;
+    }
+    if(use->is_bias) {
+        return g2;
+    }
+
+    const Tensor* A = use->node->inputs[0]->out;
+    float a2 = 0.0f;
+    if(A->csr) {
+        for(int32_t p = A->csr->row_ptr[n]; p < A->csr->row_ptr[n + 1]; p++) {
+            a2 += A->data[p] * A->data[p];
+        }
+
+        return a2 * g2;
+    }
+    for(int64_t i = 0; i < A->shape[1]; i++) {
+        float a = tensor_load(A, (size_t) (n * A->stride[0] + i * A->stride[1]));
+        a2 += a * a;
+    }
+
+    return a2 * g2;
+}
+
+void graph_per_sample_grads(Node* const* order, size_t order_size, const Tensor* param, Tensor* out) {
+    if(!order || !param || !param->grad || !out) {
+        fatal("graph_per_sample_grads cannot run: input is NULL or param has no grad");
+    }
+
+    const int64_t batch = out->shape[0];
+    const size_t param_elems = total_elems(param);
+    int shape_ok = out->dtype == DTYPE_F32 && out->is_contiguous && out->ndim == param->ndim + 1;
+    for(int d = 0; shape_ok && d < param->ndim; d++) {
+        shape_ok = out->shape[d + 1] == param->shape[d];
+    }
+    if(!shape_ok) {
+        fatal("graph_per_sample_grads cannot run: out has to be a contiguous fp32 [N, param shape] tensor");
+    }
+
+    tensor_fill(out, 0.0f);
+
+    size_t cursor = 0;
+    int input = 0;
+    int uses = 0;
+    ParamUse use;
+    while(next_use(order, order_size, param, &cursor, &input, &use)) {
+        check_use(&use, batch);
+        for(int64_t n = 0; n < batch; n++) {
+            accumulate_sample(&use, param, n, 1.0f, out->data + (size_t) n * param_elems);
+        }
+        uses++;
+    }
+
+    if(uses == 0) {
+        fatal("graph_per_sample_grads cannot run: no node of the order reads the parameter");
+    }
+}
+
+void graph_per_sample_sq_norms(Node* const* order, size_t order_size, Tensor* const* params, size_t num_params, int64_t batch, float* sq_norms) {
+    if(!order || !params || !sq_norms) {
+        fatal("graph_per_sample_sq_norms cannot run: input is NULL");
+    }
+
+    memset(sq_norms, 0, (size_t) batch * sizeof(float));
+
+    for(size_t p = 0; p < num_params; p++) {
+        size_t cursor = 0;
+        int input = 0;
+        ParamUse use;
+
+        if(!next_use(order, order_size, params[p], &cursor, &input, &use)) {
+            fatal("graph_per_sample_sq_norms cannot run: no node of the order reads parameter %zu", p);
+        }
+        check_use(&use, batch);
+
+        // A shared parameter's per sample grad is a sum of outer products, whose norm isn't the sum of their norms
+        ParamUse other;
+        if(next_use(order, order_size, params[p], &cursor, &input, &other)) {
+            fatal("graph_per_sample_sq_norms cannot run: parameter %zu is read by more than one node", p);
+        }
+
+        for(int64_t n = 0; n < batch; n++) {
+            sq_norms[n] += sample_sq_norm(&use, n);
+        }
+    }
+}
+
+void graph_per_sample_clip_accumulate(Node* const* order, size_t order_size, Tensor* const* params, size_t num_params, int64_t batch, float clip_norm, float* scale) {
+    if(clip_norm <= 0.0f) {
+        fatal("graph_per_sample_clip_accumulate cannot run: clip_norm has to be > 0, got %f", clip_norm);
+    }
+
+    // Norms over every parameter first, then each sample's grads are added already scaled straight into the batch grads
+    graph_per_sample_sq_norms(order, order_size, params, num_params, batch, scale);
+    for(int64_t n = 0; n < batch; n++) {
+        float norm = sqrtf(scale[n]);
+        scale[n] = (norm > clip_norm)? clip_norm / norm : 1.0f;
+    }
+
+    for(size_t p = 0; p < num_params; p++) {
+        size_t cursor = 0;
+        int input = 0;
+        ParamUse use;
+
+        tensor_fill(params[p]->grad, 0.0f);
+        next_use(order, order_size, params[p], &cursor, &input, &use);
+        for(int64_t n = 0; n < batch; n++) {
+            accumulate_sample(&use, params[p], n, scale[n], params[p]->grad->data);
+        }
+    }
+}
+
+#ifdef PER_SAMPLE_SELFTEST_MAIN
+#include <assert.h>
+
+#define PS_N 6
+#define PS_IN 4
+#define PS_HIDDEN 5
+#define PS_CLASSES 3
+#define PS_NUM_PARAMS 4
+
+// Two linear layers the way layer_forward builds them, x W + expanded b, tanh in between, cross entropy on top
+static Node* build(Graph* graph, Tensor* const* params, const float* x_rows, const int32_t* labels_rows, int64_t rows) {
+    const int64_t x_shape[2] = { rows, PS_IN }, l_shape[1] = { rows };
+    const int64_t h_shape[2] = { rows, PS_HIDDEN }, o_shape[2] = { rows, PS_CLASSES };
+    Tensor* x = tensor_new(graph->arena, 2, x_shape);
+    Tensor* labels = tensor_new_dtype(graph->arena, 1, l_shape, DTYPE_I32);
+    memcpy(x->data, x_rows, total_elems(x) * sizeof(float));
+    memcpy(labels->data_i32, labels_rows, (size_t) rows * sizeof(int32_t));
+
+    Node* mm1_in[2] = { graph_add_input(graph, x), graph_add_input(graph, params[0]) };
+    Node* mm1 = add_node(graph, OP_MATMUL, 2, mm1_in);
+    Node* z1_in[2] = { mm1, graph_add_input(graph, tensor_expand(graph->arena, params[1], 2, h_shape)) };
+    Node* z1 = add_node(graph, OP_ADD, 2, z1_in);
+    Node* h_in[1] = { z1 };
+    Node* h = add_node(graph, OP_TANH, 1, h_in);
+    Node* mm2_in[2] = { h, graph_add_input(graph, params[2]) };
+    Node* mm2 = add_node(graph, OP_MATMUL, 2, mm2_in);
+    Node* z2_in[2] = { graph_add_input(graph, tensor_expand(graph->arena, params[3], 2, o_shape)), mm2 };
+    Node* z2 = add_node(graph, OP_ADD, 2, z2_in);
+    Node* ce_in[2] = { z2, graph_add_input(graph, labels) };
+    return add_node(graph, OP_SOFTMAX_CROSS_ENTROPY, 2, ce_in);
+}
+
+static void backward(Arena* scratch, Tensor* const* params, const float* x, const int32_t* labels, int64_t rows, Node*** order, size_t* order_n) {
+    Graph graph;
+    graph_init(&graph, scratch);
+    for(int p = 0; p < PS_NUM_PARAMS; p++) tensor_fill(params[p]->grad, 0.0f);
+
+    Node* loss = build(&graph, params, x, labels, rows);
+    topological_sort(&graph, order, order_n);
+    graph_forward_pass(*order, *order_n);
+    graph_backward_pass(&graph, *order, *order_n, loss->out);
+}
+
+int main(void) {
+    Arena arena, scratch;
+    arena_init(&arena, 1 << 18);
+    arena_init(&scratch, 1 << 18);
+
+    const int64_t shapes[PS_NUM_PARAMS][2] = { { PS_IN, PS_HIDDEN }, { 1, PS_HIDDEN }, { PS_HIDDEN, PS_CLASSES }, { 1, PS_CLASSES } };
+    Tensor* params[PS_NUM_PARAMS];
+    Tensor* per_sample[PS_NUM_PARAMS];
+    Tensor* reference[PS_NUM_PARAMS];
+    Tensor* batch_grad[PS_NUM_PARAMS];
+
+    for(int p = 0; p < PS_NUM_PARAMS; p++) {
+        const int64_t ps_shape[3] = { PS_N, shapes[p][0], shapes[p][1] };
+        params[p] = tensor_new(&arena, 2, shapes[p]);
+        params[p]->grad = tensor_zeroes_like(&arena, params[p]);
+        per_sample[p] = tensor_new(&arena, 3, ps_shape);
+        reference[p] = tensor_new(&arena, 3, ps_shape);
+        batch_grad[p] = tensor_new(&arena, 2, shapes[p]);
+        for(size_t i = 0; i < total_elems(params[p]); i++) params[p]->data[i] = 0.6f * sinf(1.3f * (float) i + (float) p);
+    }
+
+    float x[PS_N * PS_IN];
+    int32_t labels[PS_N];
+    for(int i = 0; i < PS_N * PS_IN; i++) x[i] = 2.0f * cosf(0.9f * (float) i);
+    for(int n = 0; n < PS_N; n++) labels[n] = (n * 2) % PS_CLASSES;
+
+    // Reference: one backward per sample, scaled by 1/N since the batch loss is a mean
+    Node** order = NULL;
+    size_t order_n = 0;
+    for(int n = 0; n < PS_N; n++) {
+        backward(&scratch, params, x + n * PS_IN, labels + n, 1, &order, &order_n);
+        for(int p = 0; p < PS_NUM_PARAMS; p++) {
+            size_t elems = total_elems(params[p]);
+            for(size_t i = 0; i < elems; i++) reference[p]->data[n * elems + i] = params[p]->grad->data[i] / PS_N;
+        }
+        arena_reset(&scratch);
+    }
+
+    backward(&scratch, params, x, labels, PS_N, &order, &order_n);
+    float ref_norms[PS_N] = { 0 };
+    for(int p = 0; p < PS_NUM_PARAMS; p++) {
+        size_t elems = total_elems(params[p]);
+        memcpy(batch_grad[p]->data, params[p]->grad->data, elems * sizeof(float));
+        graph_per_sample_grads(order, order_n, params[p], per_sample[p]);
+
+        for(size_t i = 0; i < elems; i++) {
+            float sum = 0.0f;
+            for(int n = 0; n < PS_N; n++) {
+                float got = per_sample[p]->data[n * elems + i];
+                assert(fabsf(got - reference[p]->data[n * elems + i]) < 1e-6f);
+                ref_norms[n] += got * got;
+                sum += got;
+            }
+            assert(fabsf(sum - batch_grad[p]->data[i]) < 1e-6f);
+        }
+    }
+
+    // Norms without the outer products
+    float norms[PS_N];
+    graph_per_sample_sq_norms(order, order_n, params, PS_NUM_PARAMS, PS_N, norms);
+    for(int n = 0; n < PS_N; n++) assert(fabsf(norms[n] - ref_norms[n]) < 1e-5f * (1.0f + ref_norms[n]));
+
+    // Clip at one of the sample norms so some samples are scaled and some are not
+    const float clip = sqrtf(ref_norms[PS_N / 2]);
+    float scale[PS_N];
+    int clipped = 0;
+    graph_per_sample_clip_accumulate(order, order_n, params, PS_NUM_PARAMS, PS_N, clip, scale);
+    for(int p = 0; p < PS_NUM_PARAMS; p++) {
+        size_t elems = total_elems(params[p]);
+        for(size_t i = 0; i < elems; i++) {
+            float want = 0.0f;
+            for(int n = 0; n < PS_N; n++) {
+                float norm = sqrtf(ref_norms[n]);
+                want += per_sample[p]->data[n * elems + i] * (norm > clip? clip / norm : 1.0f);
+            }
+            assert(fabsf(params[p]->grad->data[i] - want) < 1e-6f);
+        }
+    }
+    for(int n = 0; n < PS_N; n++) clipped += scale[n] < 1.0f;
+    assert(clipped > 0 && clipped < PS_N);
+
+    printf("per sample grads match %d single sample backwards, %d of %d clipped to %.4f, selftest passed\n", PS_N, clipped, PS_N, clip);
+    arena_free(&scratch);
+    arena_free(&arena);
+    return 0;
+}
+#endif
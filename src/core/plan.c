@@ -0,0 +1,254 @@
+#include "graph.h"
+#include "jit.h"
+
+static int is_flat(const Tensor* tensor, size_t n) {
+    return tensor->dtype == DTYPE_F32 && tensor->is_contiguous && total_elems(tensor) == n;
+}
+
+// [1, cols] expanded over the rows of out, what layer_forward makes of the bias
+static int is_row_broadcast(const Tensor* tensor, const Tensor* out) {
+    return tensor->dtype == DTYPE_F32 && tensor->ndim == 2 && out->ndim == 2
+        && tensor->shape[0] == out->shape[0] && tensor->shape[1] == out->shape[1]
+        && tensor->stride[0] == 0 && tensor->stride[1] == 1;
+}
+
+static int resolve_step(PlanStep* step) {
+    Node* node = step->node;
+    const OpKernel* k = get_opkernel(node->operation);
+
+    if(!k || !k->forward || !k->backward) {
+        fatal("exec_plan_build cannot run: missing kernel for op %d", (int) node->operation);
+    }
+
+    const Tensor* out = node->out;
+    step->forward = node_forward_fn(node, k);
+    step->backward = node_backward_fn(node, k);
+    step->n = total_elems(out);
+    step->cols = (out->ndim == 2)? out->shape[1] : 0;
+    step->out = out->data;
+    step->gout = out->grad? out->grad->data : NULL;
+
+    int flat = k->flat_forward && node->n_input <= 2 && is_flat(out, step->n);
+    int flat_grads = out->grad && is_flat(out->grad, step->n);
+    int has_grads = out->grad != NULL;
+
+    for(int j = 0; j < 2; j++) {
+        step->in[j] = NULL;
+        step->gin[j] = NULL;
+        step->bcast[j] = 0;
+    }
+
+    for(int j = 0; j < node->n_input && j < 2; j++) {
+        const Tensor* in = node->inputs[j]->out;
+
+        step->in[j] = in->data;
+        if(!is_flat(in, step->n)) {
+            step->bcast[j] = k->flat_row_broadcast && is_row_broadcast(in, out);
+            flat = flat && step->bcast[j];
+        }
+
+        if(!in->grad) {
+            has_grads = has_grads && (!tensor_is_differentiable(in) || in->sparse_grad);
+            flat_grads = 0;
+            continue;
+        }
+
+        step->gin[j] = in->grad->data;
+        flat_grads = flat_grads && (step->bcast[j]? is_row_broadcast(in->grad, out) : is_flat(in->grad, step->n));
+    }
+
+    step->flat_forward = flat? k->flat_forward : NULL;
+    step->flat_backward = (flat && flat_grads)? k->flat_backward : NULL;
+
+    return has_grads;
+}
+
+void exec_plan_refresh(ExecPlan* plan) {
+    plan->num_flat = 0;
+    plan->has_grads = 1;
+
+    for(size_t i = 0; i < plan->num_steps; i++) {
+        plan->has_grads &= resolve_step(&plan->steps[i]);
+        plan->num_flat += plan->steps[i].flat_forward != NULL;
+    }
+
+    if(plan->jit) {
+        jit_free(plan->jit);
+        plan->jit = jit_compile_forward(plan);
+    }
+}
+
+void exec_plan_build(ExecPlan* plan, Arena* arena, Node* const* order, size_t order_size) {
+    if(!plan || !arena || (!order && order_size != 0)) {
+        fatal("exec_plan_build cannot run: input is NULL");
+    }
+
+    size_t num_ops = 0;
+    for(size_t i = 0; i < order_size; i++) {
+        num_ops += order[i]->operation != OP_INPUT;
+    }
+
+    plan->steps = arena_alloc(arena, (num_ops + 1) * sizeof(PlanStep), alignof(PlanStep));
+    plan->num_steps = 0;
+    plan->jit = NULL;
+
+    for(size_t i = 0; i < order_size; i++) {
+        if(order[i]->operation != OP_INPUT) {
+            plan->steps[plan->num_steps++].node = order[i];
+        }
+    }
+
+    exec_plan_refresh(plan);
+}
+
+int exec_plan_enable_jit(ExecPlan* plan) {
+    if(!plan) {
+        fatal("exec_plan_enable_jit cannot run: input is NULL");
+    }
+
+    exec_plan_disable_jit(plan);
+    plan->jit = jit_compile_forward(plan);
+    return plan->jit != NULL;
+}
+
+void exec_plan_disable_jit(ExecPlan* plan) {
+    jit_free(plan->jit);
+    plan->jit = NULL;
+}
+
+void exec_plan_forward(const ExecPlan* plan) {
+    if(plan->jit) {
+        jit_run_forward(plan->jit);
+        return;
+    }
+
+    const PlanStep* step = plan->steps;
+    const PlanStep* end = step + plan->num_steps;
+
+    for(; step < end; step++) {
+        if(step->flat_forward) step->flat_forward(step);
+        else step->forward(step->node);
+    }
+}
+
+void exec_plan_backward(const ExecPlan* plan, Tensor* loss) {
+    if(!plan->has_grads) {
+        fatal("exec_plan_backward cannot run: the plan was built before the grads were allocated");
+    }
+    if(!loss || !loss->grad || total_elems(loss) != 1) {
+        fatal("exec_plan_backward cannot run: loss must be a scalar with a grad");
+    }
+
+    loss->grad->data[0] = 1.0f;
+
+    for(size_t i = plan->num_steps; i-- > 0; ) {
+        const PlanStep* step = &plan->steps[i];
+
+        if(step->flat_backward) step->flat_backward(step);
+        else step->backward(step->node);
+    }
+}
+
+#ifdef PLAN_SELFTEST_MAIN
+#include <assert.h>
+#include <math.h>
+
+#define PLAN_ROWS 5
+#define PLAN_COLS 6
+
+// Covers the flat path (the bias add, mul, relu) and the node path (matmul, sub on a transposed operand)
+static Node* build(Graph* graph, Tensor* x, Tensor* w, Tensor* b, Tensor* ones, Tensor** leaves) {
+    const int64_t b_shape[2] = { PLAN_ROWS, PLAN_COLS };
+    Node* xn = graph_add_input(graph, x);
+    Node* mm_in[2] = { xn, graph_add_input(graph, w) };
+    Node* mm = add_node(graph, OP_MATMUL, 2, mm_in);
+    Node* add_in[2] = { mm, graph_add_input(graph, tensor_expand(graph->arena, b, 2, b_shape)) };
+    Node* add = add_node(graph, OP_ADD, 2, add_in);
+    Node* mul_in[2] = { add, xn };
+    Node* mul = add_node(graph, OP_MUL, 2, mul_in);
+    Node* sub_in[2] = { mul, graph_add_input(graph, tensor_transpose(graph->arena, leaves[0], 0, 1)) };
+    Node* sub = add_node(graph, OP_SUB, 2, sub_in);
+    Node* act_in[1] = { sub };
+    Node* act = add_node(graph, OP_RELU, 1, act_in);
+    Node* red_in[2] = { graph_add_input(graph, ones), act };
+    Node* red = add_node(graph, OP_MATMUL, 2, red_in);
+    Node* sum_in[2] = { red, graph_add_input(graph, leaves[1]) };
+    return add_node(graph, OP_MATMUL, 2, sum_in);
+}
+
+static float run(int use_plan, Tensor* w, Tensor* b, float* gw, float* gb) {
+    Arena scratch;
+    arena_init(&scratch, 1 << 18);
+    Graph graph;
+    graph_init(&graph, &scratch);
+
+    const int64_t x_shape[2] = { PLAN_ROWS, PLAN_COLS }, t_shape[2] = { PLAN_COLS, PLAN_ROWS };
+    const int64_t ones_shape[2] = { 1, PLAN_ROWS }, col_shape[2] = { PLAN_COLS, 1 };
+    Tensor* x = tensor_new(&scratch, 2, x_shape);
+    Tensor* leaves[2] = { tensor_new(&scratch, 2, t_shape), tensor_new(&scratch, 2, col_shape) };
+    Tensor* ones = tensor_new(&scratch, 2, ones_shape);
+    for(size_t i = 0; i < total_elems(x); i++) x->data[i] = sinf((float) i);
+    for(size_t i = 0; i < total_elems(leaves[0]); i++) leaves[0]->data[i] = 0.3f * cosf((float) i);
+    tensor_fill(leaves[1], 1.0f);
+    tensor_fill(ones, 1.0f);
+    // The transposed view carries a grad view, so the base needs its grad before the view is made
+    leaves[0]->grad = tensor_zeroes_like(&scratch, leaves[0]);
+
+    Node* loss = build(&graph, x, w, b, ones, leaves);
+    Node** order = NULL;
+    size_t order_n = 0;
+    topological_sort(&graph, &order, &order_n);
+
+    if(use_plan) {
+        for(size_t i = 0; i < order_n; i++) {
+            graph_ensure_grad(&graph, order[i]->out);
+        }
+
+        ExecPlan plan;
+        exec_plan_build(&plan, &scratch, order, order_n);
+        // The matmuls and the sub with the transposed operand take the node path, the add, mul and relu run flat
+        assert(plan.num_steps == 7 && plan.num_flat == 3);
+        assert(plan.has_grads);
+        exec_plan_forward(&plan);
+        exec_plan_backward(&plan, loss->out);
+    }
+    else {
+        graph_forward_pass(order, order_n);
+        graph_backward_pass(&graph, order, order_n, loss->out);
+    }
+
+    float value = loss->out->data[0];
+    memcpy(gw, w->grad->data, total_elems(w) * sizeof(float));
+    memcpy(gb, b->grad->data, total_elems(b) * sizeof(float));
+    tensor_fill(w->grad, 0.0f);
+    tensor_fill(b->grad, 0.0f);
+    arena_free(&scratch);
+
+    return value;
+}
+
+int main(void) {
+    Arena params;
+    arena_init(&params, 1 << 16);
+
+    const int64_t w_shape[2] = { PLAN_COLS, PLAN_COLS }, b_shape[2] = { 1, PLAN_COLS };
+    Tensor* w = tensor_new(&params, 2, w_shape);
+    Tensor* b = tensor_new(&params, 2, b_shape);
+    for(size_t i = 0; i < total_elems(w); i++) w->data[i] = 0.2f * cosf((float) (3 * i));
+    for(size_t i = 0; i < total_elems(b); i++) b->data[i] = 0.1f * (float) i - 0.2f;
+    w->grad = tensor_zeroes_like(&params, w);
+    b->grad = tensor_zeroes_like(&params, b);
+
+    float gw_ref[PLAN_COLS * PLAN_COLS], gb_ref[PLAN_COLS], gw[PLAN_COLS * PLAN_COLS], gb[PLAN_COLS];
+    float ref = run(0, w, b, gw_ref, gb_ref);
+    float got = run(1, w, b, gw, gb);
+
+    assert(fabsf(ref - got) < 1e-5f);
+    for(int i = 0; i < PLAN_COLS * PLAN_COLS; i++) assert(fabsf(gw_ref[i] - gw[i]) < 1e-5f);
+    for(int i = 0; i < PLAN_COLS; i++) assert(fabsf(gb_ref[i] - gb[i]) < 1e-5f);
+
+    printf("exec plan: loss %.6f matches the node walk, selftest passed\n", got);
+    arena_free(&params);
+    return 0;
+}
+#endif
@@ -1,4 +1,6 @@
 #include "probhelper.h"
+#include "fastmath.h"
+#include "parallel.h"
 
 /*XORShift is just a fast (but weak) PRNG that is a subset of LFSRs. Deterministic and not truly random,. 
   Returns a 32 bit int */
@@ -64,4 +66,280 @@ float rand_normal(uint32_t* state, float mean, float std) {
     float z = r * cosf(theta);
 
     return mean + std * z;
-}
\ No newline at end of file
+}
+
+// Philox4x32-10, constants from Random123
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+// Blocks per philox_block4 call, 16 outputs
+#define PHILOX_LANES 4
+
+// Top 24 bits onto [0, 1) and (0, 1], the latter for the log in Box-Muller
+#define U24_SCALE (1.0f / 16777216.0f)
+// fill_uniform and fill_normal hand chunks of this many outputs to parallel_for, under 2 of them they stay inline
+#define FILL_CHUNK 16384
+
+typedef uint64_t u64x4 __attribute__((vector_size(32)));
+
+void philox_init(Philox* rng, uint64_t seed, uint64_t stream) {
+    rng->key[0] = (uint32_t) seed;
+    rng->key[1] = (uint32_t) (seed >> 32);
+    rng->stream = stream;
+    rng->offset = 0;
+}
+
+// One round: two 32x32 -> 64 multiplies, the high halves mixed with the other words and the round key
+void philox_block(const Philox* rng, uint64_t block, uint32_t out[4]) {
+    uint32_t x0 = (uint32_t) block, x1 = (uint32_t) (block >> 32);
+    uint32_t x2 = (uint32_t) rng->stream, x3 = (uint32_t) (rng->stream >> 32);
+    uint32_t k0 = rng->key[0], k1 = rng->key[1];
+
+    for(int r = 0; r < PHILOX_ROUNDS; r++) {
+        uint64_t p0 = (uint64_t) PHILOX_M0 * x0;
+        uint64_t p1 = (uint64_t) PHILOX_M1 * x2;
+
+        x0 = (uint32_t) (p1 >> 32) ^ x1 ^ k0;
+        x1 = (uint32_t) p1;
+        x2 = (uint32_t) (p0 >> 32) ^ x3 ^ k1;
+        x3 = (uint32_t) p0;
+
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    out[0] = x0;
+    out[1] = x1;
+    out[2] = x2;
+    out[3] = x3;
+}
+
+/* Same rounds on 4 consecutive blocks at once, one block per 64 bit lane. Every lane value stays below 2^32 so the
+   lane multiply is exactly the 32x32 -> 64 product (pmuludq / vpmuludq) */
+static void philox_block4(const Philox* rng, uint64_t block, uint32_t out[4 * PHILOX_LANES]) {
+    const uint64_t lo_mask = 0xFFFFFFFFu;
+    u64x4 ctr = { block, block + 1, block + 2, block + 3 };
+
+    u64x4 x0 = ctr & lo_mask;
+    u64x4 x1 = ctr >> 32;
+    u64x4 x2 = (u64x4) { 0, 0, 0, 0 } + (rng->stream & lo_mask);
+    u64x4 x3 = (u64x4) { 0, 0, 0, 0 } + (rng->stream >> 32);
+    uint32_t k0 = rng->key[0], k1 = rng->key[1];
+
+    for(int r = 0; r < PHILOX_ROUNDS; r++) {
+        u64x4 p0 = x0 * PHILOX_M0;
+        u64x4 p1 = x2 * PHILOX_M1;
+
+        x0 = (p1 >> 32) ^ x1 ^ k0;
+        x1 = p1 & lo_mask;
+        x2 = (p0 >> 32) ^ x3 ^ k1;
+        x3 = p0 & lo_mask;
+
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    for(int b = 0; b < PHILOX_LANES; b++) {
+        out[4 * b + 0] = (uint32_t) x0[b];
+        out[4 * b + 1] = (uint32_t) x1[b];
+        out[4 * b + 2] = (uint32_t) x2[b];
+        out[4 * b + 3] = (uint32_t) x3[b];
+    }
+}
+
+void fill_uniform_at(const Philox* rng, float* dst, uint64_t first, size_t n, float low, float high) {
+    uint32_t buf[4 * PHILOX_LANES];
+    const float scale = (high - low) * U24_SCALE;
+    size_t done = 0;
+
+    while(done < n) {
+        uint64_t idx = first + done;
+        size_t skip = (size_t) (idx % 4);
+        size_t take = 4 * PHILOX_LANES - skip;
+        take = (take < n - done)? take : n - done;
+
+        philox_block4(rng, idx / 4, buf);
+        for(size_t j = 0; j < take; j++) {
+            dst[done + j] = low + (float) (buf[skip + j] >> 8) * scale;
+        }
+
+        done += take;
+    }
+}
+
+void fill_normal_at(const Philox* rng, float* dst, uint64_t first, size_t n, float mean, float std) {
+    uint32_t buf[4 * PHILOX_LANES];
+    size_t done = 0;
+
+    while(done < n) {
+        uint64_t idx = first + done;
+        size_t skip = (size_t) (idx % 4);
+        size_t take = 4 * PHILOX_LANES - skip;
+        take = (take < n - done)? take : n - done;
+
+        philox_block4(rng, idx / 4, buf);
+
+        // The 16 outputs are exactly 8 pairs, one vector of radii and one of angles (in turns)
+        f32x8 r, turn, sin_t, cos_t;
+        for(int p = 0; p < V8_WIDTH; p++) {
+            r[p] = (float) ((buf[2 * p] >> 8) + 1) * U24_SCALE;
+            turn[p] = (float) (buf[2 * p + 1] >> 8) * U24_SCALE;
+        }
+        v8_log(&r);
+        r *= -2.0f;
+        v8_sqrt(&r);
+        r *= std;
+        v8_sincos_turn(&turn, &sin_t, &cos_t);
+        f32x8 z0 = mean + r * cos_t;
+        f32x8 z1 = mean + r * sin_t;
+
+        // Pairs start on even indices, a range starting or ending mid pair only writes its half
+        for(size_t pos = skip & ~(size_t) 1; pos < skip + take; pos += 2) {
+            if(pos >= skip) dst[done + pos - skip] = z0[pos / 2];
+            if(pos + 1 < skip + take) dst[done + pos + 1 - skip] = z1[pos / 2];
+        }
+
+        done += take;
+    }
+}
+
+typedef void (*FillAtFn)(const Philox* rng, float* dst, uint64_t first, size_t n, float a, float b);
+
+typedef struct {
+    FillAtFn fill;
+    const Philox* rng;
+    float* dst;
+    uint64_t first;
+    size_t n;
+    float a;
+    float b;
+} FillJob;
+
+static void fill_chunks(void* ctx, size_t begin, size_t end) {
+    const FillJob* job = ctx;
+    size_t lo = begin * FILL_CHUNK;
+    size_t hi = end * FILL_CHUNK < job->n? end * FILL_CHUNK : job->n;
+
+    job->fill(job->rng, job->dst + lo, job->first + lo, hi - lo, job->a, job->b);
+}
+
+// Every chunk is a *_at call on its own range, so the bits don't depend on how many threads took part
+static void fill_split(FillAtFn fill, Philox* rng, float* dst, size_t n, float a, float b) {
+    FillJob job = { fill, rng, dst, rng->offset, n, a, b };
+
+    parallel_for((n + FILL_CHUNK - 1) / FILL_CHUNK, 1, fill_chunks, &job);
+    rng->offset += n;
+}
+
+void fill_uniform(Philox* rng, float* dst, size_t n, float low, float high) {
+    fill_split(fill_uniform_at, rng, dst, n, low, high);
+}
+
+void fill_normal(Philox* rng, float* dst, size_t n, float mean, float std) {
+    fill_split(fill_normal_at, rng, dst, n, mean, std);
+}
+
+#ifdef PROBHELPER_SELFTEST_MAIN
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PH_N 1000003
+
+int main(void) {
+    // Known answers from the Random123 kat_vectors, key = seed, counter = (block, stream)
+    const struct { uint64_t seed; uint64_t block; uint64_t stream; uint32_t expect[4]; } kat[3] = {
+        { 0, 0, 0, { 0x6627e8d5u, 0xe169c58du, 0xbc57ac4cu, 0x9b00dbd8u } },
+        { 0xffffffffffffffffull, 0xffffffffffffffffull, 0xffffffffffffffffull, { 0x408f276du, 0x41c83b0eu, 0xa20bc7c6u, 0x6d5451fdu } },
+        { 0x299f31d0a4093822ull, 0x85a308d3243f6a88ull, 0x0370734413198a2eull, { 0xd16cfe09u, 0x94fdccebu, 0x5001e420u, 0x24126ea1u } },
+    };
+
+    for(int t = 0; t < 3; t++) {
+        Philox rng;
+        philox_init(&rng, kat[t].seed, kat[t].stream);
+
+        uint32_t out[4], out4[16];
+        philox_block(&rng, kat[t].block, out);
+        philox_block4(&rng, kat[t].block, out4);
+        assert(memcmp(out, kat[t].expect, sizeof(out)) == 0);
+        assert(memcmp(out4, kat[t].expect, sizeof(out)) == 0);
+    }
+
+    float* whole = malloc(PH_N * sizeof(float));
+    float* split = malloc(PH_N * sizeof(float));
+    assert(whole && split);
+
+    Philox rng;
+    philox_init(&rng, 42, 7);
+
+    // One sequential fill vs the same range cut into uneven, odd aligned chunks the way threads would get it
+    const size_t cuts[5] = { 0, 1, 333335, 700002, PH_N };
+    for(int dist = 0; dist < 2; dist++) {
+        rng.offset = 0;
+        if(dist == 0) fill_uniform(&rng, whole, PH_N, -2.0f, 3.0f);
+        else fill_normal(&rng, whole, PH_N, 1.0f, 2.0f);
+        assert(rng.offset == PH_N);
+
+        for(int c = 0; c < 4; c++) {
+            size_t len = cuts[c + 1] - cuts[c];
+            if(dist == 0) fill_uniform_at(&rng, split + cuts[c], cuts[c], len, -2.0f, 3.0f);
+            else fill_normal_at(&rng, split + cuts[c], cuts[c], len, 1.0f, 2.0f);
+        }
+        assert(memcmp(whole, split, PH_N * sizeof(float)) == 0);
+
+        double sum = 0.0, sq = 0.0;
+        for(size_t i = 0; i < PH_N; i++) {
+            if(dist == 0) assert(whole[i] >= -2.0f && whole[i] < 3.0f);
+            sum += whole[i];
+            sq += (double) whole[i] * whole[i];
+        }
+        double mean = sum / PH_N;
+        double var = sq / PH_N - mean * mean;
+
+        // U(-2, 3): mean 0.5, var 25/12. N(1, 4)
+        if(dist == 0) assert(fabs(mean - 0.5) < 0.01 && fabs(var - 25.0 / 12.0) < 0.02);
+        else assert(fabs(mean - 1.0) < 0.01 && fabs(var - 4.0) < 0.03);
+        printf("philox %s: mean %.4f var %.4f, split fill identical\n", dist == 0? "uniform" : "normal", mean, var);
+    }
+
+    // The vector Box-Muller against libm in double on the same uniforms, errors in units of std
+    double max_err = 0.0;
+    for(size_t i = 0; i + 1 < PH_N; i += 2) {
+        uint32_t out[4];
+        philox_block(&rng, i / 4, out);
+        double u1 = (double) ((out[i % 4] >> 8) + 1) * U24_SCALE;
+        double u2 = (double) (out[i % 4 + 1] >> 8) * U24_SCALE;
+        double r = sqrt(-2.0 * log(u1));
+        double e0 = fabs(1.0 + 2.0 * r * cos(2.0 * PI * u2) - whole[i]) / 2.0;
+        double e1 = fabs(1.0 + 2.0 * r * sin(2.0 * PI * u2) - whole[i + 1]) / 2.0;
+
+        max_err = e0 > max_err? e0 : max_err;
+        max_err = e1 > max_err? e1 : max_err;
+    }
+    assert(max_err < 2e-6);
+
+    // Big fills go through parallel_for, any thread count has to give the same bits
+    for(int threads = 1; threads <= 3; threads += 2) {
+        parallel_set_threads(threads);
+        rng.offset = 0;
+        fill_normal(&rng, split, PH_N, 1.0f, 2.0f);
+        assert(memcmp(whole, split, PH_N * sizeof(float)) == 0);
+    }
+    parallel_set_threads(0);
+    printf("normal max error %.2e std vs libm in double, same bits on 1 and 3 threads\n", max_err);
+
+    // Different streams of one seed must not overlap
+    Philox other;
+    philox_init(&other, 42, 8);
+    fill_uniform(&other, split, 16, -2.0f, 3.0f);
+    assert(memcmp(whole, split, 16 * sizeof(float)) != 0);
+
+    printf("probhelper selftest passed\n");
+    free(whole);
+    free(split);
+    return 0;
+}
+#endif
@@ -47,6 +47,19 @@ size_t total_elems(const Tensor* tensor) {
 }
 
 Tensor* tensor_new(Arena* arena, int ndim, const int64_t* shape) {
+    return tensor_new_dtype(arena, ndim, shape, DTYPE_F32);
+}
+
+Tensor* tensor_new_dtype(Arena* arena, int ndim, const int64_t* shape, DType dtype) {
+    Tensor* tensor = tensor_new_header(arena, ndim, shape, dtype);
+
+    size_t n = total_elems(tensor);
+    tensor->data = (float*) arena_alloc(arena, n * dtype_size(dtype), alignof(float));
+
+    return tensor;
+}
+
+Tensor* tensor_new_header(Arena* arena, int ndim, const int64_t* shape, DType dtype) {
     if(!arena) {
         fatal("tensor_new cannot run: arena is NULL");
     }
@@ -58,6 +71,7 @@ Tensor* tensor_new(Arena* arena, int ndim, const int64_t* shape) {
     memset(tensor, 0, sizeof(Tensor));
 
     tensor->ndim = ndim;
+    tensor->dtype = dtype;
 
     if(ndim > 0) {
         memcpy(tensor->shape, shape, (size_t) ndim * sizeof(int64_t));
@@ -65,9 +79,13 @@ Tensor* tensor_new(Arena* arena, int ndim, const int64_t* shape) {
 
     compute_rowmajor_strides(tensor);
 
-    size_t n = total_elems(tensor);
-    tensor->data = (float*) arena_alloc(arena, n * sizeof(float), alignof(float));
+    tensor->data = NULL;
     tensor->grad = NULL;
+    tensor->tangent = NULL;
+    tensor->base = NULL;
+    tensor->is_contiguous = 1;
+    tensor->csr = NULL;
+    tensor->sparse_grad = NULL;
 
     return tensor;
 }
@@ -78,6 +96,24 @@ void tensor_fill(Tensor* tensor, float value) {
     }
 
     size_t n = total_elems(tensor);
+
+    if(tensor->dtype == DTYPE_I32) {
+        for(size_t i = 0; i < n; i++) {
+            tensor->data_i32[i] = (int32_t) value;
+        }
+
+        return;
+    }
+
+    if(tensor->dtype != DTYPE_F32) {
+        uint16_t bits = (tensor->dtype == DTYPE_BF16)? f32_to_bf16(value) : f32_to_f16(value);
+
+        for(size_t i = 0; i < n; i++) {
+            tensor->data16[i] = bits;
+        }
+
+        return;
+    }
     
     for(size_t i = 0; i < n; i++) {
         tensor->data[i] = value;
@@ -89,15 +125,101 @@ Tensor* tensor_zeroes_like(Arena* arena, const Tensor* like) {
         return NULL;
     }
 
+    // Always fp32 whatever the dtype of like, since this is what the grads are allocated with
     Tensor* new_tensor = tensor_new(arena, like->ndim, like->shape);
     tensor_fill(new_tensor, 0.0f);
 
     return new_tensor;
 }
 
+Tensor* tensor_new_csr(Arena* arena, int64_t rows, int64_t cols, int64_t nnz) {
+    if(!arena || rows < 0 || cols < 0 || nnz < 0 || nnz > INT32_MAX) {
+        fatal("tensor_new_csr cannot run: arena is NULL or bad sizes %lld x %lld with %lld nonzeros", (long long) rows, (long long) cols, (long long) nnz);
+    }
+
+    const int64_t shape[2] = { rows, cols };
+    Tensor* tensor = tensor_new_header(arena, 2, shape, DTYPE_F32);
+    CsrIndex* csr = arena_alloc(arena, sizeof(CsrIndex), alignof(CsrIndex));
+
+    csr->nnz = nnz;
+    csr->row_ptr = arena_alloc(arena, (size_t) (rows + 1) * sizeof(int32_t), alignof(int32_t));
+    csr->col_idx = arena_alloc(arena, (size_t) (nnz > 0? nnz : 1) * sizeof(int32_t), alignof(int32_t));
+    tensor->data = arena_alloc(arena, (size_t) (nnz > 0? nnz : 1) * sizeof(float), 64);
+    // Never dense, so nothing takes the flat data[i] paths on it
+    tensor->is_contiguous = 0;
+    tensor->csr = csr;
+    csr->row_ptr[0] = 0;
+
+    return tensor;
+}
+
+Tensor* tensor_csr_copy(Arena* arena, const Tensor* src) {
+    if(!src || !src->csr) {
+        fatal("tensor_csr_copy cannot run: src is NULL or not sparse");
+    }
+
+    Tensor* copy = tensor_new_csr(arena, src->shape[0], src->shape[1], src->csr->nnz);
+    CsrIndex* csr = (CsrIndex*) copy->csr;
+    memcpy(csr->row_ptr, src->csr->row_ptr, (size_t) (src->shape[0] + 1) * sizeof(int32_t));
+    memcpy(csr->col_idx, src->csr->col_idx, (size_t) src->csr->nnz * sizeof(int32_t));
+    memcpy(copy->data, src->data, (size_t) src->csr->nnz * sizeof(float));
+
+    return copy;
+}
+
+void tensor_attach_sparse_grad(Arena* arena, Tensor* table, int64_t capacity) {
+    if(!arena || !table || table->ndim != 2 || table->dtype != DTYPE_F32 || table->base || capacity <= 0) {
+        fatal("tensor_attach_sparse_grad cannot run: needs an owning fp32 [vocab, dim] table and capacity > 0");
+    }
+
+    const int64_t vocab = table->shape[0];
+    const int64_t dim = table->shape[1];
+    capacity = capacity < vocab? capacity : vocab;
+
+    RowSparseGrad* grad = arena_alloc(arena, sizeof(RowSparseGrad), alignof(RowSparseGrad));
+    grad->vocab = vocab;
+    grad->dim = dim;
+    grad->num_rows = 0;
+    grad->capacity = capacity;
+    grad->rows = arena_alloc(arena, (size_t) capacity * sizeof(int32_t), alignof(int32_t));
+    grad->values = arena_alloc(arena, (size_t) (capacity * dim) * sizeof(float), 64);
+    // The one vocab sized array, 4 bytes a row and only ever set once
+    grad->slot = arena_alloc(arena, (size_t) vocab * sizeof(int32_t), alignof(int32_t));
+    memset(grad->slot, 0xff, (size_t) vocab * sizeof(int32_t));
+
+    table->sparse_grad = grad;
+}
+
+float* row_sparse_grad_row(RowSparseGrad* grad, int32_t row) {
+    if(row < 0 || row >= grad->vocab) {
+        fatal("row_sparse_grad_row cannot run: row %d outside [0, %lld)", row, (long long) grad->vocab);
+    }
+
+    int32_t s = grad->slot[row];
+    if(s < 0) {
+        if(grad->num_rows == grad->capacity) {
+            fatal("row_sparse_grad_row cannot run: more than %lld distinct rows this step, raise the capacity", (long long) grad->capacity);
+        }
+
+        s = (int32_t) grad->num_rows++;
+        grad->slot[row] = s;
+        grad->rows[s] = row;
+        memset(grad->values + (size_t) s * grad->dim, 0, (size_t) grad->dim * sizeof(float));
+    }
+
+    return grad->values + (size_t) s * grad->dim;
+}
+
+void row_sparse_grad_clear(RowSparseGrad* grad) {
+    for(int64_t i = 0; i < grad->num_rows; i++) {
+        grad->slot[grad->rows[i]] = -1;
+    }
+    grad->num_rows = 0;
+}
+
 void print_tensor_recursive(const Tensor* t, int dim, int64_t offset) {
     if (dim == t->ndim) {
-        printf("%g", t->data[offset]);
+        printf("%g", tensor_load(t, (size_t) offset));
         return;
     }
 
@@ -146,7 +268,7 @@ void print_tensor(const Tensor* t) {
     if (!t->data) {
         printf("NULL\n");
     } else if (t->ndim == 0) {
-        printf("%g\n", t->data[0]);
+        printf("%g\n", tensor_load(t, 0));
     } else {
         print_tensor_recursive(t, 0, 0);
         printf("\n");
@@ -155,6 +277,207 @@ void print_tensor(const Tensor* t) {
     printf(")\n");
 }
 
+int tensor_is_contiguous(const Tensor* tensor) {
+    int64_t expected = 1;
+
+    for(int i = tensor->ndim - 1; i >= 0; i--) {
+        // Size 1 dims can carry any stride without changing the memory layout
+        if(tensor->shape[i] != 1 && tensor->stride[i] != expected) {
+            return 0;
+        }
+        expected *= tensor->shape[i];
+    }
+
+    return 1;
+}
+
+void tensor_update_contiguity(Tensor* tensor) {
+    tensor->is_contiguous = tensor_is_contiguous(tensor);
+}
+
+size_t tensor_elem_offset(const Tensor* tensor, size_t linear_idx) {
+    int64_t offset = 0;
+
+    for(int i = tensor->ndim - 1; i >= 0; i--) {
+        int64_t dim = tensor->shape[i];
+        offset += (int64_t)(linear_idx % (size_t) dim) * tensor->stride[i];
+        linear_idx /= (size_t) dim;
+    }
+
+    return (size_t) offset;
+}
+
+// View header shares data with src, the shape/stride tweaks are left to the caller
+static void view_init(Tensor* view, const Tensor* src) {
+    memcpy(view, src, sizeof(Tensor));
+    view->base = src->base? src->base : src;
+    view->grad = NULL;
+    view->tangent = NULL;
+    view->sparse_grad = NULL;
+}
+
+static Tensor* view_alloc(Arena* arena, const Tensor* src, const char* caller) {
+    if(!arena || !src) {
+        fatal("%s cannot run: arena or src is NULL", caller);
+    }
+    if(src->csr) {
+        fatal("%s cannot run: no views of sparse tensors", caller);
+    }
+
+    Tensor* view = (Tensor*) arena_alloc(arena, sizeof(Tensor), alignof(Tensor));
+    view_init(view, src);
+
+    return view;
+}
+
+static void transpose_dims(Tensor* view, int dim0, int dim1) {
+    if(dim0 < 0 || dim0 >= view->ndim || dim1 < 0 || dim1 >= view->ndim) {
+        fatal("tensor_transpose cannot run: dims %d, %d out of range for ndim %d", dim0, dim1, view->ndim);
+    }
+
+    int64_t tmp = view->shape[dim0];
+    view->shape[dim0] = view->shape[dim1];
+    view->shape[dim1] = tmp;
+
+    tmp = view->stride[dim0];
+    view->stride[dim0] = view->stride[dim1];
+    view->stride[dim1] = tmp;
+
+    tensor_update_contiguity(view);
+}
+
+void tensor_transpose_into(Tensor* view, const Tensor* src, int dim0, int dim1) {
+    if(!view || !src) {
+        fatal("tensor_transpose_into cannot run: view or src is NULL");
+    }
+
+    view_init(view, src);
+    transpose_dims(view, dim0, dim1);
+}
+
+Tensor* tensor_transpose(Arena* arena, const Tensor* src, int dim0, int dim1) {
+    Tensor* view = view_alloc(arena, src, "tensor_transpose");
+    transpose_dims(view, dim0, dim1);
+
+    if(src->grad) {
+        view->grad = tensor_transpose(arena, src->grad, dim0, dim1);
+    }
+
+    return view;
+}
+
+Tensor* tensor_permute(Arena* arena, const Tensor* src, const int* perm) {
+    Tensor* view = view_alloc(arena, src, "tensor_permute");
+    int seen[6] = {0};
+
+    for(int i = 0; i < src->ndim; i++) {
+        if(perm[i] < 0 || perm[i] >= src->ndim || seen[perm[i]]) {
+            fatal("tensor_permute cannot run: perm is not a permutation of %d dims", src->ndim);
+        }
+        seen[perm[i]] = 1;
+
+        view->shape[i] = src->shape[perm[i]];
+        view->stride[i] = src->stride[perm[i]];
+    }
+
+    tensor_update_contiguity(view);
+
+    if(src->grad) {
+        view->grad = tensor_permute(arena, src->grad, perm);
+    }
+
+    return view;
+}
+
+Tensor* tensor_reshape(Arena* arena, const Tensor* src, int ndim, const int64_t* shape) {
+    Tensor* view = view_alloc(arena, src, "tensor_reshape");
+
+    if(!src->is_contiguous) {
+        fatal("tensor_reshape cannot run: src is not contiguous");
+    }
+    if(ndim < 0 || ndim > 6) {
+        fatal("tensor_reshape cannot run: tensor ndim is out of range %d < 0 || %d > 6", ndim, ndim);
+    }
+
+    view->ndim = ndim;
+    if(ndim > 0) {
+        memcpy(view->shape, shape, (size_t) ndim * sizeof(int64_t));
+    }
+    compute_rowmajor_strides(view);
+
+    if(total_elems(view) != total_elems(src)) {
+        fatal("tensor_reshape cannot run: %zu elems vs %zu elems", total_elems(view), total_elems(src));
+    }
+    view->is_contiguous = 1;
+
+    if(src->grad) {
+        view->grad = tensor_reshape(arena, src->grad, ndim, shape);
+    }
+
+    return view;
+}
+
+Tensor* tensor_narrow(Arena* arena, const Tensor* src, int dim, int64_t start, int64_t length) {
+    Tensor* view = view_alloc(arena, src, "tensor_narrow");
+
+    if(dim < 0 || dim >= src->ndim) {
+        fatal("tensor_narrow cannot run: dim %d out of range for ndim %d", dim, src->ndim);
+    }
+    if(start < 0 || length < 0 || start + length > src->shape[dim]) {
+        fatal("tensor_narrow cannot run: [%lld, %lld) out of range for dim of size %lld",
+            (long long) start, (long long) (start + length), (long long) src->shape[dim]);
+    }
+
+    // Byte arithmetic so the offset is right for the 16 bit dtypes too
+    view->data = (float*) ((uint8_t*) src->data + (size_t) (start * src->stride[dim]) * dtype_size(src->dtype));
+    view->shape[dim] = length;
+    tensor_update_contiguity(view);
+
+    if(src->grad) {
+        view->grad = tensor_narrow(arena, src->grad, dim, start, length);
+    }
+
+    return view;
+}
+
+Tensor* tensor_expand(Arena* arena, const Tensor* src, int ndim, const int64_t* shape) {
+    Tensor* view = view_alloc(arena, src, "tensor_expand");
+
+    if(ndim < src->ndim || ndim > 6) {
+        fatal("tensor_expand cannot run: cannot expand %d dims to %d dims", src->ndim, ndim);
+    }
+
+    // Align trailing dims like numpy broadcasting, new leading dims get a 0 stride
+    int lead = ndim - src->ndim;
+    view->ndim = ndim;
+
+    for(int i = ndim - 1; i >= 0; i--) {
+        int j = i - lead;
+        int64_t src_dim = (j >= 0)? src->shape[j] : 1;
+        int64_t src_stride = (j >= 0)? src->stride[j] : 0;
+
+        if(src_dim == shape[i]) {
+            view->shape[i] = src_dim;
+            view->stride[i] = src_stride;
+        }
+        else if(src_dim == 1) {
+            view->shape[i] = shape[i];
+            view->stride[i] = 0;
+        }
+        else {
+            fatal("tensor_expand cannot run: dim %d of size %lld cannot expand to %lld", i, (long long) src_dim, (long long) shape[i]);
+        }
+    }
+
+    tensor_update_contiguity(view);
+
+    if(src->grad) {
+        view->grad = tensor_expand(arena, src->grad, ndim, shape);
+    }
+
+    return view;
+}
+
 #ifdef TENSOR_SELFTEST_MAIN
 
 int main(void) {
@@ -172,6 +495,36 @@ int main(void) {
     Tensor* t2 = tensor_zeroes_like(&a, t);
     print_tensor(t2);
 
+    for(size_t i = 0; i < total_elems(t); i++) {
+        t->data[i] = (float) i;
+    }
+
+    Tensor* tt = tensor_transpose(&a, t, 0, 1);
+    print_tensor(tt);
+    assert(tt->data == t->data && !tt->is_contiguous);
+    assert(tt->data[tensor_elem_offset(tt, 1)] == 3.0f);
+
+    const int64_t r_shape[2] = {3, 2};
+    Tensor* r = tensor_reshape(&a, t, 2, r_shape);
+    assert(r->is_contiguous && r->data[3] == 3.0f);
+
+    Tensor* n = tensor_narrow(&a, t, 1, 1, 2);
+    print_tensor(n);
+    assert(!n->is_contiguous && n->data[tensor_elem_offset(n, 2)] == 4.0f);
+
+    Tensor* row = tensor_narrow(&a, t, 0, 1, 1);
+    assert(row->is_contiguous && row->data[0] == 3.0f);
+
+    const int64_t e_shape[2] = {4, 3};
+    Tensor* e = tensor_expand(&a, row, 2, e_shape);
+    print_tensor(e);
+    assert(e->stride[0] == 0 && e->data[tensor_elem_offset(e, 10)] == 4.0f);
+
+    const int perm[2] = {1, 0};
+    Tensor* p = tensor_permute(&a, t, perm);
+    assert(p->shape[0] == 3 && p->stride[0] == 1);
+
+    printf("tensor view selftest passed\n");
 
     arena_free(&a);
     return 0;
@@ -5,6 +5,18 @@ int areAlmostEqual(float a, float b) {
     return fabs(a - b) < epsilon;
 }
 
+// Floats ordered as sign magnitude ints, flipping the negatives makes the int order match the float order
+int64_t ulp_distance(float a, float b) {
+    int32_t ia, ib;
+    memcpy(&ia, &a, sizeof(ia));
+    memcpy(&ib, &b, sizeof(ib));
+
+    int64_t oa = (ia < 0)? (int64_t) INT32_MIN - ia : ia;
+    int64_t ob = (ib < 0)? (int64_t) INT32_MIN - ib : ib;
+
+    return (oa > ob)? oa - ob : ob - oa;
+}
+
 void testOp(Op op, const int64_t* sh_a, const int64_t* sh_b, const int64_t* sh_c, 
     float* fill_a, float* fill_b, float fill_c, float* unary_out) {
     const OpKernel* k = get_opkernel(op);
@@ -1,5 +1,9 @@
+// clock_gettime
+#define _POSIX_C_SOURCE 199309L
+
 #include "utils.h"
 #include <stdarg.h>
+#include <time.h>
 
 void fatalf(const char* file, int line, const char* fmt, ...) {
     fprintf(stderr, "Fatal (%s:%d): ", file, line);
@@ -13,6 +17,12 @@ void fatalf(const char* file, int line, const char* fmt, ...) {
     exit(EXIT_FAILURE);
 }
 
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e3 + (double) ts.tv_nsec * 1e-6;
+}
+
 #ifdef UTILS_SELFTEST_MAIN
 #include <assert.h>
 
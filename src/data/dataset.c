@@ -1,12 +1,47 @@
 #include "dataset.h"
 #include "probhelper.h"
 #include "arena.h"
+#include "parallel.h"
 
+// Points per parallel_for chunk of the spiral, fewer than this and it stays on the calling thread
+#define SPIRAL_GRAIN 4096
+
+typedef struct {
+    float* points;
+    const float* t_draws;
+    int num_data_points;
+    int num_classes;
+    int data_dims;
+    double b;
+} SpiralJob;
+
+// Every point only reads its own draw and writes its own row, so the split doesn't change a bit
+static void spiral_points(void* ctx, size_t begin, size_t end) {
+    const SpiralJob* job = ctx;
+
+    for(size_t point_idx = begin; point_idx < end; point_idx++) {
+        // Row major [class, point, dim], the class idx is implied by the first dimension
+        int class_idx = (int) (point_idx / (size_t) job->num_data_points);
+        double offset = 2.0 * PI * (double) class_idx / (double) job->num_classes;
+        size_t tmp_idx = (size_t) job->data_dims * point_idx;
+
+        double t = job->t_draws[point_idx];
+        double r = job->b * t;
+        double theta = t + offset;
+
+        job->points[tmp_idx] += r * cos(theta);
+        job->points[tmp_idx + 1] += r * sin(theta);
+    }
+}
 
 void generate_dataset(Dataset* dataset, Arena* arena, int data_dims, int num_data_points, int num_classes, DatasetShape shape, uint32_t* state) {
     dataset->num_classes = num_classes;
     dataset->num_data_points = num_data_points;
-    dataset->class_dpoints = arena_alloc(arena, data_dims * sizeof(float) * num_classes * num_data_points, alignof(float));
+    dataset->data_dims = data_dims;
+
+    int64_t points_shape[2] = { (int64_t) num_classes * num_data_points, data_dims };
+    dataset->points = tensor_new(arena, 2, points_shape);
+    dataset->class_dpoints = dataset->points->data;
 
     if(shape == DATA_XOR) {
 
@@ -17,7 +52,7 @@ void generate_dataset(Dataset* dataset, Arena* arena, int data_dims, int num_dat
     else if(shape == DATA_SPIRAL) {
         // TODO: We only take 2D for now (3D 1 for class)? dims are [class x data_dims]
         if(data_dims != 2) {
-            print("DATA_SPIRAL only allows for 2D plane!");
+            printf("DATA_SPIRAL only allows for 2D plane!");
             
             return;
         }
@@ -28,29 +63,26 @@ void generate_dataset(Dataset* dataset, Arena* arena, int data_dims, int num_dat
         // Not dynamic for now, for future changes
         double t_max = 2 * PI;
         double b = 1.0;
-        for(int i = 0; i < dataset->num_classes; i++) {
-            double offset = 2.0 * PI * (double) i / (double) num_classes;
-
-            for(int j = 0; j < dataset->num_data_points; j++) {
-                double t = t_max * rand_uniform01(state);
-                double r = b * t;
-                double theta = t + offset;
-
-                double x = r * cos(theta);
-                double y = r * sin(theta);
-
-                // Std is hardcoded for now, for future chagnes
-                x += rand_normal(state, 0, 0.2);
-                y += rand_normal(state, 0, 0.2);
-
-                // Pseudo row major strides (since 2 dim is hardcoded)
-                // TODO: Change this to invovle the first dimension for the class idx
-                int tmp_idx = data_dims * (i * num_data_points + j);
-                dataset->class_dpoints[tmp_idx] = i;
-                dataset->class_dpoints[tmp_idx + 1] = x;
-                dataset->class_dpoints[tmp_idx + 2] = y;
-            }
+        size_t total_points = (size_t) num_classes * num_data_points;
+
+        // Bulk draws up front from two Philox streams of one seed: the spiral parameters, and the noise written
+        // straight into the points (Std is hardcoded for now, for future chagnes) so the loop below only adds the spiral
+        uint32_t seed = xorshift32(state);
+        Philox noise, spiral;
+        philox_init(&noise, seed, 0);
+        philox_init(&spiral, seed, 1);
+        fill_normal(&noise, dataset->class_dpoints, total_points * data_dims, 0.0f, 0.2f);
+
+        float* t_draws = (float*) malloc(total_points * sizeof(float));
+        if(!t_draws) {
+            fatal("generate_dataset cannot run: malloc for %zu spiral parameters failed", total_points);
         }
+        fill_uniform(&spiral, t_draws, total_points, 0.0f, (float) t_max);
+
+        SpiralJob job = { dataset->class_dpoints, t_draws, num_data_points, num_classes, data_dims, b };
+        parallel_for(total_points, SPIRAL_GRAIN, spiral_points, &job);
+
+        free(t_draws);
     }
     else if(shape == DATA_FPETALS) {
 
@@ -66,11 +98,28 @@ void free_dataset(Dataset* dataset) {
     }
 
     dataset->class_dpoints = NULL;
+    dataset->points = NULL;
     dataset->num_classes = 0;
     dataset->num_data_points = 0;
     // free arena
 }
 
+Tensor* dataset_batch_view(Arena* arena, const Dataset* dataset, int class_idx, int start, int count) {
+    if(!arena || !dataset || !dataset->points) {
+        fatal("dataset_batch_view cannot run: arena or dataset is NULL");
+    }
+    if(class_idx < 0 || class_idx >= dataset->num_classes) {
+        fatal("dataset_batch_view cannot run: class %d out of range of %d classes", class_idx, dataset->num_classes);
+    }
+
+    int64_t row = (int64_t) class_idx * dataset->num_data_points + start;
+    if(start < 0 || count < 0 || start + count > dataset->num_data_points) {
+        fatal("dataset_batch_view cannot run: [%d, %d) out of range of %d points", start, start + count, dataset->num_data_points);
+    }
+
+    return tensor_narrow(arena, dataset->points, 0, row, count);
+}
+
 // Fisher-Yates shuffle, again like in pathfinder repo :^)
 void shuffle_indexes(int* shuffle_arr, int arr_size, uint32_t* rng) {
     for(int i = arr_size - 1; i > 0; i--) {
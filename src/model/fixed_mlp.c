@@ -0,0 +1,219 @@
+#include "nn.h"
+#include "model.h"
+#include "graph.h"
+#include "fixed_mlp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+// Driver for the kernels generated for one fixed MLP shape (make fixed-mlp, shape from FIXED_* in the Makefile).
+// Checks them against the graph path on the same weights, per sample logits and a run of fused SGD steps, and then
+// times per sample inference both ways. -i loads weights saved by train, which has to use the same shape, -o saves the
+// weights the fused steps ended at
+
+#define FIXED_SAMPLES 256
+#define FIXED_CHECK_STEPS 64
+#define FIXED_TOL 1e-4f
+
+static Activation spec_activation(const char* name) {
+    if(strcmp(name, "tanh") == 0) return ACT_TANH;
+    if(strcmp(name, "sigmoid") == 0) return ACT_SIGMOID;
+
+    return ACT_RELU;
+}
+
+// MLP::layers into the generated layout, weight [in, out] then bias [out] per layer
+static void pack_params(const MLP* nn, float* params) {
+    size_t offset = 0;
+
+    for(int l = 0; l < nn->num_layers; l++) {
+        const Tensor* w = nn->layers[l].weight;
+        const Tensor* b = nn->layers[l].bias;
+
+        memcpy(params + offset, w->data, total_elems(w) * sizeof(float));
+        offset += total_elems(w);
+        memcpy(params + offset, b->data, total_elems(b) * sizeof(float));
+        offset += total_elems(b);
+    }
+
+    if(offset != fixed_mlp_spec.num_params) {
+        fatal("fixed_mlp: the model has %zu params, the generated kernels expect %zu", offset, fixed_mlp_spec.num_params);
+    }
+}
+
+// One sample through the graph with a cross entropy loss, the same thing train records per batch
+typedef struct {
+    GraphTemplate graph;
+    Tensor* x;
+    Tensor* label;
+    Node* logits;
+    Node* loss;
+} SampleStep;
+
+static void record_sample_step(SampleStep* step, Arena* tmpl_arena, Arena* scratch, const MLP* nn) {
+    Graph graph;
+    graph_init(&graph, scratch);
+
+    const int64_t x_shape[2] = { 1, fixed_mlp_spec.input_dim };
+    const int64_t label_shape[1] = { 1 };
+    Tensor* x = tensor_new(scratch, 2, x_shape);
+    Tensor* label = tensor_new_dtype(scratch, 1, label_shape, DTYPE_I32);
+    label->data_i32[0] = 0;
+
+    Node* x_node = graph_add_input(&graph, x);
+    Node* logits = mlp_forward(&graph, x_node, nn);
+    Node* label_node = graph_add_input(&graph, label);
+    Node* ce_in[2] = { logits, label_node };
+    Node* loss = add_node(&graph, OP_SOFTMAX_CROSS_ENTROPY, 2, ce_in);
+
+    Node** order = NULL;
+    size_t order_n = 0;
+    topological_sort(&graph, &order, &order_n);
+    graph_template_record(&step->graph, tmpl_arena, &graph, order, order_n);
+
+    step->x = graph_template_node(&step->graph, x_node)->out;
+    step->label = graph_template_node(&step->graph, label_node)->out;
+    step->logits = graph_template_node(&step->graph, logits);
+    step->loss = graph_template_node(&step->graph, loss);
+}
+
+static float max_abs_diff(const float* a, const float* b, size_t n) {
+    float worst = 0.0f;
+
+    for(size_t i = 0; i < n; i++) {
+        float d = fabsf(a[i] - b[i]);
+        worst = d > worst? d : worst;
+    }
+
+    return worst;
+}
+
+int main(int argc, char* argv[]) {
+    const FixedMlpSpec* spec = &fixed_mlp_spec;
+    const char* input_file = NULL;
+    const char* output_file = NULL;
+    int reps = 200;
+    float lr = 0.03f;
+    int opt;
+
+    while((opt = getopt(argc, argv, "i:o:n:")) != -1) {
+        switch(opt) {
+            case 'i': input_file = optarg; break;
+            case 'o': output_file = optarg; break;
+            case 'n': reps = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-i model.bin] [-o model.bin] [-n timing passes]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    Arena param_arena, scratch, tmpl_arena;
+    arena_init(&param_arena, 1 << 22);
+    arena_init(&scratch, 1 << 22);
+    arena_init(&tmpl_arena, 1 << 22);
+
+    uint32_t rng = 12345;
+    MLP nn;
+    init_mlp(&nn, &param_arena, spec->num_layers, spec->input_dim, spec->width, spec->output_dim,
+        spec_activation(spec->activation), INIT_HE_NORMAL, INIT_HE_NORMAL, &rng);
+    if(input_file) {
+        load_model(input_file, &nn);
+    }
+
+    float* params = (float*) malloc(spec->num_params * sizeof(float));
+    float* graph_params = (float*) malloc(spec->num_params * sizeof(float));
+    float* xs = (float*) malloc((size_t) FIXED_SAMPLES * (size_t) spec->input_dim * sizeof(float));
+    float* logits = (float*) malloc((size_t) spec->output_dim * sizeof(float));
+    int* labels = (int*) malloc(FIXED_SAMPLES * sizeof(int));
+    if(!params || !graph_params || !xs || !logits || !labels) {
+        fatal("fixed_mlp: malloc failed");
+    }
+
+    for(int i = 0; i < FIXED_SAMPLES * spec->input_dim; i++) xs[i] = rand_uniform(&rng, -1.0f, 1.0f);
+    for(int i = 0; i < FIXED_SAMPLES; i++) labels[i] = (int) (xorshift32(&rng) % (uint32_t) spec->output_dim);
+
+    SampleStep step;
+    record_sample_step(&step, &tmpl_arena, &scratch, &nn);
+    const size_t x_bytes = (size_t) spec->input_dim * sizeof(float);
+
+    // Same weights, same logits
+    pack_params(&nn, params);
+    float logit_diff = 0.0f;
+    for(int s = 0; s < FIXED_SAMPLES; s++) {
+        memcpy(step.x->data, xs + (size_t) s * (size_t) spec->input_dim, x_bytes);
+        graph_template_forward(&step.graph);
+        fixed_mlp_forward(params, xs + (size_t) s * (size_t) spec->input_dim, logits);
+
+        float d = max_abs_diff(logits, step.logits->out->data, (size_t) spec->output_dim);
+        logit_diff = d > logit_diff? d : logit_diff;
+    }
+
+    // A run of per sample SGD steps both ways ends at the same weights
+    for(int s = 0; s < FIXED_CHECK_STEPS; s++) {
+        const float* x = xs + (size_t) s * (size_t) spec->input_dim;
+
+        memcpy(step.x->data, x, x_bytes);
+        step.label->data_i32[0] = labels[s];
+        graph_template_forward(&step.graph);
+        graph_template_backward(&step.graph, step.loss);
+        mlp_sgd_step(&nn, lr);
+        mlp_zero_grads(&nn);
+
+        fixed_mlp_train_step(params, x, labels[s], lr);
+    }
+    pack_params(&nn, graph_params);
+    float param_diff = max_abs_diff(params, graph_params, spec->num_params);
+
+    if(!(logit_diff <= FIXED_TOL) || !(param_diff <= FIXED_TOL)) {
+        fatal("fixed_mlp: generated kernels disagree with the graph, logits %g, params after %d steps %g",
+            (double) logit_diff, FIXED_CHECK_STEPS, (double) param_diff);
+    }
+
+    if(output_file) {
+        save_model(output_file, &nn);
+    }
+
+    double start = now_ms();
+    // Keeps the timed calls from being optimised out
+    volatile float sink = 0.0f;
+    for(int r = 0; r < reps; r++) {
+        for(int s = 0; s < FIXED_SAMPLES; s++) {
+            fixed_mlp_forward(params, xs + (size_t) s * (size_t) spec->input_dim, logits);
+            sink += logits[0];
+        }
+    }
+    double fixed_ns = (now_ms() - start) * 1e6 / ((double) reps * FIXED_SAMPLES);
+
+    start = now_ms();
+    for(int r = 0; r < reps; r++) {
+        for(int s = 0; s < FIXED_SAMPLES; s++) {
+            memcpy(step.x->data, xs + (size_t) s * (size_t) spec->input_dim, x_bytes);
+            graph_template_forward(&step.graph);
+            sink += step.logits->out->data[0];
+        }
+    }
+    double graph_ns = (now_ms() - start) * 1e6 / ((double) reps * FIXED_SAMPLES);
+
+    printf("fixed %d layer %d -> %d -> %d %s mlp: logits within %g and params within %g of the graph after %d steps\n",
+        spec->num_layers, spec->input_dim, spec->width, spec->output_dim, spec->activation, (double) logit_diff, (double) param_diff,
+        FIXED_CHECK_STEPS);
+    // Both sides are built with the same flags (FIXED_CFLAGS), the ratio is what the fixed shape buys
+    printf("per sample forward: %.1f ns generated vs %.1f ns graph (%.1fx)\n", fixed_ns, graph_ns, graph_ns / fixed_ns);
+    // Kernels that lose to the graph they replace are a regression, not a result
+    if(!(graph_ns / fixed_ns >= 1.0)) {
+        fatal("fixed_mlp: generated forward is slower than the graph, %.1f ns vs %.1f ns", fixed_ns, graph_ns);
+    }
+
+    free(params);
+    free(graph_params);
+    free(xs);
+    free(logits);
+    free(labels);
+    mlp_free(&nn);
+    arena_free(&param_arena);
+    arena_free(&scratch);
+    arena_free(&tmpl_arena);
+
+    return 0;
+}
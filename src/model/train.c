@@ -4,6 +4,9 @@
 #include "optim.h"
 #include "loss.h"
 #include "graph.h"
+#include "autotune.h"
+#include "jit.h"
+#include "async_save.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -55,9 +58,139 @@ static struct option long_opts[] = {
     {"outputdim", required_argument, 0, 'z'},
     {"epochs", required_argument, 0, 'e'},
     {"lr", required_argument, 0, 't'},
+    {"batch", required_argument, 0, 'b'},
+    {"norm", required_argument, 0, 'N'},
+    {"dropout", required_argument, 0, 'D'},
+    {"tune", required_argument, 0, 'T'},
+    {"jit", no_argument, 0, 'J'},
+    {"ckpt", required_argument, 0, 'c'},
+    {"direct", no_argument, 0, 'O'},
+    {"half", required_argument, 0, 'H'},
+    {"recompute", required_argument, 0, 'R'},
     {0, 0, 0, 0}
 };
 
+// One training step for a fixed batch size, x and labels are refilled every step. Normally a template recorded once
+// and replayed. With recompute > 0 it is a checkpointed graph built fresh in scratch for every step instead, templates
+// can't hold those (they bind their own activation storage)
+typedef struct {
+    GraphTemplate graph;
+    Tensor* x;
+    Tensor* labels;
+    Node* logits;
+    Node* loss;
+
+    int recompute;
+    Graph live;
+    Node** order;
+    size_t order_n;
+} TrainStep;
+
+// The MLP under the fused softmax cross entropy with x and labels in the graph's arena, fills in everything of step
+// but the template. The x and labels leaves come back for mapping onto a template
+static void build_train_graph(Graph* graph, TrainStep* step, const MLP* nn, int count, int dims, Node** x_node,
+    Node** label_node) {
+    const int64_t input_shape[2] = { count, dims };
+    const int64_t label_shape[1] = { count };
+    step->x = tensor_new(graph->arena, 2, input_shape);
+    step->labels = tensor_new_dtype(graph->arena, 1, label_shape, DTYPE_I32);
+    // Recorded labels have to be valid class ids, the real ones are written before every run
+    tensor_fill(step->labels, 0.0f);
+
+    *x_node = graph_add_input(graph, step->x);
+    step->logits = mlp_forward(graph, *x_node, nn);
+    *label_node = graph_add_input(graph, step->labels);
+    Node* ce_inputs[2] = { step->logits, *label_node };
+    step->loss = add_node(graph, OP_SOFTMAX_CROSS_ENTROPY, 2, ce_inputs);
+
+    topological_sort(graph, &step->order, &step->order_n);
+}
+
+static void record_train_step(TrainStep* step, Arena* tmpl_arena, Arena* scratch, const MLP* nn, int count, int dims) {
+    arena_reset(scratch);
+
+    Graph graph;
+    graph_init(&graph, scratch);
+    Node* x_node;
+    Node* label_node;
+    build_train_graph(&graph, step, nn, count, dims, &x_node, &label_node);
+    graph_template_record(&step->graph, tmpl_arena, &graph, step->order, step->order_n);
+
+    step->x = graph_template_node(&step->graph, x_node)->out;
+    step->labels = graph_template_node(&step->graph, label_node)->out;
+    step->logits = graph_template_node(&step->graph, step->logits);
+    step->loss = graph_template_node(&step->graph, step->loss);
+    step->recompute = 0;
+
+    arena_reset(scratch);
+}
+
+// A fresh checkpointed graph in scratch that keeps every recompute-th op output, for the next step only
+static void build_recompute_step(TrainStep* step, Arena* scratch, const MLP* nn, int count, int dims, int recompute) {
+    arena_reset(scratch);
+
+    graph_init(&step->live, scratch);
+    graph_enable_checkpointing(&step->live, recompute);
+    Node* x_node;
+    Node* label_node;
+    build_train_graph(&step->live, step, nn, count, dims, &x_node, &label_node);
+    step->recompute = recompute;
+}
+
+static void train_step_forward(TrainStep* step) {
+    if(step->recompute) {
+        graph_forward_pass_checkpointed(&step->live, step->order, step->order_n);
+        return;
+    }
+    graph_template_forward(&step->graph);
+}
+
+static void train_step_backward(TrainStep* step) {
+    if(step->recompute) {
+        graph_backward_pass(&step->live, step->order, step->order_n, step->loss->out);
+        return;
+    }
+    graph_template_backward(&step->graph, step->loss);
+}
+
+// Unshuffled pass in eval mode. A class's points are contiguous, so every batch is a view over the dataset and
+// nothing gets copied in, unlike the shuffled training batches which gather rows from all over it
+static float evaluate(const MLP* nn, const Dataset* dataset, Arena* scratch, int batch_size) {
+    int correct = 0;
+
+    for(int c = 0; c < dataset->num_classes; c++) {
+        for(int start = 0; start < dataset->num_data_points; start += batch_size) {
+            int count = (dataset->num_data_points - start < batch_size)? dataset->num_data_points - start : batch_size;
+
+            arena_reset(scratch);
+            Graph graph;
+            graph_init(&graph, scratch);
+
+            Tensor* x = dataset_batch_view(scratch, dataset, c, start, count);
+            Node* logits = mlp_forward(&graph, graph_add_input(&graph, x), nn);
+
+            Node** order = NULL;
+            size_t order_n = 0;
+            topological_sort(&graph, &order, &order_n);
+            graph_forward_pass(order, order_n);
+
+            const Tensor* out = logits->out;
+            for(int i = 0; i < count; i++) {
+                const float* row = out->data + (size_t) i * out->stride[0];
+                int pred = 0;
+
+                for(int k = 1; k < out->shape[1]; k++) {
+                    pred = (row[k] > row[pred])? k : pred;
+                }
+                correct += pred == c;
+            }
+        }
+    }
+
+    arena_reset(scratch);
+    return (float) correct / (float) (dataset->num_classes * dataset->num_data_points);
+}
+
 // TODO: maybe wrap this into a main .c file, where inference and training can be toggled.
 // inference must have load flag set though
 int main(int argc, char* argv[]) {
@@ -79,9 +212,18 @@ int main(int argc, char* argv[]) {
 
     int training_epochs = 100;
     float lr = 0.03f;
+    int batch_size = 32;
+    NormType norm = NORM_NONE;
+    float dropout = 0.0f;
+    char* tune_file = NULL;
+    int use_jit = 0;
+    int ckpt_every = 0;
+    int save_flags = 0;
+    DType half = DTYPE_F32;
+    int recompute = 0;
 
     // Hardcoded for now
-    Activation hidden_activation = ACT_SOFTMAX;
+    Activation hidden_activation = ACT_RELU;
     InitScheme hidden_init = INIT_HE_NORMAL;
     InitScheme output_init = INIT_HE_NORMAL;
     int hard_coded_input_dim = 2;
@@ -91,7 +233,7 @@ int main(int argc, char* argv[]) {
 
     // TODO: registry for datasetshape, so user can flag into the right dataset shape (add flag);
     // Flags might blow up when we add more dataset shapes........ hmmm.....
-    const char help_menu = "\nUsage: %s [options/flags]\n"
+    const char* help_menu = "\nUsage: %s [options/flags]\n"
                         "===================== Options/Flags =====================\n"
                         "-m                                Mute this error message\n"
                         "-i <file_path>                       Load model from path\n"
@@ -106,7 +248,16 @@ int main(int argc, char* argv[]) {
                         "-width <int>                   # of dims for hidden layer\n"
                         "-outputdim <int>                     # of dims for output\n"
                         "-epochs <int>                        # of training epochs\n"
-                        "-lr <float>                        Learning rate of model\n";
+                        "-lr <float>                        Learning rate of model\n"
+                        "-batch <int>                           Minibatch size\n"
+                        "-norm <none|layer|batch>     Norm after each hidden layer\n"
+                        "-dropout <float>     Dropout prob after hidden activations\n"
+                        "-tune <file_path>     Autotune op variants, cached in file\n"
+                        "-jit                Compile the forward to x86-64 code\n"
+                        "-ckpt <int>      Checkpoint to the -o path every n epochs\n"
+                        "-direct             Write the checkpoints with O_DIRECT\n"
+                        "-half <bf16|f16>   16 bit weights in the step, fp32 masters\n"
+                        "-recompute <int>  Checkpointed steps, keep every n-th op\n";
 
     // When no arguments are provided by the user at all (min value for argc is 1), the help menu
     // for flags comes up
@@ -128,7 +279,7 @@ int main(int argc, char* argv[]) {
        - longopts is a struct for the longer option to single char conversion
        - If non-NULL, *longindex will be set to the index in longopts[] of the matched option, most people pass NULL.
     */
-    while((opt = getopt_long(argc, argv, "hmi:o:d:n:p:r:j:l:k:w:z:e:t:", long_opts, NULL)) != -1) {
+    while((opt = getopt_long(argc, argv, "hmi:o:d:n:p:r:j:l:k:w:z:e:t:b:N:D:T:Jc:OH:R:", long_opts, NULL)) != -1) {
         switch(opt) {
             case 'h':
                 fprintf(stderr, help_menu, argv[0]);
@@ -148,6 +299,30 @@ int main(int argc, char* argv[]) {
             case 'z': SET_INT(output_dim); break;
             case 'e': SET_INT(training_epochs); break;
             case 't': SET_FLOAT(lr); break;
+            case 'b': SET_INT(batch_size); break;
+            case 'D': SET_FLOAT(dropout); break;
+            case 'T': tune_file = optarg; break;
+            case 'J': use_jit = 1; break;
+            case 'c': SET_INT(ckpt_every); break;
+            case 'O': save_flags |= ASYNC_SAVE_DIRECT; break;
+            case 'R': SET_INT(recompute); break;
+            case 'H':
+                if(strcmp(optarg, "bf16") == 0) half = DTYPE_BF16;
+                else if(strcmp(optarg, "f16") == 0) half = DTYPE_F16;
+                else {
+                    fprintf(stderr, "Invalid half: '%s', expected bf16 or f16\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'N':
+                if(strcmp(optarg, "none") == 0) norm = NORM_NONE;
+                else if(strcmp(optarg, "layer") == 0) norm = NORM_LAYER;
+                else if(strcmp(optarg, "batch") == 0) norm = NORM_BATCH;
+                else {
+                    fprintf(stderr, "Invalid norm: '%s', expected none, layer or batch\n", optarg);
+                    return 2;
+                }
+                break;
             default:
                 fprintf(stderr, "INVALID FLAG/ARGUMENT");
                 fprintf(stderr, help_menu, argv[0]);
@@ -155,137 +330,223 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if(batch_size < 1) {
+        fatal("batch must be >= 1, got %d", batch_size);
+    }
+    if(recompute < 0) {
+        fatal("recompute must be >= 0, got %d", recompute);
+    }
+    // The JIT compiles recorded templates, a checkpointed graph is rebuilt every step and never recorded
+    if(recompute && use_jit) {
+        fatal("recompute and jit can't be combined");
+    }
+    // Not wired up yet, the spiral dataset and the hardcoded 2d input are the only options for now
+    (void) data_shape;
+    (void) input_dim;
+    (void) rotations;
+    (void) noise_std;
+
     Arena param_arena;
     // 1 mb
     arena_init(&param_arena, 1 << 20);
     
-    // Scratch aren for each epoch
+    // Scratch aren for recording the step graphs
     Arena scratch;
-    arena_init(&scratch, 1 << 20);
+    arena_init(&scratch, 1 << 22);
+
+    // Recorded step graphs, live for the whole run
+    Arena tmpl_arena;
+    arena_init(&tmpl_arena, 1 << 22);
 
     Arena data_arena;
     Dataset dataset;
     arena_init(&data_arena, 1 << 20);
 
     // DatasetShape is hardcoded for now
-    generate_dataset(&dataset, &data_arena, hard_coded_input_dim, n_per_class, num_classes, DATA_SPIRAL, rng);
-    int* shuffle_dpoint_arr = (int*) malloc((size_t) n_per_class * sizeof(int));
-    int* shuffle_class_arr = (int*) malloc((size_t) num_classes * sizeof(int));
+    generate_dataset(&dataset, &data_arena, hard_coded_input_dim, n_per_class, num_classes, DATA_SPIRAL, &rng);
 
-    if(!shuffle_dpoint_arr) {
-        fatal("malloc for shuffle_dpoint_arr failed");
-    }
-    for(int i = 0; i < n_per_class; i++){
-        shuffle_dpoint_arr[i] = i;
-    }
-    if(!shuffle_class_arr) {
-        fatal("malloc for shuffle_class_arr failed");
+    // Points are stored [class][point][dim], so a flat index idx belongs to class idx / n_per_class
+    int total_points = num_classes * n_per_class;
+    int* shuffle_arr = (int*) malloc((size_t) total_points * sizeof(int));
+
+    if(!shuffle_arr) {
+        fatal("malloc for shuffle_arr failed");
     }
-    for(int i = 0; i < num_classes; i++) {
-        shuffle_class_arr[i] = i;
+    for(int i = 0; i < total_points; i++){
+        shuffle_arr[i] = i;
     }
 
-
     MLP nn;
     // TODO: shouldnt be hardcodedinput dim for the input dim, its meant to be for the wdith
     init_mlp(&nn, &param_arena, num_layers, hard_coded_input_dim, width,
         output_dim, hidden_activation, hidden_init, output_init, &rng);
+    mlp_enable_norm(&nn, &param_arena, norm);
+    if(dropout > 0.0f) {
+        mlp_enable_dropout(&nn, dropout, xorshift32(&rng));
+    }
 
-    // add a shuffle for the class dimension, 
-    for(int epoch = 1; epoch <= training_epochs; epoch++) {
-        shuffle_indexes(shuffle_dpoint_arr, n_per_class, rng);
-        shuffle_indexes(shuffle_class_arr,  num_classes, rng);
+    if(input_file) {
+        load_model(input_file, &nn);
+        printf("Loaded model from %s\n", input_file);
+    }
+    // After the load, the 16 bit copies start from the loaded masters. mlp_sgd_step keeps them in sync
+    if(half != DTYPE_F32) {
+        mlp_enable_mixed_precision(&nn, &param_arena, half);
+    }
 
-        float loss_sum = 0.0f;
-        int correct = 0;
+    // Variants are picked when the nodes are added, so the tuner has to be in place before recording
+    if(tune_file) {
+        autotune_enable(tune_file);
+    }
 
-        // BGD for now
-        // Not sure if this shuffling is sufficient, loop per data isntance outside then per class inside.
-        // TODO: might not need the additional dimension for the storage of the class since we already have the value at the start of the training loop
-       for(int it = 0; it < n_per_class; it++) {
-            int data_idx = shuffle_dpoint_arr[it];
+    // Every step has the same structure, so it is recorded once per batch size (full batches and the tail) and replayed.
+    // With recompute the step graph only keeps every n-th activation, it is built again in scratch for every step
+    TrainStep full_step, tail_step;
+    int tail = total_points % batch_size;
+    if(!recompute) {
+        record_train_step(&full_step, &tmpl_arena, &scratch, &nn, batch_size, hard_coded_input_dim);
+        if(tail) {
+            record_train_step(&tail_step, &tmpl_arena, &scratch, &nn, tail, hard_coded_input_dim);
+        }
+    }
 
-            for(int j = 0; j < num_classes; j++) {
-                int class_idx = shuffle_class_arr[j];
+    if(use_jit) {
+        if(graph_template_enable_jit(&full_step.graph) && (!tail || graph_template_enable_jit(&tail_step.graph))) {
+            JitStats jit;
+            jit_stats(full_step.graph.plan.jit, &jit);
+            printf("JIT: %zu functions over %zu steps, %zu interpreted, %zu bytes of code\n", jit.fused_groups,
+                jit.fused_steps, jit.interpreted_steps, jit.code_bytes);
+        }
+        else {
+            printf("JIT not available here, running the interpreter\n");
+        }
+    }
 
-                arena_reset(&scratch);
+    // Checkpoints are snapshotted between epochs and written by a background thread, the loop only pays for the copy
+    const char* save_path = output_file? output_file : "spirals_model.bin";
+    AsyncSaver saver;
+    if(ckpt_every > 0) {
+        async_save_init(&saver, &nn, &param_arena, save_path, save_flags);
+    }
 
-                Graph graph;
-                graph_init(&graph, &scratch);
+    double train_start = now_ms();
+    for(int epoch = 1; epoch <= training_epochs; epoch++) {
+        shuffle_indexes(shuffle_arr, total_points, &rng);
 
-                // Value 3 is hard_coded_input_dim + 1 for class index
-                int64_t input_shape[2] = { 1, hard_coded_input_dim };
-                Tensor* tensor = tensor_new(&scratch, hard_coded_input_dim, input_shape);
-                size_t num_elements = total_elems(tensor);
+        float loss_sum = 0.0f;
+        int correct = 0;
 
-                // TODO: Pseudo rowmajor strides calc as well
-                size_t base_idx = n_per_class * (class_idx * num_classes + data_idx);
+        // Minibatch SGD, the fused softmax cross entropy gives the mean loss and the logits grad in one kernel
+        for(int start = 0; start < total_points; start += batch_size) {
+            int count = (total_points - start < batch_size)? total_points - start : batch_size;
+            TrainStep* step = (count == batch_size)? &full_step : &tail_step;
+            if(recompute) {
+                build_recompute_step(step, &scratch, &nn, count, hard_coded_input_dim, recompute);
+            }
+            Tensor* x = step->x;
+            Tensor* labels = step->labels;
 
-                for(int k = 0; k < num_elements; k++) {
-                    tensor->data[k] = dataset.class_dpoints[base_idx + k];
-                }
+            for(int i = 0; i < count; i++) {
+                int idx = shuffle_arr[start + i];
 
-                Node* input_node = graph_add_input(&graph, tensor);
-                Node* output_node = mlp_forward(&graph, input_node, &nn);
-                Node* final_output = apply_activation(&graph, ACT_SOFTMAX, output_node);
+                memcpy(x->data + (size_t) i * hard_coded_input_dim, dataset.class_dpoints + (size_t) idx * hard_coded_input_dim,
+                    (size_t) hard_coded_input_dim * sizeof(float));
+                labels->data_i32[i] = idx / n_per_class;
+            }
 
-                Node** order = NULL;
-                size_t order_n = 0;
-                topo_sort(&graph, &order, &order_n);
-                forward(&graph, order, order_n);
+            train_step_forward(step);
 
-                // TODO: Fix dims for the probs output
-                float loss = cross_entropy(final_output->out->data, class_idx);
-                loss_sum += loss;
+            loss_sum += step->loss->out->data[0] * (float) count;
 
+            const Tensor* out = step->logits->out;
+            for(int i = 0; i < count; i++) {
+                const float* row = out->data + (size_t) i * out->stride[0];
                 int pred = 0;
 
-                for(size_t i = 0; i < final_output->out->ndim; i++) {
-                    pred = final_output->out->data[pred] > final_output->out->data[i]? final_output->out->data[pred] : final_output->out->data[i];
+                for(int c = 1; c < output_dim; c++) {
+                    pred = (row[c] > row[pred])? c : pred;
                 }
 
-                if(pred == class_idx) {
+                if(pred == labels->data_i32[i]) {
                     correct++;
                 }
+            }
 
-                ensure_grad(&scratch, output_node->out);
-
-                // TODO: Check
-                for(size_t i = 0; i < output_node->out->ndim; i++) {
-                    output_node->out->grad->data[i] = final_output->out->data[i] - (i == class_idx? 1.0f : 0.0f);
-                }
+            train_step_backward(step);
+            mlp_sgd_step(&nn, lr);
+            mlp_zero_grads(&nn);
+        }
 
-                graph_backward_pass(&graph, order, order_n, output_node->out->grad);
-                // TODO: Implement per op, pseudo for now
-                // mlp_sgd_step(&nn, lr);
+        float avg_loss = loss_sum / (float) total_points;
+        float acc = (float) correct / (float) total_points;
 
-                // mlp_zero_grads(&nn);
+        if(epoch % 10 == 0 || epoch == 1 || epoch == training_epochs) {
+            printf("Epoch %4d | loss %.6f | acc %.3f\n", epoch, avg_loss, acc);
+        }
 
-                free(order);
-                graph_free(&graph);
-            }
+        if(ckpt_every > 0 && epoch % ckpt_every == 0) {
+            async_save_snapshot(&saver, (uint64_t) epoch);
         }
-        float avg_loss = loss_sum / (float) n_per_class;
-        float acc = (float)correct / (float) n_per_class;
+    }
+    double train_ms = now_ms() - train_start;
+
+    // The last step graph is still in scratch until the eval resets it
+    if(recompute) {
+        TrainStep* last = tail? &tail_step : &full_step;
+        CheckpointStats ckpt;
+        graph_checkpoint_stats(&last->live, &ckpt);
+        printf("Recompute: every %d, %zu of %zu activation bytes stored (peak %zu), %zu of %zu nodes recomputed\n",
+            last->live.checkpoint_every, ckpt.stored_activation_bytes, ckpt.full_activation_bytes,
+            ckpt.peak_activation_bytes, ckpt.recomputed_nodes, ckpt.forward_nodes);
+    }
 
-        if(epoch % 10 == 0 || epoch == 1 || epoch == training_epochs) {
-            printf("Epoch %4d | loss %.6f | acc %.3f\n", epoch, avg_loss, acc);
+    mlp_set_training(&nn, 0);
+    float eval_acc = evaluate(&nn, &dataset, &scratch, batch_size);
+    printf("Eval | acc %.3f (unshuffled, batches are views of the dataset)\n", eval_acc);
+
+    // The writer uses the same .tmp file as save_model, it has to be done first
+    if(ckpt_every > 0) {
+        AsyncSaveStats save_stats;
+        async_save_flush(&saver);
+        async_save_stats(&saver, &save_stats);
+        printf("Checkpoints: %zu snapshots, %zu written (last of epoch %llu), %zu superseded, %zu failed, "
+            "%.3f ms in the loop (%.4f%% of training, max %.3f ms), %.2f ms writing in the background\n",
+            save_stats.snapshots, save_stats.written, (unsigned long long) save_stats.written_step,
+            save_stats.superseded, save_stats.failed, save_stats.snapshot_ms, 100.0 * save_stats.snapshot_ms / train_ms,
+            save_stats.max_snapshot_ms, save_stats.write_ms);
+        if(save_stats.failed) {
+            printf("Last checkpoint error: %s\n", save_stats.error);
+        }
+        if(save_stats.direct_fallbacks) {
+            printf("O_DIRECT was refused %zu times, those were written buffered\n", save_stats.direct_fallbacks);
         }
+        async_save_free(&saver);
     }
 
-    // TODO: Pseudo for now
-    // float final_acc = eval_accuracy(&nn, &dataset);
-    // printf("Final accuracy (train set): %.3f\n", final_acc);
+    save_model(save_path, &nn);
+    printf("Saved model to %s\n", save_path);
 
-    save_model("spirals_model.bin", &nn);
-    printf("Saved model to spirals_model.bin\n");
+    if(tune_file) {
+        AutotuneStats tune_stats;
+        autotune_stats(&tune_stats);
+        printf("Autotune: %zu nodes from the cache, %zu keys tuned, %zu known\n", tune_stats.hits, tune_stats.tuned, tune_stats.entries);
+        autotune_disable();
+    }
+
+    if(!recompute) {
+        exec_plan_disable_jit(&full_step.graph.plan);
+        if(tail) {
+            exec_plan_disable_jit(&tail_step.graph.plan);
+        }
+    }
 
     mlp_free(&nn);
     arena_free(&param_arena);
     arena_free(&scratch);
-    free(shuffle_class_arr);
-    free(shuffle_dpoint_arr);
+    arena_free(&tmpl_arena);
+    arena_free(&data_arena);
+    free(shuffle_arr);
     free_dataset(&dataset);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+
+#include "async_save.h"
+#include "model.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// O_DIRECT wants the buffer, the length and the file offset in whole logical blocks, a page covers all the usual ones
+#define SAVE_ALIGN 4096
+
+static size_t round_up(size_t bytes, size_t align) {
+    return (bytes + align - 1) / align * align;
+}
+
+static char* concat(const char* a, const char* b, size_t a_len) {
+    size_t b_len = strlen(b);
+    char* out = (char*) malloc(a_len + b_len + 1);
+    if(!out) {
+        fatal("async_save: malloc failed");
+    }
+
+    memcpy(out, a, a_len);
+    memcpy(out + a_len, b, b_len + 1);
+    return out;
+}
+
+static void check_in_arena(const Tensor* tensor, const Arena* arena) {
+    const uint8_t* data = (const uint8_t*) tensor->data;
+
+    if(data < arena->base || data + total_elems(tensor) * sizeof(float) > arena->curr) {
+        fatal("async_save_init: a tensor of the model is outside the param arena");
+    }
+}
+
+static int write_all(int fd, const uint8_t* data, size_t bytes) {
+    while(bytes > 0) {
+        ssize_t n = write(fd, data, bytes);
+
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return 0;
+        }
+        data += n;
+        bytes -= (size_t) n;
+    }
+
+    return 1;
+}
+
+// saver->file to tmp_path and on disk, 0 with errno set if any of it failed
+static int write_tmp(AsyncSaver* saver, int direct) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    flags |= direct? O_DIRECT : 0;
+#endif
+
+    int fd = open(saver->tmp_path, flags, 0644);
+    if(fd < 0) {
+        return 0;
+    }
+
+    // Direct writes go out in whole blocks (the padding is zeroes) and the file is cut back to size after
+    size_t bytes = direct? round_up(saver->file_bytes, SAVE_ALIGN) : saver->file_bytes;
+    int ok = write_all(fd, saver->file, bytes);
+    ok = ok && (!direct || ftruncate(fd, (off_t) saver->file_bytes) == 0);
+    ok = ok && fsync(fd) == 0;
+
+    int err = errno;
+    if(close(fd) != 0 && ok) {
+        ok = 0;
+        err = errno;
+    }
+    errno = err;
+    return ok;
+}
+
+static int sync_dir(const char* dir_path) {
+    int fd = open(dir_path, O_RDONLY);
+    if(fd < 0) {
+        return 0;
+    }
+
+    int ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// The file from one snapshot, on the writer thread with the slot marked as writing
+static int write_slot(AsyncSaver* saver, const SaveSlot* slot, int* fell_back, char* err, size_t err_size) {
+    model_serialize(saver->nn, saver->arena->base, slot->image, saver->file);
+    memset(saver->file + saver->file_bytes, 0, saver->file_capacity - saver->file_bytes);
+
+    int direct = (saver->flags & ASYNC_SAVE_DIRECT) != 0;
+    int ok = write_tmp(saver, direct);
+    if(!ok && direct) {
+        *fell_back = 1;
+        ok = write_tmp(saver, 0);
+    }
+    if(!ok) {
+        snprintf(err, err_size, "writing %s failed (errno %d)", saver->tmp_path, errno);
+        return 0;
+    }
+
+    if(rename(saver->tmp_path, saver->path) != 0) {
+        snprintf(err, err_size, "renaming %s failed (errno %d)", saver->tmp_path, errno);
+        return 0;
+    }
+    // Lost only on a crash right now, the file itself is complete either way
+    if(!sync_dir(saver->dir_path)) {
+        snprintf(err, err_size, "fsync of %s failed (errno %d)", saver->dir_path, errno);
+        return 0;
+    }
+
+    return 1;
+}
+
+static SaveSlot* find_slot(AsyncSaver* saver, SaveSlotState state) {
+    for(int s = 0; s < 2; s++) {
+        if(saver->slots[s].state == state) return &saver->slots[s];
+    }
+
+    return NULL;
+}
+
+static void* writer_main(void* arg) {
+    AsyncSaver* saver = arg;
+
+    pthread_mutex_lock(&saver->lock);
+    for(;;) {
+        SaveSlot* slot = find_slot(saver, SAVE_SLOT_READY);
+        if(!slot) {
+            if(saver->stop) break;
+
+            pthread_cond_wait(&saver->wake, &saver->lock);
+            continue;
+        }
+
+        slot->state = SAVE_SLOT_WRITING;
+        pthread_mutex_unlock(&saver->lock);
+
+        char err[sizeof(saver->error)];
+        int fell_back = 0;
+        double start = now_ms();
+        int ok = write_slot(saver, slot, &fell_back, err, sizeof(err));
+        double ms = now_ms() - start;
+
+        pthread_mutex_lock(&saver->lock);
+        slot->state = SAVE_SLOT_FREE;
+        saver->last_ok = ok;
+        saver->direct_fallbacks += (size_t) fell_back;
+        saver->write_ms += ms;
+        saver->max_write_ms = ms > saver->max_write_ms? ms : saver->max_write_ms;
+        if(ok) {
+            saver->written++;
+            saver->written_step = slot->step;
+        }
+        else {
+            saver->failed++;
+            memcpy(saver->error, err, sizeof(err));
+        }
+        pthread_cond_broadcast(&saver->idle);
+    }
+    pthread_mutex_unlock(&saver->lock);
+
+    return NULL;
+}
+
+void async_save_init(AsyncSaver* saver, const MLP* nn, const Arena* arena, const char* path, int flags) {
+    if(!saver || !nn || !arena || !path) {
+        fatal("async_save_init cannot run: saver, nn, arena or path is NULL");
+    }
+
+    memset(saver, 0, sizeof(*saver));
+    saver->nn = nn;
+    saver->arena = arena;
+    saver->flags = flags;
+    saver->last_ok = 1;
+
+    for(int l = 0; l < nn->num_layers; l++) {
+        check_in_arena(nn->layers[l].weight, arena);
+        check_in_arena(nn->layers[l].bias, arena);
+    }
+    for(int l = 0; nn->norms && l < nn->num_layers - 1; l++) {
+        check_in_arena(nn->norms[l].gamma, arena);
+        check_in_arena(nn->norms[l].beta, arena);
+        if(nn->norm == NORM_BATCH) {
+            check_in_arena(nn->norms[l].attrs.running_mean, arena);
+            check_in_arena(nn->norms[l].attrs.running_var, arena);
+        }
+    }
+
+    const char* slash = strrchr(path, '/');
+    saver->path = concat(path, "", strlen(path));
+    saver->tmp_path = concat(path, ".tmp", strlen(path));
+    saver->dir_path = slash? concat(path, "", slash == path? 1 : (size_t) (slash - path)) : concat(".", "", 1);
+
+    // Sized for the whole arena, so whatever gets allocated in it later is snapshotted too
+    size_t capacity = (size_t) (arena->end - arena->base);
+    for(int s = 0; s < 2; s++) {
+        saver->slots[s].image = (uint8_t*) malloc(capacity);
+        if(!saver->slots[s].image) {
+            fatal("async_save_init: malloc of %zu bytes failed", capacity);
+        }
+    }
+
+    saver->file_bytes = model_serialize(nn, NULL, NULL, NULL);
+    saver->file_capacity = round_up(saver->file_bytes, SAVE_ALIGN);
+    void* file = NULL;
+    if(posix_memalign(&file, SAVE_ALIGN, saver->file_capacity) != 0) {
+        fatal("async_save_init: posix_memalign of %zu bytes failed", saver->file_capacity);
+    }
+    saver->file = (uint8_t*) file;
+
+    pthread_mutex_init(&saver->lock, NULL);
+    pthread_cond_init(&saver->wake, NULL);
+    pthread_cond_init(&saver->idle, NULL);
+    if(pthread_create(&saver->writer, NULL, writer_main, saver) != 0) {
+        fatal("async_save_init: pthread_create failed");
+    }
+}
+
+void async_save_free(AsyncSaver* saver) {
+    if(!saver || !saver->path) {
+        return;
+    }
+
+    pthread_mutex_lock(&saver->lock);
+    saver->stop = 1;
+    pthread_cond_signal(&saver->wake);
+    pthread_mutex_unlock(&saver->lock);
+    // The writer drains what is ready before it looks at stop
+    pthread_join(saver->writer, NULL);
+
+    pthread_cond_destroy(&saver->idle);
+    pthread_cond_destroy(&saver->wake);
+    pthread_mutex_destroy(&saver->lock);
+    for(int s = 0; s < 2; s++) {
+        free(saver->slots[s].image);
+    }
+    free(saver->file);
+    free(saver->path);
+    free(saver->tmp_path);
+    free(saver->dir_path);
+    saver->path = NULL;
+}
+
+void async_save_snapshot(AsyncSaver* saver, uint64_t step) {
+    double start = now_ms();
+
+    // At most one slot is being written, so there always is one to fill. A waiting one is replaced by the newer state
+    pthread_mutex_lock(&saver->lock);
+    SaveSlot* slot = find_slot(saver, SAVE_SLOT_READY);
+    if(slot) {
+        saver->superseded++;
+    }
+    else {
+        slot = find_slot(saver, SAVE_SLOT_FREE);
+    }
+    slot->state = SAVE_SLOT_FILLING;
+    pthread_mutex_unlock(&saver->lock);
+
+    slot->bytes = (size_t) (saver->arena->curr - saver->arena->base);
+    slot->step = step;
+    memcpy(slot->image, saver->arena->base, slot->bytes);
+
+    pthread_mutex_lock(&saver->lock);
+    slot->state = SAVE_SLOT_READY;
+    saver->snapshots++;
+    double ms = now_ms() - start;
+    saver->snapshot_ms += ms;
+    saver->max_snapshot_ms = ms > saver->max_snapshot_ms? ms : saver->max_snapshot_ms;
+    pthread_cond_signal(&saver->wake);
+    pthread_mutex_unlock(&saver->lock);
+}
+
+int async_save_flush(AsyncSaver* saver) {
+    pthread_mutex_lock(&saver->lock);
+    while(find_slot(saver, SAVE_SLOT_READY) || find_slot(saver, SAVE_SLOT_WRITING)) {
+        pthread_cond_wait(&saver->idle, &saver->lock);
+    }
+    int ok = saver->last_ok;
+    pthread_mutex_unlock(&saver->lock);
+
+    return ok;
+}
+
+void async_save_stats(AsyncSaver* saver, AsyncSaveStats* stats) {
+    if(!saver || !stats) {
+        fatal("async_save_stats cannot run: input is NULL");
+    }
+
+    pthread_mutex_lock(&saver->lock);
+    stats->snapshots = saver->snapshots;
+    stats->written = saver->written;
+    stats->superseded = saver->superseded;
+    stats->failed = saver->failed;
+    stats->direct_fallbacks = saver->direct_fallbacks;
+    stats->written_step = saver->written_step;
+    stats->snapshot_ms = saver->snapshot_ms;
+    stats->max_snapshot_ms = saver->max_snapshot_ms;
+    stats->write_ms = saver->write_ms;
+    stats->max_write_ms = saver->max_write_ms;
+    memcpy(stats->error, saver->error, sizeof(stats->error));
+    pthread_mutex_unlock(&saver->lock);
+}
+
+#ifdef ASYNC_SAVE_SELFTEST_MAIN
+#include <assert.h>
+
+#define SAVE_STEPS 200
+
+static uint8_t* read_file(const char* path, size_t* bytes) {
+    FILE* f = fopen(path, "rb");
+    assert(f);
+    fseek(f, 0, SEEK_END);
+    *bytes = (size_t) ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t* data = (uint8_t*) malloc(*bytes);
+    assert(data);
+    size_t got = fread(data, 1, *bytes, f);
+    assert(got == *bytes);
+    fclose(f);
+    return data;
+}
+
+// Stands in for an optimiser step, every param moves
+static void perturb(MLP* nn, uint32_t* rng) {
+    for(int l = 0; l < nn->num_layers; l++) {
+        Tensor* params[2] = { nn->layers[l].weight, nn->layers[l].bias };
+        for(int p = 0; p < 2; p++) {
+            for(size_t i = 0; i < total_elems(params[p]); i++) params[p]->data[i] += rand_uniform(rng, -0.01f, 0.01f);
+        }
+    }
+    for(int l = 0; l < nn->num_layers - 1; l++) {
+        Tensor* mean = nn->norms[l].attrs.running_mean;
+        for(size_t i = 0; i < total_elems(mean); i++) mean->data[i] += 0.001f;
+    }
+}
+
+// Snapshots one step after another, then one more, then the params move on before it's written: the file has to be
+// the bytes save_model gives for that last snapshot and nothing later
+static void run(MLP* nn, Arena* arena, const char* path, int flags, uint32_t* rng) {
+    AsyncSaver saver;
+    async_save_init(&saver, nn, arena, path, flags);
+
+    for(int step = 1; step <= SAVE_STEPS; step++) {
+        perturb(nn, rng);
+        async_save_snapshot(&saver, (uint64_t) step);
+    }
+
+    size_t expect_bytes = model_serialize(nn, NULL, NULL, NULL);
+    uint8_t* expect = (uint8_t*) malloc(expect_bytes);
+    assert(expect);
+    model_serialize(nn, NULL, NULL, expect);
+    perturb(nn, rng);
+
+    assert(async_save_flush(&saver));
+    size_t got_bytes = 0;
+    uint8_t* got = read_file(path, &got_bytes);
+    assert(got_bytes == expect_bytes && memcmp(got, expect, expect_bytes) == 0);
+
+    AsyncSaveStats stats;
+    async_save_stats(&saver, &stats);
+    assert(stats.snapshots == SAVE_STEPS && stats.failed == 0 && stats.error[0] == '\0');
+    assert(stats.written + stats.superseded == stats.snapshots && stats.written_step == SAVE_STEPS);
+
+    printf("async save%s: %zu snapshots, %zu written, %zu superseded, %zu direct fallbacks, %.4f ms per snapshot "
+        "(max %.4f), %.3f ms per write\n", (flags & ASYNC_SAVE_DIRECT)? " (O_DIRECT)" : "", stats.snapshots,
+        stats.written, stats.superseded, stats.direct_fallbacks, stats.snapshot_ms / (double) stats.snapshots,
+        stats.max_snapshot_ms, stats.write_ms / (double) stats.written);
+
+    async_save_free(&saver);
+    free(expect);
+    free(got);
+}
+
+int main(void) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/tinyengine_async_%ld.bin", (long) getpid());
+
+    Arena param_arena;
+    arena_init(&param_arena, 1 << 22);
+    uint32_t rng = 7;
+    MLP nn;
+    init_mlp(&nn, &param_arena, 4, 2, 64, 3, ACT_RELU, INIT_HE_NORMAL, INIT_HE_NORMAL, &rng);
+    mlp_enable_norm(&nn, &param_arena, NORM_BATCH);
+
+    run(&nn, &param_arena, path, 0, &rng);
+    run(&nn, &param_arena, path, ASYNC_SAVE_DIRECT, &rng);
+
+    // The checkpoint is an ordinary model file
+    MLP loaded;
+    Arena load_arena;
+    arena_init(&load_arena, 1 << 22);
+    init_mlp(&loaded, &load_arena, 4, 2, 64, 3, ACT_RELU, INIT_HE_NORMAL, INIT_HE_NORMAL, &rng);
+    mlp_enable_norm(&loaded, &load_arena, NORM_BATCH);
+    load_model(path, &loaded);
+
+    // A path in a directory that isn't there: counted and kept, training isn't stopped over it
+    AsyncSaver saver;
+    async_save_init(&saver, &nn, &param_arena, "/tmp/tinyengine_no_such_dir/model.bin", 0);
+    async_save_snapshot(&saver, 1);
+    assert(!async_save_flush(&saver));
+    AsyncSaveStats stats;
+    async_save_stats(&saver, &stats);
+    assert(stats.failed == 1 && stats.written == 0 && stats.error[0] != '\0');
+    async_save_free(&saver);
+
+    printf("async save selftest passed\n");
+
+    remove(path);
+    mlp_free(&loaded);
+    mlp_free(&nn);
+    arena_free(&load_arena);
+    arena_free(&param_arena);
+    return 0;
+}
+#endif
@@ -0,0 +1,390 @@
+#include "infer.h"
+#include "parallel.h"
+
+// Generous on purpose, an arena is an mmap and only the pages a forward touches get backed. Per layer up to 8 [rows,
+// out] buffers (matmul, bias add, norm and its stats, activation, dropout and its mask), plus headers and sort arrays
+static size_t infer_arena_bytes(const InferPool* pool, int64_t rows) {
+    size_t floats = (size_t) rows * (size_t) pool->input_dim;
+    for(int l = 0; l < pool->num_layers; l++) {
+        floats += 8 * (size_t) rows * (size_t) pool->dims[l + 1];
+    }
+
+    return 2 * (floats * sizeof(float) + (size_t) (pool->num_layers + 1) * 16 * 1024) + (64 << 10);
+}
+
+void infer_pool_init(InferPool* pool, const MLP* nn, int64_t input_dim, int64_t max_rows, int num_slots) {
+    if(!pool || !nn) {
+        fatal("infer_pool_init cannot run: pool or nn is NULL");
+    }
+    if(input_dim < 1 || max_rows < 1) {
+        fatal("infer_pool_init cannot run: input_dim %" PRId64 " and max_rows %" PRId64 " must be >= 1",
+            input_dim, max_rows);
+    }
+    if(nn->num_layers < 1 || (int64_t) nn->layers[0].in_features != input_dim) {
+        fatal("infer_pool_init cannot run: the model takes %zu inputs, got input_dim %" PRId64,
+            nn->num_layers > 0? nn->layers[0].in_features : (size_t) 0, input_dim);
+    }
+
+    pool->nn = nn;
+    pool->num_layers = nn->num_layers;
+    pool->input_dim = input_dim;
+    pool->output_dim = (int64_t) nn->layers[nn->num_layers - 1].out_features;
+    pool->max_rows = max_rows;
+    pool->num_slots = num_slots > 0? num_slots : parallel_num_threads();
+
+    pool->dims = (int64_t*) malloc((size_t) (nn->num_layers + 1) * sizeof(int64_t));
+    pool->slots = (InferSlot*) malloc((size_t) pool->num_slots * sizeof(InferSlot));
+    if(!pool->dims || !pool->slots) {
+        fatal("infer_pool_init: malloc for %d slots failed", pool->num_slots);
+    }
+
+    pool->dims[0] = input_dim;
+    for(int l = 0; l < nn->num_layers; l++) {
+        pool->dims[l + 1] = (int64_t) nn->layers[l].out_features;
+    }
+    pool->arena_bytes = infer_arena_bytes(pool, max_rows);
+
+    // Slot i sits on slot i - 1, the top is the last one
+    for(int i = 0; i < pool->num_slots; i++) {
+        arena_init(&pool->slots[i].arena, pool->arena_bytes);
+        atomic_init(&pool->slots[i].next, (unsigned) i);
+    }
+    atomic_init(&pool->head, (uint64_t) pool->num_slots);
+    atomic_init(&pool->calls, 0);
+    atomic_init(&pool->overflows, 0);
+}
+
+void infer_pool_free(InferPool* pool) {
+    if(!pool || !pool->slots) {
+        return;
+    }
+
+    for(int i = 0; i < pool->num_slots; i++) {
+        arena_free(&pool->slots[i].arena);
+    }
+    free(pool->slots);
+    free(pool->dims);
+    pool->slots = NULL;
+    pool->dims = NULL;
+    pool->num_slots = 0;
+}
+
+// The tag in the high half changes on every successful swap, so a head that was popped and pushed back in between
+// doesn't compare equal and a stale next is never installed
+static InferSlot* pop_slot(InferPool* pool) {
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+
+    for(;;) {
+        uint32_t top = (uint32_t) head;
+        if(top == 0) {
+            return NULL;
+        }
+
+        InferSlot* slot = &pool->slots[top - 1];
+        uint64_t next = atomic_load_explicit(&slot->next, memory_order_relaxed);
+        uint64_t want = (((head >> 32) + 1) << 32) | next;
+
+        if(atomic_compare_exchange_weak_explicit(&pool->head, &head, want, memory_order_acquire,
+            memory_order_acquire)) {
+            return slot;
+        }
+    }
+}
+
+static void push_slot(InferPool* pool, InferSlot* slot) {
+    const uint64_t index = (uint64_t) (slot - pool->slots) + 1;
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+
+    do {
+        atomic_store_explicit(&slot->next, (unsigned) (uint32_t) head, memory_order_relaxed);
+    } while(!atomic_compare_exchange_weak_explicit(&pool->head, &head, (((head >> 32) + 1) << 32) | index,
+        memory_order_release, memory_order_relaxed));
+}
+
+static void run_forward(const InferPool* pool, const MLP* nn, Arena* arena, const float* x, int64_t rows,
+    float* logits) {
+    Graph graph;
+    graph_init(&graph, arena);
+
+    const int64_t x_shape[2] = { rows, pool->input_dim };
+    Tensor* x_tensor = tensor_new(arena, 2, x_shape);
+    memcpy(x_tensor->data, x, total_elems(x_tensor) * sizeof(float));
+
+    Node* out = mlp_forward(&graph, graph_add_input(&graph, x_tensor), nn);
+
+    Node** order = NULL;
+    size_t order_n = 0;
+    topological_sort(&graph, &order, &order_n);
+    graph_forward_pass(order, order_n);
+
+    // The last bias add, contiguous [rows, output_dim]
+    memcpy(logits, out->out->data, (size_t) rows * (size_t) pool->output_dim * sizeof(float));
+}
+
+static int same_shapes(const InferPool* pool, const MLP* nn) {
+    if(nn->num_layers != pool->num_layers) {
+        return 0;
+    }
+
+    for(int l = 0; l < nn->num_layers; l++) {
+        const Linear* layer = &nn->layers[l];
+        if((int64_t) layer->in_features != pool->dims[l] || (int64_t) layer->out_features != pool->dims[l + 1]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void mlp_infer(InferPool* pool, const float* x, int64_t rows, float* logits) {
+    if(!pool) {
+        fatal("mlp_infer cannot run: pool is NULL");
+    }
+
+    mlp_infer_on(pool, pool->nn, x, rows, logits);
+}
+
+void mlp_infer_on(InferPool* pool, const MLP* nn, const float* x, int64_t rows, float* logits) {
+    if(!pool || !pool->slots || !nn || !x || !logits) {
+        fatal("mlp_infer cannot run: pool, nn, x or logits is NULL");
+    }
+    if(rows < 1) {
+        fatal("mlp_infer cannot run: rows must be >= 1, got %" PRId64, rows);
+    }
+    if(nn != pool->nn && !same_shapes(pool, nn)) {
+        fatal("mlp_infer cannot run: the model's layer shapes differ from the ones the pool was made for");
+    }
+
+    atomic_fetch_add_explicit(&pool->calls, 1, memory_order_relaxed);
+
+    InferSlot* slot = (rows <= pool->max_rows)? pop_slot(pool) : NULL;
+    if(slot) {
+        arena_reset(&slot->arena);
+        run_forward(pool, nn, &slot->arena, x, rows, logits);
+        push_slot(pool, slot);
+        return;
+    }
+
+    atomic_fetch_add_explicit(&pool->overflows, 1, memory_order_relaxed);
+
+    Arena arena;
+    arena_init(&arena, infer_arena_bytes(pool, rows));
+    run_forward(pool, nn, &arena, x, rows, logits);
+    arena_free(&arena);
+}
+
+void infer_pool_stats(InferPool* pool, InferStats* stats) {
+    if(!pool || !stats) {
+        fatal("infer_pool_stats cannot run: input is NULL");
+    }
+
+    stats->calls = atomic_load(&pool->calls);
+    stats->overflows = atomic_load(&pool->overflows);
+}
+
+#ifdef INFER_SELFTEST_MAIN
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define INFER_THREADS 8
+#define INFER_SLOTS 3
+#define INFER_MAX_ROWS 32
+#define INFER_BATCHES 24
+#define INFER_ITERS 150
+#define INFER_IN 6
+#define INFER_OUT 4
+// How long the pool holder waits for the inference threads before calling them stuck
+#define INFER_HOLD_MS 30000.0
+
+// Batch b has 1 + (b * 7) % 40 rows, so a few go over INFER_MAX_ROWS and always take the one-off arena
+static int64_t batch_rows(int b) {
+    return 1 + (b * 7) % 40;
+}
+
+typedef struct {
+    InferPool* pool;
+    float* const* xs;
+    float* const* refs;
+    int id;
+    size_t mismatches;
+} Worker;
+
+// Every thread walks the batches in an order of its own and checks every result bit for bit against the single
+// threaded one
+static void* worker_main(void* arg) {
+    Worker* w = arg;
+    float logits[40 * INFER_OUT];
+    uint32_t rng = 1000u + (uint32_t) w->id;
+
+    for(int it = 0; it < INFER_ITERS; it++) {
+        int b = (int) (xorshift32(&rng) % INFER_BATCHES);
+        int64_t rows = batch_rows(b);
+
+        mlp_infer(w->pool, w->xs[b], rows, logits);
+        w->mismatches += memcmp(logits, w->refs[b], (size_t) rows * INFER_OUT * sizeof(float)) != 0;
+    }
+
+    return NULL;
+}
+
+// A threaded parallel_for that keeps the worker pool, and so its job lock, until every inference thread is done. Graph
+// building asks for the thread count on every matmul, had that taken the job lock the inference threads would sit
+// behind this job and it would time out
+typedef struct {
+    atomic_int holding;
+    atomic_int finished;
+    int timed_out;
+} PoolHold;
+
+static void hold_pool(void* ctx, size_t begin, size_t end) {
+    PoolHold* hold = ctx;
+    (void) end;
+
+    if(begin != 0) {
+        return;
+    }
+
+    atomic_store(&hold->holding, 1);
+    double start = now_ms();
+    while(atomic_load(&hold->finished) < INFER_THREADS) {
+        if(now_ms() - start > INFER_HOLD_MS) {
+            hold->timed_out = 1;
+            return;
+        }
+        sched_yield();
+    }
+}
+
+static void* holder_main(void* arg) {
+    parallel_for(4, 1, hold_pool, arg);
+    return NULL;
+}
+
+// Nodes of op in the graph mlp_forward builds for nn
+static int count_nodes(const MLP* nn, Op op) {
+    Arena scratch;
+    arena_init(&scratch, 1 << 20);
+    Graph graph;
+    graph_init(&graph, &scratch);
+
+    const int64_t shape[2] = { 1, INFER_IN };
+    mlp_forward(&graph, graph_add_input(&graph, tensor_new(&scratch, 2, shape)), nn);
+    Node** order;
+    size_t order_n;
+    topological_sort(&graph, &order, &order_n);
+
+    int count = 0;
+    for(size_t i = 0; i < order_n; i++) count += order[i]->operation == op;
+
+    arena_free(&scratch);
+    return count;
+}
+
+static uint64_t checksum(const MLP* nn) {
+    uint64_t sum = 1469598103934665603ull;
+
+    for(int l = 0; l < nn->num_layers; l++) {
+        const Tensor* tensors[2] = { nn->layers[l].weight, nn->layers[l].bias };
+        for(int t = 0; t < 2; t++) {
+            const uint8_t* bytes = (const uint8_t*) tensors[t]->data;
+            for(size_t i = 0; i < total_elems(tensors[t]) * sizeof(float); i++) {
+                sum = (sum ^ bytes[i]) * 1099511628211ull;
+            }
+        }
+    }
+
+    return sum;
+}
+
+int main(void) {
+    Arena param_arena;
+    arena_init(&param_arena, 1 << 22);
+
+    uint32_t rng = 4242;
+    MLP nn;
+    init_mlp(&nn, &param_arena, 4, INFER_IN, 96, INFER_OUT, ACT_RELU, INIT_HE_NORMAL, INIT_HE_NORMAL, &rng);
+    mlp_enable_norm(&nn, &param_arena, NORM_BATCH);
+    mlp_enable_dropout(&nn, 0.3f, 7);
+    // Dropout is a node per hidden layer while training and none at all for inference
+    assert(count_nodes(&nn, OP_DROPOUT) == 3);
+    mlp_set_training(&nn, 0);
+    assert(count_nodes(&nn, OP_DROPOUT) == 0);
+
+    float* xs[INFER_BATCHES];
+    float* refs[INFER_BATCHES];
+    for(int b = 0; b < INFER_BATCHES; b++) {
+        int64_t rows = batch_rows(b);
+        xs[b] = malloc((size_t) rows * INFER_IN * sizeof(float));
+        refs[b] = malloc((size_t) rows * INFER_OUT * sizeof(float));
+        assert(xs[b] && refs[b]);
+        for(int64_t i = 0; i < rows * INFER_IN; i++) xs[b][i] = rand_uniform(&rng, -1.0f, 1.0f);
+    }
+
+    // References one call at a time, on a worker pool big enough for the bigger layers to take the threaded matmul
+    parallel_set_threads(3);
+    InferPool pool;
+    infer_pool_init(&pool, &nn, INFER_IN, INFER_MAX_ROWS, INFER_SLOTS);
+    for(int b = 0; b < INFER_BATCHES; b++) {
+        mlp_infer(&pool, xs[b], batch_rows(b), refs[b]);
+    }
+    const uint64_t params_before = checksum(&nn);
+
+    pthread_t threads[INFER_THREADS];
+    Worker workers[INFER_THREADS];
+    for(int t = 0; t < INFER_THREADS; t++) {
+        workers[t] = (Worker) { &pool, xs, refs, t, 0 };
+        assert(pthread_create(&threads[t], NULL, worker_main, &workers[t]) == 0);
+    }
+
+    size_t mismatches = 0;
+    for(int t = 0; t < INFER_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        mismatches += workers[t].mismatches;
+    }
+
+    InferStats stats;
+    infer_pool_stats(&pool, &stats);
+    assert(mismatches == 0);
+    assert(checksum(&nn) == params_before);
+    assert(stats.calls == INFER_BATCHES + INFER_THREADS * INFER_ITERS);
+    assert(stats.overflows > 0);
+    // Every slot came back
+    int free_slots = 0;
+    for(InferSlot* slot; (slot = pop_slot(&pool)); ) free_slots++;
+    assert(free_slots == INFER_SLOTS);
+
+    // Again while another thread's parallel_for owns the pool, the threaded matmuls run inline then and still match
+    PoolHold hold = { 0 };
+    pthread_t holder;
+    assert(pthread_create(&holder, NULL, holder_main, &hold) == 0);
+    while(!atomic_load(&hold.holding)) sched_yield();
+
+    for(int t = 0; t < INFER_THREADS; t++) {
+        workers[t] = (Worker) { &pool, xs, refs, t + INFER_THREADS, 0 };
+        assert(pthread_create(&threads[t], NULL, worker_main, &workers[t]) == 0);
+    }
+    for(int t = 0; t < INFER_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        mismatches += workers[t].mismatches;
+        atomic_fetch_add(&hold.finished, 1);
+    }
+    pthread_join(holder, NULL);
+    assert(!hold.timed_out);
+    assert(mismatches == 0);
+
+    printf("mlp_infer: %d threads x %d calls on %d slots matched the single threaded logits bit for bit, %zu of %zu "
+        "calls on a one-off arena, params untouched, and again alongside a parallel_for holding the pool, selftest "
+        "passed\n", INFER_THREADS, INFER_ITERS, INFER_SLOTS, stats.overflows, stats.calls);
+
+    parallel_set_threads(1);
+    for(int b = 0; b < INFER_BATCHES; b++) {
+        free(xs[b]);
+        free(refs[b]);
+    }
+    infer_pool_free(&pool);
+    mlp_free(&nn);
+    arena_free(&param_arena);
+    return 0;
+}
+#endif
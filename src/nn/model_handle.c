@@ -0,0 +1,415 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "model_handle.h"
+#include "model.h"
+
+#include <math.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static void sleep_us(long us) {
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+// Weights and their grads (init_mlp allocates both), the norm params and stats, tensor headers. Only the touched pages
+// of the mapping get backed
+static size_t version_arena_bytes(const ModelArch* arch) {
+    size_t params = 0;
+    for(int l = 0; l < arch->num_layers; l++) {
+        size_t in = (size_t) (l == 0? arch->input_dim : arch->width);
+        size_t out = (size_t) (l == arch->num_layers - 1? arch->output_dim : arch->width);
+        params += (in + 1) * out + 4 * out;
+    }
+
+    return 2 * params * sizeof(float) + (size_t) arch->num_layers * 8 * 1024 + (64 << 10);
+}
+
+static void version_free(ModelVersion* version) {
+    mlp_free(&version->nn);
+    arena_free(&version->arena);
+    free(version);
+}
+
+static int tensor_finite(const Tensor* tensor) {
+    for(size_t i = 0; tensor && i < total_elems(tensor); i++) {
+        if(!isfinite(tensor->data[i])) return 0;
+    }
+
+    return 1;
+}
+
+static int params_finite(const MLP* nn) {
+    for(int l = 0; l < nn->num_layers; l++) {
+        if(!tensor_finite(nn->layers[l].weight) || !tensor_finite(nn->layers[l].bias)) return 0;
+    }
+    for(int l = 0; nn->norms && l < nn->num_layers - 1; l++) {
+        const NormLayer* norm = &nn->norms[l];
+        if(!tensor_finite(norm->gamma) || !tensor_finite(norm->beta)
+            || !tensor_finite(norm->attrs.running_mean) || !tensor_finite(norm->attrs.running_var)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// A fresh model of the handle's architecture with path's params, NULL and err set when the file doesn't fit it
+static ModelVersion* version_load(const ModelArch* arch, const char* path, char* err, size_t err_size) {
+    ModelVersion* version = (ModelVersion*) calloc(1, sizeof(ModelVersion));
+    if(!version) {
+        fatal("model_handle: calloc failed");
+    }
+
+    // The init values are overwritten by the file, the rng only has to be something
+    uint32_t rng = 1;
+    arena_init(&version->arena, version_arena_bytes(arch));
+    init_mlp(&version->nn, &version->arena, arch->num_layers, arch->input_dim, arch->width, arch->output_dim,
+        arch->activation, INIT_HE_NORMAL, INIT_HE_NORMAL, &rng);
+    mlp_enable_norm(&version->nn, &version->arena, arch->norm);
+    mlp_set_training(&version->nn, 0);
+
+    if(!read_model(path, &version->nn, err, err_size)) {
+        version_free(version);
+        return NULL;
+    }
+    if(!params_finite(&version->nn)) {
+        snprintf(err, err_size, "%s has params that are NaN or inf", path);
+        version_free(version);
+        return NULL;
+    }
+
+    return version;
+}
+
+// Whether path is a different file than the one last seen, which it then becomes
+static int file_changed(ModelHandle* handle) {
+    struct stat st;
+    if(stat(handle->path, &st) != 0) {
+        return 0;
+    }
+
+    int64_t mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    int changed = st.st_dev != handle->seen_dev || st.st_ino != handle->seen_ino || st.st_size != handle->seen_size
+        || mtime_ns != handle->seen_mtime_ns;
+
+    handle->seen_dev = st.st_dev;
+    handle->seen_ino = st.st_ino;
+    handle->seen_size = st.st_size;
+    handle->seen_mtime_ns = mtime_ns;
+    return changed;
+}
+
+void model_handle_init(ModelHandle* handle, const ModelArch* arch, const char* path, int64_t max_rows, int num_slots) {
+    if(!handle || !arch || !path) {
+        fatal("model_handle_init cannot run: handle, arch or path is NULL");
+    }
+
+    memset(handle, 0, sizeof(*handle));
+    handle->arch = *arch;
+    handle->path = (char*) malloc(strlen(path) + 1);
+    if(!handle->path) {
+        fatal("model_handle_init: malloc failed");
+    }
+    strcpy(handle->path, path);
+    file_changed(handle);
+
+    char err[256];
+    ModelVersion* first = version_load(arch, path, err, sizeof(err));
+    if(!first) {
+        fatal("model_handle_init: %s", err);
+    }
+    first->id = 1;
+
+    atomic_init(&handle->current, first);
+    atomic_init(&handle->epoch, 0);
+    atomic_init(&handle->readers[0], 0);
+    atomic_init(&handle->readers[1], 0);
+    atomic_init(&handle->stop, 0);
+    pthread_mutex_init(&handle->reload_lock, NULL);
+
+    // Sized off the first version, every later one has the same shapes. The pool keeps no model of its own, so a
+    // freed version can't be mistaken for it
+    infer_pool_init(&handle->pool, &first->nn, arch->input_dim, max_rows, num_slots);
+    handle->pool.nn = NULL;
+}
+
+void model_handle_free(ModelHandle* handle) {
+    if(!handle || !handle->path) {
+        return;
+    }
+
+    if(handle->watching) {
+        atomic_store(&handle->stop, 1);
+        pthread_join(handle->watcher, NULL);
+        handle->watching = 0;
+    }
+
+    version_free(atomic_load(&handle->current));
+    infer_pool_free(&handle->pool);
+    pthread_mutex_destroy(&handle->reload_lock);
+    free(handle->path);
+    handle->path = NULL;
+}
+
+ModelRead model_read_begin(ModelHandle* handle) {
+    unsigned side = atomic_load(&handle->epoch) & 1u;
+    atomic_fetch_add(&handle->readers[side], 1);
+
+    return (ModelRead) { atomic_load(&handle->current), side };
+}
+
+void model_read_end(ModelHandle* handle, ModelRead read) {
+    atomic_fetch_sub(&handle->readers[read.side], 1);
+}
+
+uint64_t model_handle_infer(ModelHandle* handle, const float* x, int64_t rows, float* logits) {
+    ModelRead read = model_read_begin(handle);
+    mlp_infer_on(&handle->pool, &read.version->nn, x, rows, logits);
+    uint64_t id = read.version->id;
+    model_read_end(handle, read);
+
+    return id;
+}
+
+/* Every reader that could hold the old pointer counted itself in before the swap. The first flip sends new readers to
+   the other side and drains this one, the second flip drains the other side too, which catches a reader that read the
+   epoch before some earlier flip but only counted itself in after it */
+static void wait_for_readers(ModelHandle* handle) {
+    for(int flip = 0; flip < 2; flip++) {
+        unsigned side = atomic_fetch_add(&handle->epoch, 1) & 1u;
+
+        while(atomic_load(&handle->readers[side]) != 0) {
+            sleep_us(20);
+        }
+    }
+}
+
+int model_handle_reload(ModelHandle* handle, const char* path, char* err, size_t err_size) {
+    if(!handle || !path) {
+        fatal("model_handle_reload cannot run: handle or path is NULL");
+    }
+
+    char local_err[256];
+    if(!err || err_size == 0) {
+        err = local_err;
+        err_size = sizeof(local_err);
+    }
+
+    // The load is the slow part and needs no lock, readers keep going on the current version meanwhile
+    ModelVersion* next = version_load(&handle->arch, path, err, err_size);
+    if(!next) {
+        atomic_fetch_add(&handle->rejected, 1);
+        return 0;
+    }
+
+    pthread_mutex_lock(&handle->reload_lock);
+    ModelVersion* old = atomic_load(&handle->current);
+    next->id = old->id + 1;
+    atomic_store(&handle->current, next);
+
+    double start = now_ms();
+    wait_for_readers(handle);
+    size_t grace_us = (size_t) ((now_ms() - start) * 1e3);
+    if(grace_us > atomic_load(&handle->max_grace_us)) {
+        atomic_store(&handle->max_grace_us, grace_us);
+    }
+    pthread_mutex_unlock(&handle->reload_lock);
+
+    version_free(old);
+    atomic_fetch_add(&handle->freed, 1);
+    atomic_fetch_add(&handle->reloads, 1);
+    return 1;
+}
+
+static void* watch_main(void* arg) {
+    ModelHandle* handle = arg;
+
+    while(!atomic_load(&handle->stop)) {
+        if(file_changed(handle)) {
+            model_handle_reload(handle, handle->path, NULL, 0);
+        }
+
+        sleep_us((long) handle->poll_ms * 1000);
+    }
+
+    return NULL;
+}
+
+void model_handle_watch(ModelHandle* handle, int poll_ms) {
+    if(!handle || !handle->path) {
+        fatal("model_handle_watch cannot run: handle is not initialised");
+    }
+    if(handle->watching) {
+        fatal("model_handle_watch cannot run: already watching %s", handle->path);
+    }
+
+    handle->poll_ms = poll_ms > 0? poll_ms : 1;
+    atomic_store(&handle->stop, 0);
+    if(pthread_create(&handle->watcher, NULL, watch_main, handle) != 0) {
+        fatal("model_handle_watch: pthread_create failed");
+    }
+    handle->watching = 1;
+}
+
+void model_handle_stats(ModelHandle* handle, ModelHandleStats* stats) {
+    if(!handle || !stats) {
+        fatal("model_handle_stats cannot run: input is NULL");
+    }
+
+    ModelRead read = model_read_begin(handle);
+    stats->version = read.version->id;
+    model_read_end(handle, read);
+
+    stats->reloads = atomic_load(&handle->reloads);
+    stats->rejected = atomic_load(&handle->rejected);
+    stats->freed = atomic_load(&handle->freed);
+    stats->max_grace_ms = (double) atomic_load(&handle->max_grace_us) * 1e-3;
+}
+
+#ifdef MODEL_HANDLE_SELFTEST_MAIN
+#include <assert.h>
+#include <unistd.h>
+
+#define HANDLE_READERS 4
+#define HANDLE_ROWS 16
+#define HANDLE_SWAPS 6
+
+typedef struct {
+    ModelHandle* handle;
+    const float* x;
+    // Logits of model A and model B, odd versions are A and even ones B
+    const float* refs[2];
+    atomic_int* stop;
+    size_t calls;
+    size_t mismatches;
+    uint64_t versions_seen;
+} Reader;
+
+static void* reader_main(void* arg) {
+    Reader* r = arg;
+    float logits[HANDLE_ROWS * 3];
+    uint64_t last = 0;
+
+    while(!atomic_load(r->stop)) {
+        uint64_t id = model_handle_infer(r->handle, r->x, HANDLE_ROWS, logits);
+
+        r->mismatches += memcmp(logits, r->refs[(id - 1) % 2], sizeof(logits)) != 0;
+        r->versions_seen += id != last;
+        last = id;
+        r->calls++;
+    }
+
+    return NULL;
+}
+
+// Until the handle counted one more reload or rejection, the watcher polls every millisecond
+static void wait_for(ModelHandle* handle, size_t reloads, size_t rejected) {
+    ModelHandleStats stats;
+    double start = now_ms();
+
+    do {
+        sleep_us(500);
+        model_handle_stats(handle, &stats);
+        assert(now_ms() - start < 10000.0);
+    } while(stats.reloads < reloads || stats.rejected < rejected);
+}
+
+int main(void) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/tinyengine_handle_%ld.bin", (long) getpid());
+
+    const ModelArch arch = { 3, 2, 24, 3, ACT_TANH, NORM_LAYER };
+    Arena param_arena;
+    arena_init(&param_arena, 1 << 22);
+
+    uint32_t rng = 99;
+    MLP models[2], other;
+    for(int m = 0; m < 2; m++) {
+        init_mlp(&models[m], &param_arena, arch.num_layers, arch.input_dim, arch.width, arch.output_dim,
+            arch.activation, INIT_HE_NORMAL, INIT_HE_NORMAL, &rng);
+        mlp_enable_norm(&models[m], &param_arena, arch.norm);
+        mlp_set_training(&models[m], 0);
+    }
+    init_mlp(&other, &param_arena, arch.num_layers, arch.input_dim, arch.width + 1, arch.output_dim, arch.activation,
+        INIT_HE_NORMAL, INIT_HE_NORMAL, &rng);
+    mlp_enable_norm(&other, &param_arena, arch.norm);
+
+    float x[HANDLE_ROWS * 2], refs[2][HANDLE_ROWS * 3];
+    for(int i = 0; i < HANDLE_ROWS * 2; i++) x[i] = rand_uniform(&rng, -1.0f, 1.0f);
+    for(int m = 0; m < 2; m++) {
+        InferPool pool;
+        infer_pool_init(&pool, &models[m], arch.input_dim, HANDLE_ROWS, 1);
+        mlp_infer(&pool, x, HANDLE_ROWS, refs[m]);
+        infer_pool_free(&pool);
+    }
+
+    save_model(path, &models[0]);
+    ModelHandle handle;
+    model_handle_init(&handle, &arch, path, HANDLE_ROWS, 0);
+    model_handle_watch(&handle, 1);
+
+    atomic_int stop;
+    atomic_init(&stop, 0);
+    pthread_t threads[HANDLE_READERS];
+    Reader readers[HANDLE_READERS];
+    for(int t = 0; t < HANDLE_READERS; t++) {
+        readers[t] = (Reader) { &handle, x, { refs[0], refs[1] }, &stop, 0, 0, 0 };
+        assert(pthread_create(&threads[t], NULL, reader_main, &readers[t]) == 0);
+    }
+
+    // Alternate the two models under the readers, with a broken file of each kind in between that must not go in
+    size_t reloads = 0, rejected = 0;
+    for(int s = 0; s < HANDLE_SWAPS; s++) {
+        save_model(path, &models[(s + 1) % 2]);
+        wait_for(&handle, ++reloads, rejected);
+
+        if(s == 1) {
+            save_model(path, &other);
+        }
+        else if(s == 3) {
+            float keep = models[0].layers[1].weight->data[5];
+            models[0].layers[1].weight->data[5] = NAN;
+            save_model(path, &models[0]);
+            models[0].layers[1].weight->data[5] = keep;
+        }
+        else if(s == 4) {
+            FILE* f = fopen(path, "wb");
+            assert(f);
+            fwrite("TMLP000", 1, 8, f);
+            fclose(f);
+        }
+        else {
+            continue;
+        }
+        wait_for(&handle, reloads, ++rejected);
+    }
+
+    atomic_store(&stop, 1);
+    size_t calls = 0, mismatches = 0, min_seen = SIZE_MAX;
+    for(int t = 0; t < HANDLE_READERS; t++) {
+        pthread_join(threads[t], NULL);
+        calls += readers[t].calls;
+        mismatches += readers[t].mismatches;
+        min_seen = readers[t].versions_seen < min_seen? readers[t].versions_seen : min_seen;
+    }
+
+    ModelHandleStats stats;
+    model_handle_stats(&handle, &stats);
+    assert(mismatches == 0);
+    assert(stats.reloads == HANDLE_SWAPS && stats.rejected == 3 && stats.freed == HANDLE_SWAPS);
+    assert(stats.version == 1 + HANDLE_SWAPS);
+
+    printf("model handle: %d swaps and 3 rejected files under %d readers, %zu calls all on a whole version (every "
+        "reader saw at least %zu), longest grace period %.3f ms, selftest passed\n", HANDLE_SWAPS, HANDLE_READERS,
+        calls, min_seen, stats.max_grace_ms);
+
+    model_handle_free(&handle);
+    remove(path);
+    mlp_free(&models[0]);
+    mlp_free(&models[1]);
+    mlp_free(&other);
+    arena_free(&param_arena);
+    return 0;
+}
+#endif
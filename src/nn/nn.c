@@ -1,51 +1,44 @@
 #include "nn.h"
 #include "optim.h"
 
-// rng for random init
-static void weight_init_matrix(Tensor* tensor, InitScheme init_scheme, uint32_t* rng) {
+// rng for random init, it only seeds a Philox stream per matrix and the bulk fill does the rest (across parallel_for
+// for the big matrices, same values on any thread count)
+static void weight_init_fans(Tensor* tensor, int fan_in, int fan_out, InitScheme init_scheme, uint32_t* rng) {
     if(!tensor) {
         printf("weight_init_matrix failed, tensor is NULL");
         return;
     }
 
-    int fan_in = (int) tensor->shape[0];
-    int fan_out = (int) tensor->shape[1];
+    Philox philox;
+    philox_init(&philox, xorshift32(rng), 0);
 
     size_t number_elements = total_elems(tensor);
 
     if(init_scheme == INIT_XAVIER_UNIFORM) {
         float a = sqrtf(6.0f / (float) (fan_in + fan_out));
 
-        for(size_t i = 0; i < number_elements; i++) {
-            tensor->data[i] = rand_uniform(rng, -a, a);
-        }
+        fill_uniform(&philox, tensor->data, number_elements, -a, a);
 
         return;
     }
     else if(init_scheme == INIT_XAVIER_NORMAL) {
         float std = sqrt(2.0f / (float) (fan_in + fan_out));
 
-        for(size_t i = 0; i < number_elements; i++) {
-            tensor->data[i] = rand_normal(rng, 0.0f, std);
-        }
+        fill_normal(&philox, tensor->data, number_elements, 0.0f, std);
 
         return;
     }
     else if(init_scheme == INIT_HE_UNIFORM) {
         float a = sqrtf(6.0f / (float)(fan_in));
 
-        for(size_t i = 0; i < number_elements; i++) {
-            tensor->data[i] = rand_uniform(rng, -a, a);
-        }
+        fill_uniform(&philox, tensor->data, number_elements, -a, a);
 
         return;
     }
     else if(init_scheme == INIT_HE_NORMAL) {
         float std = sqrtf(2.0f / (float)(fan_in));
 
-        for(size_t i = 0; i < number_elements; i++) {
-            tensor->data[i] = rand_normal(rng, 0.0f, std);
-        }
+        fill_normal(&philox, tensor->data, number_elements, 0.0f, std);
 
         return;
     }
@@ -54,6 +47,10 @@ static void weight_init_matrix(Tensor* tensor, InitScheme init_scheme, uint32_t*
     }
 }
 
+static void weight_init_matrix(Tensor* tensor, InitScheme init_scheme, uint32_t* rng) {
+    weight_init_fans(tensor, (int) tensor->shape[0], (int) tensor->shape[1], init_scheme, rng);
+}
+
 static void init_bias(Tensor* tensor) {
     if(!tensor) {
         printf("init_bias cannot run, bias tensor is NULL");
@@ -65,15 +62,15 @@ static void init_bias(Tensor* tensor) {
 
 static void linear_init(Linear* layer, Arena* param_arena, size_t in_features, size_t out_features, InitScheme init_scheme, uint32_t* rng) {
     if(!layer || !param_arena) {
-        prinf("layer_init failed, layer or param_arena is NULL");
+        printf("layer_init failed, layer or param_arena is NULL");
         return;
     }
 
     layer->in_features = in_features;
     layer->out_features = out_features;
 
-    int64_t w_shape = { in_features, out_features };
-    int64_t b_shape = { 1, out_features };
+    int64_t w_shape[2] = { (int64_t) in_features, (int64_t) out_features };
+    int64_t b_shape[2] = { 1, (int64_t) out_features };
 
     layer->weight = tensor_new(param_arena, 2, w_shape);
     layer->bias = tensor_new(param_arena, 2, b_shape);
@@ -81,6 +78,8 @@ static void linear_init(Linear* layer, Arena* param_arena, size_t in_features, s
     layer->weight->grad = tensor_zeroes_like(param_arena, layer->weight);
     layer->bias->grad = tensor_zeroes_like(param_arena, layer->bias);
 
+    layer->weight_half = NULL;
+
     weight_init_matrix(layer->weight, init_scheme, rng);
     init_bias(layer->bias);
 
@@ -109,6 +108,9 @@ void init_mlp(MLP* nn,
 
                 nn->num_layers = num_layers;
                 nn->hidden_activation = hidden_activation;
+                nn->norm = NORM_NONE;
+                nn->norms = NULL;
+                nn->dropouts = NULL;
                 // Arena?
                 nn->layers = (Linear*) malloc((size_t) num_layers * sizeof(Linear));
 
@@ -134,13 +136,22 @@ Node* layer_forward(Graph* graph, Node* input, const Linear* layer) {
         fatal("mlp_forward cannot run: graph or input or nn is NULL");
     }
 
-    Tensor* weight = layer->weight;
+    // The 16 bit copy halves the weight bytes streamed by matmul, which accumulates in fp32 either way
+    Tensor* weight = layer->weight_half? layer->weight_half : layer->weight;
     Tensor* bias = layer->bias;
 
     Node* w_node = graph_add_input(graph, weight);
     Node* inputs_w[2] = { input, w_node };
     Node* mm_node = add_node(graph, OP_MATMUL, 2, inputs_w);
 
+    // Batched input, broadcast the [1, out] bias over the rows with a 0 stride view so no copy is made
+    // and its grad view sums the rows back into bias->grad
+    int64_t rows = mm_node->out->shape[0];
+    if(rows != bias->shape[0]) {
+        int64_t b_shape[2] = { rows, bias->shape[1] };
+        bias = tensor_expand(graph->arena, bias, 2, b_shape);
+    }
+
     Node* b_node = graph_add_input(graph, bias);
     Node* inputs_b[2] = { mm_node, b_node };
     Node* a_node = add_node(graph, OP_ADD, 2, inputs_b);
@@ -148,13 +159,57 @@ Node* layer_forward(Graph* graph, Node* input, const Linear* layer) {
     return a_node;
 }
 
+void conv_layer_init(ConvLayer* layer, Arena* param_arena, int spatial, size_t in_channels, size_t out_channels,
+    const int* kernel, const int* stride, const int* padding, InitScheme init_scheme, uint32_t* rng) {
+    if(!layer || !param_arena || !kernel) {
+        fatal("conv_layer_init cannot run: layer, param_arena or kernel is NULL");
+    }
+    if(spatial != 1 && spatial != 2) {
+        fatal("conv_layer_init cannot run: only 1 and 2 spatial dims, got %d", spatial);
+    }
+
+    layer->spatial = spatial;
+    layer->in_channels = in_channels;
+    layer->out_channels = out_channels;
+    layer->attrs = (ConvAttrs) { { 1, 1 }, { 0, 0 } };
+
+    int64_t w_shape[4] = { (int64_t) out_channels, (int64_t) in_channels, 0, 0 };
+    int taps = 1;
+    for(int d = 0; d < spatial; d++) {
+        w_shape[2 + d] = kernel[d];
+        taps *= kernel[d];
+        layer->attrs.stride[d] = stride? stride[d] : 1;
+        layer->attrs.padding[d] = padding? padding[d] : 0;
+    }
+    const int64_t b_shape[1] = { (int64_t) out_channels };
+
+    layer->weight = tensor_new(param_arena, spatial + 2, w_shape);
+    layer->bias = tensor_new(param_arena, 1, b_shape);
+    layer->weight->grad = tensor_zeroes_like(param_arena, layer->weight);
+    layer->bias->grad = tensor_zeroes_like(param_arena, layer->bias);
+
+    // Every output sees in_channels * taps inputs, every input feeds out_channels * taps outputs
+    weight_init_fans(layer->weight, (int) in_channels * taps, (int) out_channels * taps, init_scheme, rng);
+    init_bias(layer->bias);
+}
+
+Node* conv_layer_forward(Graph* graph, Node* input, const ConvLayer* layer) {
+    if(!graph || !input || !layer) {
+        fatal("conv_layer_forward cannot run: graph or input or layer is NULL");
+    }
+
+    Node* conv_in[3] = { input, graph_add_input(graph, layer->weight), graph_add_input(graph, layer->bias) };
+    return add_node_attrs(graph, layer->spatial == 1? OP_CONV1D : OP_CONV2D, 3, conv_in, &layer->attrs);
+}
+
 Node* apply_activation(Graph* graph, Activation activation, Node* input) {
     if(activation == ACT_NONE) {
         return input;
     }
 
     Node* act_input[1] = { input };
-    Op op_type;
+    // fatal isn't noreturn, -O2 would flag the else branch as leaving it unset
+    Op op_type = OP_RELU;
 
     if(activation == ACT_RELU) {
         op_type = OP_RELU;
@@ -186,7 +241,20 @@ Node* mlp_forward(Graph* graph, Node* input, const MLP* nn) {
 
     for(int i = 0; i < nn->num_layers - 1; i++) {
         head = layer_forward(graph, head, &nn->layers[i]);
+
+        if(nn->norms) {
+            const NormLayer* norm = &nn->norms[i];
+            Node* norm_in[3] = { head, graph_add_input(graph, norm->gamma), graph_add_input(graph, norm->beta) };
+            head = add_node_attrs(graph, nn->norm == NORM_LAYER? OP_LAYERNORM : OP_BATCHNORM, 3, norm_in, &norm->attrs);
+        }
+
         head = apply_activation(graph, nn->hidden_activation, head);
+
+        // Out of the graph when it would only copy, inference pays nothing for it
+        if(nn->dropouts && nn->dropouts[i].training && nn->dropouts[i].p > 0.0f) {
+            Node* drop_in[1] = { head };
+            head = add_node_attrs(graph, OP_DROPOUT, 1, drop_in, &nn->dropouts[i]);
+        }
     }
 
     head = layer_forward(graph, head, &nn->layers[nn->num_layers-1]);
@@ -195,11 +263,127 @@ Node* mlp_forward(Graph* graph, Node* input, const MLP* nn) {
     return head;
 }
 
-static void mlp_zero_grads(MLP* nn) {
+void mlp_zero_grads(MLP* nn) {
     for(int l = 0; l < nn->num_layers; l++) {
         tensor_zero_grad(nn->layers[l].weight);
         tensor_zero_grad(nn->layers[l].bias);
     }
+    for(int l = 0; nn->norms && l < nn->num_layers - 1; l++) {
+        tensor_zero_grad(nn->norms[l].gamma);
+        tensor_zero_grad(nn->norms[l].beta);
+    }
+}
+
+// Plain SGD on the fp32 masters, the half copies are refreshed from them right after
+void mlp_sgd_step(MLP* nn, float lr) {
+    for(int l = 0; l < nn->num_layers; l++) {
+        sgd_step(nn->layers[l].weight, lr);
+        sgd_step(nn->layers[l].bias, lr);
+    }
+    for(int l = 0; nn->norms && l < nn->num_layers - 1; l++) {
+        sgd_step(nn->norms[l].gamma, lr);
+        sgd_step(nn->norms[l].beta, lr);
+    }
+    for(int l = 0; nn->dropouts && l < nn->num_layers - 1; l++) {
+        nn->dropouts[l].step++;
+    }
+
+    mlp_sync_half_weights(nn);
+}
+
+void mlp_enable_mixed_precision(MLP* nn, Arena* param_arena, DType dtype) {
+    if(!nn || !param_arena) {
+        fatal("mlp_enable_mixed_precision cannot run: nn or param_arena is NULL");
+    }
+    if(dtype == DTYPE_F32) {
+        fatal("mlp_enable_mixed_precision cannot run: dtype must be bf16 or fp16");
+    }
+
+    for(int l = 0; l < nn->num_layers; l++) {
+        Linear* layer = &nn->layers[l];
+
+        layer->weight_half = tensor_cast(param_arena, layer->weight, dtype);
+        layer->weight_half->grad = layer->weight->grad;
+    }
+}
+
+void mlp_sync_half_weights(MLP* nn) {
+    for(int l = 0; l < nn->num_layers; l++) {
+        Linear* layer = &nn->layers[l];
+
+        if(layer->weight_half) {
+            tensor_copy_cast(layer->weight_half, layer->weight);
+        }
+    }
+}
+
+void mlp_enable_norm(MLP* nn, Arena* param_arena, NormType norm) {
+    if(!nn || !param_arena) {
+        fatal("mlp_enable_norm cannot run: nn or param_arena is NULL");
+    }
+    if(nn->norms) {
+        fatal("mlp_enable_norm cannot run: norm layers are already set");
+    }
+    if(norm == NORM_NONE || nn->num_layers < 2) {
+        return;
+    }
+
+    nn->norm = norm;
+    nn->norms = (NormLayer*) malloc((size_t) (nn->num_layers - 1) * sizeof(NormLayer));
+    if(!nn->norms) {
+        fatal("mlp_enable_norm: malloc for the norm layers failed");
+    }
+
+    for(int l = 0; l < nn->num_layers - 1; l++) {
+        NormLayer* layer = &nn->norms[l];
+        const int64_t shape[2] = { 1, (int64_t) nn->layers[l].out_features };
+
+        layer->gamma = tensor_new(param_arena, 2, shape);
+        layer->beta = tensor_new(param_arena, 2, shape);
+        tensor_fill(layer->gamma, 1.0f);
+        tensor_fill(layer->beta, 0.0f);
+        layer->gamma->grad = tensor_zeroes_like(param_arena, layer->gamma);
+        layer->beta->grad = tensor_zeroes_like(param_arena, layer->beta);
+
+        layer->attrs = (NormAttrs) { .eps = NORM_DEFAULT_EPS, .momentum = 0.1f, .training = 1 };
+        if(norm == NORM_BATCH) {
+            layer->attrs.running_mean = tensor_zeroes_like(param_arena, layer->gamma);
+            layer->attrs.running_var = tensor_new(param_arena, 2, shape);
+            tensor_fill(layer->attrs.running_var, 1.0f);
+        }
+    }
+}
+
+void mlp_enable_dropout(MLP* nn, float p, uint64_t seed) {
+    if(!nn) {
+        fatal("mlp_enable_dropout cannot run: nn is NULL");
+    }
+    if(p < 0.0f || p >= 1.0f) {
+        fatal("mlp_enable_dropout cannot run: p must be in [0, 1), got %f", p);
+    }
+    if(p == 0.0f || nn->num_layers < 2) {
+        return;
+    }
+
+    free(nn->dropouts);
+    nn->dropouts = (DropoutAttrs*) malloc((size_t) (nn->num_layers - 1) * sizeof(DropoutAttrs));
+    if(!nn->dropouts) {
+        fatal("mlp_enable_dropout: malloc for the dropout attrs failed");
+    }
+
+    // Layers share the step but not the seed, so their masks are independent
+    for(int l = 0; l < nn->num_layers - 1; l++) {
+        nn->dropouts[l] = (DropoutAttrs) { .p = p, .seed = seed + (uint64_t) l, .step = 0, .training = 1 };
+    }
+}
+
+void mlp_set_training(MLP* nn, int training) {
+    for(int l = 0; nn->norms && l < nn->num_layers - 1; l++) {
+        nn->norms[l].attrs.training = training;
+    }
+    for(int l = 0; nn->dropouts && l < nn->num_layers - 1; l++) {
+        nn->dropouts[l].training = training;
+    }
 }
 
 void mlp_free(MLP* nn) {
@@ -207,7 +391,116 @@ void mlp_free(MLP* nn) {
         return;
     }
 
+    free(nn->norms);
+    nn->norms = NULL;
+    free(nn->dropouts);
+    nn->dropouts = NULL;
+
     free(nn->layers);
     nn->layers = NULL;
     nn->layers = 0;
-}
\ No newline at end of file
+}
+#ifdef NN_SELFTEST_MAIN
+#include "dataset.h"
+#include <assert.h>
+#include <math.h>
+
+#define NN_POINTS 100
+#define NN_STEPS 300
+#define NN_LR 0.5f
+
+// 16 bit copy of a master value, what mlp_sync_half_weights has to leave behind
+static float half_of(DType dtype, float value) {
+    return dtype == DTYPE_BF16? bf16_to_f32(f32_to_bf16(value)) : f16_to_f32(f32_to_f16(value));
+}
+
+// Full batch SGD on a 2 class spiral from a fixed init, fp32 when half is DTYPE_F32. Loss of the first and last step
+static void train_spiral(DType half, float* first_loss, float* last_loss) {
+    Arena param_arena, data_arena, scratch;
+    arena_init(&param_arena, 1 << 20);
+    arena_init(&data_arena, 1 << 16);
+    arena_init(&scratch, 1 << 20);
+
+    uint32_t seed = 2024;
+    Dataset dataset;
+    generate_dataset(&dataset, &data_arena, 2, NN_POINTS, 2, DATA_SPIRAL, &seed);
+    MLP nn;
+    init_mlp(&nn, &param_arena, 3, 2, 32, 2, ACT_TANH, INIT_XAVIER_NORMAL, INIT_XAVIER_NORMAL, &seed);
+
+    if(half != DTYPE_F32) {
+        mlp_enable_mixed_precision(&nn, &param_arena, half);
+        for(int l = 0; l < nn.num_layers; l++) {
+            assert(nn.layers[l].weight_half->dtype == half);
+            // The graph's weight grad is the master's, the optimiser only ever sees fp32
+            assert(nn.layers[l].weight_half->grad == nn.layers[l].weight->grad);
+        }
+    }
+
+    const int64_t x_shape[2] = { 2 * NN_POINTS, 2 };
+    const int64_t label_shape[1] = { 2 * NN_POINTS };
+    const Tensor* w0 = nn.layers[1].weight;
+    float* before = malloc(total_elems(w0) * sizeof(float));
+    assert(before);
+
+    for(int s = 0; s < NN_STEPS; s++) {
+        arena_reset(&scratch);
+        Graph graph;
+        graph_init(&graph, &scratch);
+
+        // Graph inputs live in the graph's arena, the backward gives them grads there
+        Tensor* x = tensor_new(&scratch, 2, x_shape);
+        Tensor* labels = tensor_new_dtype(&scratch, 1, label_shape, DTYPE_I32);
+        memcpy(x->data, dataset.class_dpoints, total_elems(x) * sizeof(float));
+        for(int i = 0; i < 2 * NN_POINTS; i++) labels->data_i32[i] = i / NN_POINTS;
+
+        Node* logits = mlp_forward(&graph, graph_add_input(&graph, x), &nn);
+        Node* ce_in[2] = { logits, graph_add_input(&graph, labels) };
+        Node* loss = add_node(&graph, OP_SOFTMAX_CROSS_ENTROPY, 2, ce_in);
+        Node** order = NULL;
+        size_t order_n = 0;
+        topological_sort(&graph, &order, &order_n);
+        graph_forward_pass(order, order_n);
+        graph_backward_pass(&graph, order, order_n, loss->out);
+
+        if(s == 0) *first_loss = loss->out->data[0];
+        *last_loss = loss->out->data[0];
+
+        memcpy(before, w0->data, total_elems(w0) * sizeof(float));
+        mlp_sgd_step(&nn, NN_LR);
+        mlp_zero_grads(&nn);
+
+        if(half == DTYPE_F32) continue;
+
+        // The update lands in the fp32 master and the 16 bit copy is its rounding again
+        assert(memcmp(before, w0->data, total_elems(w0) * sizeof(float)) != 0);
+        for(int l = 0; l < nn.num_layers; l++) {
+            const Linear* layer = &nn.layers[l];
+            for(size_t i = 0; i < total_elems(layer->weight); i++) {
+                assert(tensor_load(layer->weight_half, i) == half_of(half, layer->weight->data[i]));
+            }
+        }
+    }
+
+    free(before);
+    mlp_free(&nn);
+    arena_free(&scratch);
+    arena_free(&data_arena);
+    arena_free(&param_arena);
+}
+
+int main(void) {
+    float first32, last32, first_bf, last_bf, first_hf, last_hf;
+    train_spiral(DTYPE_F32, &first32, &last32);
+    train_spiral(DTYPE_BF16, &first_bf, &last_bf);
+    train_spiral(DTYPE_F16, &first_hf, &last_hf);
+
+    printf("spiral loss over %d steps: fp32 %.4f -> %.4f, bf16 %.4f -> %.4f, fp16 %.4f -> %.4f\n", NN_STEPS,
+        (double) first32, (double) last32, (double) first_bf, (double) last_bf, (double) first_hf, (double) last_hf);
+    assert(last32 < 0.25f * first32);
+    assert(fabsf(last_bf - last32) < 0.25f * last32 + 0.002f);
+    assert(fabsf(last_hf - last32) < 0.25f * last32 + 0.002f);
+
+    printf("mixed precision training tracks fp32, masters take the updates and the 16 bit copies resync, selftest passed\n");
+    return 0;
+}
+#endif
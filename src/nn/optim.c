@@ -1,10 +1,13 @@
 #include "optim.h"
 #include "tensor.h"
+#include "utils.h"
+
+#include <math.h>
 
 void tensor_zero_grad(Tensor* tensor) {
     if(!tensor || !tensor->grad) {
         printf("tensor_zero_grad: tensor or gradient is NULL");
-        return NULL;
+        return;
     }
 
     tensor_fill(tensor->grad, 0.0f);
@@ -13,7 +16,7 @@ void tensor_zero_grad(Tensor* tensor) {
 void sgd_step(Tensor* tensor, float lr) {
     if(!tensor || !tensor->grad) {
         printf("sgd_step: tensor or gradient is NULL");
-        return NULL;
+        return;
     }
 
     size_t number_elements = total_elems(tensor);
@@ -23,4 +26,80 @@ void sgd_step(Tensor* tensor, float lr) {
     }
 }
 
-// TODO: no adam yet, did not add momentum or velocity fields into tensor struct
\ No newline at end of file
+// Moments live in their own state instead of the tensor struct, one AdamState per parameter
+void adam_init(AdamState* state, Arena* arena, const Tensor* like, float beta1, float beta2, float eps, float weight_decay) {
+    if(!state || !arena || !like) {
+        fatal("adam_init cannot run: state, arena or like is NULL");
+    }
+
+    state->m = tensor_zeroes_like(arena, like);
+    state->v = tensor_zeroes_like(arena, like);
+    state->beta1 = beta1;
+    state->beta2 = beta2;
+    state->eps = eps;
+    state->weight_decay = weight_decay;
+    state->step = 0;
+}
+
+// One contiguous run of weights, lr already carries the bias corrections
+static void adam_update(float* w, const float* g, float* m, float* v, size_t n, const AdamState* state, float lr, float decay) {
+    for(size_t i = 0; i < n; i++) {
+        m[i] = state->beta1 * m[i] + (1.0f - state->beta1) * g[i];
+        v[i] = state->beta2 * v[i] + (1.0f - state->beta2) * g[i] * g[i];
+        w[i] -= lr * m[i] / (sqrtf(v[i]) + state->eps) + decay * w[i];
+    }
+}
+
+// Both bias corrections folded into the step size, the paper's cheaper form of the update
+static float adam_begin_step(AdamState* state, float lr) {
+    state->step++;
+    float c1 = 1.0f - powf(state->beta1, (float) state->step);
+    float c2 = 1.0f - powf(state->beta2, (float) state->step);
+
+    return lr * sqrtf(c2) / c1;
+}
+
+void adam_step(Tensor* tensor, AdamState* state, float lr) {
+    if(!tensor || !tensor->grad || !state) {
+        fatal("adam_step cannot run: tensor, its grad or the state is NULL");
+    }
+
+    float step_lr = adam_begin_step(state, lr);
+    adam_update(tensor->data, tensor->grad->data, state->m->data, state->v->data, total_elems(tensor), state, step_lr, lr * state->weight_decay);
+}
+
+void sparse_sgd_step(Tensor* table, float lr) {
+    if(!table || !table->sparse_grad) {
+        fatal("sparse_sgd_step cannot run: table or its sparse grad is NULL");
+    }
+
+    RowSparseGrad* grad = table->sparse_grad;
+    for(int64_t r = 0; r < grad->num_rows; r++) {
+        float* w = table->data + (size_t) grad->rows[r] * (size_t) grad->dim;
+        const float* g = grad->values + (size_t) r * grad->dim;
+
+        for(int64_t j = 0; j < grad->dim; j++) {
+            w[j] -= lr * g[j];
+        }
+    }
+
+    row_sparse_grad_clear(grad);
+}
+
+void sparse_adam_step(Tensor* table, AdamState* state, float lr) {
+    if(!table || !table->sparse_grad || !state) {
+        fatal("sparse_adam_step cannot run: table, its sparse grad or the state is NULL");
+    }
+
+    RowSparseGrad* grad = table->sparse_grad;
+    float step_lr = adam_begin_step(state, lr);
+
+    for(int64_t r = 0; r < grad->num_rows; r++) {
+        size_t offset = (size_t) grad->rows[r] * (size_t) grad->dim;
+
+        adam_update(table->data + offset, grad->values + (size_t) r * grad->dim, state->m->data + offset, state->v->data + offset,
+            (size_t) grad->dim, state, step_lr, lr * state->weight_decay);
+    }
+
+    row_sparse_grad_clear(grad);
+}
\ No newline at end of file
@@ -0,0 +1,399 @@
+#include "quant.h"
+#include "graph.h"
+
+#include <immintrin.h>
+#include <math.h>
+#include <stdalign.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define QUANT_X86_SIMD 1
+#endif
+
+// int32 dot product of an int8 activation row with an int8 weight row, w_sum is the row sum of w
+typedef int32_t (*DotI8)(const int8_t* x, const int8_t* w, int64_t len, int32_t w_sum);
+
+static int32_t dot_i8_scalar(const int8_t* x, const int8_t* w, int64_t len, int32_t w_sum) {
+    (void) w_sum;
+    int32_t acc = 0;
+
+    for(int64_t i = 0; i < len; i++) {
+        acc += (int32_t) x[i] * (int32_t) w[i];
+    }
+
+    return acc;
+}
+
+#ifdef QUANT_X86_SIMD
+// maddubs would saturate its int16 pair sums (255 * 127 * 2 > 32767), so the AVX2 path widens both sides
+// to int16 and uses madd, which is exact
+__attribute__((target("avx2")))
+static int32_t dot_i8_avx2(const int8_t* x, const int8_t* w, int64_t len, int32_t w_sum) {
+    (void) w_sum;
+    __m256i acc = _mm256_setzero_si256();
+    int64_t i = 0;
+
+    for(; i + 16 <= len; i += 16) {
+        __m256i vx = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*) (x + i)));
+        __m256i vw = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*) (w + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(vx, vw));
+    }
+
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_hadd_epi32(sum, sum);
+    sum = _mm_hadd_epi32(sum, sum);
+    int32_t total = _mm_cvtsi128_si32(sum);
+
+    for(; i < len; i++) {
+        total += (int32_t) x[i] * (int32_t) w[i];
+    }
+
+    return total;
+}
+
+// vpdpbusd multiplies u8 by s8, so x is shifted to u8 with x ^ 0x80 (= x + 128) and 128 * sum(w) is taken back out.
+// The tail goes through a masked load, the masked lanes of w are 0 so they add nothing
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static int32_t dot_i8_vnni(const int8_t* x, const int8_t* w, int64_t len, int32_t w_sum) {
+    const __m512i flip = _mm512_set1_epi8((char) 0x80);
+    __m512i acc = _mm512_setzero_si512();
+
+    for(int64_t i = 0; i < len; i += 64) {
+        int64_t left = len - i;
+        __mmask64 mask = (left >= 64)? ~(__mmask64) 0 : (((__mmask64) 1 << left) - 1);
+        __m512i vx = _mm512_xor_si512(_mm512_maskz_loadu_epi8(mask, x + i), flip);
+        __m512i vw = _mm512_maskz_loadu_epi8(mask, w + i);
+        acc = _mm512_dpbusd_epi32(acc, vx, vw);
+    }
+
+    return _mm512_reduce_add_epi32(acc) - 128 * w_sum;
+}
+#endif
+
+static DotI8 select_dot_i8(void) {
+#ifdef QUANT_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni")) {
+        return dot_i8_vnni;
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        return dot_i8_avx2;
+    }
+#endif
+    return dot_i8_scalar;
+}
+
+static inline int8_t quantize_value(float value, float inv_scale) {
+    float q = nearbyintf(value * inv_scale);
+
+    if(q > 127.0f) q = 127.0f;
+    if(q < -127.0f) q = -127.0f;
+
+    return (int8_t) q;
+}
+
+static float scale_from_max(float max_abs) {
+    return (max_abs > 0.0f)? max_abs / 127.0f : 1.0f;
+}
+
+// Activations the int8 epilogue cannot fuse elementwise, run on a fp32 row before requantising
+static void apply_activation_row(Activation activation, float* row, int64_t len) {
+    if(activation == ACT_RELU) {
+        for(int64_t j = 0; j < len; j++) row[j] = row[j] > 0.0f? row[j] : 0.0f;
+    }
+    else if(activation == ACT_TANH) {
+        for(int64_t j = 0; j < len; j++) row[j] = tanhf(row[j]);
+    }
+    else if(activation == ACT_SIGMOID) {
+        for(int64_t j = 0; j < len; j++) row[j] = 1.0f / (1.0f + expf(-row[j]));
+    }
+    else if(activation == ACT_SOFTMAX) {
+        float max_ = -INFINITY;
+        float sum = 0.0f;
+
+        for(int64_t j = 0; j < len; j++) max_ = row[j] > max_? row[j] : max_;
+        for(int64_t j = 0; j < len; j++) {
+            row[j] = expf(row[j] - max_);
+            sum += row[j];
+        }
+        for(int64_t j = 0; j < len; j++) row[j] /= sum;
+    }
+}
+
+// Reference fp32 forward through the graph engine, optionally recording the node feeding each layer
+static Node* fp32_forward(Graph* graph, const MLP* nn, const float* x, int64_t n, Node** layer_inputs) {
+    int64_t shape[2] = { n, (int64_t) nn->layers[0].in_features };
+    Tensor* input = tensor_new(graph->arena, 2, shape);
+    memcpy(input->data, x, (size_t) (n * shape[1]) * sizeof(float));
+
+    Node* head = graph_add_input(graph, input);
+
+    for(int l = 0; l < nn->num_layers; l++) {
+        if(layer_inputs) {
+            layer_inputs[l] = head;
+        }
+
+        head = layer_forward(graph, head, &nn->layers[l]);
+
+        // Dropout is a copy at inference, so it has no place in the calibration or the int8 forward
+        if(l < nn->num_layers - 1) {
+            head = apply_activation(graph, nn->hidden_activation, head);
+        }
+    }
+
+    Node** order = NULL;
+    size_t order_n = 0;
+    topological_sort(graph, &order, &order_n);
+    graph_forward_pass(order, order_n);
+
+    return head;
+}
+
+void quantize_mlp(QuantMLP* q, const MLP* nn, Arena* q_arena, Arena* scratch, const float* calib, int64_t n_calib) {
+    if(!q || !nn || !q_arena || !scratch || !calib) {
+        fatal("quantize_mlp cannot run: input is NULL");
+    }
+    if(n_calib < 1) {
+        fatal("quantize_mlp cannot run: calibration needs at least 1 sample, got %lld", (long long) n_calib);
+    }
+    if(nn->norms) {
+        fatal("quantize_mlp cannot run: the int8 path has no norm layers yet");
+    }
+
+    q->num_layers = nn->num_layers;
+    q->hidden_activation = nn->hidden_activation;
+    q->layers = arena_alloc(q_arena, (size_t) nn->num_layers * sizeof(QuantLinear), alignof(QuantLinear));
+
+    // Calibration pass, the activation scale of each layer comes from the max abs value feeding it
+    Graph graph;
+    graph_init(&graph, scratch);
+    Node** layer_inputs = arena_alloc(scratch, (size_t) nn->num_layers * sizeof(Node*), alignof(Node*));
+    fp32_forward(&graph, nn, calib, n_calib, layer_inputs);
+
+    for(int l = 0; l < nn->num_layers; l++) {
+        const Linear* layer = &nn->layers[l];
+        const Tensor* W = layer->weight;
+        QuantLinear* ql = &q->layers[l];
+
+        int64_t in = W->shape[0];
+        int64_t out = W->shape[1];
+
+        const Tensor* act = layer_inputs[l]->out;
+        float max_abs = 0.0f;
+        for(size_t i = 0; i < total_elems(act); i++) {
+            float a = fabsf(act->data[i]);
+            max_abs = a > max_abs? a : max_abs;
+        }
+
+        ql->in_features = in;
+        ql->out_features = out;
+        ql->in_scale = scale_from_max(max_abs);
+        ql->weight = arena_alloc(q_arena, (size_t) (in * out), 64);
+        ql->w_scale = arena_alloc(q_arena, (size_t) out * sizeof(float), alignof(float));
+        ql->w_sum = arena_alloc(q_arena, (size_t) out * sizeof(int32_t), alignof(int32_t));
+        ql->bias = arena_alloc(q_arena, (size_t) out * sizeof(float), alignof(float));
+
+        for(int64_t c = 0; c < out; c++) {
+            float w_max = 0.0f;
+            for(int64_t r = 0; r < in; r++) {
+                float w = fabsf(W->data[r * W->stride[0] + c * W->stride[1]]);
+                w_max = w > w_max? w : w_max;
+            }
+
+            float scale = scale_from_max(w_max);
+            float inv_scale = 1.0f / scale;
+            int32_t w_sum = 0;
+
+            for(int64_t r = 0; r < in; r++) {
+                int8_t qw = quantize_value(W->data[r * W->stride[0] + c * W->stride[1]], inv_scale);
+                ql->weight[c * in + r] = qw;
+                w_sum += qw;
+            }
+
+            ql->w_scale[c] = scale;
+            ql->w_sum[c] = w_sum;
+            ql->bias[c] = layer->bias->data[c * layer->bias->stride[1]];
+        }
+    }
+}
+
+void qmlp_forward(const QuantMLP* q, const float* x, int64_t n, float* out, Arena* scratch) {
+    if(!q || !x || !out || !scratch) {
+        fatal("qmlp_forward cannot run: input is NULL");
+    }
+
+    DotI8 dot = select_dot_i8();
+
+    // Quantise the network input with the first layer's calibrated scale
+    int64_t in = q->layers[0].in_features;
+    int8_t* xq = arena_alloc(scratch, (size_t) (n * in), 64);
+    float inv_scale = 1.0f / q->layers[0].in_scale;
+
+    for(int64_t i = 0; i < n * in; i++) {
+        xq[i] = quantize_value(x[i], inv_scale);
+    }
+
+    for(int l = 0; l < q->num_layers; l++) {
+        const QuantLinear* ql = &q->layers[l];
+        int64_t k = ql->out_features;
+        int is_last = (l == q->num_layers - 1);
+
+        int8_t* yq = NULL;
+        float next_inv_scale = 1.0f;
+        float* row = NULL;
+
+        if(!is_last) {
+            yq = arena_alloc(scratch, (size_t) (n * k), 64);
+            next_inv_scale = 1.0f / q->layers[l + 1].in_scale;
+            row = arena_alloc(scratch, (size_t) k * sizeof(float), alignof(float));
+        }
+
+        // Elementwise activations are fused straight into the dequant + bias + requant epilogue
+        int fused = (q->hidden_activation == ACT_NONE || q->hidden_activation == ACT_RELU);
+
+        for(int64_t i = 0; i < n; i++) {
+            const int8_t* x_row = xq + i * in;
+
+            for(int64_t c = 0; c < k; c++) {
+                int32_t acc = dot(x_row, ql->weight + c * in, in, ql->w_sum[c]);
+                float y = (float) acc * (ql->in_scale * ql->w_scale[c]) + ql->bias[c];
+
+                if(is_last) {
+                    out[i * k + c] = y;
+                }
+                else if(fused) {
+                    if(q->hidden_activation == ACT_RELU && y < 0.0f) {
+                        y = 0.0f;
+                    }
+                    yq[i * k + c] = quantize_value(y, next_inv_scale);
+                }
+                else {
+                    row[c] = y;
+                }
+            }
+
+            if(!is_last && !fused) {
+                apply_activation_row(q->hidden_activation, row, k);
+
+                for(int64_t c = 0; c < k; c++) {
+                    yq[i * k + c] = quantize_value(row[c], next_inv_scale);
+                }
+            }
+        }
+
+        xq = yq;
+        in = k;
+    }
+}
+
+void qmlp_compare(const QuantMLP* q, const MLP* nn, const float* x, int64_t n, Arena* scratch, float* max_abs_err, float* argmax_agreement) {
+    if(!q || !nn || !x || !scratch) {
+        fatal("qmlp_compare cannot run: input is NULL");
+    }
+
+    Graph graph;
+    graph_init(&graph, scratch);
+    Node* ref = fp32_forward(&graph, nn, x, n, NULL);
+
+    int64_t k = q->layers[q->num_layers - 1].out_features;
+    float* out = arena_alloc(scratch, (size_t) (n * k) * sizeof(float), alignof(float));
+    qmlp_forward(q, x, n, out, scratch);
+
+    float max_err = 0.0f;
+    int64_t agree = 0;
+
+    for(int64_t i = 0; i < n; i++) {
+        int64_t ref_arg = 0, q_arg = 0;
+
+        for(int64_t c = 0; c < k; c++) {
+            float r = ref->out->data[i * k + c];
+            float err = fabsf(r - out[i * k + c]);
+            max_err = err > max_err? err : max_err;
+
+            if(r > ref->out->data[i * k + ref_arg]) ref_arg = c;
+            if(out[i * k + c] > out[i * k + q_arg]) q_arg = c;
+        }
+
+        agree += (ref_arg == q_arg);
+    }
+
+    if(max_abs_err) *max_abs_err = max_err;
+    if(argmax_agreement) *argmax_agreement = (float) agree / (float) n;
+}
+
+size_t qmlp_weight_bytes(const QuantMLP* q) {
+    size_t bytes = 0;
+
+    for(int l = 0; l < q->num_layers; l++) {
+        const QuantLinear* ql = &q->layers[l];
+        bytes += (size_t) (ql->in_features * ql->out_features) * sizeof(int8_t);
+        bytes += (size_t) ql->out_features * (sizeof(float) + sizeof(int32_t) + sizeof(float));
+    }
+
+    return bytes;
+}
+
+#ifdef QUANT_SELFTEST_MAIN
+#include "dataset.h"
+#include <assert.h>
+
+int main(void) {
+    // All dot product paths must agree exactly, including the masked/scalar tails
+    int8_t a[131], b[131];
+    uint32_t rng = 777;
+    int32_t b_sum = 0;
+    for(int i = 0; i < 131; i++) {
+        a[i] = (int8_t) ((int) (xorshift32(&rng) % 255) - 127);
+        b[i] = (int8_t) ((int) (xorshift32(&rng) % 255) - 127);
+        b_sum += b[i];
+    }
+    for(int len = 0; len <= 131; len += 7) {
+        int32_t sum = 0;
+        for(int i = 0; i < len; i++) sum += b[i];
+        int32_t ref = dot_i8_scalar(a, b, len, sum);
+        assert(select_dot_i8()(a, b, len, sum) == ref);
+#ifdef QUANT_X86_SIMD
+        if(__builtin_cpu_supports("avx2")) assert(dot_i8_avx2(a, b, len, sum) == ref);
+#endif
+    }
+    (void) b_sum;
+
+    Arena param_arena, data_arena, q_arena, scratch;
+    arena_init(&param_arena, 1 << 20);
+    arena_init(&data_arena, 1 << 20);
+    arena_init(&q_arena, 1 << 20);
+    arena_init(&scratch, 1 << 22);
+
+    uint32_t seed = 12345;
+    Dataset dataset;
+    generate_dataset(&dataset, &data_arena, 2, 200, 3, DATA_SPIRAL, &seed);
+
+    MLP nn;
+    init_mlp(&nn, &param_arena, 4, 2, 64, 3, ACT_RELU, INIT_HE_NORMAL, INIT_XAVIER_NORMAL, &seed);
+
+    int64_t n = (int64_t) dataset.num_classes * dataset.num_data_points;
+    QuantMLP q;
+    quantize_mlp(&q, &nn, &q_arena, &scratch, dataset.class_dpoints, n);
+    arena_reset(&scratch);
+
+    float max_err = 0.0f, agreement = 0.0f;
+    qmlp_compare(&q, &nn, dataset.class_dpoints, n, &scratch, &max_err, &agreement);
+
+    size_t fp32_bytes = 0;
+    for(int l = 0; l < nn.num_layers; l++) {
+        fp32_bytes += (total_elems(nn.layers[l].weight) + total_elems(nn.layers[l].bias)) * sizeof(float);
+    }
+
+    printf("int8 vs fp32: max abs logit err %.5f, argmax agreement %.4f, weights %zu -> %zu bytes\n",
+        max_err, agreement, fp32_bytes, qmlp_weight_bytes(&q));
+    assert(agreement >= 0.95f);
+    assert(qmlp_weight_bytes(&q) * 3 < fp32_bytes);
+
+    mlp_free(&nn);
+    arena_free(&param_arena);
+    arena_free(&data_arena);
+    arena_free(&q_arena);
+    arena_free(&scratch);
+    printf("quant selftest passed\n");
+    return 0;
+}
+#endif
@@ -9,8 +9,17 @@ static void add_fwd(Node* node) {
     Tensor* C = node->out;
     size_t number_elements = total_elems(C);
 
+    if(A->is_contiguous && B->is_contiguous) {
+        for(size_t i = 0; i < number_elements; i++) {
+            C->data[i] = A->data[i] + B->data[i];
+        }
+
+        return;
+    }
+
+    // Views (eg a transposed or expanded input) go through the strides
     for(size_t i = 0; i < number_elements; i++) {
-        C->data[i] = A->data[i] + B->data[i];
+        C->data[i] = A->data[tensor_elem_offset(A, i)] + B->data[tensor_elem_offset(B, i)];
     }
 }
 
@@ -20,9 +29,73 @@ static void add_bwd(Node* node) {
     Tensor* gC = node->out->grad;
     size_t number_elements = total_elems(gC);
     
+    if(gA->is_contiguous && gB->is_contiguous) {
+        for(size_t i = 0; i < number_elements; i++) {
+            gA->data[i] += gC->data[i];
+            gB->data[i] += gC->data[i];
+        }
+
+        return;
+    }
+
+    // An expanded grad view has 0 strides, so the += sums the broadcast dims back into the base grad
+    for(size_t i = 0; i < number_elements; i++) {
+        gA->data[tensor_elem_offset(gA, i)] += gC->data[i];
+        gB->data[tensor_elem_offset(gB, i)] += gC->data[i];
+    }
+}
+
+// Plan variants, a bcast input is a [1, cols] row (the expanded bias) so it is walked per row instead of per element
+static void add_flat_fwd(const PlanStep* step) {
+    const size_t cols = step->bcast[0] || step->bcast[1]? (size_t) step->cols : step->n;
+
+    for(size_t r = 0; r < step->n; r += cols) {
+        const float* a = step->bcast[0]? step->in[0] : step->in[0] + r;
+        const float* b = step->bcast[1]? step->in[1] : step->in[1] + r;
+        float* c = step->out + r;
+
+        for(size_t i = 0; i < cols; i++) {
+            c[i] = a[i] + b[i];
+        }
+    }
+}
+
+static void add_flat_bwd(const PlanStep* step) {
+    const size_t cols = step->bcast[0] || step->bcast[1]? (size_t) step->cols : step->n;
+
+    for(size_t r = 0; r < step->n; r += cols) {
+        float* ga = step->bcast[0]? step->gin[0] : step->gin[0] + r;
+        float* gb = step->bcast[1]? step->gin[1] : step->gin[1] + r;
+        const float* gc = step->gout + r;
+
+        for(size_t i = 0; i < cols; i++) {
+            ga[i] += gc[i];
+            gb[i] += gc[i];
+        }
+    }
+}
+
+// Linear, so the tangents go through exactly like the values and the grads do
+static void add_jvp(Node* node) {
+    const Tensor* dA = node->inputs[0]->out->tangent;
+    const Tensor* dB = node->inputs[1]->out->tangent;
+    Tensor* dC = node->out->tangent;
+    size_t number_elements = total_elems(dC);
+
+    for(size_t i = 0; i < number_elements; i++) {
+        dC->data[i] = *tensor_at(dA, i) + *tensor_at(dB, i);
+    }
+}
+
+static void add_backward_jvp(Node* node) {
+    Tensor* dgA = node->inputs[0]->out->grad->tangent;
+    Tensor* dgB = node->inputs[1]->out->grad->tangent;
+    const Tensor* dgC = node->out->grad->tangent;
+    size_t number_elements = total_elems(dgC);
+
     for(size_t i = 0; i < number_elements; i++) {
-        gA->data[i] += gC->data[i];
-        gB->data[i] += gC->data[i];
+        *tensor_at(dgA, i) += dgC->data[i];
+        *tensor_at(dgB, i) += dgC->data[i];
     }
 }
 
@@ -31,6 +104,13 @@ static const OpKernel add_kernel = {
     .name = "add",
     .forward = add_fwd,
     .backward = add_bwd,
+    .arity = 2,
+    .infer = op_infer_elementwise,
+    .flat_forward = add_flat_fwd,
+    .flat_backward = add_flat_bwd,
+    .flat_row_broadcast = 1,
+    .jvp = add_jvp,
+    .backward_jvp = add_backward_jvp,
 };
 
 // Run before main is called
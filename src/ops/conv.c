@@ -0,0 +1,544 @@
+#include "op.h"
+#include "graph.h"
+#include "fastmath.h"
+#include "parallel.h"
+#include "tester.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Conv1D/Conv2D (cross correlation) over NCHW, x [N, C_in, (H,) W] and weight [C_out, C_in, (KH,) KW] with an
+// optional bias [C_out]. Direct convolution: every kernel tap is an axpy of a shifted input row into an output row,
+// so there is no im2col buffer at all. The output plane is walked in blocks of rows so a block and the input rows it
+// reads stay in cache across the C_in * KH * KW taps. Conv1D is the H = KH = 1 case of the same code
+
+// Output rows per cache block, 32 rows of a 256 wide plane is 32 KB
+#define CONV_ROW_BLOCK 32
+
+typedef struct {
+    int64_t N, C_in, C_out;
+    int64_t H, W, KH, KW, OH, OW;
+    int64_t sh, sw, ph, pw;
+} ConvGeom;
+
+static ConvGeom conv_geom(const Node* node) {
+    const Tensor* X = node->inputs[0]->out;
+    const Tensor* Wt = node->inputs[1]->out;
+    const Tensor* C = node->out;
+    const ConvAttrs* attrs = node->attrs;
+    ConvGeom g = { .N = X->shape[0], .C_in = X->shape[1], .C_out = Wt->shape[0] };
+
+    if(node->operation == OP_CONV1D) {
+        g.H = g.KH = g.OH = 1;
+        g.sh = 1;
+        g.ph = 0;
+        g.W = X->shape[2];
+        g.KW = Wt->shape[2];
+        g.OW = C->shape[2];
+        g.sw = attrs? attrs->stride[0] : 1;
+        g.pw = attrs? attrs->padding[0] : 0;
+        return g;
+    }
+
+    g.H = X->shape[2];
+    g.W = X->shape[3];
+    g.KH = Wt->shape[2];
+    g.KW = Wt->shape[3];
+    g.OH = C->shape[2];
+    g.OW = C->shape[3];
+    g.sh = attrs? attrs->stride[0] : 1;
+    g.sw = attrs? attrs->stride[1] : 1;
+    g.ph = attrs? attrs->padding[0] : 0;
+    g.pw = attrs? attrs->padding[1] : 0;
+    return g;
+}
+
+// Outputs [lo, hi) of one axis whose input o * stride - pad + k lands inside [0, in)
+static void valid_range(int64_t in, int64_t out, int64_t stride, int64_t pad, int64_t k, int64_t* lo, int64_t* hi) {
+    int64_t first = pad - k;
+    int64_t last = in - 1 + pad - k;
+
+    *lo = first > 0? (first + stride - 1) / stride : 0;
+    *hi = last < 0? 0 : last / stride + 1;
+    *hi = *hi > out? out : *hi;
+    *hi = *hi < *lo? *lo : *hi;
+}
+
+// y[o] += a * x[o * stride]
+static void axpy_gather(float* y, const float* x, int64_t stride, float a, int64_t n) {
+    int64_t o = 0;
+
+    if(stride == 1) {
+        const f32x8 va = v8_set(a);
+        for(; o + V8_WIDTH <= n; o += V8_WIDTH) {
+            v8_store(y + o, v8_load(y + o) + va * v8_load(x + o));
+        }
+    }
+    for(; o < n; o++) {
+        y[o] += a * x[o * stride];
+    }
+}
+
+// y[o * stride] += a * x[o]
+static void axpy_scatter(float* y, int64_t stride, const float* x, float a, int64_t n) {
+    if(stride == 1) {
+        axpy_gather(y, x, 1, a, n);
+        return;
+    }
+    for(int64_t o = 0; o < n; o++) {
+        y[o * stride] += a * x[o];
+    }
+}
+
+// sum of a[o] * b[o * stride]
+static float dot_gather(const float* a, const float* b, int64_t stride, int64_t n) {
+    int64_t o = 0;
+    float sum = 0.0f;
+
+    if(stride == 1) {
+        f32x8 acc = v8_set(0.0f);
+        for(; o + V8_WIDTH <= n; o += V8_WIDTH) {
+            acc += v8_load(a + o) * v8_load(b + o);
+        }
+        sum = v8_hsum(&acc);
+    }
+    for(; o < n; o++) {
+        sum += a[o] * b[o * stride];
+    }
+
+    return sum;
+}
+
+typedef struct {
+    const ConvGeom* g;
+    const float* x;
+    const float* w;
+    const float* bias;
+    const float* gout;
+    float* out;
+    float* gx;
+    float* gw;
+    float* gb;
+    int accumulate;
+} ConvTask;
+
+// out[n, co] (+)= bias[co] + sum over ci and the taps, one task per (n, co) output plane
+static void conv_forward_planes(void* ctx, size_t begin, size_t end) {
+    const ConvTask* t = ctx;
+    const ConvGeom* g = t->g;
+
+    for(size_t p = begin; p < end; p++) {
+        int64_t n = (int64_t) p / g->C_out, co = (int64_t) p % g->C_out;
+        float* out = t->out + (size_t) p * (size_t) (g->OH * g->OW);
+
+        if(!t->accumulate) {
+            memset(out, 0, (size_t) (g->OH * g->OW) * sizeof(float));
+        }
+        if(t->bias) {
+            for(int64_t i = 0; i < g->OH * g->OW; i++) out[i] += t->bias[co];
+        }
+
+        for(int64_t oh0 = 0; oh0 < g->OH; oh0 += CONV_ROW_BLOCK) {
+            int64_t oh1 = (oh0 + CONV_ROW_BLOCK < g->OH)? oh0 + CONV_ROW_BLOCK : g->OH;
+
+            for(int64_t ci = 0; ci < g->C_in; ci++) {
+                const float* in = t->x + (size_t) ((n * g->C_in + ci) * g->H * g->W);
+                const float* w = t->w + (size_t) ((co * g->C_in + ci) * g->KH * g->KW);
+
+                for(int64_t kh = 0; kh < g->KH; kh++) {
+                    int64_t oh_lo, oh_hi;
+                    valid_range(g->H, g->OH, g->sh, g->ph, kh, &oh_lo, &oh_hi);
+                    oh_lo = oh_lo > oh0? oh_lo : oh0;
+                    oh_hi = oh_hi < oh1? oh_hi : oh1;
+
+                    for(int64_t kw = 0; kw < g->KW; kw++) {
+                        int64_t ow_lo, ow_hi;
+                        valid_range(g->W, g->OW, g->sw, g->pw, kw, &ow_lo, &ow_hi);
+                        const float tap = w[kh * g->KW + kw];
+
+                        for(int64_t oh = oh_lo; oh < oh_hi; oh++) {
+                            const float* in_row = in + (oh * g->sh - g->ph + kh) * g->W + ow_lo * g->sw - g->pw + kw;
+                            axpy_gather(out + oh * g->OW + ow_lo, in_row, g->sw, tap, ow_hi - ow_lo);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// gx[n, ci] += the taps of every co run backwards, one task per (n, ci) input plane so no two tasks share a write
+static void conv_grad_input_planes(void* ctx, size_t begin, size_t end) {
+    const ConvTask* t = ctx;
+    const ConvGeom* g = t->g;
+
+    for(size_t p = begin; p < end; p++) {
+        int64_t n = (int64_t) p / g->C_in, ci = (int64_t) p % g->C_in;
+        float* gx = t->gx + (size_t) p * (size_t) (g->H * g->W);
+
+        for(int64_t co = 0; co < g->C_out; co++) {
+            const float* gout = t->gout + (size_t) ((n * g->C_out + co) * g->OH * g->OW);
+            const float* w = t->w + (size_t) ((co * g->C_in + ci) * g->KH * g->KW);
+
+            for(int64_t kh = 0; kh < g->KH; kh++) {
+                int64_t oh_lo, oh_hi;
+                valid_range(g->H, g->OH, g->sh, g->ph, kh, &oh_lo, &oh_hi);
+
+                for(int64_t kw = 0; kw < g->KW; kw++) {
+                    int64_t ow_lo, ow_hi;
+                    valid_range(g->W, g->OW, g->sw, g->pw, kw, &ow_lo, &ow_hi);
+                    const float tap = w[kh * g->KW + kw];
+
+                    for(int64_t oh = oh_lo; oh < oh_hi; oh++) {
+                        float* gx_row = gx + (oh * g->sh - g->ph + kh) * g->W + ow_lo * g->sw - g->pw + kw;
+                        axpy_scatter(gx_row, g->sw, gout + oh * g->OW + ow_lo, tap, ow_hi - ow_lo);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// gw[co] += gout[., co] correlated with x, gb[co] += the sum of gout[., co], one task per output channel
+static void conv_grad_weight_channels(void* ctx, size_t begin, size_t end) {
+    const ConvTask* t = ctx;
+    const ConvGeom* g = t->g;
+
+    for(size_t co = begin; co < end; co++) {
+        for(int64_t n = 0; n < g->N; n++) {
+            const float* gout = t->gout + (size_t) ((n * g->C_out + (int64_t) co) * g->OH * g->OW);
+
+            if(t->gb) {
+                float sum = 0.0f;
+                for(int64_t i = 0; i < g->OH * g->OW; i++) sum += gout[i];
+                t->gb[co] += sum;
+            }
+            if(!t->gw) {
+                continue;
+            }
+
+            for(int64_t ci = 0; ci < g->C_in; ci++) {
+                const float* in = t->x + (size_t) ((n * g->C_in + ci) * g->H * g->W);
+                float* gw = t->gw + (size_t) (((int64_t) co * g->C_in + ci) * g->KH * g->KW);
+
+                for(int64_t kh = 0; kh < g->KH; kh++) {
+                    int64_t oh_lo, oh_hi;
+                    valid_range(g->H, g->OH, g->sh, g->ph, kh, &oh_lo, &oh_hi);
+
+                    for(int64_t kw = 0; kw < g->KW; kw++) {
+                        int64_t ow_lo, ow_hi;
+                        valid_range(g->W, g->OW, g->sw, g->pw, kw, &ow_lo, &ow_hi);
+                        float sum = 0.0f;
+
+                        for(int64_t oh = oh_lo; oh < oh_hi; oh++) {
+                            const float* in_row = in + (oh * g->sh - g->ph + kh) * g->W + ow_lo * g->sw - g->pw + kw;
+                            sum += dot_gather(gout + oh * g->OW + ow_lo, in_row, g->sw, ow_hi - ow_lo);
+                        }
+                        gw[kh * g->KW + kw] += sum;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Same task split serial or on the pool, the tasks own disjoint outputs so both give the same bits
+static void run_tasks(size_t n, ParallelFn fn, ConvTask* t, int threaded) {
+    if(threaded) parallel_for(n, 1, fn, t);
+    else fn(t, 0, n);
+}
+
+static void conv_forward(const ConvGeom* g, const float* x, const float* w, const float* bias, float* out, int accumulate, int threaded) {
+    ConvTask t = { .g = g, .x = x, .w = w, .bias = bias, .out = out, .accumulate = accumulate };
+    run_tasks((size_t) (g->N * g->C_out), conv_forward_planes, &t, threaded);
+}
+
+static void conv_backward(const ConvGeom* g, const float* gout, const float* x, const float* w, float* gx, float* gw, float* gb, int threaded) {
+    ConvTask t = { .g = g, .x = x, .w = w, .gout = gout, .gx = gx, .gw = gw, .gb = gb };
+
+    if(gx) {
+        run_tasks((size_t) (g->N * g->C_in), conv_grad_input_planes, &t, threaded);
+    }
+    if(gw || gb) {
+        run_tasks((size_t) g->C_out, conv_grad_weight_channels, &t, threaded);
+    }
+}
+
+static const Tensor* conv_bias(const Node* node) {
+    return node->n_input == 3? node->inputs[2]->out : NULL;
+}
+
+static float* grad_data(const Tensor* tensor) {
+    return (tensor && tensor->grad)? tensor->grad->data : NULL;
+}
+
+static void conv_run_forward(Node* node, int threaded) {
+    const ConvGeom g = conv_geom(node);
+    const Tensor* bias = conv_bias(node);
+
+    conv_forward(&g, node->inputs[0]->out->data, node->inputs[1]->out->data, bias? bias->data : NULL, node->out->data, 0, threaded);
+}
+
+static void conv_run_backward(Node* node, int threaded) {
+    const ConvGeom g = conv_geom(node);
+    const Tensor* X = node->inputs[0]->out;
+    const Tensor* Wt = node->inputs[1]->out;
+
+    conv_backward(&g, node->out->grad->data, X->data, Wt->data, grad_data(X), grad_data(Wt), grad_data(conv_bias(node)), threaded);
+}
+
+static void conv_fwd(Node* node) { conv_run_forward(node, 1); }
+static void conv_bwd(Node* node) { conv_run_backward(node, 1); }
+static void conv_fwd_serial(Node* node) { conv_run_forward(node, 0); }
+static void conv_bwd_serial(Node* node) { conv_run_backward(node, 0); }
+
+// Bilinear in x and the weight: dout = conv(dx, w) + conv(x, dw) + db
+static void conv_jvp(Node* node) {
+    const ConvGeom g = conv_geom(node);
+    const Tensor* X = node->inputs[0]->out;
+    const Tensor* Wt = node->inputs[1]->out;
+    const Tensor* bias = conv_bias(node);
+    float* dout = node->out->tangent->data;
+
+    conv_forward(&g, X->tangent->data, Wt->data, bias? bias->tangent->data : NULL, dout, 0, 1);
+    conv_forward(&g, X->data, Wt->tangent->data, NULL, dout, 1, 1);
+}
+
+// The backward differentiated: each grad gets its term from d(gout) with the primals plus gout with the tangents
+static void conv_backward_jvp(Node* node) {
+    const ConvGeom g = conv_geom(node);
+    const Tensor* X = node->inputs[0]->out;
+    const Tensor* Wt = node->inputs[1]->out;
+    const Tensor* bias = conv_bias(node);
+    const Tensor* gC = node->out->grad;
+    float* dgx = X->grad? X->grad->tangent->data : NULL;
+    float* dgw = Wt->grad? Wt->grad->tangent->data : NULL;
+    float* dgb = (bias && bias->grad)? bias->grad->tangent->data : NULL;
+
+    conv_backward(&g, gC->tangent->data, X->data, Wt->data, dgx, dgw, dgb, 1);
+    conv_backward(&g, gC->data, X->tangent->data, Wt->tangent->data, dgx, dgw, NULL, 1);
+}
+
+// x [N, C_in, (H,) W], weight [C_out, C_in, (KH,) KW] and an optional bias [C_out]
+static int conv_infer(const Node* node, int64_t out_shape[6]) {
+    const int spatial = (node->operation == OP_CONV1D)? 1 : 2;
+    const ConvAttrs* conv = node->attrs;
+    const Tensor* A = node->inputs[0]->out;
+
+    if(node->n_input != 2 && node->n_input != 3) {
+        fatal("infer_and_alloc_output: conv expects x, weight and an optional bias (got %d inputs)", node->n_input);
+    }
+    op_require_dense_f32(node, 0);
+
+    const Tensor* B = node->inputs[1]->out;
+    if(A->ndim != spatial + 2 || B->ndim != spatial + 2 || !A->is_contiguous || !B->is_contiguous) {
+        fatal("infer_and_alloc_output cannot run: conv%dd x and weight must be contiguous %dD tensors", spatial, spatial + 2);
+    }
+    if(A->shape[1] != B->shape[1]) {
+        fatal("infer_and_alloc_output cannot run: conv input has %lld channels, weight expects %lld", (long long) A->shape[1], (long long) B->shape[1]);
+    }
+    if(node->n_input == 3) {
+        const Tensor* bias = node->inputs[2]->out;
+        if(bias->ndim != 1 || bias->shape[0] != B->shape[0] || !bias->is_contiguous) {
+            fatal("infer_and_alloc_output cannot run: conv bias must be contiguous [%lld]", (long long) B->shape[0]);
+        }
+    }
+
+    out_shape[0] = A->shape[0];
+    out_shape[1] = B->shape[0];
+    for(int d = 0; d < spatial; d++) {
+        int64_t stride = conv? conv->stride[d] : 1;
+        int64_t padding = conv? conv->padding[d] : 0;
+        int64_t size = A->shape[2 + d] + 2 * padding - B->shape[2 + d];
+
+        if(stride < 1 || padding < 0 || size < 0) {
+            fatal("infer_and_alloc_output cannot run: conv kernel %lld doesn't fit input %lld with padding %lld and stride %lld",
+                (long long) B->shape[2 + d], (long long) A->shape[2 + d], (long long) padding, (long long) stride);
+        }
+        out_shape[2 + d] = size / stride + 1;
+    }
+
+    return spatial + 2;
+}
+
+// A multiply add per output element and tap, padding taps included
+static void conv_cost(const Node* node, OpCost* cost) {
+    const ConvGeom g = conv_geom(node);
+
+    cost->flops = 2.0 * (double) (g.N * g.C_out * g.OH * g.OW) * (double) (g.C_in * g.KH * g.KW);
+    cost->bytes = sizeof(float) * (double) (g.N * g.C_in * g.H * g.W + g.C_out * g.C_in * g.KH * g.KW + g.N * g.C_out * g.OH * g.OW);
+}
+
+#define CONV_KERNEL_COMMON \
+    .forward = conv_fwd, \
+    .backward = conv_bwd, \
+    .arity = 0, \
+    .infer = conv_infer, \
+    .cost = conv_cost, \
+    .variants = { \
+        { OP_IMPL_SIMD, "serial", conv_fwd_serial, conv_bwd_serial, NULL }, \
+        { OP_IMPL_THREADED, "threaded", conv_fwd, conv_bwd, NULL }, \
+    }, \
+    .num_variants = 2, \
+    .jvp = conv_jvp, \
+    .backward_jvp = conv_backward_jvp,
+
+static const OpKernel conv1d_kernel = {
+    .optype = OP_CONV1D,
+    .name = "conv1d",
+    CONV_KERNEL_COMMON
+};
+
+static const OpKernel conv2d_kernel = {
+    .optype = OP_CONV2D,
+    .name = "conv2d",
+    CONV_KERNEL_COMMON
+};
+__attribute__((constructor))
+static void register_conv_kernels(void) {
+    register_opkernel(&conv1d_kernel);
+    register_opkernel(&conv2d_kernel);
+}
+
+#ifdef CONV_SELFTEST_MAIN
+#include <assert.h>
+
+typedef struct {
+    Op op;
+    int ndim;
+    int64_t x_shape[4];
+    int64_t w_shape[4];
+    ConvAttrs attrs;
+    Tensor* x;
+    Tensor* w;
+    Tensor* b;
+} ConvCase;
+
+// loss = sum(out * cos(i)), out copied into out_copy. grads leaves the grads of x, w and b behind, jvp the output
+// tangent for the tangents already on x, w and b
+static double run(ConvCase* tc, int grads, int jvp, float* out_copy) {
+    Arena scratch;
+    arena_init(&scratch, 1 << 20);
+    Graph graph;
+    graph_init(&graph, &scratch);
+
+    Node* in[3] = { graph_add_input(&graph, tc->x), graph_add_input(&graph, tc->w), graph_add_input(&graph, tc->b) };
+    Node* conv = add_node_attrs(&graph, tc->op, 3, in, &tc->attrs);
+    const OpKernel* k = get_opkernel(tc->op);
+    size_t n = total_elems(conv->out);
+
+    k->forward(conv);
+    if(jvp) {
+        conv->out->tangent = tensor_zeroes_like(&scratch, conv->out);
+        k->jvp(conv);
+    }
+    memcpy(out_copy, jvp? conv->out->tangent->data : conv->out->data, n * sizeof(float));
+
+    double loss = 0.0;
+    for(size_t i = 0; i < n; i++) loss += cos((double) i) * conv->out->data[i];
+
+    if(grads) {
+        graph_ensure_grad(&graph, conv->out);
+        for(size_t i = 0; i < n; i++) conv->out->grad->data[i] = (float) cos((double) i);
+        k->backward(conv);
+    }
+
+    arena_free(&scratch);
+    return loss;
+}
+
+// Plain loops in double over every output and tap
+static void reference(const ConvCase* tc, double* out, int64_t* out_n) {
+    int conv2d = tc->op == OP_CONV2D;
+    int64_t N = tc->x_shape[0], C_in = tc->x_shape[1], C_out = tc->w_shape[0];
+    int64_t H = conv2d? tc->x_shape[2] : 1, W = tc->x_shape[conv2d? 3 : 2];
+    int64_t KH = conv2d? tc->w_shape[2] : 1, KW = tc->w_shape[conv2d? 3 : 2];
+    int64_t sh = conv2d? tc->attrs.stride[0] : 1, sw = tc->attrs.stride[conv2d? 1 : 0];
+    int64_t ph = conv2d? tc->attrs.padding[0] : 0, pw = tc->attrs.padding[conv2d? 1 : 0];
+    int64_t OH = (H + 2 * ph - KH) / sh + 1, OW = (W + 2 * pw - KW) / sw + 1;
+    int64_t idx = 0;
+
+    for(int64_t n = 0; n < N; n++) for(int64_t co = 0; co < C_out; co++) for(int64_t oh = 0; oh < OH; oh++) for(int64_t ow = 0; ow < OW; ow++) {
+        double sum = tc->b->data[co];
+        for(int64_t ci = 0; ci < C_in; ci++) for(int64_t kh = 0; kh < KH; kh++) for(int64_t kw = 0; kw < KW; kw++) {
+            int64_t ih = oh * sh - ph + kh, iw = ow * sw - pw + kw;
+            if(ih < 0 || ih >= H || iw < 0 || iw >= W) continue;
+            sum += (double) tc->x->data[((n * C_in + ci) * H + ih) * W + iw] * tc->w->data[((co * C_in + ci) * KH + kh) * KW + kw];
+        }
+        out[idx++] = sum;
+    }
+    *out_n = idx;
+}
+
+static void check_case(Arena* arena, ConvCase* tc) {
+    tc->x = tensor_new(arena, tc->ndim, tc->x_shape);
+    tc->w = tensor_new(arena, tc->ndim, tc->w_shape);
+    const int64_t b_shape[1] = { tc->w_shape[0] };
+    tc->b = tensor_new(arena, 1, b_shape);
+    Tensor* leaves[3] = { tc->x, tc->w, tc->b };
+    for(int l = 0; l < 3; l++) {
+        for(size_t i = 0; i < total_elems(leaves[l]); i++) leaves[l]->data[i] = sinf(0.37f * (float) i + (float) l);
+        leaves[l]->grad = tensor_zeroes_like(arena, leaves[l]);
+        leaves[l]->tangent = tensor_new(arena, leaves[l]->ndim, leaves[l]->shape);
+        for(size_t i = 0; i < total_elems(leaves[l]); i++) leaves[l]->tangent->data[i] = cosf(1.3f * (float) i - (float) l);
+    }
+
+    static double want[4096];
+    static float got[4096], threaded[4096], plus[4096], minus[4096];
+    int64_t n = 0;
+    reference(tc, want, &n);
+    run(tc, 1, 0, got);
+    for(int64_t i = 0; i < n; i++) assert(fabs(got[i] - want[i]) < 1e-4 * (1.0 + fabs(want[i])));
+
+    // The loss is linear in any single element, so the central difference is exact up to rounding
+    const float h = 0.5f;
+    for(int l = 0; l < 3; l++) {
+        for(size_t i = 0; i < total_elems(leaves[l]); i++) {
+            float saved = leaves[l]->data[i];
+            leaves[l]->data[i] = saved + h;
+            double up = run(tc, 0, 0, plus);
+            leaves[l]->data[i] = saved - h;
+            double down = run(tc, 0, 0, minus);
+            leaves[l]->data[i] = saved;
+
+            float fd = (float) ((up - down) / (2.0 * h));
+            assert(fabsf(fd - leaves[l]->grad->data[i]) < 1e-3f * (1.0f + fabsf(fd)));
+        }
+    }
+
+    // Every task owns its outputs, so the pool gives the single thread bits
+    float grads_1[3][1024];
+    for(int l = 0; l < 3; l++) memcpy(grads_1[l], leaves[l]->grad->data, total_elems(leaves[l]) * sizeof(float));
+    for(int l = 0; l < 3; l++) tensor_fill(leaves[l]->grad, 0.0f);
+    parallel_set_threads(3);
+    run(tc, 1, 0, threaded);
+    parallel_set_threads(1);
+    assert(memcmp(got, threaded, (size_t) n * sizeof(float)) == 0);
+    for(int l = 0; l < 3; l++) assert(memcmp(grads_1[l], leaves[l]->grad->data, total_elems(leaves[l]) * sizeof(float)) == 0);
+
+    // Bilinear, so (f(p + t) - f(p - t)) / 2 is exactly the jvp along t
+    run(tc, 0, 1, got);
+    for(int l = 0; l < 3; l++) for(size_t i = 0; i < total_elems(leaves[l]); i++) leaves[l]->data[i] += leaves[l]->tangent->data[i];
+    run(tc, 0, 0, plus);
+    for(int l = 0; l < 3; l++) for(size_t i = 0; i < total_elems(leaves[l]); i++) leaves[l]->data[i] -= 2.0f * leaves[l]->tangent->data[i];
+    run(tc, 0, 0, minus);
+    for(int64_t i = 0; i < n; i++) assert(fabsf(got[i] - 0.5f * (plus[i] - minus[i])) < 1e-3f * (1.0f + fabsf(got[i])));
+}
+
+int main(void) {
+    Arena arena;
+    arena_init(&arena, 1 << 20);
+
+    // Strided and padded along both axes, 13 wide outputs cover the vector body and the scalar tail
+    ConvCase conv1d = { .op = OP_CONV1D, .ndim = 3, .x_shape = { 2, 2, 20 }, .w_shape = { 3, 2, 5 }, .attrs = { { 2, 0 }, { 2, 0 } } };
+    ConvCase conv2d = { .op = OP_CONV2D, .ndim = 4, .x_shape = { 2, 3, 7, 11 }, .w_shape = { 4, 3, 3, 3 }, .attrs = { { 2, 1 }, { 1, 2 } } };
+    ConvCase conv2d_s = { .op = OP_CONV2D, .ndim = 4, .x_shape = { 1, 2, 6, 9 }, .w_shape = { 2, 2, 2, 4 }, .attrs = { { 1, 3 }, { 0, 1 } } };
+    check_case(&arena, &conv1d);
+    check_case(&arena, &conv2d);
+    check_case(&arena, &conv2d_s);
+
+    printf("conv1d and conv2d forward, grads, jvp and threaded determinism selftest passed\n");
+    arena_free(&arena);
+    return 0;
+}
+#endif
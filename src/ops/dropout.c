@@ -0,0 +1,221 @@
+#include "op.h"
+#include "graph.h"
+#include "probhelper.h"
+#include "tester.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Inverted dropout, out = a * keep / (1 - p). The keep mask is never a float tensor: the forward draws it from Philox
+// keyed by (seed, step) with the element index as the counter and packs it into node->aux, one bit per element, which
+// the backward reads back. Same seed and step give the same mask, so checkpoint recomputes match the first forward
+
+static int dropout_active(const Node* node) {
+    const DropoutAttrs* attrs = node->attrs;
+
+    if(!attrs || !attrs->training || attrs->p == 0.0f) {
+        return 0;
+    }
+    if(attrs->p < 0.0f || attrs->p >= 1.0f) {
+        fatal("dropout cannot run: p must be in [0, 1), got %f", attrs->p);
+    }
+
+    return 1;
+}
+
+// One Philox block is 4 draws, 8 blocks fill a mask word. An element is kept when its draw is >= p * 2^32
+static void dropout_mask(const DropoutAttrs* attrs, size_t n, uint32_t* bits) {
+    Philox rng;
+    philox_init(&rng, attrs->seed, attrs->step);
+    const uint32_t threshold = (uint32_t) ((double) attrs->p * 4294967296.0);
+
+    for(size_t w = 0; w < (n + 31) / 32; w++) {
+        uint32_t word = 0;
+
+        for(uint32_t b = 0; b < 8; b++) {
+            uint32_t draws[4];
+            philox_block(&rng, (uint64_t) w * 8 + b, draws);
+
+            for(uint32_t k = 0; k < 4; k++) {
+                word |= (uint32_t) (draws[k] >= threshold) << (4 * b + k);
+            }
+        }
+
+        bits[w] = word;
+    }
+}
+
+static inline int mask_bit(const uint32_t* bits, size_t i) {
+    return (bits[i / 32] >> (i % 32)) & 1u;
+}
+
+static void dropout_fwd(Node* node) {
+    const Tensor* A = node->inputs[0]->out;
+    Tensor* C = node->out;
+    size_t number_elements = total_elems(C);
+
+    if(!dropout_active(node)) {
+        for(size_t i = 0; i < number_elements; i++) {
+            C->data[i] = *tensor_at(A, i);
+        }
+        return;
+    }
+
+    const DropoutAttrs* attrs = node->attrs;
+    uint32_t* bits = (uint32_t*) node->aux->data_i32;
+    const float scale = 1.0f / (1.0f - attrs->p);
+    dropout_mask(attrs, number_elements, bits);
+
+    for(size_t i = 0; i < number_elements; i++) {
+        C->data[i] = mask_bit(bits, i)? *tensor_at(A, i) * scale : 0.0f;
+    }
+}
+
+static void dropout_bwd(Node* node) {
+    Tensor* gA = node->inputs[0]->out->grad;
+    const Tensor* gC = node->out->grad;
+    size_t number_elements = total_elems(gC);
+
+    if(!dropout_active(node)) {
+        for(size_t i = 0; i < number_elements; i++) {
+            *tensor_at(gA, i) += gC->data[i];
+        }
+        return;
+    }
+
+    const DropoutAttrs* attrs = node->attrs;
+    const uint32_t* bits = (const uint32_t*) node->aux->data_i32;
+    const float scale = 1.0f / (1.0f - attrs->p);
+
+    for(size_t i = 0; i < number_elements; i++) {
+        *tensor_at(gA, i) += mask_bit(bits, i)? gC->data[i] * scale : 0.0f;
+    }
+}
+
+// Linear once the mask is fixed, both tangents go through the same mask as the values and the grads
+static void dropout_jvp(Node* node) {
+    const Tensor* A = node->inputs[0]->out;
+    Tensor* dC = node->out->tangent;
+    size_t number_elements = total_elems(dC);
+    int active = dropout_active(node);
+    const float scale = active? 1.0f / (1.0f - ((const DropoutAttrs*) node->attrs)->p) : 1.0f;
+
+    for(size_t i = 0; i < number_elements; i++) {
+        int keep = !active || mask_bit((const uint32_t*) node->aux->data_i32, i);
+        dC->data[i] = keep? *tensor_at(A->tangent, i) * scale : 0.0f;
+    }
+}
+
+static void dropout_backward_jvp(Node* node) {
+    const Tensor* A = node->inputs[0]->out;
+    const Tensor* dgC = node->out->grad->tangent;
+    size_t number_elements = total_elems(dgC);
+    int active = dropout_active(node);
+    const float scale = active? 1.0f / (1.0f - ((const DropoutAttrs*) node->attrs)->p) : 1.0f;
+
+    for(size_t i = 0; i < number_elements; i++) {
+        int keep = !active || mask_bit((const uint32_t*) node->aux->data_i32, i);
+        *tensor_at(A->grad->tangent, i) += keep? dgC->data[i] * scale : 0.0f;
+    }
+}
+
+// Packed keep mask, one bit per element
+static int dropout_aux_shape(const Node* node, int64_t aux_shape[6], DType* dtype) {
+    *dtype = DTYPE_I32;
+    aux_shape[0] = (int64_t) ((total_elems(node->out) + 31) / 32);
+    return 1;
+}
+
+static const OpKernel dropout_kernel = {
+    .optype = OP_DROPOUT,
+    .name = "dropout",
+    .forward = dropout_fwd,
+    .backward = dropout_bwd,
+    .arity = 1,
+    .infer = op_infer_unary,
+    .aux_shape = dropout_aux_shape,
+    .jvp = dropout_jvp,
+    .backward_jvp = dropout_backward_jvp,
+};
+
+__attribute__((constructor))
+static void register_dropout_kernel(void) {
+    register_opkernel(&dropout_kernel);
+}
+
+#ifdef DROPOUT_SELFTEST_MAIN
+#include <assert.h>
+
+#define DROP_ROWS 64
+#define DROP_COLS 33
+
+// Forward and backward with gC = 1, out and gA come back in the caller's buffers
+static void run(Tensor* a, const DropoutAttrs* attrs, float* out, float* ga, size_t* mask_bytes) {
+    Arena scratch;
+    arena_init(&scratch, 1 << 18);
+    Graph graph;
+    graph_init(&graph, &scratch);
+
+    tensor_fill(a->grad, 0.0f);
+    Node* in[1] = { graph_add_input(&graph, a) };
+    Node* drop = add_node_attrs(&graph, OP_DROPOUT, 1, in, attrs);
+    graph_ensure_grad(&graph, drop->out);
+    tensor_fill(drop->out->grad, 1.0f);
+
+    dropout_kernel.forward(drop);
+    dropout_kernel.backward(drop);
+    memcpy(out, drop->out->data, sizeof(float) * DROP_ROWS * DROP_COLS);
+    memcpy(ga, a->grad->data, sizeof(float) * DROP_ROWS * DROP_COLS);
+    *mask_bytes = total_elems(drop->aux) * sizeof(int32_t);
+
+    arena_free(&scratch);
+}
+
+int main(void) {
+    Arena arena;
+    arena_init(&arena, 1 << 18);
+
+    const int64_t shape[2] = { DROP_ROWS, DROP_COLS };
+    const size_t n = DROP_ROWS * DROP_COLS;
+    Tensor* a = tensor_new(&arena, 2, shape);
+    a->grad = tensor_zeroes_like(&arena, a);
+    for(size_t i = 0; i < n; i++) a->data[i] = 1.0f + 0.01f * (float) i;
+
+    static float out[DROP_ROWS * DROP_COLS], ga[DROP_ROWS * DROP_COLS], again[DROP_ROWS * DROP_COLS], scratch_ga[DROP_ROWS * DROP_COLS];
+    size_t mask_bytes = 0;
+    DropoutAttrs attrs = { .p = 0.25f, .seed = 1234, .step = 7, .training = 1 };
+
+    // Kept elements are scaled by 1 / (1 - p), the grad goes through the same mask, and the mask costs a bit each
+    run(a, &attrs, out, ga, &mask_bytes);
+    size_t dropped = 0;
+    for(size_t i = 0; i < n; i++) {
+        if(out[i] == 0.0f) {
+            dropped++;
+            assert(ga[i] == 0.0f);
+            continue;
+        }
+        assert(fabsf(out[i] - a->data[i] / 0.75f) < 1e-5f * out[i]);
+        assert(fabsf(ga[i] - 1.0f / 0.75f) < 1e-6f);
+    }
+    assert(fabs((double) dropped / (double) n - 0.25) < 0.03);
+    assert(mask_bytes == (n + 31) / 32 * sizeof(uint32_t));
+
+    // Same (seed, step) is the same mask, the next step isn't
+    run(a, &attrs, again, scratch_ga, &mask_bytes);
+    assert(memcmp(out, again, sizeof(out)) == 0);
+    attrs.step++;
+    run(a, &attrs, again, scratch_ga, &mask_bytes);
+    size_t same = 0;
+    for(size_t i = 0; i < n; i++) same += (out[i] == 0.0f) == (again[i] == 0.0f);
+    assert(same < n);
+
+    // Inference is the identity both ways
+    attrs.training = 0;
+    run(a, &attrs, out, ga, &mask_bytes);
+    for(size_t i = 0; i < n; i++) assert(out[i] == a->data[i] && ga[i] == 1.0f);
+
+    printf("dropout dropped %.3f of the elements at p = 0.25, mask and inference selftest passed\n", (double) dropped / (double) n);
+    arena_free(&arena);
+    return 0;
+}
+#endif
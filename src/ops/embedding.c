@@ -0,0 +1,175 @@
+#include "op.h"
+#include "graph.h"
+#include "tester.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Embedding lookup, table [vocab, dim] and int32 indices [N] -> out [N, dim], out row n is table row indices[n].
+// The backward only touches the looked up rows: into table->sparse_grad when the table has one (see
+// tensor_attach_sparse_grad and the sparse optimiser steps), otherwise scattered into a dense table->grad
+
+static void embedding_fwd(Node* node) {
+    const Tensor* W = node->inputs[0]->out;
+    const Tensor* indices = node->inputs[1]->out;
+    Tensor* C = node->out;
+    const int64_t vocab = W->shape[0];
+    const int64_t dim = W->shape[1];
+
+    for(int64_t n = 0; n < C->shape[0]; n++) {
+        int32_t row = indices->data_i32[n * indices->stride[0]];
+        float* c = C->data + n * C->stride[0];
+
+        if(row < 0 || row >= vocab) {
+            fatal("embedding_fwd cannot run: index %d of row %lld is outside [0, %lld)", row, (long long) n, (long long) vocab);
+        }
+
+        if(W->dtype == DTYPE_F32 && W->stride[1] == 1) {
+            memcpy(c, W->data + row * W->stride[0], (size_t) dim * sizeof(float));
+            continue;
+        }
+
+        for(int64_t j = 0; j < dim; j++) {
+            c[j] = tensor_load(W, (size_t) (row * W->stride[0] + j * W->stride[1]));
+        }
+    }
+}
+
+static void embedding_bwd(Node* node) {
+    Tensor* W = node->inputs[0]->out;
+    const Tensor* indices = node->inputs[1]->out;
+    const Tensor* gC = node->out->grad;
+    const int64_t dim = W->shape[1];
+
+    for(int64_t n = 0; n < gC->shape[0]; n++) {
+        int32_t row = indices->data_i32[n * indices->stride[0]];
+        const float* gc = gC->data + n * gC->stride[0];
+
+        if(W->sparse_grad) {
+            // Repeated rows land in the same packed row
+            float* g = row_sparse_grad_row(W->sparse_grad, row);
+
+            for(int64_t j = 0; j < dim; j++) {
+                g[j] += gc[j];
+            }
+            continue;
+        }
+
+        Tensor* gW = W->grad;
+        for(int64_t j = 0; j < dim; j++) {
+            gW->data[row * gW->stride[0] + j * gW->stride[1]] += gc[j];
+        }
+    }
+}
+
+static int embedding_infer(const Node* node, int64_t out_shape[6]) {
+    const Tensor* table = node->inputs[0]->out;
+    const Tensor* indices = node->inputs[1]->out;
+
+    op_require_dense_f32(node, 1u << 1);
+    if(table->ndim != 2 || indices->dtype != DTYPE_I32 || indices->ndim != 1) {
+        fatal("infer_and_alloc_output cannot run: embedding takes a [vocab, dim] table and int32 [N] indices");
+    }
+
+    out_shape[0] = indices->shape[0];
+    out_shape[1] = table->shape[1];
+    return 2;
+}
+
+static const OpKernel embedding_kernel = {
+    .optype = OP_EMBEDDING,
+    .name = "embedding",
+    .forward = embedding_fwd,
+    .backward = embedding_bwd,
+    .arity = 2,
+    .infer = embedding_infer,
+};
+
+__attribute__((constructor))
+static void register_embedding_kernel(void) {
+    register_opkernel(&embedding_kernel);
+}
+
+#ifdef EMBEDDING_SELFTEST_MAIN
+#include "optim.h"
+
+#include <assert.h>
+#include <math.h>
+
+#define EMB_VOCAB 50
+#define EMB_DIM 4
+#define EMB_N 6
+
+// Looks the indices up in table, backward with gC[n, j] = n + j / 10
+static void lookup(Arena* arena, Tensor* table, const int32_t* idx, Tensor** out) {
+    Graph graph;
+    graph_init(&graph, arena);
+
+    const int64_t i_shape[1] = { EMB_N };
+    Tensor* indices = tensor_new_dtype(arena, 1, i_shape, DTYPE_I32);
+    memcpy(indices->data_i32, idx, EMB_N * sizeof(int32_t));
+
+    Node* in[2] = { graph_add_input(&graph, table), graph_add_input(&graph, indices) };
+    Node* emb = add_node(&graph, OP_EMBEDDING, 2, in);
+    graph_ensure_grad(&graph, emb->out);
+    for(int n = 0; n < EMB_N; n++) {
+        for(int j = 0; j < EMB_DIM; j++) emb->out->grad->data[n * EMB_DIM + j] = (float) n + 0.1f * (float) j;
+    }
+
+    embedding_kernel.forward(emb);
+    embedding_kernel.backward(emb);
+    *out = emb->out;
+}
+
+int main(void) {
+    Arena arena;
+    arena_init(&arena, 1 << 18);
+
+    const int64_t t_shape[2] = { EMB_VOCAB, EMB_DIM };
+    Tensor* dense = tensor_new(&arena, 2, t_shape);
+    Tensor* sparse = tensor_new(&arena, 2, t_shape);
+    for(size_t i = 0; i < total_elems(dense); i++) dense->data[i] = sinf((float) i);
+    memcpy(sparse->data, dense->data, total_elems(dense) * sizeof(float));
+    dense->grad = tensor_zeroes_like(&arena, dense);
+    tensor_attach_sparse_grad(&arena, sparse, EMB_N);
+
+    // Row 7 twice, its grads have to add up
+    const int32_t idx[EMB_N] = { 7, 3, 42, 7, 0, 19 };
+    Tensor* out = NULL;
+    lookup(&arena, dense, idx, &out);
+    for(int n = 0; n < EMB_N; n++) {
+        for(int j = 0; j < EMB_DIM; j++) assert(out->data[n * EMB_DIM + j] == dense->data[idx[n] * EMB_DIM + j]);
+    }
+    lookup(&arena, sparse, idx, &out);
+    assert(sparse->grad == NULL && sparse->sparse_grad->num_rows == 5);
+
+    // Every dense grad row either matches its packed row or is zero and was never touched
+    for(int r = 0; r < EMB_VOCAB; r++) {
+        int32_t s = sparse->sparse_grad->slot[r];
+        for(int j = 0; j < EMB_DIM; j++) {
+            float want = dense->grad->data[r * EMB_DIM + j];
+            float got = s < 0? 0.0f : sparse->sparse_grad->values[s * EMB_DIM + j];
+            assert(fabsf(want - got) < 1e-6f);
+        }
+    }
+    assert(fabsf(dense->grad->data[7 * EMB_DIM] - 3.0f) < 1e-6f);
+
+    // Lazy steps against the dense ones, on the first step untouched rows don't move in either
+    AdamState dense_adam, sparse_adam;
+    adam_init(&dense_adam, &arena, dense, 0.9f, 0.999f, 1e-8f, 0.0f);
+    adam_init(&sparse_adam, &arena, sparse, 0.9f, 0.999f, 1e-8f, 0.0f);
+    adam_step(dense, &dense_adam, 0.01f);
+    sparse_adam_step(sparse, &sparse_adam, 0.01f);
+    for(size_t i = 0; i < total_elems(dense); i++) assert(fabsf(dense->data[i] - sparse->data[i]) < 1e-6f);
+    assert(sparse->sparse_grad->num_rows == 0 && sparse->sparse_grad->slot[7] == -1);
+
+    lookup(&arena, sparse, idx, &out);
+    sgd_step(dense, 0.5f);
+    sparse_sgd_step(sparse, 0.5f);
+    for(size_t i = 0; i < total_elems(dense); i++) assert(fabsf(dense->data[i] - sparse->data[i]) < 1e-6f);
+
+    printf("embedding lookup, sparse grad and lazy sgd/adam selftest passed\n");
+    arena_free(&arena);
+    return 0;
+}
+#endif
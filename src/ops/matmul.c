@@ -1,4 +1,6 @@
 #include "op.h"
+#include "fastmath.h"
+#include "parallel.h"
 #include "tester.h"
 
 #include <stddef.h>
@@ -9,27 +11,168 @@ static inline float at(const Tensor* tensor, int64_t i, int64_t j) {
     return tensor->data[(size_t) (i * tensor->stride[0] + j * tensor->stride[1])];
 }
 
-static inline void add(const Tensor* tensor, int64_t i, int64_t j, float value) {
-    tensor->data[(size_t) (i * tensor->stride[0] + j * tensor->stride[1])] += value;
+static inline float* ptr(const Tensor* tensor, int64_t i, int64_t j) {
+    return &tensor->data[(size_t) (i * tensor->stride[0] + j * tensor->stride[1])];
 }
 
-static inline void set(const Tensor* tensor, int64_t i, int64_t j, float value) {
-    tensor->data[(size_t) (i * tensor->stride[0] + j * tensor->stride[1])] = value;
+// Unit stride along the columns (rows themselves can be padded, eg a narrowed view)
+static inline int is_rowmajor(const Tensor* tensor) {
+    return tensor->stride[1] == 1 || tensor->shape[1] == 1;
 }
 
-static void matmul_fwd(Node* node) {
-    // Take shape as [n,m]
-    Tensor* A =  node->inputs[0]->out;
-    // Take shape as [m,k]
-    Tensor* B = node->inputs[1]->out;
-    // Take shape as [n,k]
-    Tensor* C = node->out;
+// Unit stride along the rows, eg the transposed view of a row major tensor
+static inline int is_colmajor(const Tensor* tensor) {
+    return tensor->stride[0] == 1 || tensor->shape[0] == 1;
+}
+
+#define GEMM_CHUNK 256
+
+// Widens len elements of a row major run starting at offset into fp32
+static void widen_run(const Tensor* tensor, size_t offset, float* out, size_t len) {
+    if(tensor->dtype == DTYPE_BF16) convert_bf16_to_f32(tensor->data16 + offset, out, len);
+    else if(tensor->dtype == DTYPE_F16) convert_f16_to_f32(tensor->data16 + offset, out, len);
+    else memcpy(out, tensor->data + offset, len * sizeof(float));
+}
 
-    // Dimension checking is done before this function is called in graph.c
+// A and/or B stored in bf16/fp16, products are accumulated in fp32 (C and the grads are always fp32)
+static void gemm_mixed(const Tensor* A, const Tensor* B, Tensor* C, int accumulate) {
     int64_t n = A->shape[0];
     int64_t m = A->shape[1];
     int64_t k = B->shape[1];
 
+    if(!accumulate) {
+        for(int64_t i = 0; i < n; i++) {
+            for(int64_t j = 0; j < k; j++) {
+                *ptr(C, i, j) = 0.0f;
+            }
+        }
+    }
+
+    if(is_rowmajor(B) && is_rowmajor(C)) {
+        // Each chunk of a B row is widened once and reused for every row of C, so B is read at half width exactly once
+        float b_buf[GEMM_CHUNK];
+
+        for(int64_t j0 = 0; j0 < k; j0 += GEMM_CHUNK) {
+            int64_t len = (k - j0 < GEMM_CHUNK)? k - j0 : GEMM_CHUNK;
+
+            for(int64_t l = 0; l < m; l++) {
+                widen_run(B, (size_t) (l * B->stride[0] + j0), b_buf, (size_t) len);
+
+                for(int64_t i = 0; i < n; i++) {
+                    const float a = tensor_load(A, (size_t) (i * A->stride[0] + l * A->stride[1]));
+                    float* c_row = ptr(C, i, j0);
+
+                    for(int64_t j = 0; j < len; j++) {
+                        c_row[j] += a * b_buf[j];
+                    }
+                }
+            }
+        }
+
+        return;
+    }
+
+    for(int64_t i = 0; i < n; i++) {
+        for(int64_t j = 0; j < k; j++) {
+            float sum = 0.0f;
+
+            for(int64_t l = 0; l < m; l++) {
+                sum += tensor_load(A, (size_t) (i * A->stride[0] + l * A->stride[1]))
+                     * tensor_load(B, (size_t) (l * B->stride[0] + j * B->stride[1]));
+            }
+
+            *ptr(C, i, j) += sum;
+        }
+    }
+}
+
+// Roughly the multiply adds one parallel_for chunk should carry, below that the handoff costs more than it saves
+#define GEMM_GRAIN_FLOPS 32768
+
+// How the fp32 row major path runs, the variants of the op pick one. Same bits for all three
+typedef enum { GEMM_SCALAR, GEMM_SIMD, GEMM_THREADED } GemmMode;
+
+typedef struct {
+    const Tensor* A;
+    const Tensor* B;
+    Tensor* C;
+    int accumulate;
+    int vector;
+} GemmRows;
+
+// Rows [begin, end) of C as a scaled sum of rows of B (A can be any view since its read as a scalar). Each C element
+// still sums over l in order, so the vector body and any split of the rows give the same bits as the scalar loop
+static void gemm_rows(void* ctx, size_t begin, size_t end) {
+    const GemmRows* g = ctx;
+    int64_t m = g->A->shape[1];
+    int64_t k = g->B->shape[1];
+
+    for(int64_t i = (int64_t) begin; i < (int64_t) end; i++) {
+        float* c_row = ptr(g->C, i, 0);
+
+        if(!g->accumulate) {
+            memset(c_row, 0, (size_t) k * sizeof(float));
+        }
+
+        for(int64_t l = 0; l < m; l++) {
+            const float a = at(g->A, i, l);
+            const float* b_row = ptr(g->B, l, 0);
+            const f32x8 va = v8_set(a);
+            int64_t j = 0;
+
+            for(; g->vector && j + V8_WIDTH <= k; j += V8_WIDTH) {
+                v8_store(c_row + j, v8_load(c_row + j) + va * v8_load(b_row + j));
+            }
+            for(; j < k; j++) {
+                c_row[j] += a * b_row[j];
+            }
+        }
+    }
+}
+
+// C (+)= A @ B for A [n,m], B [m,k], C [n,k], the layouts of the operands pick the loop order so that
+// transposed views in the backward pass still stream through contiguous memory
+static void gemm_with(const Tensor* A, const Tensor* B, Tensor* C, int accumulate, GemmMode mode) {
+    int64_t n = A->shape[0];
+    int64_t m = A->shape[1];
+    int64_t k = B->shape[1];
+
+    if(A->dtype != DTYPE_F32 || B->dtype != DTYPE_F32) {
+        gemm_mixed(A, B, C, accumulate);
+        return;
+    }
+
+    if(is_rowmajor(B) && is_rowmajor(C)) {
+        GemmRows rows = { A, B, C, accumulate, mode != GEMM_SCALAR };
+        size_t row_flops = (size_t) (m * k) + 1;
+
+        if(mode == GEMM_THREADED) parallel_for((size_t) n, GEMM_GRAIN_FLOPS / row_flops + 1, gemm_rows, &rows);
+        else gemm_rows(&rows, 0, (size_t) n);
+
+        return;
+    }
+
+    if(is_rowmajor(A) && is_colmajor(B)) {
+        // Each C element is a dot product of a contiguous row of A and a contiguous column of B
+        for(int64_t i = 0; i < n; i++) {
+            const float* a_row = ptr(A, i, 0);
+
+            for(int64_t j = 0; j < k; j++) {
+                const float* b_col = ptr(B, 0, j);
+                float sum = 0.0f;
+
+                for(int64_t l = 0; l < m; l++) {
+                    sum += a_row[l] * b_col[l];
+                }
+
+                float* c = ptr(C, i, j);
+                *c = accumulate? *c + sum : sum;
+            }
+        }
+
+        return;
+    }
+
     for(int64_t i = 0; i < n; i++) {
         for(int64_t j = 0; j < k; j++) {
             float sum = 0.0f;
@@ -37,13 +180,115 @@ static void matmul_fwd(Node* node) {
             for(int64_t l = 0; l < m; l++) {
                 sum += at(A, i, l) * at(B, l, j);
             }
-            
-            set(C, i, j, sum);
+
+            float* c = ptr(C, i, j);
+            *c = accumulate? *c + sum : sum;
         }
     }
 }
 
-static void matmul_bwd(Node* node) {
+static void gemm(const Tensor* A, const Tensor* B, Tensor* C, int accumulate) {
+    gemm_with(A, B, C, accumulate, GEMM_THREADED);
+}
+
+// C (+)= A @ B for a CSR A [n, m]: row i of C only sums the rows of B that row i of A hits, nnz * k work instead of
+// n * m * k. The column indices are checked here since the forward is the first thing to read them
+static void csr_gemm(const Tensor* A, const Tensor* B, Tensor* C, int accumulate) {
+    const CsrIndex* csr = A->csr;
+    const int64_t n = A->shape[0];
+    const int64_t m = A->shape[1];
+    const int64_t k = B->shape[1];
+    const int fast = B->dtype == DTYPE_F32 && is_rowmajor(B) && is_rowmajor(C);
+
+    for(int64_t i = 0; i < n; i++) {
+        if(!accumulate) {
+            for(int64_t j = 0; j < k; j++) {
+                *ptr(C, i, j) = 0.0f;
+            }
+        }
+
+        for(int32_t p = csr->row_ptr[i]; p < csr->row_ptr[i + 1]; p++) {
+            const int32_t l = csr->col_idx[p];
+            const float a = A->data[p];
+
+            if(l < 0 || l >= m) {
+                fatal("csr_gemm cannot run: column %d of row %lld is outside [0, %lld)", l, (long long) i, (long long) m);
+            }
+
+            if(fast) {
+                const float* b_row = ptr(B, l, 0);
+                float* c_row = ptr(C, i, 0);
+
+                for(int64_t j = 0; j < k; j++) {
+                    c_row[j] += a * b_row[j];
+                }
+                continue;
+            }
+
+            for(int64_t j = 0; j < k; j++) {
+                *ptr(C, i, j) += a * tensor_load(B, (size_t) (l * B->stride[0] + j * B->stride[1]));
+            }
+        }
+    }
+}
+
+// gB += A^T @ gC for a CSR A, scattered into just the rows of gB that A touches, every other row is left alone
+static void csr_gemm_tn(const Tensor* A, const Tensor* gC, Tensor* gB) {
+    if(!gB) {
+        fatal("csr_gemm_tn cannot run: the weight has neither a grad nor a sparse grad");
+    }
+
+    const CsrIndex* csr = A->csr;
+    const int64_t k = gC->shape[1];
+
+    for(int64_t i = 0; i < A->shape[0]; i++) {
+        for(int32_t p = csr->row_ptr[i]; p < csr->row_ptr[i + 1]; p++) {
+            const float a = A->data[p];
+            const int32_t l = csr->col_idx[p];
+
+            for(int64_t j = 0; j < k; j++) {
+                *ptr(gB, l, j) += a * at(gC, i, j);
+            }
+        }
+    }
+}
+
+// The same into a row sparse grad (see tensor_attach_sparse_grad), so neither the grad nor the optimiser step ever
+// touches the rows A doesn't
+static void csr_gemm_tn_sparse(const Tensor* A, const Tensor* gC, RowSparseGrad* gB) {
+    const CsrIndex* csr = A->csr;
+    const int64_t k = gC->shape[1];
+
+    for(int64_t i = 0; i < A->shape[0]; i++) {
+        for(int32_t p = csr->row_ptr[i]; p < csr->row_ptr[i + 1]; p++) {
+            const float a = A->data[p];
+            // Repeated columns land in the same packed row
+            float* g = row_sparse_grad_row(gB, csr->col_idx[p]);
+
+            for(int64_t j = 0; j < k; j++) {
+                g[j] += a * at(gC, i, j);
+            }
+        }
+    }
+}
+
+static void matmul_forward(Node* node, GemmMode mode) {
+    // Take shape as [n,m]
+    Tensor* A =  node->inputs[0]->out;
+    // Take shape as [m,k]
+    Tensor* B = node->inputs[1]->out;
+    // Take shape as [n,k]
+    Tensor* C = node->out;
+
+    // Dimension checking is done by matmul_infer before this function is called
+    if(A->csr) {
+        csr_gemm(A, B, C, 0);
+        return;
+    }
+    gemm_with(A, B, C, 0, mode);
+}
+
+static void matmul_backward(Node* node, GemmMode mode) {
     // Take shape as [n,m]
     Tensor* A =  node->inputs[0]->out;
     // Take shape as [m,k]
@@ -55,36 +300,102 @@ static void matmul_bwd(Node* node) {
     Tensor* gB = B->grad;
     Tensor* gC = C->grad;
 
-    // Dimension checking is done before this function is called in graph.c
-    int64_t n = A->shape[0];
-    int64_t m = A->shape[1];
-    int64_t k = B->shape[1];
+    // Sparse inputs are data, so only the weight grad, and only its touched rows
+    if(A->csr) {
+        if(B->sparse_grad) {
+            csr_gemm_tn_sparse(A, gC, B->sparse_grad);
+            return;
+        }
+        csr_gemm_tn(A, gC, gB);
+        return;
+    }
+
+    // Transposed views share data, only the shape and strides are swapped
+    Tensor At, Bt;
+    tensor_transpose_into(&At, A, 0, 1);
+    tensor_transpose_into(&Bt, B, 0, 1);
 
     // Partial adjoint for given A is dA = dC @ B^T, we accumulate this
-    for(int64_t i = 0; i < n; i++) {
-        for(int64_t j = 0; j < m; j++) {
-            float sum = 0.0f;
+    gemm_with(gC, &Bt, gA, 1, mode);
 
-            for(int64_t l = 0; l < k; l++) {
-                sum += at(gC, i, l) * at(B, j, l);
-            }
+    // Partial adjoint for given B is dB = A^T @ dC, we accumulate this
+    gemm_with(&At, gC, gB, 1, mode);
+}
+
+static void matmul_fwd(Node* node) { matmul_forward(node, GEMM_THREADED); }
+static void matmul_bwd(Node* node) { matmul_backward(node, GEMM_THREADED); }
+static void matmul_fwd_scalar(Node* node) { matmul_forward(node, GEMM_SCALAR); }
+static void matmul_bwd_scalar(Node* node) { matmul_backward(node, GEMM_SCALAR); }
+static void matmul_fwd_simd(Node* node) { matmul_forward(node, GEMM_SIMD); }
+static void matmul_bwd_simd(Node* node) { matmul_backward(node, GEMM_SIMD); }
+
+// dC = dA @ B + A @ dB
+static void matmul_jvp(Node* node) {
+    const Tensor* A = node->inputs[0]->out;
+    const Tensor* B = node->inputs[1]->out;
+
+    if(A->csr) {
+        csr_gemm(A, B->tangent, node->out->tangent, 0);
+        return;
+    }
+    gemm(A->tangent, B, node->out->tangent, 0);
+    gemm(A, B->tangent, node->out->tangent, 1);
+}
+
+// The two adjoints differentiated: dgA = dgC @ B^T + gC @ dB^T, dgB = A^T @ dgC + dA^T @ gC
+static void matmul_backward_jvp(Node* node) {
+    const Tensor* A = node->inputs[0]->out;
+    const Tensor* B = node->inputs[1]->out;
+    const Tensor* gC = node->out->grad;
 
-            add(gA, i, j, sum);
+    if(A->csr) {
+        if(!B->grad) {
+            fatal("matmul backward jvp cannot run: a row sparse weight grad has no tangent");
         }
+        csr_gemm_tn(A, gC->tangent, B->grad->tangent);
+        return;
     }
 
-    // Partial adjoint for given B is dB = A^T @ dC, we accumulate this (Double check dim iteration)
-    for(int64_t i = 0; i < m; i++) {
-        for(int64_t j = 0; j < k; j++) {
-            float sum = 0.0f;
+    Tensor At, Bt, dAt, dBt;
+    tensor_transpose_into(&At, A, 0, 1);
+    tensor_transpose_into(&Bt, B, 0, 1);
+    tensor_transpose_into(&dAt, A->tangent, 0, 1);
+    tensor_transpose_into(&dBt, B->tangent, 0, 1);
 
-            for(int64_t l = 0; l < n; l++) {
-                sum += at(A, l, i) + at(gC, l, j);
-            }
+    gemm(gC->tangent, &Bt, A->grad->tangent, 1);
+    gemm(gC, &dBt, A->grad->tangent, 1);
+    gemm(&At, gC->tangent, B->grad->tangent, 1);
+    gemm(&dAt, gC, B->grad->tangent, 1);
+}
 
-            add(gB, i, j, sum);
-        }
+// A can be CSR or 16 bit, B can be 16 bit, both 2D with matching inner dims
+static int matmul_infer(const Node* node, int64_t out_shape[6]) {
+    const Tensor* A = node->inputs[0]->out;
+    const Tensor* B = node->inputs[1]->out;
+
+    if(B->csr) {
+        fatal("infer_and_alloc_output cannot run: op %d can't take a sparse input 1, only matmul's A can be CSR", (int) node->operation);
+    }
+    if(A->ndim != 2 || B->ndim != 2) {
+        fatal("infer_and_alloc_output cannot run: matmul must involve 2 dimensional tensors");
+    }
+    if(A->shape[1] != B->shape[0]) {
+        fatal("infer_and_alloc_output cannot run: matmul shape mismatch, %lld vs %lld", (long long) A->shape[1], (long long) B->shape[0]);
     }
+
+    out_shape[0] = A->shape[0];
+    out_shape[1] = B->shape[1];
+    return 2;
+}
+
+static void matmul_cost(const Node* node, OpCost* cost) {
+    const Tensor* A = node->inputs[0]->out;
+    const Tensor* B = node->inputs[1]->out;
+    double n = (double) A->shape[0], m = (double) A->shape[1], k = (double) B->shape[1];
+    double a_elems = A->csr? (double) A->csr->nnz : n * m;
+
+    cost->flops = 2.0 * a_elems * k;
+    cost->bytes = a_elems * (double) dtype_size(A->dtype) + m * k * (double) dtype_size(B->dtype) + n * k * sizeof(float);
 }
 
 static const OpKernel mat_mul_kernel = {
@@ -92,6 +403,17 @@ static const OpKernel mat_mul_kernel = {
     .name = "mat_mul",
     .forward = matmul_fwd,
     .backward = matmul_bwd,
+    .arity = 2,
+    .infer = matmul_infer,
+    .cost = matmul_cost,
+    .variants = {
+        { OP_IMPL_SCALAR, "scalar", matmul_fwd_scalar, matmul_bwd_scalar, NULL },
+        { OP_IMPL_SIMD, "simd", matmul_fwd_simd, matmul_bwd_simd, NULL },
+        { OP_IMPL_THREADED, "threaded", matmul_fwd, matmul_bwd, NULL },
+    },
+    .num_variants = 3,
+    .jvp = matmul_jvp,
+    .backward_jvp = matmul_backward_jvp,
 };
 
 __attribute__((constructor))
@@ -100,6 +422,7 @@ static void register_mul_kernel(void) {
 }
 
 #ifdef MATMUL_SELFTEST_MAIN
+#include "optim.h"
 
 int main(void) {
     const int64_t dim_a[2] = {2, 3};
@@ -107,9 +430,115 @@ int main(void) {
     const int64_t dim_c[2] = {2, 2};
 
     float fill_a[2] = {2.0, 110.0};
-    float fill_b[2] = {3.0, 43.0};
+    float fill_b[2] = {3.0, 75.0};
 
     testOp(OP_MATMUL, dim_a, dim_b, dim_c, fill_a, fill_b, 18.0, NULL);
+
+    // bf16/fp16 weights with fp32 accumulation should match the fp32 product up to the storage rounding
+    Arena arena;
+    arena_init(&arena, 1 << 16);
+    Graph graph;
+    graph_init(&graph, &arena);
+
+    const int64_t dim_x[2] = {3, 300};
+    const int64_t dim_w[2] = {300, 5};
+    Tensor* x = tensor_new(&arena, 2, dim_x);
+    Tensor* w = tensor_new(&arena, 2, dim_w);
+    for(size_t i = 0; i < total_elems(x); i++) x->data[i] = (float) (i % 7) * 0.25f - 0.5f;
+    for(size_t i = 0; i < total_elems(w); i++) w->data[i] = (float) (i % 5) * 0.125f - 0.25f;
+
+    Node* x_node = graph_add_input(&graph, x);
+    Node* ref_in[2] = { x_node, graph_add_input(&graph, w) };
+    Node* ref = add_node(&graph, OP_MATMUL, 2, ref_in);
+    Node* bf_in[2] = { x_node, graph_add_input(&graph, tensor_cast(&arena, w, DTYPE_BF16)) };
+    Node* bf = add_node(&graph, OP_MATMUL, 2, bf_in);
+    Node* hf_in[2] = { x_node, graph_add_input(&graph, tensor_cast(&arena, w, DTYPE_F16)) };
+    Node* hf = add_node(&graph, OP_MATMUL, 2, hf_in);
+
+    mat_mul_kernel.forward(ref);
+    mat_mul_kernel.forward(bf);
+    mat_mul_kernel.forward(hf);
+
+    // These weights are exact in both 16 bit formats so the results must match exactly
+    for(size_t i = 0; i < total_elems(ref->out); i++) {
+        assert(areAlmostEqual(ref->out->data[i], bf->out->data[i]));
+        assert(areAlmostEqual(ref->out->data[i], hf->out->data[i]));
+    }
+    printf("mat_mul mixed precision selftest passed\n");
+
+    // CSR x dense against the same matrix stored dense, forward and the weight grad
+    const int64_t dim_s[2] = {4, 40};
+    const int64_t dim_v[2] = {40, 3};
+    const int64_t dim_o[2] = {4, 3};
+    const int32_t cols[7] = { 3, 17, 39, 0, 17, 25, 8 };
+    const int32_t row_ptr[5] = { 0, 3, 3, 5, 7 };
+    Tensor* sparse = tensor_new_csr(&arena, 4, 40, 7);
+    Tensor* dense = tensor_new(&arena, 2, dim_s);
+    Tensor* v = tensor_new(&arena, 2, dim_v);
+    tensor_fill(dense, 0.0f);
+    memcpy((int32_t*) sparse->csr->row_ptr, row_ptr, sizeof(row_ptr));
+    memcpy((int32_t*) sparse->csr->col_idx, cols, sizeof(cols));
+    for(int64_t i = 0; i < 4; i++) {
+        for(int32_t p = row_ptr[i]; p < row_ptr[i + 1]; p++) {
+            sparse->data[p] = 0.5f * (float) (p + 1);
+            dense->data[i * 40 + cols[p]] = sparse->data[p];
+        }
+    }
+    for(size_t i = 0; i < total_elems(v); i++) v->data[i] = (float) (i % 9) * 0.25f - 1.0f;
+    v->grad = tensor_zeroes_like(&arena, v);
+    dense->grad = tensor_zeroes_like(&arena, dense);
+    Tensor* v_ref_grad = tensor_zeroes_like(&arena, v);
+
+    Node* v_node = graph_add_input(&graph, v);
+    Node* sp_in[2] = { graph_add_input(&graph, sparse), v_node };
+    Node* sp = add_node(&graph, OP_MATMUL, 2, sp_in);
+    Node* de_in[2] = { graph_add_input(&graph, dense), v_node };
+    Node* de = add_node(&graph, OP_MATMUL, 2, de_in);
+    sp->out->grad = tensor_new(&arena, 2, dim_o);
+    de->out->grad = sp->out->grad;
+    for(size_t i = 0; i < total_elems(sp->out); i++) sp->out->grad->data[i] = (float) i - 5.0f;
+
+    mat_mul_kernel.forward(sp);
+    mat_mul_kernel.forward(de);
+    mat_mul_kernel.backward(sp);
+    memcpy(v_ref_grad->data, v->grad->data, total_elems(v) * sizeof(float));
+    tensor_fill(v->grad, 0.0f);
+    mat_mul_kernel.backward(de);
+
+    for(size_t i = 0; i < total_elems(sp->out); i++) assert(areAlmostEqual(sp->out->data[i], de->out->data[i]));
+    for(size_t i = 0; i < total_elems(v); i++) assert(areAlmostEqual(v_ref_grad->data[i], v->grad->data[i]));
+    assert(sparse->grad == NULL);
+    printf("mat_mul csr selftest passed\n");
+
+    // The same product into a weight with a row sparse grad, then one lazy SGD step against the dense grad and step
+    Tensor* w_sparse = tensor_new(&arena, 2, dim_v);
+    Tensor* w_dense = tensor_new(&arena, 2, dim_v);
+    memcpy(w_sparse->data, v->data, total_elems(v) * sizeof(float));
+    memcpy(w_dense->data, v->data, total_elems(v) * sizeof(float));
+    tensor_attach_sparse_grad(&arena, w_sparse, 7);
+    w_dense->grad = tensor_zeroes_like(&arena, w_dense);
+
+    Node* sw_in[2] = { sp_in[0], graph_add_input(&graph, w_sparse) };
+    Node* sw = add_node(&graph, OP_MATMUL, 2, sw_in);
+    Node* dw_in[2] = { de_in[0], graph_add_input(&graph, w_dense) };
+    Node* dw = add_node(&graph, OP_MATMUL, 2, dw_in);
+    sw->out->grad = sp->out->grad;
+    dw->out->grad = sp->out->grad;
+
+    mat_mul_kernel.forward(sw);
+    mat_mul_kernel.forward(dw);
+    mat_mul_kernel.backward(sw);
+    mat_mul_kernel.backward(dw);
+    // Columns 3, 17, 39, 0, 25 and 8, 17 twice
+    assert(w_sparse->grad == NULL && w_sparse->sparse_grad->num_rows == 6);
+
+    sparse_sgd_step(w_sparse, 0.1f);
+    sgd_step(w_dense, 0.1f);
+    for(size_t i = 0; i < total_elems(v); i++) assert(areAlmostEqual(w_sparse->data[i], w_dense->data[i]));
+    assert(w_sparse->sparse_grad->num_rows == 0);
+    printf("mat_mul csr into a row sparse grad with sparse_sgd_step matches the dense grad and step, selftest passed\n");
+
+    arena_free(&arena);
     return 0;
 }
 #endif
\ No newline at end of file
@@ -9,8 +9,17 @@ static void mul_fwd(Node* node) {
     Tensor* C = node->out;
     size_t number_elements = total_elems(C);
 
+    if(A->is_contiguous && B->is_contiguous) {
+        for(size_t i = 0; i < number_elements; i++) {
+            C->data[i] = A->data[i] * B->data[i];
+        }
+
+        return;
+    }
+
+    // Views (eg a transposed or expanded input) go through the strides
     for(size_t i = 0; i < number_elements; i++) {
-        C->data[i] = A->data[i] * B->data[i];
+        C->data[i] = A->data[tensor_elem_offset(A, i)] * B->data[tensor_elem_offset(B, i)];
     }
 }
 
@@ -22,9 +31,62 @@ static void mul_bwd(Node* node) {
     Tensor* gC = C->grad;
     size_t number_elements = total_elems(C);
 
+    if(A->is_contiguous && B->is_contiguous && A->grad->is_contiguous && B->grad->is_contiguous) {
+        for(size_t i = 0; i < number_elements; i++) {
+            A->grad->data[i] += B->data[i] * gC->data[i];
+            B->grad->data[i] += A->data[i] * gC->data[i];
+        }
+
+        return;
+    }
+
     for(size_t i = 0; i < number_elements; i++) {
-        A->grad->data[i] += B->data[i] * gC->data[i];
-        B->grad->data[i] += A->data[i] * gC->data[i];
+        float a = A->data[tensor_elem_offset(A, i)];
+        float b = B->data[tensor_elem_offset(B, i)];
+        A->grad->data[tensor_elem_offset(A->grad, i)] += b * gC->data[i];
+        B->grad->data[tensor_elem_offset(B->grad, i)] += a * gC->data[i];
+    }
+}
+
+static void mul_flat_fwd(const PlanStep* step) {
+    for(size_t i = 0; i < step->n; i++) {
+        step->out[i] = step->in[0][i] * step->in[1][i];
+    }
+}
+
+static void mul_flat_bwd(const PlanStep* step) {
+    for(size_t i = 0; i < step->n; i++) {
+        step->gin[0][i] += step->in[1][i] * step->gout[i];
+        step->gin[1][i] += step->in[0][i] * step->gout[i];
+    }
+}
+
+// Product rule, dC = dA b + a dB
+static void mul_jvp(Node* node) {
+    const Tensor* A = node->inputs[0]->out;
+    const Tensor* B = node->inputs[1]->out;
+    Tensor* dC = node->out->tangent;
+    size_t number_elements = total_elems(dC);
+
+    for(size_t i = 0; i < number_elements; i++) {
+        dC->data[i] = *tensor_at(A->tangent, i) * *tensor_at(B, i) + *tensor_at(A, i) * *tensor_at(B->tangent, i);
+    }
+}
+
+// gA += b gC differentiated is dgA += b dgC + db gC, gB the same way round
+static void mul_backward_jvp(Node* node) {
+    const Tensor* A = node->inputs[0]->out;
+    const Tensor* B = node->inputs[1]->out;
+    const Tensor* gC = node->out->grad;
+    size_t number_elements = total_elems(gC);
+
+    for(size_t i = 0; i < number_elements; i++) {
+        float a = *tensor_at(A, i), b = *tensor_at(B, i);
+        float da = *tensor_at(A->tangent, i), db = *tensor_at(B->tangent, i);
+        float g = gC->data[i], dg = gC->tangent->data[i];
+
+        *tensor_at(A->grad->tangent, i) += b * dg + db * g;
+        *tensor_at(B->grad->tangent, i) += a * dg + da * g;
     }
 }
 
@@ -33,6 +95,12 @@ static const OpKernel mul_kernel = {
     .name = "mul",
     .forward = mul_fwd,
     .backward = mul_bwd,
+    .arity = 2,
+    .infer = op_infer_elementwise,
+    .flat_forward = mul_flat_fwd,
+    .flat_backward = mul_flat_bwd,
+    .jvp = mul_jvp,
+    .backward_jvp = mul_backward_jvp,
 };
 
 __attribute__((constructor))
@@ -0,0 +1,521 @@
+#include "op.h"
+#include "fastmath.h"
+#include "tester.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+// LayerNorm and BatchNorm over x [N, D] with gamma, beta [1, D]. Layer norm takes the stats of each row, batch norm
+// of each column. Both get mean and variance in a single Welford pass (no sum of squares cancelling out) and keep
+// mean and 1/std in aux for the backward, which then needs only the two reductions sum(dxhat) and sum(dxhat * xhat)
+
+static const NormAttrs default_attrs = { .eps = NORM_DEFAULT_EPS, .momentum = 0.1f, .training = 1 };
+
+static const NormAttrs* norm_attrs(const Node* node) {
+    return node->attrs? (const NormAttrs*) node->attrs : &default_attrs;
+}
+
+// Chan's merge of two Welford partials (count, mean, m2)
+static void welford_merge(float* count, float* mean, float* m2, float count_b, float mean_b, float m2_b) {
+    float n = *count + count_b;
+    if(n == 0.0f) {
+        return;
+    }
+
+    float delta = mean_b - *mean;
+    *mean += delta * count_b / n;
+    *m2 += m2_b + delta * delta * *count * count_b / n;
+    *count = n;
+}
+
+// Each lane runs its own Welford over every 8th element, the lanes and the scalar tail are merged at the end
+static void row_stats(const float* x, int64_t n, float* mean_out, float* var_out) {
+    f32x8 mean = v8_set(0.0f), m2 = v8_set(0.0f);
+    float lane_count = 0.0f;
+    int64_t j = 0;
+
+    for(; j + V8_WIDTH <= n; j += V8_WIDTH) {
+        lane_count += 1.0f;
+        f32x8 v = v8_load(x + j);
+        f32x8 delta = v - mean;
+        mean += delta * (1.0f / lane_count);
+        m2 += delta * (v - mean);
+    }
+
+    float count = 0.0f, mu = 0.0f, s = 0.0f;
+    for(int l = 0; l < V8_WIDTH; l++) {
+        welford_merge(&count, &mu, &s, lane_count, mean[l], m2[l]);
+    }
+    for(; j < n; j++) {
+        welford_merge(&count, &mu, &s, 1.0f, x[j], 0.0f);
+    }
+
+    *mean_out = mu;
+    *var_out = s / (float) n;
+}
+
+static void layernorm_fwd(Node* node) {
+    const Tensor* X = node->inputs[0]->out;
+    const float* gamma = node->inputs[1]->out->data;
+    const float* beta = node->inputs[2]->out->data;
+    Tensor* C = node->out;
+    float* stats = node->aux->data;
+    const float eps = norm_attrs(node)->eps;
+    const int64_t D = X->shape[1];
+
+    for(int64_t r = 0; r < X->shape[0]; r++) {
+        const float* x = X->data + r * X->stride[0];
+        float* c = C->data + r * C->stride[0];
+        float mean, var;
+
+        row_stats(x, D, &mean, &var);
+        float rstd = 1.0f / sqrtf(var + eps);
+        stats[2 * r] = mean;
+        stats[2 * r + 1] = rstd;
+
+        int64_t j = 0;
+        f32x8 vmean = v8_set(mean), vrstd = v8_set(rstd);
+        for(; j + V8_WIDTH <= D; j += V8_WIDTH) {
+            f32x8 xhat = (v8_load(x + j) - vmean) * vrstd;
+            v8_store(c + j, xhat * v8_load(gamma + j) + v8_load(beta + j));
+        }
+        for(; j < D; j++) {
+            c[j] = (x[j] - mean) * rstd * gamma[j] + beta[j];
+        }
+    }
+}
+
+// With dxhat = gy * gamma: dx = rstd * (dxhat - mean(dxhat) - xhat * mean(dxhat * xhat)), the gamma and beta grads
+// ride along in the pass that takes the two sums
+static void layernorm_bwd(Node* node) {
+    const Tensor* X = node->inputs[0]->out;
+    Tensor* gX = X->grad;
+    const float* gamma = node->inputs[1]->out->data;
+    Tensor* gGamma = node->inputs[1]->out->grad;
+    Tensor* gBeta = node->inputs[2]->out->grad;
+    const Tensor* gC = node->out->grad;
+    const float* stats = node->aux->data;
+    const int64_t D = X->shape[1];
+    const float inv_d = 1.0f / (float) D;
+
+    for(int64_t r = 0; r < X->shape[0]; r++) {
+        const float* x = X->data + r * X->stride[0];
+        const float* gy = gC->data + r * gC->stride[0];
+        const float mean = stats[2 * r], rstd = stats[2 * r + 1];
+        const f32x8 vmean = v8_set(mean), vrstd = v8_set(rstd);
+
+        f32x8 vs1 = v8_set(0.0f), vs2 = v8_set(0.0f);
+        int64_t j = 0;
+        for(; j + V8_WIDTH <= D; j += V8_WIDTH) {
+            f32x8 xhat = (v8_load(x + j) - vmean) * vrstd;
+            f32x8 g = v8_load(gy + j);
+            f32x8 dxhat = g * v8_load(gamma + j);
+            vs1 += dxhat;
+            vs2 += dxhat * xhat;
+            if(gGamma) v8_store(gGamma->data + j, v8_load(gGamma->data + j) + g * xhat);
+            if(gBeta) v8_store(gBeta->data + j, v8_load(gBeta->data + j) + g);
+        }
+        float s1 = v8_hsum(&vs1), s2 = v8_hsum(&vs2);
+        for(; j < D; j++) {
+            float xhat = (x[j] - mean) * rstd;
+            float dxhat = gy[j] * gamma[j];
+            s1 += dxhat;
+            s2 += dxhat * xhat;
+            if(gGamma) gGamma->data[j] += gy[j] * xhat;
+            if(gBeta) gBeta->data[j] += gy[j];
+        }
+
+        if(!gX) {
+            continue;
+        }
+
+        float* gx = gX->data + r * gX->stride[0];
+        const f32x8 vm1 = v8_set(s1 * inv_d), vm2 = v8_set(s2 * inv_d);
+        j = 0;
+        for(; j + V8_WIDTH <= D; j += V8_WIDTH) {
+            f32x8 xhat = (v8_load(x + j) - vmean) * vrstd;
+            f32x8 dxhat = v8_load(gy + j) * v8_load(gamma + j);
+            v8_store(gx + j, v8_load(gx + j) + vrstd * (dxhat - vm1 - xhat * vm2));
+        }
+        for(; j < D; j++) {
+            float xhat = (x[j] - mean) * rstd;
+            gx[j] += rstd * (gy[j] * gamma[j] - s1 * inv_d - xhat * s2 * inv_d);
+        }
+    }
+}
+
+// aux rows: 0 mean, 1 rstd, 2 sum(gy), 3 sum(gy * xhat). Training takes the batch stats with one Welford step per row,
+// vectorised across the columns (all lanes share the count so there is nothing to merge), inference the running ones
+static void batchnorm_fwd(Node* node) {
+    const Tensor* X = node->inputs[0]->out;
+    const float* gamma = node->inputs[1]->out->data;
+    const float* beta = node->inputs[2]->out->data;
+    Tensor* C = node->out;
+    const NormAttrs* attrs = norm_attrs(node);
+    const int64_t N = X->shape[0], D = X->shape[1];
+    float* mean = node->aux->data;
+    float* rstd = mean + D;
+
+    if(attrs->training) {
+        memset(mean, 0, (size_t) (2 * D) * sizeof(float));
+
+        for(int64_t r = 0; r < N; r++) {
+            const float* x = X->data + r * X->stride[0];
+            const float inv_count = 1.0f / (float) (r + 1);
+            int64_t j = 0;
+
+            for(; j + V8_WIDTH <= D; j += V8_WIDTH) {
+                f32x8 v = v8_load(x + j);
+                f32x8 mu = v8_load(mean + j);
+                f32x8 delta = v - mu;
+                mu += delta * inv_count;
+                v8_store(mean + j, mu);
+                v8_store(rstd + j, v8_load(rstd + j) + delta * (v - mu));
+            }
+            for(; j < D; j++) {
+                float delta = x[j] - mean[j];
+                mean[j] += delta * inv_count;
+                rstd[j] += delta * (x[j] - mean[j]);
+            }
+        }
+
+        for(int64_t j = 0; j < D; j++) {
+            rstd[j] = 1.0f / sqrtf(rstd[j] / (float) N + attrs->eps);
+        }
+    }
+    else {
+        if(!attrs->running_mean || !attrs->running_var) {
+            fatal("batchnorm_fwd cannot run: inference mode needs the running mean and var");
+        }
+        for(int64_t j = 0; j < D; j++) {
+            mean[j] = attrs->running_mean->data[j];
+            rstd[j] = 1.0f / sqrtf(attrs->running_var->data[j] + attrs->eps);
+        }
+    }
+
+    // gamma * rstd folded into one scale per column, parked in the sum row. Keeping the x - mean (rather than a
+    // x * scale + shift) matters when the mean dwarfs the std, the shift would cancel away the low bits
+    float* scale = rstd + D;
+    for(int64_t j = 0; j < D; j++) {
+        scale[j] = gamma[j] * rstd[j];
+    }
+
+    for(int64_t r = 0; r < N; r++) {
+        const float* x = X->data + r * X->stride[0];
+        float* c = C->data + r * C->stride[0];
+        int64_t j = 0;
+
+        for(; j + V8_WIDTH <= D; j += V8_WIDTH) {
+            v8_store(c + j, (v8_load(x + j) - v8_load(mean + j)) * v8_load(scale + j) + v8_load(beta + j));
+        }
+        for(; j < D; j++) {
+            c[j] = (x[j] - mean[j]) * scale[j] + beta[j];
+        }
+    }
+}
+
+// Running stats move here and not in the forward so a checkpoint recompute doesn't count the batch twice
+static void update_running_stats(const NormAttrs* attrs, const float* mean, const float* rstd, int64_t N, int64_t D) {
+    if(!attrs->running_mean || !attrs->running_var) {
+        return;
+    }
+
+    const float m = attrs->momentum;
+    const float unbias = N > 1? (float) N / (float) (N - 1) : 1.0f;
+    for(int64_t j = 0; j < D; j++) {
+        float var = 1.0f / (rstd[j] * rstd[j]) - attrs->eps;
+        attrs->running_mean->data[j] = (1.0f - m) * attrs->running_mean->data[j] + m * mean[j];
+        attrs->running_var->data[j] = (1.0f - m) * attrs->running_var->data[j] + m * var * unbias;
+    }
+}
+
+// dx = gamma * rstd * (gy - sum(gy) / N - xhat * sum(gy * xhat) / N), the sums are exactly the beta and gamma grads.
+// In inference mode the stats are constants and dx is just gy * gamma * rstd
+static void batchnorm_bwd(Node* node) {
+    const Tensor* X = node->inputs[0]->out;
+    Tensor* gX = X->grad;
+    const float* gamma = node->inputs[1]->out->data;
+    Tensor* gGamma = node->inputs[1]->out->grad;
+    Tensor* gBeta = node->inputs[2]->out->grad;
+    const Tensor* gC = node->out->grad;
+    const NormAttrs* attrs = norm_attrs(node);
+    const int64_t N = X->shape[0], D = X->shape[1];
+    const float* mean = node->aux->data;
+    const float* rstd = mean + D;
+    float* sum_gy = node->aux->data + 2 * D;
+    float* sum_gy_xhat = sum_gy + D;
+
+    memset(sum_gy, 0, (size_t) (2 * D) * sizeof(float));
+
+    for(int64_t r = 0; r < N; r++) {
+        const float* x = X->data + r * X->stride[0];
+        const float* gy = gC->data + r * gC->stride[0];
+        int64_t j = 0;
+
+        for(; j + V8_WIDTH <= D; j += V8_WIDTH) {
+            f32x8 g = v8_load(gy + j);
+            f32x8 xhat = (v8_load(x + j) - v8_load(mean + j)) * v8_load(rstd + j);
+            v8_store(sum_gy + j, v8_load(sum_gy + j) + g);
+            v8_store(sum_gy_xhat + j, v8_load(sum_gy_xhat + j) + g * xhat);
+        }
+        for(; j < D; j++) {
+            float xhat = (x[j] - mean[j]) * rstd[j];
+            sum_gy[j] += gy[j];
+            sum_gy_xhat[j] += gy[j] * xhat;
+        }
+    }
+
+    for(int64_t j = 0; j < D; j++) {
+        if(gGamma) gGamma->data[j] += sum_gy_xhat[j];
+        if(gBeta) gBeta->data[j] += sum_gy[j];
+    }
+
+    if(attrs->training) {
+        update_running_stats(attrs, mean, rstd, N, D);
+    }
+
+    if(!gX) {
+        return;
+    }
+
+    const float inv_n = attrs->training? 1.0f / (float) N : 0.0f;
+    for(int64_t r = 0; r < N; r++) {
+        const float* x = X->data + r * X->stride[0];
+        const float* gy = gC->data + r * gC->stride[0];
+        float* gx = gX->data + r * gX->stride[0];
+        const f32x8 vinv_n = v8_set(inv_n);
+        int64_t j = 0;
+
+        for(; j + V8_WIDTH <= D; j += V8_WIDTH) {
+            f32x8 rs = v8_load(rstd + j);
+            f32x8 xhat = (v8_load(x + j) - v8_load(mean + j)) * rs;
+            f32x8 inner = v8_load(gy + j) - (v8_load(sum_gy + j) + xhat * v8_load(sum_gy_xhat + j)) * vinv_n;
+            v8_store(gx + j, v8_load(gx + j) + v8_load(gamma + j) * rs * inner);
+        }
+        for(; j < D; j++) {
+            float xhat = (x[j] - mean[j]) * rstd[j];
+            gx[j] += gamma[j] * rstd[j] * (gy[j] - (sum_gy[j] + xhat * sum_gy_xhat[j]) * inv_n);
+        }
+    }
+}
+
+// x [N, D] with contiguous rows, gamma and beta contiguous [1, D]
+static int norm_infer(const Node* node, int64_t out_shape[6]) {
+    const Tensor* x = node->inputs[0]->out;
+
+    op_require_dense_f32(node, 0);
+    if(x->ndim != 2 || x->stride[1] != 1) {
+        fatal("infer_and_alloc_output cannot run: norm input must be [N, D] with contiguous rows");
+    }
+    for(int i = 1; i < 3; i++) {
+        const Tensor* p = node->inputs[i]->out;
+        if(p->ndim != 2 || p->shape[0] != 1 || p->shape[1] != x->shape[1] || !p->is_contiguous) {
+            fatal("infer_and_alloc_output cannot run: norm gamma and beta must be contiguous [1, %lld]", (long long) x->shape[1]);
+        }
+    }
+
+    out_shape[0] = x->shape[0];
+    out_shape[1] = x->shape[1];
+    return 2;
+}
+
+// Row mean and 1/std
+static int layernorm_aux_shape(const Node* node, int64_t aux_shape[6], DType* dtype) {
+    *dtype = DTYPE_F32;
+    aux_shape[0] = node->inputs[0]->out->shape[0];
+    aux_shape[1] = 2;
+    return 2;
+}
+
+// Column mean, 1/std and the two backward sums
+static int batchnorm_aux_shape(const Node* node, int64_t aux_shape[6], DType* dtype) {
+    *dtype = DTYPE_F32;
+    aux_shape[0] = 4;
+    aux_shape[1] = node->inputs[0]->out->shape[1];
+    return 2;
+}
+
+static const OpKernel layernorm_kernel = {
+    .optype = OP_LAYERNORM,
+    .name = "layernorm",
+    .forward = layernorm_fwd,
+    .backward = layernorm_bwd,
+    .arity = 3,
+    .infer = norm_infer,
+    .aux_shape = layernorm_aux_shape,
+};
+
+static const OpKernel batchnorm_kernel = {
+    .optype = OP_BATCHNORM,
+    .name = "batchnorm",
+    .forward = batchnorm_fwd,
+    .backward = batchnorm_bwd,
+    .arity = 3,
+    .infer = norm_infer,
+    .aux_shape = batchnorm_aux_shape,
+};
+
+__attribute__((constructor))
+static void register_norm_kernels(void) {
+    register_opkernel(&layernorm_kernel);
+    register_opkernel(&batchnorm_kernel);
+}
+
+#ifdef NORM_SELFTEST_MAIN
+#include <assert.h>
+
+// 11 columns so both the vector body and the scalar tail run
+#define NORM_N 6
+#define NORM_D 11
+
+typedef struct {
+    Tensor* x;
+    Tensor* gamma;
+    Tensor* beta;
+    Tensor* w;
+} NormCase;
+
+// loss = sum(w * norm(x)), forward only unless grads is set, then the grads of x, gamma and beta are left behind
+static double run(Op op, NormCase* tc, NormAttrs* attrs, int grads, Tensor** out) {
+    Arena scratch;
+    arena_init(&scratch, 1 << 16);
+    Graph graph;
+    graph_init(&graph, &scratch);
+
+    Node* in[3] = { graph_add_input(&graph, tc->x), graph_add_input(&graph, tc->gamma), graph_add_input(&graph, tc->beta) };
+    Node* norm = add_node_attrs(&graph, op, 3, in, attrs);
+
+    const OpKernel* k = get_opkernel(op);
+    k->forward(norm);
+    double loss = 0.0;
+    for(int i = 0; i < NORM_N * NORM_D; i++) loss += (double) tc->w->data[i] * norm->out->data[i];
+    if(out) memcpy((*out)->data, norm->out->data, sizeof(float) * NORM_N * NORM_D);
+
+    if(grads) {
+        graph_ensure_grad(&graph, norm->out);
+        memcpy(norm->out->grad->data, tc->w->data, sizeof(float) * NORM_N * NORM_D);
+        k->backward(norm);
+    }
+
+    arena_free(&scratch);
+    return loss;
+}
+
+// Central differences on the loss for every x, gamma and beta element
+static void check_grads(Op op, NormCase* tc, NormAttrs* attrs) {
+    tensor_fill(tc->x->grad, 0.0f);
+    tensor_fill(tc->gamma->grad, 0.0f);
+    tensor_fill(tc->beta->grad, 0.0f);
+    run(op, tc, attrs, 1, NULL);
+
+    Tensor* leaves[3] = { tc->x, tc->gamma, tc->beta };
+    const float h = 3e-3f;
+    for(int l = 0; l < 3; l++) {
+        for(size_t i = 0; i < total_elems(leaves[l]); i++) {
+            float saved = leaves[l]->data[i];
+            leaves[l]->data[i] = saved + h;
+            double up = run(op, tc, attrs, 0, NULL);
+            leaves[l]->data[i] = saved - h;
+            double down = run(op, tc, attrs, 0, NULL);
+            leaves[l]->data[i] = saved;
+
+            float fd = (float) ((up - down) / (2.0 * h));
+            assert(fabsf(fd - leaves[l]->grad->data[i]) < 2e-3f * (1.0f + fabsf(fd)));
+        }
+    }
+}
+
+// Stats over the rows (layer) or the columns (batch) in double
+static void reference(const NormCase* tc, int per_row, const float* mean_in, const float* var_in, float eps, float* out) {
+    int outer = per_row? NORM_N : NORM_D, inner = per_row? NORM_D : NORM_N;
+
+    for(int o = 0; o < outer; o++) {
+        double mean = 0.0, var = 0.0;
+        for(int i = 0; i < inner; i++) mean += tc->x->data[per_row? o * NORM_D + i : i * NORM_D + o];
+        mean /= inner;
+        for(int i = 0; i < inner; i++) {
+            double d = tc->x->data[per_row? o * NORM_D + i : i * NORM_D + o] - mean;
+            var += d * d;
+        }
+        var /= inner;
+        if(mean_in) {
+            mean = mean_in[o];
+            var = var_in[o];
+        }
+
+        for(int i = 0; i < inner; i++) {
+            int idx = per_row? o * NORM_D + i : i * NORM_D + o;
+            int col = per_row? i : o;
+            out[idx] = (float) ((tc->x->data[idx] - mean) / sqrt(var + eps) * tc->gamma->data[col] + tc->beta->data[col]);
+        }
+    }
+}
+
+int main(void) {
+    Arena arena;
+    arena_init(&arena, 1 << 16);
+
+    const int64_t x_shape[2] = { NORM_N, NORM_D }, p_shape[2] = { 1, NORM_D };
+    NormCase tc = {
+        tensor_new(&arena, 2, x_shape), tensor_new(&arena, 2, p_shape), tensor_new(&arena, 2, p_shape), tensor_new(&arena, 2, x_shape)
+    };
+    // A large offset on x, the naive sum of squares loses most of its digits there
+    for(int i = 0; i < NORM_N * NORM_D; i++) {
+        tc.x->data[i] = 1000.0f + 3.0f * sinf(1.7f * (float) i);
+        tc.w->data[i] = cosf(0.9f * (float) i);
+    }
+    for(int j = 0; j < NORM_D; j++) {
+        tc.gamma->data[j] = 1.0f + 0.1f * (float) j;
+        tc.beta->data[j] = 0.05f * (float) j - 0.2f;
+    }
+    tc.x->grad = tensor_zeroes_like(&arena, tc.x);
+    tc.gamma->grad = tensor_zeroes_like(&arena, tc.gamma);
+    tc.beta->grad = tensor_zeroes_like(&arena, tc.beta);
+
+    Tensor* got = tensor_new(&arena, 2, x_shape);
+    float want[NORM_N * NORM_D];
+
+    run(OP_LAYERNORM, &tc, NULL, 0, &got);
+    reference(&tc, 1, NULL, NULL, NORM_DEFAULT_EPS, want);
+    for(int i = 0; i < NORM_N * NORM_D; i++) assert(fabsf(got->data[i] - want[i]) < 1e-3f);
+
+    run(OP_BATCHNORM, &tc, NULL, 0, &got);
+    reference(&tc, 0, NULL, NULL, NORM_DEFAULT_EPS, want);
+    for(int i = 0; i < NORM_N * NORM_D; i++) assert(fabsf(got->data[i] - want[i]) < 1e-3f);
+
+    // The grads on a well scaled x, finite differences around 1000 only see float noise
+    for(int i = 0; i < NORM_N * NORM_D; i++) tc.x->data[i] -= 1000.0f;
+    check_grads(OP_LAYERNORM, &tc, NULL);
+
+    Tensor* running_mean = tensor_zeroes_like(&arena, tc.gamma);
+    Tensor* running_var = tensor_new(&arena, 2, p_shape);
+    tensor_fill(running_var, 1.0f);
+    NormAttrs attrs = { .eps = 1e-3f, .momentum = 0.5f, .training = 1, .running_mean = running_mean, .running_var = running_var };
+    check_grads(OP_BATCHNORM, &tc, &attrs);
+
+    // One training backward per check_grads run, so the running stats moved once from (0, 1) towards the batch ones
+    float batch_mean[NORM_D], batch_var[NORM_D];
+    for(int j = 0; j < NORM_D; j++) {
+        double mean = 0.0, var = 0.0;
+        for(int r = 0; r < NORM_N; r++) mean += tc.x->data[r * NORM_D + j];
+        mean /= NORM_N;
+        for(int r = 0; r < NORM_N; r++) var += (tc.x->data[r * NORM_D + j] - mean) * (tc.x->data[r * NORM_D + j] - mean);
+        batch_mean[j] = (float) mean;
+        batch_var[j] = (float) (var / (NORM_N - 1));
+        assert(fabsf(running_mean->data[j] - 0.5f * batch_mean[j]) < 1e-4f);
+        assert(fabsf(running_var->data[j] - (0.5f + 0.5f * batch_var[j])) < 1e-3f);
+    }
+
+    // Inference normalises with the running stats, the grads treat them as constants
+    attrs.training = 0;
+    run(OP_BATCHNORM, &tc, &attrs, 0, &got);
+    reference(&tc, 0, running_mean->data, running_var->data, attrs.eps, want);
+    for(int i = 0; i < NORM_N * NORM_D; i++) assert(fabsf(got->data[i] - want[i]) < 1e-4f);
+    check_grads(OP_BATCHNORM, &tc, &attrs);
+    assert(fabsf(running_mean->data[0] - 0.5f * batch_mean[0]) < 1e-4f);
+
+    printf("layernorm and batchnorm forward, fused backward and running stats selftest passed\n");
+    arena_free(&arena);
+    return 0;
+}
+#endif
@@ -9,8 +9,17 @@ static void relu_fwd(Node* node) {
 
     size_t number_elements = total_elems(C);
 
+    if(A->is_contiguous) {
+        for(size_t i = 0; i < number_elements; i++) {
+            C->data[i] = A->data[i] > 0.0f? A->data[i] : 0.0f;
+        }
+
+        return;
+    }
+
     for(size_t i = 0; i < number_elements; i++) {
-        C->data[i] = A->data[i] > 0.0f? A->data[i] : 0.0f;
+        float a = A->data[tensor_elem_offset(A, i)];
+        C->data[i] = a > 0.0f? a : 0.0f;
     }
 }
 
@@ -22,8 +31,50 @@ static void relu_bwd(Node* node) {
 
     size_t number_elements = total_elems(C);
 
+    if(A->is_contiguous && gA->is_contiguous) {
+        for(size_t i = 0; i < number_elements; i++) {
+            gA->data[i] += (A->data[i] > 0.0f)? gC->data[i] : 0.0f;
+        }
+
+        return;
+    }
+
+    for(size_t i = 0; i < number_elements; i++) {
+        float a = A->data[tensor_elem_offset(A, i)];
+        gA->data[tensor_elem_offset(gA, i)] += (a > 0.0f)? gC->data[i] : 0.0f;
+    }
+}
+
+static void relu_flat_fwd(const PlanStep* step) {
+    for(size_t i = 0; i < step->n; i++) {
+        step->out[i] = step->in[0][i] > 0.0f? step->in[0][i] : 0.0f;
+    }
+}
+
+static void relu_flat_bwd(const PlanStep* step) {
+    for(size_t i = 0; i < step->n; i++) {
+        step->gin[0][i] += (step->in[0][i] > 0.0f)? step->gout[i] : 0.0f;
+    }
+}
+
+// The second derivative is 0 wherever it exists, so both just pass the tangent through the forward's mask
+static void relu_jvp(Node* node) {
+    const Tensor* A = node->inputs[0]->out;
+    Tensor* dC = node->out->tangent;
+    size_t number_elements = total_elems(dC);
+
+    for(size_t i = 0; i < number_elements; i++) {
+        dC->data[i] = (*tensor_at(A, i) > 0.0f)? *tensor_at(A->tangent, i) : 0.0f;
+    }
+}
+
+static void relu_backward_jvp(Node* node) {
+    const Tensor* A = node->inputs[0]->out;
+    const Tensor* dgC = node->out->grad->tangent;
+    size_t number_elements = total_elems(dgC);
+
     for(size_t i = 0; i < number_elements; i++) {
-        gA->data[i] += (A->data[i] > 0.0f)? gC->data[i] : 0.0f;
+        *tensor_at(A->grad->tangent, i) += (*tensor_at(A, i) > 0.0f)? dgC->data[i] : 0.0f;
     }
 }
 
@@ -32,6 +83,12 @@ static const OpKernel relu_kernel = {
     .name = "relu",
     .forward = relu_fwd,
     .backward = relu_bwd,
+    .arity = 1,
+    .infer = op_infer_unary,
+    .flat_forward = relu_flat_fwd,
+    .flat_backward = relu_flat_bwd,
+    .jvp = relu_jvp,
+    .backward_jvp = relu_backward_jvp,
 };
 
 __attribute__((constructor))
@@ -99,11 +99,74 @@ static void softmax_bwd(Node* node) {
     }
 }
 
+// Tangents share the layout of their tensors, so the same strides index them. Like the forward this is 1D/2D only,
+// anything else was already rejected there
+static void softmax_rows(const Tensor* A, const Tensor* C, int64_t* batch, int64_t* dimension, int64_t* a_stride, int64_t* c_stride) {
+    *batch = (A->ndim == 1)? 1 : A->shape[0];
+    *dimension = A->shape[A->ndim - 1];
+    a_stride[0] = (A->ndim == 1)? 0 : A->stride[0];
+    a_stride[1] = A->stride[A->ndim - 1];
+    c_stride[0] = (C->ndim == 1)? 0 : C->stride[0];
+    c_stride[1] = C->stride[C->ndim - 1];
+}
+
+// dY_i = Y_i * (dX_i - dot(Y, dX))
+static void softmax_jvp(Node* node) {
+    const Tensor* A = node->inputs[0]->out;
+    const Tensor* C = node->out;
+    int64_t batch, dimension, a_stride[2], c_stride[2];
+    softmax_rows(A, C, &batch, &dimension, a_stride, c_stride);
+
+    for(int64_t b = 0; b < batch; b++) {
+        float dot = 0.0f;
+
+        for(int64_t d = 0; d < dimension; d++) {
+            dot += C->data[b * c_stride[0] + d * c_stride[1]] * A->tangent->data[b * a_stride[0] + d * a_stride[1]];
+        }
+
+        for(int64_t d = 0; d < dimension; d++) {
+            size_t idx = (size_t)(b * c_stride[0] + d * c_stride[1]);
+            C->tangent->data[idx] = C->data[idx] * (A->tangent->data[b * a_stride[0] + d * a_stride[1]] - dot);
+        }
+    }
+}
+
+// dX_i = Y_i * (dY_i - s) with s = dot(dY, Y) differentiated, ds = dot(d(dY), Y) + dot(dY, dY_fwd)
+static void softmax_backward_jvp(Node* node) {
+    const Tensor* A = node->inputs[0]->out;
+    const Tensor* C = node->out;
+    const Tensor* gC = C->grad;
+    Tensor* dgA = A->grad->tangent;
+    int64_t batch, dimension, a_stride[2], c_stride[2];
+    softmax_rows(A, C, &batch, &dimension, a_stride, c_stride);
+
+    for(int64_t b = 0; b < batch; b++) {
+        float dot = 0.0f;
+        float ddot = 0.0f;
+
+        for(int64_t d = 0; d < dimension; d++) {
+            size_t idx = (size_t)(b * c_stride[0] + d * c_stride[1]);
+            dot += gC->data[idx] * C->data[idx];
+            ddot += gC->tangent->data[idx] * C->data[idx] + gC->data[idx] * C->tangent->data[idx];
+        }
+
+        for(int64_t d = 0; d < dimension; d++) {
+            size_t idx = (size_t)(b * c_stride[0] + d * c_stride[1]);
+            dgA->data[b * a_stride[0] + d * a_stride[1]] += C->tangent->data[idx] * (gC->data[idx] - dot)
+                + C->data[idx] * (gC->tangent->data[idx] - ddot);
+        }
+    }
+}
+
 static const OpKernel softmax_kernel = {
     .optype = OP_SOFTMAX,
     .name = "softmax",
     .forward = softmax_fwd,
     .backward = softmax_bwd,
+    .arity = 1,
+    .infer = op_infer_unary,
+    .jvp = softmax_jvp,
+    .backward_jvp = softmax_backward_jvp,
 };
 
 __attribute__((constructor))
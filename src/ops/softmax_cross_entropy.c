@@ -0,0 +1,265 @@
+#include "op.h"
+#include "graph.h"
+#include "fastmath.h"
+#include "tester.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <float.h>
+#include <math.h>
+
+// Fused softmax + cross entropy over a batch, logits [N, C] and int32 labels [N] -> mean loss [1]
+// The forward already knows d(loss)/d(logits) = (softmax - onehot) / N, so it is written into node->aux while the row
+// is still in cache and the backward is a single scaled add, no softmax output or softmax backward on the training path
+
+// Online max/sum over one row: each lane keeps its own running max m and sum s of exp(x - m), rescaling s whenever m
+// grows, so the row is read once instead of once for the max and once for the sum. Returns log(sum exp(x))
+static float row_logsumexp(const float* x, int64_t n) {
+    f32x8 m = v8_set(-FLT_MAX);
+    f32x8 s = v8_set(0.0f);
+    int64_t j = 0;
+
+    for(; j + V8_WIDTH <= n; j += V8_WIDTH) {
+        f32x8 v = v8_load(x + j);
+        f32x8 m_new = v8_max(m, v);
+        f32x8 rescale = m - m_new, e = v - m_new;
+        v8_exp(&rescale);
+        v8_exp(&e);
+        s = s * rescale + e;
+        m = m_new;
+    }
+
+    float max_ = v8_hmax(&m);
+    for(; j < n; j++) {
+        max_ = (x[j] > max_)? x[j] : max_;
+    }
+
+    // Fold the lanes onto the common max, unused lanes have s = 0 so the clamped exp of -FLT_MAX doesn't matter
+    f32x8 fold = m - max_;
+    v8_exp(&fold);
+    fold *= s;
+    float sum = v8_hsum(&fold);
+    for(j = n - (n % V8_WIDTH); j < n; j++) {
+        sum += fast_expf(x[j] - max_);
+    }
+
+    return max_ + logf(sum);
+}
+
+static void softmax_ce_fwd(Node* node) {
+    const Tensor* X = node->inputs[0]->out;
+    const Tensor* labels = node->inputs[1]->out;
+    Tensor* L = node->out;
+    Tensor* G = node->aux;
+
+    const int64_t batch = X->shape[0];
+    const int64_t classes = X->shape[1];
+    const float inv_batch = 1.0f / (float) batch;
+    double total = 0.0;
+
+    for(int64_t b = 0; b < batch; b++) {
+        const float* x = X->data + b * X->stride[0];
+        float* g = G->data + b * classes;
+        int32_t label = labels->data_i32[b * labels->stride[0]];
+
+        if(label < 0 || label >= classes) {
+            fatal("softmax_ce_fwd cannot run: label %d of row %lld is outside [0, %lld)", label, (long long) b, (long long) classes);
+        }
+
+        float lse = row_logsumexp(x, classes);
+        total += (double) (lse - x[label]);
+
+        // softmax = exp(x - lse), pre scaled by 1/N for the mean
+        int64_t j = 0;
+        for(; j + V8_WIDTH <= classes; j += V8_WIDTH) {
+            f32x8 e = v8_load(x + j) - lse;
+            v8_exp(&e);
+            v8_store(g + j, e * inv_batch);
+        }
+        for(; j < classes; j++) {
+            g[j] = fast_expf(x[j] - lse) * inv_batch;
+        }
+        g[label] -= inv_batch;
+    }
+
+    L->data[0] = (float) (total / (double) batch);
+}
+
+static void softmax_ce_bwd(Node* node) {
+    Tensor* gX = node->inputs[0]->out->grad;
+    const Tensor* G = node->aux;
+    const float scale = node->out->grad->data[0];
+    size_t number_elements = total_elems(G);
+
+    if(gX->is_contiguous) {
+        for(size_t i = 0; i < number_elements; i++) {
+            gX->data[i] += scale * G->data[i];
+        }
+
+        return;
+    }
+
+    for(size_t i = 0; i < number_elements; i++) {
+        gX->data[tensor_elem_offset(gX, i)] += scale * G->data[i];
+    }
+}
+
+// aux already is d(loss)/d(logits), so the loss tangent is just its dot with the logits tangent
+static void softmax_ce_jvp(Node* node) {
+    const Tensor* dX = node->inputs[0]->out->tangent;
+    const Tensor* G = node->aux;
+    const int64_t batch = G->shape[0];
+    const int64_t classes = G->shape[1];
+    double sum = 0.0;
+
+    for(int64_t b = 0; b < batch; b++) {
+        const float* dx = dX->data + b * dX->stride[0];
+        const float* g = G->data + b * classes;
+
+        for(int64_t j = 0; j < classes; j++) {
+            sum += (double) (g[j] * dx[j]);
+        }
+    }
+
+    node->out->tangent->data[0] = (float) sum;
+}
+
+// gX += gL aux differentiated. aux = (p - onehot) / N moves with the softmax, dp_j = p_j (dx_j - dot(p, dx)), and
+// p comes back out of aux as N aux + onehot
+static void softmax_ce_backward_jvp(Node* node) {
+    const Tensor* X = node->inputs[0]->out;
+    const Tensor* labels = node->inputs[1]->out;
+    const Tensor* G = node->aux;
+    Tensor* dgX = X->grad->tangent;
+    const int64_t batch = G->shape[0];
+    const int64_t classes = G->shape[1];
+    const float scale = node->out->grad->data[0];
+    const float dscale = node->out->grad->tangent->data[0];
+
+    for(int64_t b = 0; b < batch; b++) {
+        const float* dx = X->tangent->data + b * X->stride[0];
+        const float* g = G->data + b * classes;
+        int32_t label = labels->data_i32[b * labels->stride[0]];
+        float dot = 0.0f;
+
+        for(int64_t j = 0; j < classes; j++) {
+            float p = (float) batch * g[j] + (j == label);
+            dot += p * dx[j];
+        }
+
+        for(int64_t j = 0; j < classes; j++) {
+            float p = (float) batch * g[j] + (j == label);
+            *tensor_at(dgX, (size_t) (b * classes + j)) += dscale * g[j] + scale * p * (dx[j] - dot) / (float) batch;
+        }
+    }
+}
+
+static int softmax_ce_infer(const Node* node, int64_t out_shape[6]) {
+    const Tensor* logits = node->inputs[0]->out;
+    const Tensor* labels = node->inputs[1]->out;
+
+    op_require_dense_f32(node, 1u << 1);
+    if(logits->ndim != 2 || logits->stride[1] != 1) {
+        fatal("infer_and_alloc_output cannot run: softmax cross entropy logits must be [N, C] with contiguous rows");
+    }
+    if(labels->dtype != DTYPE_I32 || labels->ndim != 1 || labels->shape[0] != logits->shape[0]) {
+        fatal("infer_and_alloc_output cannot run: softmax cross entropy labels must be int32 [%lld]", (long long) logits->shape[0]);
+    }
+
+    out_shape[0] = 1;
+    return 1;
+}
+
+// d(loss)/d(logits) from the forward, shaped like the logits
+static int softmax_ce_aux_shape(const Node* node, int64_t aux_shape[6], DType* dtype) {
+    const Tensor* logits = node->inputs[0]->out;
+
+    *dtype = DTYPE_F32;
+    memcpy(aux_shape, logits->shape, (size_t) logits->ndim * sizeof(int64_t));
+    return logits->ndim;
+}
+
+static const OpKernel softmax_ce_kernel = {
+    .optype = OP_SOFTMAX_CROSS_ENTROPY,
+    .name = "softmax_cross_entropy",
+    .forward = softmax_ce_fwd,
+    .backward = softmax_ce_bwd,
+    .arity = 2,
+    .infer = softmax_ce_infer,
+    .aux_shape = softmax_ce_aux_shape,
+    .jvp = softmax_ce_jvp,
+    .backward_jvp = softmax_ce_backward_jvp,
+};
+
+__attribute__((constructor))
+static void register_softmax_ce_kernel(void) {
+    register_opkernel(&softmax_ce_kernel);
+}
+
+#ifdef SOFTMAX_CE_SELFTEST_MAIN
+#include <assert.h>
+
+#define CE_BATCH 5
+#define CE_CLASSES 19
+
+int main(void) {
+    Arena arena;
+    arena_init(&arena, 1 << 16);
+    Graph graph;
+    graph_init(&graph, &arena);
+
+    const int64_t x_shape[2] = { CE_BATCH, CE_CLASSES };
+    const int64_t l_shape[1] = { CE_BATCH };
+    Tensor* x = tensor_new(&arena, 2, x_shape);
+    Tensor* labels = tensor_new_dtype(&arena, 1, l_shape, DTYPE_I32);
+
+    // Wide spread of logits so the running max actually moves and the big ones would overflow a naive expf
+    uint32_t seed = 7;
+    for(size_t i = 0; i < total_elems(x); i++) {
+        seed = seed * 1664525u + 1013904223u;
+        x->data[i] = ((float) (seed >> 8) / 16777216.0f - 0.5f) * 40.0f;
+    }
+    x->data[CE_CLASSES + 3] = 95.0f;
+    for(int b = 0; b < CE_BATCH; b++) labels->data_i32[b] = (b * 7) % CE_CLASSES;
+
+    Node* in[2] = { graph_add_input(&graph, x), graph_add_input(&graph, labels) };
+    Node* loss = add_node(&graph, OP_SOFTMAX_CROSS_ENTROPY, 2, in);
+
+    Node** order = NULL;
+    size_t order_n = 0;
+    topological_sort(&graph, &order, &order_n);
+    graph_forward_pass(order, order_n);
+    graph_backward_pass(&graph, order, order_n, loss->out);
+
+    // Reference in double with the usual two pass softmax
+    double ref_loss = 0.0;
+    for(int b = 0; b < CE_BATCH; b++) {
+        const float* row = x->data + b * CE_CLASSES;
+        double max_ = row[0], sum = 0.0;
+        for(int j = 1; j < CE_CLASSES; j++) max_ = row[j] > max_? row[j] : max_;
+        for(int j = 0; j < CE_CLASSES; j++) sum += exp(row[j] - max_);
+        ref_loss += max_ + log(sum) - row[labels->data_i32[b]];
+
+        for(int j = 0; j < CE_CLASSES; j++) {
+            double ref_g = (exp(row[j] - max_) / sum - (j == labels->data_i32[b])) / CE_BATCH;
+            assert(fabs(ref_g - x->grad->data[b * CE_CLASSES + j]) < 1e-6);
+        }
+    }
+    ref_loss /= CE_BATCH;
+    assert(fabs(ref_loss - loss->out->data[0]) < 1e-4 * (1.0 + fabs(ref_loss)));
+    assert(labels->grad == NULL);
+
+    // fast_expf against libm over the range the kernel feeds it
+    double max_rel = 0.0;
+    for(float v = -80.0f; v <= 80.0f; v += 0.01f) {
+        double rel = fabs((double) fast_expf(v) - exp(v)) / exp(v);
+        max_rel = rel > max_rel? rel : max_rel;
+    }
+    assert(max_rel < 1e-6);
+
+    printf("softmax_cross_entropy: loss %.6f (ref %.6f), fast_expf max rel err %.2e, passed\n", loss->out->data[0], ref_loss, max_rel);
+
+    arena_free(&arena);
+    return 0;
+}
+#endif
@@ -9,8 +9,17 @@ static void sub_fwd(Node* node) {
     Tensor* C = node->out;
     size_t number_elements = total_elems(C);
 
+    if(A->is_contiguous && B->is_contiguous) {
+        for(size_t i = 0; i < number_elements; i++) {
+            C->data[i] = A->data[i] - B->data[i];
+        }
+
+        return;
+    }
+
+    // Views (eg a transposed or expanded input) go through the strides
     for(size_t i = 0; i < number_elements; i++) {
-        C->data[i] = A->data[i] - B->data[i];
+        C->data[i] = A->data[tensor_elem_offset(A, i)] - B->data[tensor_elem_offset(B, i)];
     }
 }
 
@@ -20,9 +29,54 @@ static void sub_bwd(Node* node) {
     Tensor* gC = node->out->grad;
     size_t number_elements = total_elems(gC);
 
+    if(gA->is_contiguous && gB->is_contiguous) {
+        for(size_t i = 0; i < number_elements; i++) {
+            gA->data[i] += gC->data[i];
+            gB->data[i] -= gC->data[i];
+        }
+
+        return;
+    }
+
+    for(size_t i = 0; i < number_elements; i++) {
+        gA->data[tensor_elem_offset(gA, i)] += gC->data[i];
+        gB->data[tensor_elem_offset(gB, i)] -= gC->data[i];
+    }
+}
+
+static void sub_flat_fwd(const PlanStep* step) {
+    for(size_t i = 0; i < step->n; i++) {
+        step->out[i] = step->in[0][i] - step->in[1][i];
+    }
+}
+
+static void sub_flat_bwd(const PlanStep* step) {
+    for(size_t i = 0; i < step->n; i++) {
+        step->gin[0][i] += step->gout[i];
+        step->gin[1][i] -= step->gout[i];
+    }
+}
+
+static void sub_jvp(Node* node) {
+    const Tensor* dA = node->inputs[0]->out->tangent;
+    const Tensor* dB = node->inputs[1]->out->tangent;
+    Tensor* dC = node->out->tangent;
+    size_t number_elements = total_elems(dC);
+
+    for(size_t i = 0; i < number_elements; i++) {
+        dC->data[i] = *tensor_at(dA, i) - *tensor_at(dB, i);
+    }
+}
+
+static void sub_backward_jvp(Node* node) {
+    Tensor* dgA = node->inputs[0]->out->grad->tangent;
+    Tensor* dgB = node->inputs[1]->out->grad->tangent;
+    const Tensor* dgC = node->out->grad->tangent;
+    size_t number_elements = total_elems(dgC);
+
     for(size_t i = 0; i < number_elements; i++) {
-        gA->data[i] += gC->data[i];
-        gB->data[i] -= gC->data[i];
+        *tensor_at(dgA, i) += dgC->data[i];
+        *tensor_at(dgB, i) -= dgC->data[i];
     }
 }
 
@@ -31,6 +85,12 @@ static const OpKernel sub_kernel = {
     .name = "sub",
     .forward = sub_fwd,
     .backward = sub_bwd,
+    .arity = 2,
+    .infer = op_infer_elementwise,
+    .flat_forward = sub_flat_fwd,
+    .flat_backward = sub_flat_bwd,
+    .jvp = sub_jvp,
+    .backward_jvp = sub_backward_jvp,
 };
 
 __attribute__((constructor))
@@ -0,0 +1,142 @@
+#include "op.h"
+#include "fastmath.h"
+#include "tester.h"
+
+#include <stddef.h>
+
+static void tanh_contiguous(const float* a, float* c, size_t n) {
+    size_t i = 0;
+    for(; i + V8_WIDTH <= n; i += V8_WIDTH) {
+        f32x8 v = v8_load(a + i);
+        v8_tanh(&v);
+        v8_store(c + i, v);
+    }
+    for(; i < n; i++) {
+        c[i] = fast_tanhf(a[i]);
+    }
+}
+
+// d tanh = 1 - y^2, straight from the saved output so no exp here
+static void tanh_grad_contiguous(const float* c, const float* gc, float* ga, size_t n) {
+    size_t i = 0;
+    for(; i + V8_WIDTH <= n; i += V8_WIDTH) {
+        f32x8 y = v8_load(c + i);
+        v8_store(ga + i, v8_load(ga + i) + v8_load(gc + i) * (1.0f - y * y));
+    }
+    for(; i < n; i++) {
+        ga[i] += gc[i] * (1.0f - c[i] * c[i]);
+    }
+}
+
+// Vectorised through fastmath.h, see v8_tanh for the error bound
+static void tanh_fwd(Node* node) {
+    Tensor* A = node->inputs[0]->out;
+    Tensor* C = node->out;
+
+    size_t number_elements = total_elems(C);
+
+    if(A->is_contiguous) {
+        tanh_contiguous(A->data, C->data, number_elements);
+        return;
+    }
+
+    for(size_t i = 0; i < number_elements; i++) {
+        C->data[i] = fast_tanhf(A->data[tensor_elem_offset(A, i)]);
+    }
+}
+
+static void tanh_bwd(Node* node) {
+    Tensor* C = node->out;
+    Tensor* gA = node->inputs[0]->out->grad;
+    Tensor* gC = C->grad;
+
+    size_t number_elements = total_elems(C);
+
+    if(gA->is_contiguous) {
+        tanh_grad_contiguous(C->data, gC->data, gA->data, number_elements);
+        return;
+    }
+
+    for(size_t i = 0; i < number_elements; i++) {
+        gA->data[tensor_elem_offset(gA, i)] += gC->data[i] * (1.0f - C->data[i] * C->data[i]);
+    }
+}
+
+static void tanh_flat_fwd(const PlanStep* step) {
+    tanh_contiguous(step->in[0], step->out, step->n);
+}
+
+static void tanh_flat_bwd(const PlanStep* step) {
+    tanh_grad_contiguous(step->out, step->gout, step->gin[0], step->n);
+}
+
+static void tanh_jvp(Node* node) {
+    const Tensor* dA = node->inputs[0]->out->tangent;
+    const Tensor* C = node->out;
+    size_t number_elements = total_elems(C);
+
+    for(size_t i = 0; i < number_elements; i++) {
+        C->tangent->data[i] = (1.0f - C->data[i] * C->data[i]) * *tensor_at(dA, i);
+    }
+}
+
+// gA += gC (1 - y^2) differentiated, d(1 - y^2) = -2 y dy
+static void tanh_backward_jvp(Node* node) {
+    const Tensor* C = node->out;
+    Tensor* dgA = node->inputs[0]->out->grad->tangent;
+    size_t number_elements = total_elems(C);
+
+    for(size_t i = 0; i < number_elements; i++) {
+        float y = C->data[i];
+        *tensor_at(dgA, i) += C->grad->tangent->data[i] * (1.0f - y * y) - 2.0f * C->grad->data[i] * y * C->tangent->data[i];
+    }
+}
+
+static const OpKernel tanh_kernel = {
+    .optype = OP_TANH,
+    .name = "tanh",
+    .forward = tanh_fwd,
+    .backward = tanh_bwd,
+    .arity = 1,
+    .infer = op_infer_unary,
+    .flat_forward = tanh_flat_fwd,
+    .flat_backward = tanh_flat_bwd,
+    .jvp = tanh_jvp,
+    .backward_jvp = tanh_backward_jvp,
+};
+
+__attribute__((constructor))
+static void register_tanh_kernel(void) {
+    register_opkernel(&tanh_kernel);
+}
+
+#ifdef TANH_SELFTEST_MAIN
+#include <assert.h>
+
+int main(void) {
+    const int64_t dim_a[2] = {2, 3};
+    float fill_a[2] = {0.0, 1.0};
+    float fill_b[2] = {1.0, 0.419974342};
+
+    float unary_out[6] = {0.0, 0.0, 0.0, 0.761594156, 0.761594156, 0.761594156};
+
+    testOp(OP_TANH, dim_a, dim_a, dim_a, fill_a, fill_b, 1.0, unary_out);
+
+    // Both the vector body and the scalar tail against the double reference
+    int64_t max_ulp = 0;
+    for(float x = -10.0f; x <= 10.0f; x += 0.00003f) {
+        float ref = (float) tanh((double) x);
+        f32x8 v = v8_set(x);
+        v8_tanh(&v);
+        int64_t vec_ulp = ulp_distance(v[0], ref);
+        int64_t scalar_ulp = ulp_distance(fast_tanhf(x), ref);
+
+        max_ulp = vec_ulp > max_ulp? vec_ulp : max_ulp;
+        max_ulp = scalar_ulp > max_ulp? scalar_ulp : max_ulp;
+    }
+    assert(max_ulp <= 1);
+    printf("tanh max error %lld ulp, accuracy selftest passed\n", (long long) max_ulp);
+
+    return 0;
+}
+#endif